@@ -222,11 +222,19 @@ static int write_http_response(mapcache_context_apache_request *ctx, mapcache_ht
   int rc;
   char *timestr;
 
+  if(response->etag) {
+    apr_table_setn(r->headers_out, "ETag", response->etag);
+  }
   if(response->mtime) {
     ap_update_mtime(r, response->mtime);
+  }
+  if(response->mtime || response->etag) {
+    /* answers If-None-Match and If-Modified-Since */
     if((rc = ap_meets_conditions(r)) != OK) {
       return rc;
     }
+  }
+  if(response->mtime) {
     timestr = apr_palloc(r->pool, APR_RFC822_DATE_LEN);
     apr_rfc822_date(timestr, response->mtime);
     apr_table_setn(r->headers_out, "Last-Modified", timestr);
@@ -243,6 +251,17 @@ static int write_http_response(mapcache_context_apache_request *ctx, mapcache_ht
       }
     }
   }
+  if(response->file) {
+    /* send the tile from its file, letting the core output filter use sendfile() */
+    apr_bucket_brigade *bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    r->status = response->code;
+    ap_set_content_length(r,response->file->length);
+    apr_brigade_insert_file(bb, response->file->file, response->file->offset, response->file->length, r->pool);
+    if(ap_pass_brigade(r->output_filters, bb) != APR_SUCCESS) {
+      return AP_FILTER_ERROR;
+    }
+    return OK;
+  }
   if(response->data) {
     ap_set_content_length(r,response->data->size);
     ap_rwrite((void*)response->data->buf, response->data->size, r);
@@ -268,7 +287,7 @@ static void mod_mapcache_child_init(apr_pool_t *pool, server_rec *s)
 
 #ifdef USE_S3
    S3_initialize("s3", S3_INIT_ALL, NULL);
-   apr_pool_cleanup_run(pool,NULL, unregisterS3);
+   apr_pool_cleanup_register(pool, NULL, unregisterS3, apr_pool_cleanup_null);
 #endif
   
 #ifdef APR_HAS_THREADS
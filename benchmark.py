@@ -1,15 +1,41 @@
 #! /usr/bin/env python
 
-import commands
+# throughput benchmarks, measured with apache bench and plotted with gnuplot.
+#
+# usage: benchmark.py [merging]
+#          compares the wms tile merging of tilecache and of mapcache at several
+#          compression levels, all served from http://localhost:8081
+#
+#        benchmark.py sqlite <endpoint before> <endpoint after>
+#          compares the throughput of tile hits served from a sqlite cache. run
+#          two servers on copies of the same seeded sqlite database: one with the
+#          previous defaults (<wal>false</wal>, <mmap_size>0</mmap_size>) and one
+#          with the performance settings (the defaults, i.e. write-ahead log and
+#          memory mapped i/o, plus e.g. <min_connections>8</min_connections>). the
+#          requested tile must be in the cache so that only hits are measured.
+#          e.g. benchmark.py sqlite http://localhost:8081/mapcache-before http://localhost:8082/mapcache-after
+#
+#        benchmark.py fetching <spawn per request endpoint> <thread pool endpoint>
+#          compares the throughput of wms requests assembled from multiple tiles,
+#          i.e. the threaded fetching code path of mapcache_prefetch_tiles. run two
+#          servers on the same configuration (with <threaded_fetching>true</threaded_fetching>):
+#          one built before the fetch thread pool was introduced (one thread spawned
+#          per metatile and per request), and one built with it. the tiles should be
+#          seeded beforehand so that the numbers measure the fetching overhead and
+#          not the rendering.
+#          e.g. benchmark.py fetching http://localhost:8081/mapcache-spawn http://localhost:8082/mapcache-pool
+
 import os
 import re
+import subprocess
+import sys
 
 def do_ab_call(url,nthreads,reqs):
     cmd="ab -k -c %d -n %d '%s'" % (nthreads,reqs,url)
-    print cmd
+    print(cmd)
     summary={}
-    ret = commands.getoutput(cmd)
-    sList = ret.split(os.linesep)
+    ret = subprocess.Popen(cmd,shell=True,stdout=subprocess.PIPE,stderr=subprocess.STDOUT).communicate()[0]
+    sList = ret.decode('ascii','replace').split(os.linesep)
     for i, line in enumerate(sList):
         if re.match("Requests per second", line) is not None:
             val = line.split()
@@ -17,40 +43,75 @@ def do_ab_call(url,nthreads,reqs):
         if re.match("Document Length", line) is not None:
             val = line.split()
             summary['size']=val[2]
+        if re.match("Failed requests", line) is not None:
+            val = line.split()
+            summary['failed']=val[2]
     return summary
 
-base="http://localhost:8081"
-params="LAYERS=test,test3&FORMAT=image%2Fpng&SERVICE=WMS&VERSION=1.1.1&REQUEST=GetMap&STYLES=&EXCEPTIONS=application%2Fvnd.ogc.se_inimage&SRS=EPSG%3A4326&BBOX=-2.8125,47.8125,0,50.625&WIDTH=256&HEIGHT=256"
-urls={}
-nreqs=400
+def usage():
+    print("usage: %s [merging]" % sys.argv[0])
+    print("       %s sqlite <endpoint before> <endpoint after>" % sys.argv[0])
+    print("       %s fetching <spawn per request endpoint> <thread pool endpoint>" % sys.argv[0])
+    sys.exit(1)
 
-title="tile merging"
-filebase=title
+benchmark = len(sys.argv) > 1 and sys.argv[1] or "merging"
+urls=[]
+ylabel="throughput (requests/sec)"
+threads=[1,2,3,4]
 
-urls['tilecache']="%s/%s?%s" % (base,'tilecache',params)
-urls['mapcache best compression']="%s/%s?%s" % (base,'mapcache-best',params)
-urls['mapcache default compression']="%s/%s?%s" % (base,'mapcache-default',params)
-urls['mapcache fast compression']="%s/%s?%s" % (base,'mapcache-fast',params)
-urls['mapcache png quantization']="%s/%s?%s" % (base,'mapcache-pngq',params)
-#urls['mapproxy']="http://localhost:8080/service?%s" % (params)
+if benchmark == "merging" and len(sys.argv) <= 2:
+    base="http://localhost:8081"
+    params="LAYERS=test,test3&FORMAT=image%2Fpng&SERVICE=WMS&VERSION=1.1.1&REQUEST=GetMap&STYLES=&EXCEPTIONS=application%2Fvnd.ogc.se_inimage&SRS=EPSG%3A4326&BBOX=-2.8125,47.8125,0,50.625&WIDTH=256&HEIGHT=256"
+    nreqs=400
+    title="tile merging"
+    filebase=title
+    urls.append(('tilecache',"%s/%s?%s" % (base,'tilecache',params)))
+    urls.append(('mapcache best compression',"%s/%s?%s" % (base,'mapcache-best',params)))
+    urls.append(('mapcache default compression',"%s/%s?%s" % (base,'mapcache-default',params)))
+    urls.append(('mapcache fast compression',"%s/%s?%s" % (base,'mapcache-fast',params)))
+    urls.append(('mapcache png quantization',"%s/%s?%s" % (base,'mapcache-pngq',params)))
+    #urls.append(('mapproxy',"http://localhost:8080/service?%s" % (params)))
+elif benchmark == "sqlite" and len(sys.argv) == 4:
+    # a single seeded tile, served without any image processing
+    tile="tms/1.0.0/test@WGS84/5/30/20.png"
+    nreqs=2000
+    title="sqlite cache hits"
+    filebase="sqlite"
+    ylabel="throughput (hits/sec)"
+    threads=[1,2,4,8,16,32]
+    urls.append(('before',"%s/%s" % (sys.argv[2],tile)))
+    urls.append(('after',"%s/%s" % (sys.argv[3],tile)))
+elif benchmark == "fetching" and len(sys.argv) == 4:
+    # a 1024x1024 GetMap covering about 30 256x256 tiles
+    params="LAYERS=test&FORMAT=image%2Fpng&SERVICE=WMS&VERSION=1.1.1&REQUEST=GetMap&STYLES=&EXCEPTIONS=application%2Fvnd.ogc.se_inimage&SRS=EPSG%3A4326&BBOX=-11.25,40.78125,0,52.03125&WIDTH=1024&HEIGHT=1024"
+    nreqs=200
+    title="threaded fetching"
+    filebase="fetching"
+    threads=[1,2,4,8,16,32]
+    urls.append(('thread per metatile',"%s?%s" % (sys.argv[2],params)))
+    urls.append(('fetch thread pool',"%s?%s" % (sys.argv[3],params)))
+else:
+    usage()
 
 plotfile = open("%s.plot"%(filebase),"w")
 datafile = open("%s.dat"%(filebase),"w")
 
 plotfile.write("set terminal pdf\nset key autotitle columnhead\nset output \"%s.pdf\"\nset style data lines\n"%(filebase))
 plotfile.write("set xlabel \"concurrent requests\"\n")
-plotfile.write("set ylabel \"throughput (requests/sec)\"\n")
+plotfile.write("set ylabel \"%s\"\n"%(ylabel))
 plotfile.write("set title \"%s\"\n"%(title))
 count=0
-for title,url in urls.iteritems():
+for title,url in urls:
     if count == 0:
         plotfile.write("plot \"%s.dat\" using 2:xticlabel(1) index 0"%(filebase))
     else:
         plotfile.write(",\"\" using 2 index %d"%(count))
     count += 1
-    for nthreads in [1,2,3,4]:
+    for nthreads in threads:
         reqs = min(nthreads,4) * nreqs
         res = do_ab_call(url,nthreads,reqs)
+        if res.get('failed','0') != '0':
+            print("warning: %s failed requests" % res['failed'])
         if nthreads == 1:
             datafile.write("\n\nthreads \"%s (%s bytes)\"\n"%(title,res['size']))
         datafile.write("%d %s\n"%(nthreads,res['reqspersec']))
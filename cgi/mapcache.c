@@ -30,6 +30,7 @@
 #include "mapcache.h"
 #include <stdlib.h>
 #include <apr_strings.h>
+#include <apr_lib.h>
 #include <apr_pools.h>
 #include <apr_file_io.h>
 #include <signal.h>
@@ -37,6 +38,9 @@
 #ifdef USE_FASTCGI
 #include <fcgi_stdio.h>
 #endif
+#ifdef USE_S3
+#include <libs3.h>
+#endif
 
 typedef struct mapcache_context_fcgi mapcache_context_fcgi;
 typedef struct mapcache_context_fcgi_request mapcache_context_fcgi_request;
@@ -111,21 +115,41 @@ static mapcache_context_fcgi* fcgi_context_create()
   return ctx;
 }
 
-static void fcgi_write_response(mapcache_context_fcgi *ctx, mapcache_http_response *response)
+/*
+ * header (e.g. X-Sendfile or X-Accel-Redirect) through which the web server is
+ * asked to send tile files itself, and prefix added to the filenames.
+ * X-Accel-Redirect takes a URI, in which the filenames are escaped
+ */
+static char *sendfile_header = NULL, *sendfile_prefix = NULL;
+static int sendfile_uri = 0;
+
+/* percent-encode a filename for use as a URI path, keeping its '/' separators */
+static char* fcgi_escape_path(apr_pool_t *pool, const char *path)
 {
-  if(response->code != 200) {
-    printf("Status: %ld %s\r\n",response->code, err_msg(response->code));
-  }
-  if(response->headers && !apr_is_empty_table(response->headers)) {
-    const apr_array_header_t *elts = apr_table_elts(response->headers);
-    int i;
-    for(i=0; i<elts->nelts; i++) {
-      apr_table_entry_t entry = APR_ARRAY_IDX(elts,i,apr_table_entry_t);
-      printf("%s: %s\r\n", entry.key, entry.val);
+  static const char hex[] = "0123456789ABCDEF";
+  char *escaped = apr_palloc(pool, strlen(path)*3+1), *d = escaped;
+  const unsigned char *c;
+  for(c = (const unsigned char*)path; *c; c++) {
+    if(apr_isalnum(*c) || strchr("/-._~", *c)) {
+      *d++ = *c;
+    } else {
+      *d++ = '%';
+      *d++ = hex[*c >> 4];
+      *d++ = hex[*c & 15];
     }
   }
-  if(response->mtime) {
-    char *datestr;
+  *d = '\0';
+  return escaped;
+}
+
+static void fcgi_write_response(mapcache_context_fcgi *ctx, mapcache_http_response *response)
+{
+  int not_modified = MAPCACHE_FALSE;
+  char *if_none_match = getenv("HTTP_IF_NONE_MATCH");
+  if(if_none_match) {
+    /* If-Modified-Since is ignored when If-None-Match is present */
+    not_modified = mapcache_core_etag_matches(response, if_none_match);
+  } else if(response->mtime) {
     char *if_modified_since = getenv("HTTP_IF_MODIFIED_SINCE");
     if(if_modified_since) {
       apr_time_t ims_time;
@@ -135,15 +159,41 @@ static void fcgi_write_response(mapcache_context_fcgi *ctx, mapcache_http_respon
       mtime =  apr_time_sec(response->mtime);
       ims_time = apr_date_parse_http(if_modified_since);
       ims = apr_time_sec(ims_time);
-      if(ims >= mtime) {
-        printf("Status: 304 Not Modified\r\n");
+      if(ims_time != APR_DATE_BAD && ims >= mtime) {
+        not_modified = MAPCACHE_TRUE;
       }
     }
+  }
+  if(not_modified) {
+    printf("Status: 304 Not Modified\r\n");
+  } else if(response->code != 200) {
+    printf("Status: %ld %s\r\n",response->code, err_msg(response->code));
+  }
+  if(response->headers && !apr_is_empty_table(response->headers)) {
+    const apr_array_header_t *elts = apr_table_elts(response->headers);
+    int i;
+    for(i=0; i<elts->nelts; i++) {
+      apr_table_entry_t entry = APR_ARRAY_IDX(elts,i,apr_table_entry_t);
+      printf("%s: %s\r\n", entry.key, entry.val);
+    }
+  }
+  if(response->etag) {
+    printf("ETag: %s\r\n", response->etag);
+  }
+  if(response->mtime) {
+    char *datestr;
     datestr = apr_palloc(ctx->ctx.pool, APR_RFC822_DATE_LEN);
     apr_rfc822_date(datestr, response->mtime);
     printf("Last-Modified: %s\r\n", datestr);
   }
-  if(response->data) {
+  if(not_modified) {
+    printf("\r\n");
+    return;
+  }
+  if(response->file && sendfile_header && response->file->offset == 0) {
+    printf("%s: %s%s\r\n\r\n", sendfile_header, sendfile_prefix?sendfile_prefix:"",
+           sendfile_uri?fcgi_escape_path(ctx->ctx.pool, response->file->filename):response->file->filename);
+  } else if(response->data) {
     printf("Content-Length: %ld\r\n\r\n", response->data->size);
     fwrite((char*)response->data->buf, response->data->size,1,stdout);
   }
@@ -232,6 +282,11 @@ int main(int argc, const char **argv)
   if(apr_pool_create(&global_pool,NULL) != APR_SUCCESS) {
     return 1;
   }
+#ifdef USE_S3
+  if(S3_initialize("s3", S3_INIT_ALL, NULL) != S3StatusOK) {
+    return 1;
+  }
+#endif
   config_pool = NULL;
   globalctx = fcgi_context_create();
   ctx = (mapcache_context*)globalctx;
@@ -257,6 +312,9 @@ int main(int argc, const char **argv)
     return 1;
   }
   ctx->log(ctx,MAPCACHE_INFO,"mapcache fcgi conf file: %s",conffile);
+  sendfile_header = getenv("MAPCACHE_SENDFILE_HEADER");
+  sendfile_prefix = getenv("MAPCACHE_SENDFILE_PREFIX");
+  sendfile_uri = sendfile_header && !strcasecmp(sendfile_header, "X-Accel-Redirect");
 
 
 #ifdef USE_FASTCGI
@@ -346,6 +404,9 @@ cleanup:
   }
 #endif
   apr_pool_destroy(global_pool);
+#ifdef USE_S3
+  S3_deinitialize();
+#endif
   apr_terminate();
   return 0;
 
@@ -49,6 +49,7 @@
 
 #include <assert.h>
 #include <apr_time.h>
+#include <apr_file_io.h>
 
 #ifdef USE_PCRE
 #include <pcre.h>
@@ -89,6 +90,7 @@ typedef struct mapcache_image_format_jpeg mapcache_image_format_jpeg;
 typedef struct mapcache_image_format_json mapcache_image_format_json; // would be "elevation_format"
 typedef struct mapcache_image_format_raw mapcache_image_format_raw;
 typedef struct mapcache_cfg mapcache_cfg;
+typedef struct mapcache_locker mapcache_locker;
 typedef struct mapcache_tileset mapcache_tileset;
 typedef struct mapcache_cache mapcache_cache;
 typedef struct mapcache_source mapcache_source;
@@ -99,6 +101,7 @@ typedef struct mapcache_feature_info mapcache_feature_info;
 typedef struct mapcache_request_get_feature_info mapcache_request_get_feature_info;
 typedef struct mapcache_map mapcache_map;
 typedef struct mapcache_http_response mapcache_http_response;
+typedef struct mapcache_file_range mapcache_file_range;
 typedef struct mapcache_source_wms mapcache_source_wms;
 typedef struct mapcache_source_tms mapcache_source_tms;
 #ifdef USE_GDAL
@@ -112,6 +115,8 @@ typedef struct mapcache_cache_tiff mapcache_cache_tiff;
 typedef struct mapcache_cache_s3 mapcache_cache_s3;
 #endif
 typedef struct mapcache_http mapcache_http;
+typedef struct mapcache_http_transfer mapcache_http_transfer;
+typedef struct mapcache_http_limit mapcache_http_limit;
 typedef struct mapcache_request mapcache_request;
 typedef struct mapcache_request_proxy mapcache_request_proxy;
 typedef struct mapcache_request_get_capabilities mapcache_request_get_capabilities;
@@ -268,6 +273,13 @@ int mapcache_buffer_append(mapcache_buffer *buffer, size_t len, void *data);
 
 /** @{ */
 
+typedef enum {
+  MAPCACHE_RESAMPLE_NEAREST,
+  MAPCACHE_RESAMPLE_BILINEAR,
+  MAPCACHE_RESAMPLE_CUBIC,
+  MAPCACHE_RESAMPLE_AVERAGE
+} mapcache_resample_mode;
+
 typedef enum {
   MAPCACHE_SOURCE_WMS,
   MAPCACHE_SOURCE_MAPSERVER,
@@ -294,12 +306,28 @@ struct mapcache_source {
    */
   void (*render_map)(mapcache_context *ctx, mapcache_map *map);
 
+  /**
+   * \brief get the data for multiple maps at once
+   *
+   * optional, sources that can issue their requests concurrently implement it.
+   * use mapcache_source_render_maps() rather than calling it directly
+   */
+  void (*render_maps)(mapcache_context *ctx, mapcache_map **maps, int nmaps);
+
   void (*query_info)(mapcache_context *ctx, mapcache_feature_info *fi);
 
   void (*configuration_parse_xml)(mapcache_context *ctx, ezxml_t xml, mapcache_source * source);
   void (*configuration_check)(mapcache_context *ctx, mapcache_cfg *cfg, mapcache_source * source);
 };
 
+/**
+ * \brief render multiple maps, possibly coming from different sources
+ *
+ * the maps of a source implementing mapcache_source::render_maps are requested
+ * concurrently, the others are rendered one after the other
+ */
+void mapcache_source_render_maps(mapcache_context *ctx, mapcache_map **maps, int nmaps);
+
 mapcache_http* mapcache_http_configuration_parse_xml(mapcache_context *ctx,ezxml_t node);
 mapcache_http* mapcache_http_clone(mapcache_context *ctx, mapcache_http *orig);
 
@@ -307,6 +335,9 @@ struct mapcache_http {
   char *url; /**< the base url to request */
   apr_table_t *headers; /**< additional headers to add to the http request, eg, Referer */
   int connection_timeout;
+  int max_connections; /**< maximum number of simultaneous requests to the same host, 0 for unlimited */
+  int keepalive; /**< keep connections open and reuse them for subsequent requests */
+  int http2; /**< negotiate HTTP/2 (and multiplex requests) with https servers that support it */
   /* TODO: authentication */
 };
 
@@ -320,6 +351,7 @@ struct mapcache_source_wms {
   apr_table_t *getmap_params; /**< WMS parameters specified in configuration */
   apr_table_t *getfeatureinfo_params; /**< WMS parameters specified in configuration */
   mapcache_http *http;
+  mapcache_http_limit *limit; /**< maximum number of simultaneous requests to the source, see <max_in_flight> */
 };
 
 /**\class mapcache_source_tms
@@ -333,6 +365,7 @@ struct mapcache_source_tms {
   char* format; /**< format of tile ("png" or "jpg") */
   int flipy; /**< flip y-axis */
   mapcache_http *http;
+  mapcache_http_limit *limit; /**< maximum number of simultaneous requests to the source, see <max_in_flight> */
 };
 
 #ifdef USE_MAPSERVER
@@ -367,6 +400,11 @@ struct mapcache_source_gdal {
   GDALDatasetH *poDataset;
   mapcache_extent* extent; /**< bounding box of dataset (optional)*/
   int elevation; /**< true if source is treated as elevation data (double boundaries)*/
+  int max_open_datasets; /**< number of opened datasets/transformations kept per process */
+  int reprojection_grid; /**< spacing in pixels of the exactly transformed control points */
+  double reprojection_tolerance; /**< max error in source pixels of the interpolated coordinates, 0 for exact reprojection */
+  mapcache_resample_mode resample_mode; /**< kernel used to resample the dataset window to the tile */
+  double oversampling; /**< size of the window read from the dataset, relative to the tile size */
 };
 #endif
 /** @} */
@@ -395,10 +433,17 @@ typedef enum {
 #ifdef USE_S3
   ,MAPCACHE_CACHE_S3
 #endif
+  ,MAPCACHE_CACHE_SHM
+  ,MAPCACHE_CACHE_COMPOSITE
+  ,MAPCACHE_CACHE_BUNDLE
+  ,MAPCACHE_CACHE_BLOOM
 } mapcache_cache_type;
 
 /** \interface mapcache_cache
  * \brief a place to cache a mapcache_tile
+ *
+ * the hooks are given the cache they are called on rather than reading it from
+ * the tile's tileset, so that a cache can be layered in front of another one
  */
 struct mapcache_cache {
   char *name; /**< key this cache is referenced by */
@@ -412,23 +457,34 @@ struct mapcache_cache {
    * \returns MAPCACHE_CACHE_MISS if the file does not exist on the disk
    * \memberof mapcache_cache
    */
-  int (*tile_get)(mapcache_context *ctx, mapcache_tile * tile);
+  int (*tile_get)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
 
   /**
    * delete tile from cache
    *
    * \memberof mapcache_cache
    */
-  void (*tile_delete)(mapcache_context *ctx, mapcache_tile * tile);
+  void (*tile_delete)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
 
-  int (*tile_exists)(mapcache_context *ctx, mapcache_tile * tile);
+  int (*tile_exists)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
 
   /**
    * set tile content to cache
    * \memberof mapcache_cache
    */
-  void (*tile_set)(mapcache_context *ctx, mapcache_tile * tile);
-  void (*tile_multi_set)(mapcache_context *ctx, mapcache_tile *tiles, int ntiles);
+  void (*tile_set)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
+  void (*tile_multi_set)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tiles, int ntiles);
+
+  /**
+   * get the content of several tiles with a single batched lookup (optional)
+   *
+   * tiles found in the cache have their encoded_data (and mtime if available)
+   * set, and tiles the cache knows it does not hold have their cache_miss flag
+   * set. The others (e.g. after a lookup error) are left untouched and should
+   * be fetched with tile_get()
+   * \memberof mapcache_cache
+   */
+  void (*tile_multi_get)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile **tiles, int ntiles);
 
   void (*configuration_parse_xml)(mapcache_context *ctx, ezxml_t xml, mapcache_cache * cache, mapcache_cfg *config);
   void (*configuration_post_config)(mapcache_context *ctx, mapcache_cache * cache, mapcache_cfg *config);
@@ -445,12 +501,14 @@ struct mapcache_cache_disk {
   int symlink_blank;
   int creation_retry;
   unsigned int maxzoom;
+  int atomic_writes; /**< write tiles to a temporary file renamed once complete */
+  int fsync; /**< flush atomically written tiles to disk before renaming them */
 
   /**
    * Set filename for a given tile
    * \memberof mapcache_cache_disk
    */
-  void (*tile_key)(mapcache_context *ctx, mapcache_tile *tile, char **path);
+  void (*tile_key)(mapcache_context *ctx, mapcache_cache_disk *cache, mapcache_tile *tile, char **path);
 };
 
 #ifdef USE_S3
@@ -467,12 +525,15 @@ struct mapcache_cache_s3 {
   char *host; // for example "s3-eu-west-1.amazonaws.com"
   char *bucket; // bucket-name
   unsigned int maxzoom; // max zoom level for caching, higher requests are not stored
+  S3Protocol protocol; // http or https
+  int max_parallel_requests; // requests of a tile_multi_set/tile_multi_get run concurrently
+  S3BucketContext bucket_context; // built from the above once the configuration is parsed
 
   /**
    * Set filename for a given tile
    * \memberof mapcache_cache_s3
    */
-  void (*tile_key)(mapcache_context *ctx, mapcache_tile *tile, char **path);
+  void (*tile_key)(mapcache_context *ctx, mapcache_cache_s3 *cache, mapcache_tile *tile, char **path);
 };
 #endif
 
@@ -484,6 +545,8 @@ struct mapcache_cache_tiff {
   int count_x;
   int count_y;
   mapcache_image_format_jpeg *format;
+  int max_open_files; /* number of tiff files kept opened by each process, 0 to disable */
+  void *open_files;   /* lru of the opened tiff files, created on first use */
 };
 #endif
 
@@ -505,11 +568,20 @@ struct mapcache_cache_sqlite {
   mapcache_cache_sqlite_stmt create_stmt;
   mapcache_cache_sqlite_stmt exists_stmt;
   mapcache_cache_sqlite_stmt get_stmt;
+  mapcache_cache_sqlite_stmt legacy_get_stmt; /**< get_stmt for databases without stored tile hashes */
+  mapcache_cache_sqlite_stmt upgrade_stmt; /**< brings databases created by older versions up to date, may fail */
   mapcache_cache_sqlite_stmt set_stmt;
   mapcache_cache_sqlite_stmt delete_stmt;
   apr_table_t *pragmas;
   void (*bind_stmt)(mapcache_context*ctx, void *stmt, mapcache_tile *tile);
   int n_prepared_statements;
+  int min_connections; /**< read-only connections opened as soon as a process uses the cache */
+  int wal; /**< put the database in write-ahead log mode */
+  apr_int64_t mmap_size; /**< bytes of the database accessed through memory mapped i/o */
+  int sharded; /**< dbfile is a template, tiles are spread over several database files */
+  int count_x, count_y; /**< number of tiles along each axis of a shard */
+  int max_open_dbfiles; /**< number of shards each process keeps opened */
+  void *shards; /**< the opened database files, created on first use */
 };
 
 /**
@@ -548,7 +620,8 @@ typedef struct mapcache_cache_memcache mapcache_cache_memcache;
  */
 struct mapcache_cache_memcache {
   mapcache_cache cache;
-  apr_memcache_t *memcache;
+  apr_memcache_t **memcache; /**< one per copy of the tiles, see nreplicas */
+  int nreplicas; /**< number of servers each tile is stored on */
 };
 
 /**
@@ -575,11 +648,6 @@ typedef enum {
   MAPCACHE_GETMAP_FORWARD
 } mapcache_getmap_strategy;
 
-typedef enum {
-  MAPCACHE_RESAMPLE_NEAREST,
-  MAPCACHE_RESAMPLE_BILINEAR
-} mapcache_resample_mode;
-
 /**
  * \brief a request sent by a client
  */
@@ -608,11 +676,27 @@ struct mapcache_request_get_tile {
 
 };
 
+/**
+ * \brief a region of an opened file holding the same bytes as a buffer
+ *
+ * lets the front ends send tile data from the file it was read from (e.g. with
+ * sendfile()), without copying it through user space
+ */
+struct mapcache_file_range {
+  apr_file_t *file; /**< opened for reading, closed with the pool of the request */
+  const char *filename;
+  apr_off_t offset;
+  apr_size_t length;
+  mapcache_buffer *data; /**< the buffer these bytes were read into */
+};
+
 struct mapcache_http_response {
   mapcache_buffer *data;
   apr_table_t *headers;
   long code;
   apr_time_t mtime;
+  char *etag; /**< quoted strong entity tag of data, if any */
+  mapcache_file_range *file; /**< if set, the front end may send this file instead of data */
 };
 
 struct mapcache_map {
@@ -995,6 +1079,37 @@ void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcach
 void mapcache_http_do_request_with_params(mapcache_context *ctx, mapcache_http *req, apr_table_t *params,
     mapcache_buffer *data, apr_table_t *headers, long *http_code);
 char* mapcache_http_build_url(mapcache_context *ctx, char *base, apr_table_t *params);
+
+/**
+ * \brief an upstream request performed by mapcache_http_do_requests()
+ */
+struct mapcache_http_transfer {
+  mapcache_http *req; /**< the request to perform, its url containing all the parameters */
+  mapcache_buffer *data; /**< receives the response body */
+  /**
+   * called as soon as the transfer has successfully completed, while the other
+   * transfers are still running. may set an error on the context
+   */
+  void (*done)(mapcache_context *ctx, mapcache_http_transfer *transfer);
+  void *userdata;
+};
+
+/**
+ * \brief create a limit on the number of simultaneous requests, shared by all threads of a process
+ * \param max_in_flight the maximum number of requests, 0 for unlimited
+ */
+mapcache_http_limit* mapcache_http_limit_create(mapcache_context *ctx, int max_in_flight);
+
+/**
+ * \brief perform multiple requests concurrently
+ *
+ * the requests are issued together on a single curl multi handle, keeping at most
+ * the number allowed by the limit (if not NULL) running at the same time. the first
+ * failure is reported on the context, in which case the remaining transfers are not
+ * started
+ */
+void mapcache_http_do_requests(mapcache_context *ctx, mapcache_http_transfer **transfers, int ntransfers,
+                               mapcache_http_limit *limit);
 apr_table_t *mapcache_http_parse_param_string(mapcache_context *ctx, char *args);
 /** @} */
 
@@ -1084,8 +1199,24 @@ struct mapcache_cfg {
    */
   apr_interval_time_t lock_retry_interval; /* time in nanoseconds to wait before rechecking for lockfile presence */
 
+  /**
+   * the locking mechanism used for metatile renders, see <locker>
+   */
+  mapcache_locker *locker;
+
   int threaded_fetching;
 
+  /**
+   * number of threads of the per-process pool used for threaded fetching, see <fetch_threads>
+   */
+  int fetch_threads;
+
+  /**
+   * maximum number of requests waiting for the fetch threads. requests arriving when
+   * the queue is full fetch their tiles themselves
+   */
+  int fetch_queue_size;
+
   /**
    * the uri where the base of the service is mapped
    */
@@ -1162,6 +1293,37 @@ mapcache_source* mapcache_source_dummy_create(mapcache_context *ctx);
  */
 mapcache_cache* mapcache_cache_disk_create(mapcache_context *ctx);
 
+/**
+ * \memberof mapcache_cache_shm
+ */
+mapcache_cache* mapcache_cache_shm_create(mapcache_context *ctx);
+
+/**
+ * \memberof mapcache_cache_composite
+ */
+mapcache_cache* mapcache_cache_composite_create(mapcache_context *ctx);
+
+/**
+ * \memberof mapcache_cache_bundle
+ */
+mapcache_cache* mapcache_cache_bundle_create(mapcache_context *ctx);
+
+/**
+ * \memberof mapcache_cache_bloom
+ */
+mapcache_cache* mapcache_cache_bloom_create(mapcache_context *ctx);
+
+/**
+ * \brief mark the bloom filter of a zoom level as holding all the tiles of the cache
+ *
+ * lookups are only answered from the filter afterwards. to be called once all
+ * the tiles of the level have been written through the bloom cache, e.g. by a
+ * transfer of the whole level
+ * \memberof mapcache_cache_bloom
+ */
+void mapcache_cache_bloom_set_complete(mapcache_context *ctx, mapcache_cache *cache, mapcache_tileset *tileset,
+                                       mapcache_grid_link *grid_link, int z);
+
 #ifdef USE_TIFF
 /**
  * \memberof mapcache_cache_tiff
@@ -1198,6 +1360,17 @@ struct mapcache_tile {
    * \sa mapcache_image_format
    */
   mapcache_buffer *encoded_data;
+  /**
+   * file encoded_data was read from, only valid as long as its
+   * mapcache_file_range::data is still the tile's encoded_data
+   */
+  mapcache_file_range *encoded_file;
+  /**
+   * quoted strong entity tag stored or derived by the cache, only valid as
+   * long as etag_data is still the tile's encoded_data
+   */
+  char *etag;
+  mapcache_buffer *etag_data;
   mapcache_image *raw_image;
   apr_time_t mtime; /**< last modification time */
   int expires; /**< time in seconds after which the tile should be rechecked for validity */
@@ -1212,6 +1385,13 @@ struct mapcache_tile {
    * compositing image data
    */
   int nodata;
+
+  /**
+   * set by mapcache_cache::tile_multi_get() for a tile that was looked up and
+   * is absent from the cache, so mapcache_tileset_tile_get() does not query
+   * the cache for it a second time
+   */
+  int cache_miss;
 };
 
 /**
@@ -1402,6 +1582,14 @@ void mapcache_tileset_get_level(mapcache_context *ctx, mapcache_tileset *tileset
 void mapcache_grid_get_closest_level(mapcache_context *ctx, mapcache_grid_link *grid, double resolution, int *level);
 void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile);
 
+/**
+ * \brief look up tiles in their caches, with batched lookups for the caches supporting them
+ *
+ * \returns an array of flags set to MAPCACHE_TRUE for the tiles that were found
+ * and are complete, the other ones must be fetched with mapcache_tileset_tile_get()
+ */
+int* mapcache_tileset_tile_multi_get_cached(mapcache_context *ctx, mapcache_tile **tiles, int ntiles);
+
 /**
  * \brief delete tile from cache
  * @param whole_metatile delete all the other tiles from the metatile to
@@ -1446,11 +1634,50 @@ void mapcache_tileset_configuration_check(mapcache_context *ctx, mapcache_tilese
 void mapcache_tileset_add_watermark(mapcache_context *ctx, mapcache_tileset *tileset, const char *filename);
 
 
+typedef enum {
+  MAPCACHE_LOCKER_DISK,
+  MAPCACHE_LOCKER_SHM
+} mapcache_locker_type;
+
+/**\interface mapcache_locker
+ * \brief mechanism ensuring a metatile is rendered by a single request at a time
+ */
+struct mapcache_locker {
+  /**
+   * \brief aquire the lock on the given resource, or wait for it to be released
+   * \returns MAPCACHE_TRUE if the lock was aquired, MAPCACHE_FALSE if we waited on another request
+   */
+  int (*lock_or_wait)(mapcache_context *ctx, mapcache_locker *self, char *resource);
+  void (*unlock)(mapcache_context *ctx, mapcache_locker *self, char *resource);
+  void (*configuration_parse_xml)(mapcache_context *ctx, mapcache_locker *self, ezxml_t node);
+  mapcache_locker_type type;
+  apr_interval_time_t timeout; /**< locks held longer than this are considered stale */
+};
+
+/**
+ * \brief lock files in the configured lock directory, polled by waiting requests
+ */
+mapcache_locker* mapcache_locker_disk_create(mapcache_context *ctx);
+
+/**
+ * \brief hashed lock table in POSIX shared memory, waiting requests are woken on release.
+ * only synchronizes the processes of a single host
+ */
+mapcache_locker* mapcache_locker_shm_create(mapcache_context *ctx);
+
 int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource);
 void mapcache_unlock_resource(mapcache_context *ctx, char *resource);
 
+/**
+ * \brief take an exclusive lock on an open file, waiting as long as needed.
+ * the lock is released when the file is closed. unlike apr_file_lock(), which
+ * uses fcntl locks on unix, it also excludes the other threads of the process
+ */
+apr_status_t mapcache_lock_file(apr_file_t *f);
+
 mapcache_metatile* mapcache_tileset_metatile_get(mapcache_context *ctx, mapcache_tile *tile);
 void mapcache_tileset_render_metatile(mapcache_context *ctx, mapcache_metatile *mt);
+void mapcache_tileset_render_metatiles(mapcache_context *ctx, mapcache_metatile **mts, int nmts);
 char* mapcache_tileset_metatile_resource_key(mapcache_context *ctx, mapcache_metatile *mt);
 
 
@@ -1468,6 +1695,12 @@ mapcache_http_response* mapcache_core_get_featureinfo(mapcache_context *ctx, map
 mapcache_http_response* mapcache_core_proxy_request(mapcache_context *ctx, mapcache_request_proxy *req_proxy);
 mapcache_http_response* mapcache_core_respond_to_error(mapcache_context *ctx);
 
+/**
+ * \brief tells if an If-None-Match header value matches the entity tag of the response
+ * \returns MAPCACHE_TRUE if a 304 Not Modified should be sent instead of the response
+ */
+int mapcache_core_etag_matches(mapcache_http_response *response, const char *if_none_match);
+
 
 /* in grid.c */
 mapcache_grid* mapcache_grid_create(apr_pool_t *pool);
@@ -1517,6 +1750,11 @@ int mapcache_util_extract_double_list(mapcache_context *ctx, const char* args, c
 char *mapcache_util_str_replace(apr_pool_t *pool, const char *string, const char *substr,
                                 const char *replacement );
 
+/**
+ * \brief hex encoded md5 digest of the given data, allocated from pool
+ */
+char* mapcache_util_md5_hex(apr_pool_t *pool, const void *data, apr_size_t len);
+
 /**
  * \brief replace dangerous characters in string
  * \param str the string that must be tested/replaced
@@ -0,0 +1,585 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: bloom filter negative lookup cache
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <apr_atomic.h>
+#include <apr_file_io.h>
+#include <apr_mmap.h>
+#include <apr_hash.h>
+#include <math.h>
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+
+/*
+ * bloom cache: sits in front of another cache and keeps, for each tileset, grid
+ * and zoom level, a bloom filter of the tiles that have been stored in it. a
+ * tile that is not in the filter is certainly not in the cache, and is reported
+ * as missing without querying the cache.
+ *
+ * the filters are files memory mapped by all the processes, bits are only ever
+ * set (with atomic operations) so the filter of a level always holds all the
+ * tiles that were written through it. tiles are not removed from the filter when
+ * they are deleted, they only become false positives.
+ *
+ * a filter file is created by the first write to its level, and is only used
+ * to answer lookups once it is marked complete, i.e. once it also holds the
+ * tiles the cache had before, by mapcache_seed -m transfer. until then, and for
+ * levels without a filter file, lookups are passed to the cache.
+ *
+ * file layout: a 24 byte header (magic, number of hash functions, number of
+ * bits, complete flag, unused), followed by the bits as 32 bit words, all in
+ * native byte order.
+ */
+
+#define BLOOM_MAGIC "MCB\x02"
+#define BLOOM_HEADER_SIZE 24
+#define BLOOM_COMPLETE_OFFSET 16
+#define BLOOM_LN2 0.69314718055994530942
+
+typedef struct {
+  apr_uint32_t *bits;
+  apr_uint64_t nbits;
+  int k;
+  volatile apr_uint32_t *complete; /* in the mapped header */
+} _bloom_filter;
+
+typedef struct {
+  apr_pool_t *pool;
+#if APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+  apr_hash_t *filters; /* the filters opened by this process, by tileset/grid/z */
+} _bloom_filters;
+
+typedef struct {
+  mapcache_cache cache;
+  mapcache_cache *child;
+  char *directory;
+  double capacity; /* maximum number of tiles a filter is sized for */
+  double false_positive_rate;
+  _bloom_filters *filters; /* NULL until first used in this process */
+} mapcache_cache_bloom;
+
+static apr_uint64_t _bloom_mix(apr_uint64_t h)
+{
+  h ^= h >> 33;
+  h *= APR_UINT64_C(0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  h *= APR_UINT64_C(0xc4ceb9fe1a85ec53);
+  h ^= h >> 33;
+  return h;
+}
+
+static apr_uint64_t _bloom_hash_string(apr_uint64_t h, const char *str)
+{
+  /* fnv-1a */
+  while(*str) {
+    h ^= (unsigned char)*(str++);
+    h *= APR_UINT64_C(0x100000001b3);
+  }
+  return h;
+}
+
+/*
+ * the two hashes the k bit positions of a tile are derived from
+ */
+static void _bloom_tile_hashes(mapcache_tile *tile, apr_uint64_t *h1, apr_uint64_t *h2)
+{
+  apr_uint64_t h = _bloom_mix(((apr_uint64_t)(apr_uint32_t)tile->x << 32) | (apr_uint32_t)tile->y);
+  if(tile->dimensions) {
+    const apr_array_header_t *elts = apr_table_elts(tile->dimensions);
+    int i;
+    for(i=0; i<elts->nelts; i++) {
+      apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
+      h = _bloom_hash_string(h, entry->key);
+      h = _bloom_hash_string(h ^ '=', entry->val);
+    }
+  }
+  *h1 = _bloom_mix(h);
+  *h2 = _bloom_mix(h ^ APR_UINT64_C(0x9e3779b97f4a7c15)) | 1;
+}
+
+static int _bloom_filter_contains(_bloom_filter *filter, mapcache_tile *tile)
+{
+  apr_uint64_t h1,h2,bit;
+  int i;
+  _bloom_tile_hashes(tile, &h1, &h2);
+  for(i=0; i<filter->k; i++) {
+    bit = (h1 + i*h2) % filter->nbits;
+    if(!(((volatile apr_uint32_t*)filter->bits)[bit >> 5] & (1u << (bit & 31)))) {
+      return MAPCACHE_FALSE;
+    }
+  }
+  return MAPCACHE_TRUE;
+}
+
+static void _bloom_filter_add(_bloom_filter *filter, mapcache_tile *tile)
+{
+  apr_uint64_t h1,h2,bit;
+  apr_uint32_t old, mask;
+  volatile apr_uint32_t *word;
+  int i;
+  _bloom_tile_hashes(tile, &h1, &h2);
+  for(i=0; i<filter->k; i++) {
+    bit = (h1 + i*h2) % filter->nbits;
+    word = filter->bits + (bit >> 5);
+    mask = 1u << (bit & 31);
+    /* other processes may be setting bits of the same word */
+    do {
+      old = *word;
+      if(old & mask) break;
+    } while(apr_atomic_cas32(word, old | mask, old) != old);
+  }
+}
+
+static apr_status_t _bloom_filters_destroy(void *data)
+{
+  mapcache_cache_bloom *cache = (mapcache_cache_bloom*)data;
+  _bloom_filters *filters = cache->filters;
+  cache->filters = NULL;
+  /* unmaps the filters */
+  apr_pool_destroy(filters->pool);
+  return APR_SUCCESS;
+}
+
+/*
+ * return the filters of this process, creating them on first use
+ */
+static _bloom_filters* _bloom_filters_get(mapcache_context *ctx, mapcache_cache_bloom *cache)
+{
+  apr_pool_t *pool;
+  if(cache->filters) return cache->filters;
+#if APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  if(!cache->filters && apr_pool_create(&pool,NULL) == APR_SUCCESS) {
+    _bloom_filters *filters = (_bloom_filters*)apr_pcalloc(pool,sizeof(_bloom_filters));
+    filters->pool = pool;
+    filters->filters = apr_hash_make(pool);
+#if APR_HAS_THREADS
+    if(apr_thread_mutex_create(&filters->mutex,APR_THREAD_MUTEX_DEFAULT,pool) != APR_SUCCESS) {
+      apr_pool_destroy(pool);
+      filters = NULL;
+    }
+#endif
+    if(filters) {
+      cache->filters = filters;
+      apr_pool_cleanup_register(ctx->process_pool,cache,_bloom_filters_destroy,apr_pool_cleanup_null);
+    }
+  }
+#if APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  if(!cache->filters) {
+    ctx->set_error(ctx,500,"bloom cache %s: failed to allocate filters",cache->cache.name);
+  }
+  return cache->filters;
+}
+
+/*
+ * create an empty filter file sized for the given zoom level. the file is
+ * initialized under an exclusive lock on it, other processes ignore it until it
+ * has its full size. returns once the file exists, possibly created by another
+ * process
+ */
+static void _bloom_filter_file_create(mapcache_context *ctx, mapcache_cache_bloom *cache, mapcache_grid_link *grid_link, int z, char *filename)
+{
+  apr_file_t *f;
+  apr_status_t rv;
+  apr_finfo_t finfo;
+  char header[BLOOM_HEADER_SIZE];
+  char errmsg[120];
+  char *dirname;
+  mapcache_grid_level *level = grid_link->grid->levels[z];
+  double n = MAPCACHE_MIN((double)level->maxx * (double)level->maxy, cache->capacity);
+  apr_uint64_t nbits;
+  apr_uint32_t k;
+  apr_size_t len = BLOOM_HEADER_SIZE;
+
+  /* optimal number of bits and hash functions for the expected number of tiles */
+  nbits = (apr_uint64_t)ceil(-n * log(cache->false_positive_rate) / (BLOOM_LN2 * BLOOM_LN2));
+  nbits = MAPCACHE_MAX(nbits, 64);
+  nbits = (nbits + 31) & ~APR_UINT64_C(31);
+  k = (apr_uint32_t)floor((double)nbits / n * BLOOM_LN2 + 0.5);
+  k = MAPCACHE_MAX(1, MAPCACHE_MIN(k, 16));
+
+  dirname = apr_pstrdup(ctx->pool, filename);
+  *strrchr(dirname,'/') = '\0';
+  if((rv = apr_dir_make_recursive(dirname, APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS && !APR_STATUS_IS_EEXIST(rv)) {
+    ctx->set_error(ctx, 500, "bloom cache %s: failed to create directory %s: %s", cache->cache.name, dirname, apr_strerror(rv,errmsg,120));
+    return;
+  }
+
+  rv = apr_file_open(&f, filename, APR_FOPEN_CREATE|APR_FOPEN_WRITE|APR_FOPEN_BINARY, APR_OS_DEFAULT, ctx->pool);
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "bloom cache %s: failed to create %s: %s", cache->cache.name, filename, apr_strerror(rv,errmsg,120));
+    return;
+  }
+  if((rv = mapcache_lock_file(f)) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "bloom cache %s: failed to lock %s: %s", cache->cache.name, filename, apr_strerror(rv,errmsg,120));
+    apr_file_close(f);
+    return;
+  }
+  if(apr_file_info_get(&finfo, APR_FINFO_SIZE, f) == APR_SUCCESS && finfo.size > BLOOM_HEADER_SIZE) {
+    /* created by another process while we were waiting for the lock. a
+     * shorter file was left by a process that died while creating it */
+    apr_file_close(f);
+    return;
+  }
+  memset(header, 0, BLOOM_HEADER_SIZE);
+  memcpy(header, BLOOM_MAGIC, 4);
+  memcpy(header + 4, &k, 4);
+  memcpy(header + 8, &nbits, 8);
+  rv = apr_file_trunc(f, 0);
+  if(rv == APR_SUCCESS) {
+    rv = apr_file_write_full(f, header, len, NULL);
+  }
+  if(rv == APR_SUCCESS) {
+    /* the bits are zeroed (and usually not allocated on disk) by growing the file */
+    rv = apr_file_trunc(f, BLOOM_HEADER_SIZE + nbits / 8);
+  }
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "bloom cache %s: failed to write %s: %s", cache->cache.name, filename, apr_strerror(rv,errmsg,120));
+    apr_file_trunc(f, 0);
+  }
+  apr_file_close(f);
+}
+
+/*
+ * map a filter file for the lifetime of the given pool. returns NULL without
+ * setting an error if the file does not exist or is still being created
+ */
+static _bloom_filter* _bloom_filter_file_map(mapcache_context *ctx, mapcache_cache_bloom *cache, apr_pool_t *pool, char *filename)
+{
+  apr_file_t *f;
+  apr_finfo_t finfo;
+  apr_mmap_t *mm;
+  apr_status_t rv;
+  char header[BLOOM_HEADER_SIZE];
+  char errmsg[120];
+  _bloom_filter *filter;
+  apr_uint32_t k;
+  apr_uint64_t nbits;
+
+  /* only the mapping is allocated from the long lived pool */
+  if(apr_file_open(&f, filename, APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_BINARY, APR_OS_DEFAULT, ctx->pool) != APR_SUCCESS) {
+    return NULL;
+  }
+  if(apr_file_info_get(&finfo, APR_FINFO_SIZE, f) != APR_SUCCESS || finfo.size < BLOOM_HEADER_SIZE ||
+      apr_file_read_full(f, header, BLOOM_HEADER_SIZE, NULL) != APR_SUCCESS) {
+    apr_file_close(f);
+    return NULL;
+  }
+  memcpy(&k, header + 4, 4);
+  memcpy(&nbits, header + 8, 8);
+  if(memcmp(header, BLOOM_MAGIC, 4) || !k || !nbits || nbits % 32) {
+    ctx->set_error(ctx, 500, "bloom cache %s: %s is not a filter file", cache->cache.name, filename);
+    apr_file_close(f);
+    return NULL;
+  }
+  if(finfo.size != BLOOM_HEADER_SIZE + nbits / 8) {
+    apr_file_close(f);
+    return NULL;
+  }
+  rv = apr_mmap_create(&mm, f, 0, (apr_size_t)finfo.size, APR_MMAP_READ|APR_MMAP_WRITE, pool);
+  apr_file_close(f);
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "bloom cache %s: failed to map %s: %s", cache->cache.name, filename, apr_strerror(rv,errmsg,120));
+    return NULL;
+  }
+  filter = (_bloom_filter*)apr_pcalloc(pool, sizeof(_bloom_filter));
+  filter->bits = (apr_uint32_t*)((char*)mm->mm + BLOOM_HEADER_SIZE);
+  filter->nbits = nbits;
+  filter->k = k;
+  filter->complete = (apr_uint32_t*)((char*)mm->mm + BLOOM_COMPLETE_OFFSET);
+  return filter;
+}
+
+/*
+ * return the mapped filter of a level, mapping its file on first use
+ */
+static _bloom_filter* _bloom_filter_open(mapcache_context *ctx, mapcache_cache_bloom *cache, _bloom_filters *filters, char *key, char *filename)
+{
+  _bloom_filter *filter;
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(filters->mutex);
+#endif
+  filter = apr_hash_get(filters->filters, key, APR_HASH_KEY_STRING);
+  if(!filter) {
+    /* the mapping lives as long as the process */
+    filter = _bloom_filter_file_map(ctx, cache, filters->pool, filename);
+    if(filter) {
+      apr_hash_set(filters->filters, apr_pstrdup(filters->pool, key), APR_HASH_KEY_STRING, filter);
+    }
+  }
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(filters->mutex);
+#endif
+  return filter;
+}
+
+/*
+ * return the filter of a level. returns NULL if its file does not exist or is
+ * still being created, unless create is set, in which case the file is created
+ * or waited for
+ */
+static _bloom_filter* _bloom_filter_get(mapcache_context *ctx, mapcache_cache_bloom *cache, mapcache_tileset *tileset,
+                                        mapcache_grid_link *grid_link, int z, int create)
+{
+  _bloom_filters *filters = _bloom_filters_get(ctx, cache);
+  _bloom_filter *filter;
+  char *key, *filename;
+  if(!filters) return NULL;
+  key = apr_psprintf(ctx->pool, "%s/%s/%d", tileset->name, grid_link->grid->name, z);
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(filters->mutex);
+#endif
+  filter = apr_hash_get(filters->filters, key, APR_HASH_KEY_STRING);
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(filters->mutex);
+#endif
+  if(filter) return filter;
+
+  filename = apr_psprintf(ctx->pool, "%s/%s.bloom", cache->directory, key);
+  filter = _bloom_filter_open(ctx, cache, filters, key, filename);
+  if(!filter && create && !GC_HAS_ERROR(ctx)) {
+    _bloom_filter_file_create(ctx, cache, grid_link, z, filename);
+    if(GC_HAS_ERROR(ctx)) return NULL;
+    filter = _bloom_filter_open(ctx, cache, filters, key, filename);
+  }
+  return filter;
+}
+
+/*
+ * returns MAPCACHE_FALSE if the tile is certainly not in the cache
+ */
+static int _bloom_may_contain(mapcache_context *ctx, mapcache_cache_bloom *cache, mapcache_tile *tile)
+{
+  _bloom_filter *filter = _bloom_filter_get(ctx, cache, tile->tileset, tile->grid_link, tile->z, 0);
+  if(GC_HAS_ERROR(ctx)) {
+    /* not worth failing a read for, let the child cache answer */
+    ctx->log(ctx, MAPCACHE_WARN, "bloom cache %s: %s", cache->cache.name, ctx->get_error_message(ctx));
+    ctx->clear_errors(ctx);
+    return MAPCACHE_TRUE;
+  }
+  if(!filter || !*filter->complete) {
+    /* the filter may not know about all the tiles of the cache yet */
+    return MAPCACHE_TRUE;
+  }
+  return _bloom_filter_contains(filter, tile);
+}
+
+/*
+ * add the tiles to their filters, before they are written to the child cache
+ * so that no process can see a tile that isn't in the filter
+ */
+static void _bloom_add(mapcache_context *ctx, mapcache_cache_bloom *cache, mapcache_tile *tiles, int ntiles)
+{
+  int i;
+  for(i=0; i<ntiles; i++) {
+    _bloom_filter *filter = _bloom_filter_get(ctx, cache, tiles[i].tileset, tiles[i].grid_link, tiles[i].z, 1);
+    GC_CHECK_ERROR(ctx);
+    if(!filter) {
+      ctx->set_error(ctx, 500, "bloom cache %s: filter for tile %d %d %d of tileset %s is not available",
+                     cache->cache.name, tiles[i].x, tiles[i].y, tiles[i].z, tiles[i].tileset->name);
+      return;
+    }
+    _bloom_filter_add(filter, &tiles[i]);
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_bloom
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_bloom_tile_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bloom *cache = (mapcache_cache_bloom*)pcache;
+  if(_bloom_may_contain(ctx, cache, tile) == MAPCACHE_FALSE) {
+    return MAPCACHE_CACHE_MISS;
+  }
+  return cache->child->tile_get(ctx, cache->child, tile);
+}
+
+static void _mapcache_cache_bloom_tile_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles)
+{
+  mapcache_cache_bloom *cache = (mapcache_cache_bloom*)pcache;
+  mapcache_tile **batch = (mapcache_tile**)apr_pcalloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+  int i, nbatch = 0;
+  for(i=0; i<ntiles; i++) {
+    if(_bloom_may_contain(ctx, cache, tiles[i]) == MAPCACHE_TRUE) {
+      batch[nbatch++] = tiles[i];
+    } else {
+      tiles[i]->cache_miss = 1;
+    }
+  }
+  if(nbatch) {
+    cache->child->tile_multi_get(ctx, cache->child, batch, nbatch);
+  }
+}
+
+static int _mapcache_cache_bloom_tile_exists(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bloom *cache = (mapcache_cache_bloom*)pcache;
+  if(_bloom_may_contain(ctx, cache, tile) == MAPCACHE_FALSE) {
+    return MAPCACHE_FALSE;
+  }
+  return cache->child->tile_exists(ctx, cache->child, tile);
+}
+
+static void _mapcache_cache_bloom_tile_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bloom *cache = (mapcache_cache_bloom*)pcache;
+  cache->child->tile_delete(ctx, cache->child, tile);
+}
+
+/**
+ * \private \memberof mapcache_cache_bloom
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_bloom_tile_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bloom *cache = (mapcache_cache_bloom*)pcache;
+  _bloom_add(ctx, cache, tile, 1);
+  GC_CHECK_ERROR(ctx);
+  cache->child->tile_set(ctx, cache->child, tile);
+}
+
+static void _mapcache_cache_bloom_tile_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_cache_bloom *cache = (mapcache_cache_bloom*)pcache;
+  int i;
+  _bloom_add(ctx, cache, tiles, ntiles);
+  GC_CHECK_ERROR(ctx);
+  if(cache->child->tile_multi_set) {
+    cache->child->tile_multi_set(ctx, cache->child, tiles, ntiles);
+  } else {
+    for(i=0; i<ntiles; i++) {
+      cache->child->tile_set(ctx, cache->child, &tiles[i]);
+      GC_CHECK_ERROR(ctx);
+    }
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_bloom
+ */
+static void _mapcache_cache_bloom_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *pcache, mapcache_cfg *config)
+{
+  mapcache_cache_bloom *cache = (mapcache_cache_bloom*)pcache;
+  ezxml_t cur_node;
+  char *endptr;
+  if((cur_node = ezxml_child(node,"cache")) == NULL) {
+    ctx->set_error(ctx, 400, "bloom cache %s has no <cache>", pcache->name);
+    return;
+  }
+  cache->child = mapcache_configuration_get_cache(config, cur_node->txt);
+  if(!cache->child) {
+    ctx->set_error(ctx, 400, "bloom cache %s references cache \"%s\", which has not been defined before it",
+                   pcache->name, cur_node->txt);
+    return;
+  }
+  if(cache->child->tile_multi_get) {
+    cache->cache.tile_multi_get = _mapcache_cache_bloom_tile_multi_get;
+  }
+  if((cur_node = ezxml_child(node,"directory")) == NULL) {
+    ctx->set_error(ctx, 400, "bloom cache %s has no <directory>", pcache->name);
+    return;
+  }
+  cache->directory = apr_pstrdup(ctx->pool, cur_node->txt);
+  if((cur_node = ezxml_child(node,"capacity")) != NULL) {
+    cache->capacity = strtod(cur_node->txt,&endptr);
+    if(*endptr != 0 || cache->capacity < 1) {
+      ctx->set_error(ctx, 400, "failed to parse capacity \"%s\" of bloom cache %s (expecting a positive integer)",
+                     cur_node->txt, pcache->name);
+      return;
+    }
+  }
+  if((cur_node = ezxml_child(node,"false_positive_rate")) != NULL) {
+    cache->false_positive_rate = strtod(cur_node->txt,&endptr);
+    if(*endptr != 0 || cache->false_positive_rate <= 0 || cache->false_positive_rate >= 1) {
+      ctx->set_error(ctx, 400, "failed to parse false_positive_rate \"%s\" of bloom cache %s (expecting a number between 0 and 1)",
+                     cur_node->txt, pcache->name);
+      return;
+    }
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_bloom
+ */
+static void _mapcache_cache_bloom_configuration_post_config(mapcache_context *ctx, mapcache_cache *pcache,
+    mapcache_cfg *cfg)
+{
+}
+
+void mapcache_cache_bloom_set_complete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tileset *tileset,
+                                       mapcache_grid_link *grid_link, int z)
+{
+  mapcache_cache_bloom *cache = (mapcache_cache_bloom*)pcache;
+  _bloom_filter *filter = _bloom_filter_get(ctx, cache, tileset, grid_link, z, 1);
+  GC_CHECK_ERROR(ctx);
+  if(!filter) {
+    ctx->set_error(ctx, 500, "bloom cache %s: filter for level %d of tileset %s is not available",
+                   cache->cache.name, z, tileset->name);
+    return;
+  }
+  apr_atomic_set32(filter->complete, 1);
+}
+
+/**
+ * \brief creates and initializes a mapcache_cache_bloom
+ */
+mapcache_cache* mapcache_cache_bloom_create(mapcache_context *ctx)
+{
+  mapcache_cache_bloom *cache = apr_pcalloc(ctx->pool, sizeof(mapcache_cache_bloom));
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate bloom cache");
+    return NULL;
+  }
+  cache->cache.metadata = apr_table_make(ctx->pool,3);
+  cache->cache.type = MAPCACHE_CACHE_BLOOM;
+  cache->cache.tile_get = _mapcache_cache_bloom_tile_get;
+  cache->cache.tile_exists = _mapcache_cache_bloom_tile_exists;
+  cache->cache.tile_set = _mapcache_cache_bloom_tile_set;
+  cache->cache.tile_multi_set = _mapcache_cache_bloom_tile_multi_set;
+  cache->cache.tile_delete = _mapcache_cache_bloom_tile_delete;
+  cache->cache.configuration_post_config = _mapcache_cache_bloom_configuration_post_config;
+  cache->cache.configuration_parse_xml = _mapcache_cache_bloom_configuration_parse_xml;
+  cache->capacity = 1000000;
+  cache->false_positive_rate = 0.01;
+  return (mapcache_cache*)cache;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -0,0 +1,469 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: packed bundle disk cache
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <apr_file_io.h>
+#include <apr_file_info.h>
+#include <apr_portable.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+/*
+ * bundle cache: the tiles of a zoom level are grouped in files (bundles) each
+ * holding a square block of bundle_size x bundle_size tiles, instead of one
+ * file per tile. a bundle starts with a fixed size index giving the offset,
+ * size and modification time of each of its tiles, followed by the tile data:
+ *
+ *   "MCB1" | bundle_size (uint32) | index entries (16 bytes each) | data...
+ *
+ * an index entry is the modification time of the tile followed by its location,
+ * the offset of its data shifted left by 24 bits or'ed with its size, so that
+ * the location is updated by a single aligned 8 byte write.
+ *
+ * a tile is read with one read of its index entry and one of its data. tiles
+ * are written by appending their data to the bundle, then pointing their index
+ * entry to it, under an exclusive lock on the bundle file: readers never see an
+ * entry pointing to incomplete data. the space of replaced or deleted tiles is
+ * not reclaimed. values are stored in native byte order.
+ */
+
+#define MAPCACHE_BUNDLE_MAGIC "MCB1"
+#define MAPCACHE_BUNDLE_HEADER_SIZE 8
+#define MAPCACHE_BUNDLE_SIZE_BITS 24
+#define MAPCACHE_BUNDLE_MAX_TILE_SIZE ((APR_UINT64_C(1) << MAPCACHE_BUNDLE_SIZE_BITS) - 1)
+#define MAPCACHE_BUNDLE_MAX_OFFSET (APR_UINT64_C(1) << (64 - MAPCACHE_BUNDLE_SIZE_BITS))
+
+typedef struct {
+  apr_uint64_t mtime;    /* seconds since the epoch */
+  apr_uint64_t location; /* offset << MAPCACHE_BUNDLE_SIZE_BITS | size, 0 if the tile is not in the bundle */
+} mapcache_bundle_entry;
+
+#define MAPCACHE_BUNDLE_ENTRY_OFFSET(location) ((apr_off_t)((location) >> MAPCACHE_BUNDLE_SIZE_BITS))
+#define MAPCACHE_BUNDLE_ENTRY_SIZE(location) ((apr_size_t)((location) & MAPCACHE_BUNDLE_MAX_TILE_SIZE))
+
+typedef struct {
+  mapcache_cache cache;
+  char *base_directory;
+  int bundle_size;
+} mapcache_cache_bundle;
+
+/**
+ * \brief return the filename of the bundle containing the given tile
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _mapcache_cache_bundle_key(mapcache_context *ctx, mapcache_cache_bundle *cache, mapcache_tile *tile, char **path)
+{
+  char *dimstring = "";
+  if(tile->dimensions) {
+    const apr_array_header_t *elts = apr_table_elts(tile->dimensions);
+    int i = elts->nelts;
+    while(i--) {
+      apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
+      const char *dimval = mapcache_util_str_sanitize(ctx->pool,entry->val,"/.",'#');
+      dimstring = apr_pstrcat(ctx->pool,dimstring,"#",dimval,NULL);
+    }
+  }
+  *path = apr_psprintf(ctx->pool,"%s/%s/%s%s%s/%02d/R%05xC%05x.bundle",
+                       cache->base_directory, tile->tileset->name, tile->grid_link->grid->name,
+                       *dimstring?"/":"", dimstring, tile->z,
+                       tile->y / cache->bundle_size * cache->bundle_size,
+                       tile->x / cache->bundle_size * cache->bundle_size);
+}
+
+static apr_off_t _mapcache_cache_bundle_entry_offset(mapcache_cache_bundle *cache, mapcache_tile *tile)
+{
+  int index = (tile->y % cache->bundle_size) * cache->bundle_size + tile->x % cache->bundle_size;
+  return MAPCACHE_BUNDLE_HEADER_SIZE + (apr_off_t)index * sizeof(mapcache_bundle_entry);
+}
+
+static apr_status_t _mapcache_cache_bundle_read_at(apr_file_t *f, apr_off_t offset, void *buf, apr_size_t len)
+{
+#ifndef _WIN32
+  apr_os_file_t fd;
+  apr_size_t done = 0;
+  apr_os_file_get(&fd, f);
+  while(done < len) {
+    ssize_t n = pread(fd, (char*)buf + done, len - done, offset + done);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return APR_FROM_OS_ERROR(errno);
+    }
+    if(n == 0) return APR_EOF;
+    done += n;
+  }
+  return APR_SUCCESS;
+#else
+  apr_status_t rv = apr_file_seek(f, APR_SET, &offset);
+  if(rv != APR_SUCCESS) return rv;
+  return apr_file_read_full(f, buf, len, NULL);
+#endif
+}
+
+static apr_status_t _mapcache_cache_bundle_write_at(apr_file_t *f, apr_off_t offset, const void *buf, apr_size_t len)
+{
+#ifndef _WIN32
+  apr_os_file_t fd;
+  apr_size_t done = 0;
+  apr_os_file_get(&fd, f);
+  while(done < len) {
+    ssize_t n = pwrite(fd, (const char*)buf + done, len - done, offset + done);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return APR_FROM_OS_ERROR(errno);
+    }
+    done += n;
+  }
+  return APR_SUCCESS;
+#else
+  apr_status_t rv = apr_file_seek(f, APR_SET, &offset);
+  if(rv != APR_SUCCESS) return rv;
+  return apr_file_write_full(f, buf, len, NULL);
+#endif
+}
+
+/*
+ * read the index entry of a tile.
+ * returns MAPCACHE_CACHE_MISS if the bundle or the tile do not exist
+ */
+static int _mapcache_cache_bundle_read_entry(mapcache_context *ctx, mapcache_cache_bundle *cache, mapcache_tile *tile,
+    apr_file_t **f, mapcache_bundle_entry *entry)
+{
+  char *filename;
+  char errmsg[120];
+  apr_status_t rv;
+  _mapcache_cache_bundle_key(ctx, cache, tile, &filename);
+  if((rv = apr_file_open(f, filename, APR_FOPEN_READ|APR_FOPEN_BINARY, APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS) {
+    if(APR_STATUS_IS_ENOENT(rv)) {
+      return MAPCACHE_CACHE_MISS;
+    }
+    ctx->set_error(ctx, 500, "failed to open bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+    return MAPCACHE_FAILURE;
+  }
+  if((rv = _mapcache_cache_bundle_read_at(*f, _mapcache_cache_bundle_entry_offset(cache,tile),
+                                          entry, sizeof(mapcache_bundle_entry))) != APR_SUCCESS) {
+    apr_file_close(*f);
+    if(rv == APR_EOF) {
+      /* the bundle is being created by another process */
+      return MAPCACHE_CACHE_MISS;
+    }
+    ctx->set_error(ctx, 500, "failed to read index of bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+    return MAPCACHE_FAILURE;
+  }
+  if(!entry->location) {
+    apr_file_close(*f);
+    return MAPCACHE_CACHE_MISS;
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+static int _mapcache_cache_bundle_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bundle *cache = (mapcache_cache_bundle*)pcache;
+  mapcache_bundle_entry entry;
+  apr_file_t *f;
+  if(_mapcache_cache_bundle_read_entry(ctx, cache, tile, &f, &entry) != MAPCACHE_SUCCESS) {
+    return MAPCACHE_FALSE;
+  }
+  apr_file_close(f);
+  return MAPCACHE_TRUE;
+}
+
+/**
+ * \brief get content of given tile
+ *
+ * fills the mapcache_tile::data of the given tile with content stored in its bundle
+ * \private \memberof mapcache_cache_bundle
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_bundle_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bundle *cache = (mapcache_cache_bundle*)pcache;
+  mapcache_bundle_entry entry;
+  apr_file_t *f;
+  apr_status_t rv;
+  apr_size_t size;
+  int ret = _mapcache_cache_bundle_read_entry(ctx, cache, tile, &f, &entry);
+  if(ret != MAPCACHE_SUCCESS) {
+    return ret;
+  }
+  /* the mtime may already be the one of a tile being written, the location is
+   * read in one piece */
+  size = MAPCACHE_BUNDLE_ENTRY_SIZE(entry.location);
+  tile->encoded_data = mapcache_buffer_create(size, ctx->pool);
+  rv = _mapcache_cache_bundle_read_at(f, MAPCACHE_BUNDLE_ENTRY_OFFSET(entry.location), tile->encoded_data->buf, size);
+  apr_file_close(f);
+  if(rv != APR_SUCCESS) {
+    char errmsg[120];
+    ctx->set_error(ctx, 500, "failed to read tile %d %d %d from bundle: %s", tile->x, tile->y, tile->z,
+                   apr_strerror(rv,errmsg,120));
+    return MAPCACHE_FAILURE;
+  }
+  tile->encoded_data->size = size;
+  tile->mtime = apr_time_from_sec(entry.mtime);
+  return MAPCACHE_SUCCESS;
+}
+
+/*
+ * open and lock a bundle for writing, creating it with an empty index if needed.
+ * end is set to the size of the bundle. the lock is released by closing the file
+ */
+static apr_file_t* _mapcache_cache_bundle_open_rw(mapcache_context *ctx, mapcache_cache_bundle *cache, char *filename, apr_off_t *end)
+{
+  char errmsg[120];
+  apr_file_t *f;
+  apr_finfo_t finfo;
+  apr_status_t rv;
+  apr_off_t index_end = MAPCACHE_BUNDLE_HEADER_SIZE + (apr_off_t)cache->bundle_size * cache->bundle_size * sizeof(mapcache_bundle_entry);
+
+  rv = apr_file_open(&f, filename, APR_FOPEN_CREATE|APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_BINARY, APR_OS_DEFAULT, ctx->pool);
+  if(APR_STATUS_IS_ENOENT(rv)) {
+    char *dirname = apr_pstrdup(ctx->pool, filename);
+    *strrchr(dirname,'/') = '\0';
+    if((rv = apr_dir_make_recursive(dirname, APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS && !APR_STATUS_IS_EEXIST(rv)) {
+      ctx->set_error(ctx, 500, "failed to create directory %s: %s", dirname, apr_strerror(rv,errmsg,120));
+      return NULL;
+    }
+    rv = apr_file_open(&f, filename, APR_FOPEN_CREATE|APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_BINARY, APR_OS_DEFAULT, ctx->pool);
+  }
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to open bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+    return NULL;
+  }
+  /* serialize the writers of the bundle, across threads and processes */
+  if((rv = mapcache_lock_file(f)) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to lock bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+    apr_file_close(f);
+    return NULL;
+  }
+  if((rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, f)) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to stat bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+    apr_file_close(f);
+    return NULL;
+  }
+  if(finfo.size == 0) {
+    /* new bundle: write the header, the index is created zeroed (i.e. empty) by the truncate */
+    char header[MAPCACHE_BUNDLE_HEADER_SIZE];
+    apr_uint32_t size = cache->bundle_size;
+    memcpy(header, MAPCACHE_BUNDLE_MAGIC, 4);
+    memcpy(header + 4, &size, 4);
+    if((rv = apr_file_trunc(f, index_end)) != APR_SUCCESS ||
+        (rv = _mapcache_cache_bundle_write_at(f, 0, header, MAPCACHE_BUNDLE_HEADER_SIZE)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to initialize bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+      apr_file_close(f);
+      return NULL;
+    }
+    *end = index_end;
+  } else {
+    char header[MAPCACHE_BUNDLE_HEADER_SIZE];
+    apr_uint32_t size;
+    if((rv = _mapcache_cache_bundle_read_at(f, 0, header, MAPCACHE_BUNDLE_HEADER_SIZE)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to read header of bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+      apr_file_close(f);
+      return NULL;
+    }
+    memcpy(&size, header + 4, 4);
+    if(memcmp(header, MAPCACHE_BUNDLE_MAGIC, 4) || size != cache->bundle_size || finfo.size < index_end) {
+      ctx->set_error(ctx, 500, "%s is not a bundle of %d tiles per side", filename, cache->bundle_size);
+      apr_file_close(f);
+      return NULL;
+    }
+    *end = finfo.size;
+  }
+  return f;
+}
+
+/* write the tiles, which must all belong to the same bundle */
+static void _mapcache_cache_bundle_write(mapcache_context *ctx, mapcache_cache_bundle *cache, mapcache_tile **tiles, int ntiles)
+{
+  char errmsg[120];
+  char *filename;
+  apr_file_t *f;
+  apr_status_t rv;
+  apr_off_t end;
+  apr_uint64_t now = (apr_uint64_t)apr_time_sec(apr_time_now());
+  int i;
+
+  for(i=0; i<ntiles; i++) {
+    if(!tiles[i]->encoded_data) {
+      tiles[i]->encoded_data = tiles[i]->tileset->format->write(ctx, tiles[i]->raw_image, tiles[i]->tileset->format);
+      GC_CHECK_ERROR(ctx);
+    }
+    if(tiles[i]->encoded_data->size > MAPCACHE_BUNDLE_MAX_TILE_SIZE) {
+      ctx->set_error(ctx, 500, "tile %d %d %d is too large (%d bytes) to be stored in a bundle",
+                     tiles[i]->x, tiles[i]->y, tiles[i]->z, (int)tiles[i]->encoded_data->size);
+      return;
+    }
+  }
+
+  _mapcache_cache_bundle_key(ctx, cache, tiles[0], &filename);
+  f = _mapcache_cache_bundle_open_rw(ctx, cache, filename, &end);
+  GC_CHECK_ERROR(ctx);
+  for(i=0; i<ntiles && !GC_HAS_ERROR(ctx); i++) {
+    apr_size_t size = tiles[i]->encoded_data->size;
+    apr_off_t entry_offset = _mapcache_cache_bundle_entry_offset(cache,tiles[i]);
+    apr_uint64_t location = ((apr_uint64_t)end << MAPCACHE_BUNDLE_SIZE_BITS) | size;
+    if((apr_uint64_t)end + size >= MAPCACHE_BUNDLE_MAX_OFFSET) {
+      ctx->set_error(ctx, 500, "bundle %s is full", filename);
+      break;
+    }
+    /* the data must be complete before the index points to it */
+    if((rv = _mapcache_cache_bundle_write_at(f, end, tiles[i]->encoded_data->buf, size)) != APR_SUCCESS ||
+        (rv = _mapcache_cache_bundle_write_at(f, entry_offset, &now, sizeof(now))) != APR_SUCCESS ||
+        (rv = _mapcache_cache_bundle_write_at(f, entry_offset + sizeof(now), &location, sizeof(location))) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to write tile %d %d %d to bundle %s: %s", tiles[i]->x, tiles[i]->y, tiles[i]->z,
+                     filename, apr_strerror(rv,errmsg,120));
+    }
+    end += size;
+  }
+  apr_file_close(f);
+}
+
+/**
+ * \brief write tile data to its bundle
+ * \private \memberof mapcache_cache_bundle
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_bundle_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  _mapcache_cache_bundle_write(ctx, (mapcache_cache_bundle*)pcache, &tile, 1);
+}
+
+/**
+ * \brief write several tiles, locking and opening each bundle once
+ * \private \memberof mapcache_cache_bundle
+ * \sa mapcache_cache::tile_multi_set()
+ */
+static void _mapcache_cache_bundle_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_cache_bundle *cache = (mapcache_cache_bundle*)pcache;
+  mapcache_tile **batch = (mapcache_tile**)apr_pcalloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+  int *written = (int*)apr_pcalloc(ctx->pool, ntiles*sizeof(int));
+  int i,j,nbatch;
+  for(i=0; i<ntiles; i++) {
+    int bx, by;
+    if(written[i]) continue;
+    /* the tiles of a metatile usually all fall in the same bundle */
+    bx = tiles[i].x / cache->bundle_size;
+    by = tiles[i].y / cache->bundle_size;
+    nbatch = 0;
+    for(j=i; j<ntiles; j++) {
+      if(!written[j] && tiles[j].z == tiles[i].z && tiles[j].x / cache->bundle_size == bx &&
+          tiles[j].y / cache->bundle_size == by) {
+        written[j] = 1;
+        batch[nbatch++] = &tiles[j];
+      }
+    }
+    _mapcache_cache_bundle_write(ctx, cache, batch, nbatch);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+static void _mapcache_cache_bundle_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bundle *cache = (mapcache_cache_bundle*)pcache;
+  apr_uint64_t location = 0;
+  char errmsg[120];
+  char *filename;
+  apr_file_t *f;
+  apr_status_t rv;
+  _mapcache_cache_bundle_key(ctx, cache, tile, &filename);
+  rv = apr_file_open(&f, filename, APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_BINARY, APR_OS_DEFAULT, ctx->pool);
+  if(rv == APR_SUCCESS) {
+    if((rv = mapcache_lock_file(f)) != APR_SUCCESS ||
+        (rv = _mapcache_cache_bundle_write_at(f, _mapcache_cache_bundle_entry_offset(cache,tile) + sizeof(apr_uint64_t),
+              &location, sizeof(location))) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to delete tile from bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+    }
+    apr_file_close(f);
+  } else if(!APR_STATUS_IS_ENOENT(rv)) {
+    ctx->set_error(ctx, 500, "failed to open bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _mapcache_cache_bundle_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *pcache, mapcache_cfg *config)
+{
+  mapcache_cache_bundle *cache = (mapcache_cache_bundle*)pcache;
+  ezxml_t cur_node;
+  if((cur_node = ezxml_child(node,"base")) != NULL) {
+    cache->base_directory = apr_pstrdup(ctx->pool,cur_node->txt);
+  }
+  if((cur_node = ezxml_child(node,"bundle_size")) != NULL) {
+    char *endptr;
+    cache->bundle_size = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || cache->bundle_size < 1 || cache->bundle_size > 1024) {
+      ctx->set_error(ctx, 400, "failed to parse bundle_size \"%s\" for cache %s (expecting an integer between 1 and 1024)",
+                     cur_node->txt, pcache->name);
+      return;
+    }
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _mapcache_cache_bundle_configuration_post_config(mapcache_context *ctx, mapcache_cache *pcache,
+    mapcache_cfg *cfg)
+{
+  mapcache_cache_bundle *cache = (mapcache_cache_bundle*)pcache;
+  if(!cache->base_directory || !strlen(cache->base_directory)) {
+    ctx->set_error(ctx, 400, "bundle cache %s has no base directory", pcache->name);
+  }
+}
+
+/**
+ * \brief creates and initializes a mapcache_cache_bundle
+ */
+mapcache_cache* mapcache_cache_bundle_create(mapcache_context *ctx)
+{
+  mapcache_cache_bundle *cache = apr_pcalloc(ctx->pool, sizeof(mapcache_cache_bundle));
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate bundle cache");
+    return NULL;
+  }
+  cache->cache.metadata = apr_table_make(ctx->pool,3);
+  cache->cache.type = MAPCACHE_CACHE_BUNDLE;
+  cache->cache.tile_get = _mapcache_cache_bundle_get;
+  cache->cache.tile_exists = _mapcache_cache_bundle_has_tile;
+  cache->cache.tile_set = _mapcache_cache_bundle_set;
+  cache->cache.tile_multi_set = _mapcache_cache_bundle_multi_set;
+  cache->cache.tile_delete = _mapcache_cache_bundle_delete;
+  cache->cache.configuration_post_config = _mapcache_cache_bundle_configuration_post_config;
+  cache->cache.configuration_parse_xml = _mapcache_cache_bundle_configuration_parse_xml;
+  cache->bundle_size = 128;
+  return (mapcache_cache*)cache;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -0,0 +1,609 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: composite multi-tier cache
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <apr_atomic.h>
+#include <apr_lib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#if APR_HAS_THREADS
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#endif
+
+/*
+ * composite cache: a stack of caches (tiers), the fastest first.
+ *  - reads go down the tiers until one has the tile. A tile found in a lower
+ *    tier is then copied (promoted) to the tiers above it.
+ *  - writes go synchronously to the first tier only, and are queued for the
+ *    other tiers (write-behind).
+ * promotions and queued writes are done by a per-process background thread.
+ * when its queue is full, writes are done synchronously by the requesting
+ * thread and promotions are dropped. each tier can be restricted to a range of
+ * zoom levels, tiles outside of it are neither read from nor written to it.
+ */
+
+#define MAPCACHE_COMPOSITE_STATS_INTERVAL 100000
+/* log messages of the background writer kept until a request can log them */
+#define MAPCACHE_COMPOSITE_MAX_MESSAGES 16
+
+typedef struct {
+  mapcache_cache *cache;
+  int minzoom, maxzoom;
+  volatile apr_uint32_t hits, misses, writes, promotions, queued, failures;
+} mapcache_cache_composite_tier;
+
+#if APR_HAS_THREADS
+typedef struct _composite_job _composite_job;
+typedef struct _composite_writer _composite_writer;
+
+struct _composite_job {
+  apr_pool_t *pool;     /* holds the job and its copy of the tiles */
+  mapcache_tile *tiles;
+  int ntiles;
+  int *tiers;           /* indexes of the tiers to write to */
+  int ntiers;
+  int promotion;        /* only write to tiers that do not already have the tile */
+  _composite_job *next;
+};
+
+/* context of the writer thread, not tied to a request */
+typedef struct {
+  mapcache_context ctx;
+  _composite_writer *writer;
+} _composite_writer_context;
+
+typedef struct {
+  mapcache_log_level level;
+  char message[256];
+} _composite_message;
+
+struct _composite_writer {
+  apr_pool_t *pool;
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *work;
+  apr_thread_t *thread;
+  _composite_job *head, *tail;
+  int nqueued;
+  int shutdown;
+  _composite_writer_context ctx;
+  int nerrors;          /* errors not reported yet, and the last of them */
+  char error[512];
+  /* messages logged by the tiers, not reported yet */
+  _composite_message messages[MAPCACHE_COMPOSITE_MAX_MESSAGES];
+  int nmessages;
+  int nlost;            /* messages dropped because the queue above was full */
+};
+#endif
+
+typedef struct {
+  mapcache_cache cache;
+  mapcache_cache_composite_tier *tiers;
+  int ntiers;
+  int max_queued;
+  volatile apr_uint32_t lookups;
+#if APR_HAS_THREADS
+  _composite_writer *writer; /* NULL until first used in this process */
+  int writer_failed;
+#endif
+} mapcache_cache_composite;
+
+static int _composite_tier_has_zoom(mapcache_cache_composite_tier *tier, int z)
+{
+  return (tier->minzoom < 0 || z >= tier->minzoom) && (tier->maxzoom < 0 || z <= tier->maxzoom);
+}
+
+static void _composite_log_stats(mapcache_context *ctx, mapcache_cache_composite *cache)
+{
+  int i;
+  if((apr_atomic_inc32(&cache->lookups) + 1) % MAPCACHE_COMPOSITE_STATS_INTERVAL) {
+    return;
+  }
+  for(i=0; i<cache->ntiers; i++) {
+    mapcache_cache_composite_tier *tier = &cache->tiers[i];
+    ctx->log(ctx, MAPCACHE_INFO, "composite cache %s, tier %s: %u hits, %u misses, %u writes (%u behind), %u promotions, %u failures",
+             cache->cache.name, tier->cache->name, tier->hits, tier->misses, tier->writes, tier->queued,
+             tier->promotions, tier->failures);
+  }
+}
+
+static void _composite_write_tier(mapcache_context *ctx, mapcache_cache_composite_tier *tier, mapcache_tile *tiles, int ntiles)
+{
+  int i;
+  if(ntiles > 1 && tier->cache->tile_multi_set) {
+    tier->cache->tile_multi_set(ctx, tier->cache, tiles, ntiles);
+  } else {
+    for(i=0; i<ntiles && !GC_HAS_ERROR(ctx); i++) {
+      tier->cache->tile_set(ctx, tier->cache, &tiles[i]);
+    }
+  }
+  if(GC_HAS_ERROR(ctx)) {
+    apr_atomic_inc32(&tier->failures);
+  } else {
+    apr_atomic_add32(&tier->writes, ntiles);
+  }
+}
+
+#if APR_HAS_THREADS
+
+static mapcache_context* _composite_writer_context_clone(mapcache_context *ctx)
+{
+  _composite_writer_context *nctx = (_composite_writer_context*)apr_pcalloc(ctx->pool, sizeof(_composite_writer_context));
+  mapcache_context_copy(ctx,&nctx->ctx);
+  apr_pool_create(&nctx->ctx.pool,ctx->pool);
+  nctx->writer = ((_composite_writer_context*)ctx)->writer;
+  return (mapcache_context*)nctx;
+}
+
+/*
+ * the writer has no request or server to log to: its messages are kept and
+ * logged by the next request that uses the cache
+ */
+static void _composite_writer_context_log(mapcache_context *ctx, mapcache_log_level level, char *message, ...)
+{
+  _composite_writer *writer = ((_composite_writer_context*)ctx)->writer;
+  va_list args;
+  if(ctx->config && level < ctx->config->loglevel) return;
+  apr_thread_mutex_lock(writer->mutex);
+  if(writer->nmessages < MAPCACHE_COMPOSITE_MAX_MESSAGES) {
+    _composite_message *msg = &writer->messages[writer->nmessages++];
+    msg->level = level;
+    va_start(args,message);
+    apr_vsnprintf(msg->message, sizeof(msg->message), message, args);
+    va_end(args);
+  } else {
+    writer->nlost++;
+  }
+  apr_thread_mutex_unlock(writer->mutex);
+}
+
+/* logs what the writer reported since the last call. the writer mutex must be held */
+static void _composite_writer_report(mapcache_context *ctx, mapcache_cache_composite *cache, _composite_writer *writer)
+{
+  int i;
+  for(i=0; i<writer->nmessages; i++) {
+    ctx->log(ctx, writer->messages[i].level, "composite cache %s (background): %s",
+             cache->cache.name, writer->messages[i].message);
+  }
+  if(writer->nlost) {
+    ctx->log(ctx, MAPCACHE_WARN, "composite cache %s: %d more background messages were dropped",
+             cache->cache.name, writer->nlost);
+  }
+  if(writer->nerrors) {
+    ctx->log(ctx, MAPCACHE_ERROR, "composite cache %s: %d background writes failed, last error: %s",
+             cache->cache.name, writer->nerrors, writer->error);
+  }
+  writer->nmessages = writer->nlost = writer->nerrors = 0;
+}
+
+static void _composite_job_run(_composite_writer *writer, mapcache_cache_composite *cache, _composite_job *job)
+{
+  mapcache_context *ctx = &writer->ctx.ctx;
+  int i;
+  ctx->pool = job->pool;
+  ctx->exceptions = NULL;
+  for(i=0; i<job->ntiers; i++) {
+    mapcache_cache_composite_tier *tier = &cache->tiers[job->tiers[i]];
+    ctx->clear_errors(ctx);
+    if(job->promotion) {
+      if(tier->cache->tile_exists(ctx, tier->cache, &job->tiles[0]) == MAPCACHE_TRUE) {
+        /* the tile was written through the composite cache in the meantime */
+        continue;
+      }
+      ctx->clear_errors(ctx);
+      tier->cache->tile_set(ctx, tier->cache, &job->tiles[0]);
+      if(!GC_HAS_ERROR(ctx)) apr_atomic_inc32(&tier->promotions);
+      else apr_atomic_inc32(&tier->failures);
+    } else {
+      _composite_write_tier(ctx, tier, job->tiles, job->ntiles);
+    }
+    if(GC_HAS_ERROR(ctx)) {
+      apr_thread_mutex_lock(writer->mutex);
+      writer->nerrors++;
+      apr_cpystrn(writer->error, apr_psprintf(job->pool, "%s to %s failed: %s", job->promotion?"promotion":"write-behind",
+                  tier->cache->name, ctx->get_error_message(ctx)), sizeof(writer->error));
+      apr_thread_mutex_unlock(writer->mutex);
+    }
+  }
+  ctx->clear_errors(ctx);
+}
+
+typedef struct {
+  _composite_writer *writer;
+  mapcache_cache_composite *cache;
+} _composite_writer_args;
+
+static void* APR_THREAD_FUNC _composite_writer_thread(apr_thread_t *thread, void *data)
+{
+  _composite_writer_args *args = (_composite_writer_args*)data;
+  _composite_writer *writer = args->writer;
+  apr_thread_mutex_lock(writer->mutex);
+  while(1) {
+    _composite_job *job;
+    while(!writer->shutdown && !writer->head) {
+      apr_thread_cond_wait(writer->work, writer->mutex);
+    }
+    /* on shutdown, the writes that are already queued are still done */
+    if(!writer->head) break;
+    job = writer->head;
+    writer->head = job->next;
+    if(!writer->head) writer->tail = NULL;
+    writer->nqueued--;
+    apr_thread_mutex_unlock(writer->mutex);
+    _composite_job_run(writer, args->cache, job);
+    apr_pool_destroy(job->pool);
+    apr_thread_mutex_lock(writer->mutex);
+  }
+  apr_thread_mutex_unlock(writer->mutex);
+  apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
+}
+
+static apr_status_t _composite_writer_destroy(void *data)
+{
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)data;
+  _composite_writer *writer = cache->writer;
+  apr_status_t rv;
+  int i;
+  apr_thread_mutex_lock(writer->mutex);
+  writer->shutdown = 1;
+  apr_thread_cond_signal(writer->work);
+  apr_thread_mutex_unlock(writer->mutex);
+  apr_thread_join(&rv, writer->thread);
+  cache->writer = NULL;
+  /* there is no request left to log to */
+  for(i=0; i<writer->nmessages; i++) {
+    fprintf(stderr, "composite cache %s (background): %s\n", cache->cache.name, writer->messages[i].message);
+  }
+  if(writer->nerrors) {
+    fprintf(stderr, "composite cache %s: %d background writes failed, last error: %s\n",
+            cache->cache.name, writer->nerrors, writer->error);
+  }
+  apr_pool_destroy(writer->pool);
+  return APR_SUCCESS;
+}
+
+/*
+ * return the background writer of the cache, creating it on first use.
+ * returns NULL if it could not be created, in which case the tiers are
+ * written to synchronously
+ */
+static _composite_writer* _composite_writer_get(mapcache_context *ctx, mapcache_cache_composite *cache)
+{
+  apr_pool_t *pool;
+  _composite_writer *writer;
+  _composite_writer_args *args;
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+  if(!cache->writer && !cache->writer_failed) {
+    cache->writer_failed = 1;
+    if(apr_pool_create(&pool,NULL) == APR_SUCCESS) {
+      writer = (_composite_writer*)apr_pcalloc(pool,sizeof(_composite_writer));
+      writer->pool = pool;
+      mapcache_context_copy(ctx,&writer->ctx.ctx);
+      mapcache_context_init(&writer->ctx.ctx);
+      writer->ctx.ctx.pool = pool;
+      writer->ctx.ctx.exceptions = NULL;
+      writer->ctx.ctx.log = _composite_writer_context_log;
+      writer->ctx.ctx.clone = _composite_writer_context_clone;
+      writer->ctx.writer = writer;
+      args = (_composite_writer_args*)apr_pcalloc(pool,sizeof(_composite_writer_args));
+      args->writer = writer;
+      args->cache = cache;
+      if(apr_thread_mutex_create(&writer->mutex,APR_THREAD_MUTEX_DEFAULT,pool) != APR_SUCCESS ||
+          apr_thread_cond_create(&writer->work,pool) != APR_SUCCESS ||
+          apr_thread_create(&writer->thread,NULL,_composite_writer_thread,args,pool) != APR_SUCCESS) {
+        ctx->log(ctx,MAPCACHE_WARN,"composite cache %s: failed to create write-behind thread, writing synchronously",
+                 cache->cache.name);
+        apr_pool_destroy(pool);
+      } else {
+        /* the writer lives in its own unmanaged pool, so its thread is joined before anything is freed */
+        cache->writer = writer;
+        cache->writer_failed = 0;
+        apr_pool_cleanup_register(ctx->process_pool,cache,_composite_writer_destroy,apr_pool_cleanup_null);
+      }
+    }
+  }
+  writer = cache->writer;
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+  return writer;
+}
+
+/*
+ * queue a write of the given tiles to some of the tiers.
+ * returns MAPCACHE_FALSE if the job could not be queued
+ */
+static int _composite_queue(mapcache_context *ctx, mapcache_cache_composite *cache, mapcache_tile *tiles, int ntiles,
+                            int *tiers, int ntiers, int promotion)
+{
+  _composite_writer *writer;
+  _composite_job *job;
+  apr_pool_t *pool;
+  int i;
+  if(cache->max_queued == 0 || !(writer = _composite_writer_get(ctx, cache))) {
+    return MAPCACHE_FALSE;
+  }
+  /*
+   * the job outlives the request: it needs its own copy of the tiles. tilesets
+   * cloned for the request (e.g. by the wms service) cannot be referenced
+   */
+  for(i=0; i<ntiles; i++) {
+    if(!tiles[i].encoded_data || mapcache_configuration_get_tileset(ctx->config, tiles[i].tileset->name) != tiles[i].tileset) {
+      return MAPCACHE_FALSE;
+    }
+  }
+
+  apr_thread_mutex_lock(writer->mutex);
+  _composite_writer_report(ctx, cache, writer);
+  if(writer->nqueued >= cache->max_queued) {
+    apr_thread_mutex_unlock(writer->mutex);
+    return MAPCACHE_FALSE;
+  }
+  writer->nqueued++;
+  apr_thread_mutex_unlock(writer->mutex);
+
+  if(apr_pool_create(&pool,NULL) != APR_SUCCESS) {
+    apr_thread_mutex_lock(writer->mutex);
+    writer->nqueued--;
+    apr_thread_mutex_unlock(writer->mutex);
+    return MAPCACHE_FALSE;
+  }
+  job = (_composite_job*)apr_pcalloc(pool,sizeof(_composite_job));
+  job->pool = pool;
+  job->promotion = promotion;
+  job->ntiers = ntiers;
+  job->tiers = (int*)apr_pmemdup(pool,tiers,ntiers*sizeof(int));
+  job->ntiles = ntiles;
+  job->tiles = (mapcache_tile*)apr_pmemdup(pool,tiles,ntiles*sizeof(mapcache_tile));
+  for(i=0; i<ntiles; i++) {
+    mapcache_tile *tile = &job->tiles[i];
+    mapcache_buffer *data = mapcache_buffer_create(tiles[i].encoded_data->size,pool);
+    mapcache_buffer_append(data,tiles[i].encoded_data->size,tiles[i].encoded_data->buf);
+    tile->encoded_data = data;
+    tile->raw_image = NULL;
+    if(tiles[i].dimensions) {
+      tile->dimensions = apr_table_clone(pool,tiles[i].dimensions);
+    }
+  }
+  if(!promotion) {
+    for(i=0; i<ntiers; i++) {
+      apr_atomic_add32(&cache->tiers[tiers[i]].queued, ntiles);
+    }
+  }
+
+  apr_thread_mutex_lock(writer->mutex);
+  if(writer->tail) writer->tail->next = job;
+  else writer->head = job;
+  writer->tail = job;
+  apr_thread_cond_signal(writer->work);
+  apr_thread_mutex_unlock(writer->mutex);
+  return MAPCACHE_TRUE;
+}
+
+#else
+
+static int _composite_queue(mapcache_context *ctx, mapcache_cache_composite *cache, mapcache_tile *tiles, int ntiles,
+                            int *tiers, int ntiers, int promotion)
+{
+  return MAPCACHE_FALSE;
+}
+
+#endif
+
+/* write tiles synchronously to the first tier, and queue them for the others */
+static void _composite_write(mapcache_context *ctx, mapcache_cache_composite *cache, mapcache_tile *tiles, int ntiles)
+{
+  int *tiers = (int*)apr_pcalloc(ctx->pool, cache->ntiers*sizeof(int));
+  int ntiers = 0, i;
+  for(i=0; i<cache->ntiers; i++) {
+    /* tiles written together belong to the same metatile, hence have the same zoom level */
+    if(_composite_tier_has_zoom(&cache->tiers[i], tiles[0].z)) {
+      tiers[ntiers++] = i;
+    }
+  }
+  if(!ntiers) return;
+  _composite_write_tier(ctx, &cache->tiers[tiers[0]], tiles, ntiles);
+  GC_CHECK_ERROR(ctx);
+  if(ntiers == 1 || _composite_queue(ctx, cache, tiles, ntiles, tiers+1, ntiers-1, 0) == MAPCACHE_TRUE) {
+    return;
+  }
+  for(i=1; i<ntiers; i++) {
+    _composite_write_tier(ctx, &cache->tiers[tiers[i]], tiles, ntiles);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+/**
+ * \brief get content of given tile
+ *
+ * returns the tile from the first tier that has it, and promotes it to the
+ * tiers above that one
+ * \private \memberof mapcache_cache_composite
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_composite_tile_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  int *tiers = (int*)apr_pcalloc(ctx->pool, cache->ntiers*sizeof(int));
+  int ntiers = 0, i, ret = MAPCACHE_CACHE_MISS;
+  _composite_log_stats(ctx, cache);
+  for(i=0; i<cache->ntiers; i++) {
+    mapcache_cache_composite_tier *tier = &cache->tiers[i];
+    if(!_composite_tier_has_zoom(tier, tile->z)) continue;
+    ret = tier->cache->tile_get(ctx, tier->cache, tile);
+    if(ret == MAPCACHE_SUCCESS) {
+      apr_atomic_inc32(&tier->hits);
+      break;
+    }
+    if(GC_HAS_ERROR(ctx)) {
+      apr_atomic_inc32(&tier->failures);
+      return MAPCACHE_FAILURE;
+    }
+    apr_atomic_inc32(&tier->misses);
+    if(ret != MAPCACHE_CACHE_MISS) {
+      return ret;
+    }
+    tiers[ntiers++] = i;
+  }
+  if(ret == MAPCACHE_SUCCESS && ntiers) {
+    /* promotions are best effort, they are not worth slowing down a request */
+    _composite_queue(ctx, cache, tile, 1, tiers, ntiers, 1);
+  }
+  return ret;
+}
+
+static int _mapcache_cache_composite_tile_exists(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  int i;
+  for(i=0; i<cache->ntiers; i++) {
+    mapcache_cache_composite_tier *tier = &cache->tiers[i];
+    if(!_composite_tier_has_zoom(tier, tile->z)) continue;
+    if(tier->cache->tile_exists(ctx, tier->cache, tile) == MAPCACHE_TRUE) {
+      return MAPCACHE_TRUE;
+    }
+    if(GC_HAS_ERROR(ctx)) return MAPCACHE_FALSE;
+  }
+  return MAPCACHE_FALSE;
+}
+
+static void _mapcache_cache_composite_tile_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  int i;
+  for(i=0; i<cache->ntiers; i++) {
+    mapcache_cache_composite_tier *tier = &cache->tiers[i];
+    if(!_composite_tier_has_zoom(tier, tile->z)) continue;
+    tier->cache->tile_delete(ctx, tier->cache, tile);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_composite
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_composite_tile_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  _composite_write(ctx, (mapcache_cache_composite*)pcache, tile, 1);
+}
+
+static void _mapcache_cache_composite_tile_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  _composite_write(ctx, (mapcache_cache_composite*)pcache, tiles, ntiles);
+}
+
+/**
+ * \private \memberof mapcache_cache_composite
+ */
+static void _mapcache_cache_composite_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *pcache, mapcache_cfg *config)
+{
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  ezxml_t cur_node;
+  char *endptr;
+  int i;
+  for(cur_node = ezxml_child(node,"cache"); cur_node; cur_node = cur_node->next) {
+    cache->ntiers++;
+  }
+  if(!cache->ntiers) {
+    ctx->set_error(ctx, 400, "composite cache %s has no <cache> tiers", pcache->name);
+    return;
+  }
+  cache->tiers = (mapcache_cache_composite_tier*)apr_pcalloc(ctx->pool, cache->ntiers*sizeof(mapcache_cache_composite_tier));
+  for(i=0, cur_node = ezxml_child(node,"cache"); cur_node; i++, cur_node = cur_node->next) {
+    mapcache_cache_composite_tier *tier = &cache->tiers[i];
+    const char *zoom;
+    tier->cache = mapcache_configuration_get_cache(config, cur_node->txt);
+    if(!tier->cache) {
+      ctx->set_error(ctx, 400, "composite cache %s references cache \"%s\", which has not been defined before it",
+                     pcache->name, cur_node->txt);
+      return;
+    }
+    tier->minzoom = tier->maxzoom = -1;
+    if((zoom = ezxml_attr(cur_node,"minzoom")) != NULL) {
+      tier->minzoom = (int)strtol(zoom,&endptr,10);
+      if(*endptr != 0 || tier->minzoom < 0) {
+        ctx->set_error(ctx, 400, "failed to parse minzoom \"%s\" of tier %s (expecting a positive integer)", zoom, cur_node->txt);
+        return;
+      }
+    }
+    if((zoom = ezxml_attr(cur_node,"maxzoom")) != NULL) {
+      tier->maxzoom = (int)strtol(zoom,&endptr,10);
+      if(*endptr != 0 || tier->maxzoom < 0) {
+        ctx->set_error(ctx, 400, "failed to parse maxzoom \"%s\" of tier %s (expecting a positive integer)", zoom, cur_node->txt);
+        return;
+      }
+    }
+  }
+  if((cur_node = ezxml_child(node,"write_behind_queue_size")) != NULL) {
+    cache->max_queued = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || cache->max_queued < 0) {
+      ctx->set_error(ctx, 400, "failed to parse write_behind_queue_size \"%s\". Expecting a positive integer, e.g. <write_behind_queue_size>1000</write_behind_queue_size>",
+                     cur_node->txt);
+      return;
+    }
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_composite
+ */
+static void _mapcache_cache_composite_configuration_post_config(mapcache_context *ctx, mapcache_cache *pcache,
+    mapcache_cfg *cfg)
+{
+}
+
+/**
+ * \brief creates and initializes a mapcache_cache_composite
+ */
+mapcache_cache* mapcache_cache_composite_create(mapcache_context *ctx)
+{
+  mapcache_cache_composite *cache = apr_pcalloc(ctx->pool, sizeof(mapcache_cache_composite));
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate composite cache");
+    return NULL;
+  }
+  cache->cache.metadata = apr_table_make(ctx->pool,3);
+  cache->cache.type = MAPCACHE_CACHE_COMPOSITE;
+  cache->cache.tile_get = _mapcache_cache_composite_tile_get;
+  cache->cache.tile_exists = _mapcache_cache_composite_tile_exists;
+  cache->cache.tile_set = _mapcache_cache_composite_tile_set;
+  cache->cache.tile_multi_set = _mapcache_cache_composite_tile_multi_set;
+  cache->cache.tile_delete = _mapcache_cache_composite_tile_delete;
+  cache->cache.configuration_post_config = _mapcache_cache_composite_configuration_post_config;
+  cache->cache.configuration_parse_xml = _mapcache_cache_composite_configuration_parse_xml;
+  cache->max_queued = 1000;
+  return (mapcache_cache*)cache;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -34,11 +34,21 @@
 #include <string.h>
 #include <errno.h>
 #include <apr_mmap.h>
+#include <apr_portable.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
 
-#ifdef HAVE_SYMLINK
+#include <apr_atomic.h>
+
+#ifndef _WIN32
 #include <unistd.h>
 #endif
 
+#if defined(O_TMPFILE) && defined(AT_SYMLINK_FOLLOW) && defined(AT_FDCWD)
+#define USE_O_TMPFILE
+#endif
+
 /**
  * \brief computes the relative path between two destinations
  *
@@ -111,10 +121,10 @@ char* relative_path(mapcache_context *ctx, char* tilename, char* blankname)
  * \param path pointer to a char* that will contain the filename
  * \private \memberof mapcache_cache_disk
  */
-static void _mapcache_cache_disk_base_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_disk_base_tile_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, char **path)
 {
   *path = apr_pstrcat(ctx->pool,
-                      ((mapcache_cache_disk*)tile->tileset->cache)->base_directory,"/",
+                      dcache->base_directory,"/",
                       tile->tileset->name,"/",
                       tile->grid_link->grid->name,
                       NULL);
@@ -129,11 +139,11 @@ static void _mapcache_cache_disk_base_tile_key(mapcache_context *ctx, mapcache_t
   }
 }
 
-static void _mapcache_cache_disk_blank_tile_key(mapcache_context *ctx, mapcache_tile *tile, unsigned char *color, char **path)
+static void _mapcache_cache_disk_blank_tile_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, unsigned char *color, char **path)
 {
   /* not implemented for template caches, as symlink_blank will never be set */
   *path = apr_psprintf(ctx->pool,"%s/%s/%s/blanks/%02X%02X%02X%02X.%s",
-                       ((mapcache_cache_disk*)tile->tileset->cache)->base_directory,
+                       dcache->base_directory,
                        tile->tileset->name,
                        tile->grid_link->grid->name,
                        color[0],
@@ -154,12 +164,11 @@ static void _mapcache_cache_disk_blank_tile_key(mapcache_context *ctx, mapcache_
  * \param r
  * \private \memberof mapcache_cache_disk
  */
-static void _mapcache_cache_disk_tilecache_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_disk_tilecache_tile_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
   if(dcache->base_directory) {
     char *start;
-    _mapcache_cache_disk_base_tile_key(ctx, tile, &start);
+    _mapcache_cache_disk_base_tile_key(ctx, dcache, tile, &start);
     *path = apr_psprintf(ctx->pool,"%s/%02d/%03d/%03d/%03d/%03d/%03d/%03d.%s",
                          start,
                          tile->z,
@@ -222,9 +231,8 @@ static void _mapcache_cache_disk_tilecache_tile_key(mapcache_context *ctx, mapca
   }
 }
 
-static void _mapcache_cache_disk_template_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_disk_template_tile_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
 
   *path = dcache->filename_template;
   *path = mapcache_util_str_replace(ctx->pool,*path, "{tileset}", tile->tileset->name);
@@ -278,12 +286,11 @@ static void _mapcache_cache_disk_template_tile_key(mapcache_context *ctx, mapcac
   }
 }
 
-static void _mapcache_cache_disk_arcgis_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_disk_arcgis_tile_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
   if(dcache->base_directory) {
     char *start;
-    _mapcache_cache_disk_base_tile_key(ctx, tile, &start);
+    _mapcache_cache_disk_base_tile_key(ctx, dcache, tile, &start);
     *path = apr_psprintf(ctx->pool,"%s/L%02d/R%08x/C%08x.%s" ,
                          start,
                          tile->z,
@@ -298,13 +305,13 @@ static void _mapcache_cache_disk_arcgis_tile_key(mapcache_context *ctx, mapcache
 }
 
 
-static int _mapcache_cache_disk_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_disk_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *filename;
   apr_finfo_t finfo;
   int rv;
   
-  mapcache_cache_disk* cache = (mapcache_cache_disk*)tile->tileset->cache;
+  mapcache_cache_disk *cache = (mapcache_cache_disk*)pcache;
   if (cache->maxzoom>0)  // maxzoom is set
   {
     if (tile->z>cache->maxzoom)
@@ -313,7 +320,7 @@ static int _mapcache_cache_disk_has_tile(mapcache_context *ctx, mapcache_tile *t
     }
   }
   
-  ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
+  cache->tile_key(ctx, cache, tile, &filename);
   if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FALSE;
   }
@@ -325,12 +332,13 @@ static int _mapcache_cache_disk_has_tile(mapcache_context *ctx, mapcache_tile *t
   }
 }
 
-static void _mapcache_cache_disk_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_disk_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   apr_status_t ret;
   char errmsg[120];
   char *filename;
-  ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
+  mapcache_cache_disk *cache = (mapcache_cache_disk*)pcache;
+  cache->tile_key(ctx, cache, tile, &filename);
   GC_CHECK_ERROR(ctx);
 
   ret = apr_file_remove(filename,ctx->pool);
@@ -347,16 +355,95 @@ static void _mapcache_cache_disk_delete(mapcache_context *ctx, mapcache_tile *ti
  * \private \memberof mapcache_cache_disk
  * \sa mapcache_cache::tile_get()
  */
-static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
+/*
+ * reads the content of an opened tile file. if keep_open is set, the file is
+ * left open and referenced by the tile so it can be sent as is to the client
+ */
+static int _mapcache_cache_disk_read(mapcache_context *ctx, mapcache_tile *tile, char *filename, apr_file_t *f, int keep_open)
 {
-  char *filename;
-  apr_file_t *f;
   apr_finfo_t finfo;
   apr_status_t rv;
   apr_size_t size;
+#ifndef NOMMAP
   apr_mmap_t *tilemmap;
+#endif
+  rv = apr_file_info_get(&finfo, APR_FINFO_SIZE|APR_FINFO_MTIME|APR_FINFO_INODE, f);
+  if(!finfo.size) {
+    ctx->set_error(ctx, 500, "tile %s has no data",filename);
+    return MAPCACHE_FAILURE;
+  }
+
+  size = finfo.size;
+  /*
+   * at this stage, we have a handle to an open file that contains data.
+   * idealy, we should aquire a read lock, in case the data contained inside the file
+   * is incomplete (i.e. if another process is currently writing to the tile).
+   * currently such a lock is not set, as we don't want to loose performance on tile accesses.
+   * any error that might happen at this stage should only occur if the tile isn't already cached,
+   * i.e. normally only once.
+   */
+  tile->mtime = finfo.mtime;
+  tile->encoded_data = mapcache_buffer_create(size,ctx->pool);
+  /*
+   * tiles are replaced by renaming a new file over them, so the inode, size
+   * and mtime identify the content without reading it
+   */
+  tile->etag = apr_psprintf(ctx->pool, "\"%" APR_UINT64_T_HEX_FMT "-%" APR_UINT64_T_HEX_FMT "-%" APR_UINT64_T_HEX_FMT "\"",
+                            (apr_uint64_t)finfo.inode, (apr_uint64_t)finfo.size, (apr_uint64_t)finfo.mtime);
+  tile->etag_data = tile->encoded_data;
+
+#ifndef NOMMAP
+
+  rv = apr_mmap_create(&tilemmap,f,0,finfo.size,APR_MMAP_READ,ctx->pool);
+  if(rv != APR_SUCCESS) {
+    char errmsg[120];
+    ctx->set_error(ctx, 500,  "mmap error: %s",apr_strerror(rv,errmsg,120));
+    return MAPCACHE_FAILURE;
+  }
+  tile->encoded_data->buf = tilemmap->mm;
+  tile->encoded_data->size = tile->encoded_data->avail = finfo.size;
+#else
+  //manually add the data to our buffer
+  apr_file_read(f,(void*)tile->encoded_data->buf,&size);
+  tile->encoded_data->size = size;
+  tile->encoded_data->avail = size;
+#endif
+  if(tile->encoded_data->size != finfo.size) {
+    apr_file_close(f);
+    ctx->set_error(ctx, 500,  "failed to copy image data, got %d of %d bytes",(int)size, (int)finfo.size);
+    return MAPCACHE_FAILURE;
+  }
+  if(keep_open) {
+    tile->encoded_file = (mapcache_file_range*)apr_pcalloc(ctx->pool, sizeof(mapcache_file_range));
+    tile->encoded_file->file = f;
+    tile->encoded_file->filename = filename;
+    tile->encoded_file->offset = 0;
+    tile->encoded_file->length = finfo.size;
+    tile->encoded_file->data = tile->encoded_data;
+  } else {
+    apr_file_close(f);
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+static apr_status_t _mapcache_cache_disk_open(mapcache_context *ctx, char *filename, apr_file_t **f)
+{
+  return apr_file_open(f, filename,
+#ifndef NOMMAP
+                       APR_FOPEN_READ|APR_FOPEN_SENDFILE_ENABLED, APR_UREAD | APR_GREAD,
+#else
+                       APR_FOPEN_READ|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY|APR_FOPEN_SENDFILE_ENABLED,APR_OS_DEFAULT,
+#endif
+                       ctx->pool);
+}
+
+static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  char *filename;
+  apr_file_t *f;
+  apr_status_t rv;
   
-  mapcache_cache_disk* cache = (mapcache_cache_disk*)tile->tileset->cache;
+  mapcache_cache_disk *cache = (mapcache_cache_disk*)pcache;
   if (cache->maxzoom>0)  // maxzoom is set
   {
     if (tile->z>cache->maxzoom)
@@ -365,67 +452,208 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
     }
   }
 
-  ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
+  cache->tile_key(ctx, cache, tile, &filename);
   if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FAILURE;
   }
-  if((rv=apr_file_open(&f, filename,
-#ifndef NOMMAP
-                       APR_FOPEN_READ, APR_UREAD | APR_GREAD,
-#else
-                       APR_FOPEN_READ|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,APR_OS_DEFAULT,
-#endif
-                       ctx->pool)) == APR_SUCCESS) {
-    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE|APR_FINFO_MTIME, f);
-    if(!finfo.size) {
-      ctx->set_error(ctx, 500, "tile %s has no data",filename);
+  if((rv=_mapcache_cache_disk_open(ctx, filename, &f)) == APR_SUCCESS) {
+    /* single tiles are usually sent as is, keep their file for the front end */
+    return _mapcache_cache_disk_read(ctx, tile, filename, f, 1);
+  } else {
+    if(APR_STATUS_IS_ENOENT(rv)) {
+      /* the file doesn't exist on the disk */
+      return MAPCACHE_CACHE_MISS;
+    } else {
+      char *error = strerror(rv);
+      ctx->set_error(ctx, 500,  "failed to open file %s: %s",filename, error);
       return MAPCACHE_FAILURE;
     }
+  }
+}
 
-    size = finfo.size;
-    /*
-     * at this stage, we have a handle to an open file that contains data.
-     * idealy, we should aquire a read lock, in case the data contained inside the file
-     * is incomplete (i.e. if another process is currently writing to the tile).
-     * currently such a lock is not set, as we don't want to loose performance on tile accesses.
-     * any error that might happen at this stage should only occur if the tile isn't already cached,
-     * i.e. normally only once.
-     */
-    tile->mtime = finfo.mtime;
-    tile->encoded_data = mapcache_buffer_create(size,ctx->pool);
+/**
+ * \brief get content of several tiles
+ *
+ * all the tile files are opened and announced to the kernel before any of them
+ * is read, so that the reads of the files that are not in the page cache are
+ * issued concurrently instead of one after the other
+ * \private \memberof mapcache_cache_disk
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_disk_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles)
+{
+  mapcache_cache_disk *cache = (mapcache_cache_disk*)pcache;
+  apr_file_t **files = (apr_file_t**)apr_pcalloc(ctx->pool, ntiles*sizeof(apr_file_t*));
+  char **filenames = (char**)apr_pcalloc(ctx->pool, ntiles*sizeof(char*));
+  apr_status_t rv;
+  int i;
+  for(i=0; i<ntiles; i++) {
+    if(cache->maxzoom > 0 && tiles[i]->z > cache->maxzoom) {
+      tiles[i]->cache_miss = 1;
+      continue;
+    }
+    cache->tile_key(ctx, cache, tiles[i], &filenames[i]);
+    GC_CHECK_ERROR(ctx);
+    if((rv = _mapcache_cache_disk_open(ctx, filenames[i], &files[i])) != APR_SUCCESS) {
+      /* other errors are left to be reported by tile_get() */
+      if(APR_STATUS_IS_ENOENT(rv)) tiles[i]->cache_miss = 1;
+      files[i] = NULL;
+      continue;
+    }
+#if defined(POSIX_FADV_WILLNEED) && !defined(_WIN32)
+    {
+      apr_os_file_t fd;
+      if(apr_os_file_get(&fd, files[i]) == APR_SUCCESS) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      }
+    }
+#endif
+  }
+  for(i=0; i<ntiles; i++) {
+    if(!files[i]) continue;
+    if(_mapcache_cache_disk_read(ctx, tiles[i], filenames[i], files[i], 0) != MAPCACHE_SUCCESS) {
+      tiles[i]->encoded_data = NULL;
+      ctx->clear_errors(ctx);
+    }
+  }
+}
 
-#ifndef NOMMAP
+/* a name, next to the tile, for a file that is renamed to the tile once complete */
+static char* _mapcache_cache_disk_temp_name(mapcache_context *ctx, const char *filename)
+{
+  static volatile apr_uint32_t counter = 0;
+  return apr_psprintf(ctx->pool, "%s.%d.%u.tmp", filename,
+#ifndef _WIN32
+                      (int)getpid(),
+#else
+                      0,
+#endif
+                      apr_atomic_inc32(&counter));
+}
 
-    rv = apr_mmap_create(&tilemmap,f,0,finfo.size,APR_MMAP_READ,ctx->pool);
-    if(rv != APR_SUCCESS) {
-      char errmsg[120];
-      ctx->set_error(ctx, 500,  "mmap error: %s",apr_strerror(rv,errmsg,120));
-      return MAPCACHE_FAILURE;
-    }
-    tile->encoded_data->buf = tilemmap->mm;
-    tile->encoded_data->size = tile->encoded_data->avail = finfo.size;
+static void _mapcache_cache_disk_sync(mapcache_context *ctx, apr_file_t *f, const char *filename)
+{
+#ifndef _WIN32
+  apr_os_file_t fd;
+  if(apr_os_file_get(&fd, f) == APR_SUCCESS &&
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+      fdatasync(fd) != 0
 #else
-    //manually add the data to our buffer
-    apr_file_read(f,(void*)tile->encoded_data->buf,&size);
-    tile->encoded_data->size = size;
-    tile->encoded_data->avail = size;
+      fsync(fd) != 0
 #endif
-    apr_file_close(f);
-    if(tile->encoded_data->size != finfo.size) {
-      ctx->set_error(ctx, 500,  "failed to copy image data, got %d of %d bytes",(int)size, (int)finfo.size);
+    ) {
+    ctx->set_error(ctx, 500, "failed to sync file %s: %s", filename, strerror(errno));
+  }
+#endif
+}
+
+#ifdef USE_O_TMPFILE
+/*
+ * writes the tile to an anonymous file of the tile directory, and links it
+ * once complete. nothing is left behind if the process dies while writing.
+ * returns MAPCACHE_FALSE if anonymous files are not supported, in which case
+ * nothing was done
+ */
+static int _mapcache_cache_disk_write_tmpfile(mapcache_context *ctx, mapcache_cache_disk *cache, char *dirname,
+    char *filename, mapcache_buffer *data, apr_status_t *status)
+{
+  char *procname, *tmpname;
+  apr_size_t written = 0;
+  int fd = open(dirname, O_TMPFILE|O_WRONLY, 0666);
+  if(fd < 0) {
+    if(errno == ENOENT) {
+      /* let the caller recreate the directory */
+      *status = APR_FROM_OS_ERROR(errno);
+      ctx->set_error(ctx, 500, "failed to create file in %s: %s", dirname, strerror(errno));
       return MAPCACHE_FAILURE;
     }
-    return MAPCACHE_SUCCESS;
-  } else {
-    if(APR_STATUS_IS_ENOENT(rv)) {
-      /* the file doesn't exist on the disk */
-      return MAPCACHE_CACHE_MISS;
-    } else {
-      char *error = strerror(rv);
-      ctx->set_error(ctx, 500,  "failed to open file %s: %s",filename, error);
+    /* EOPNOTSUPP, EISDIR or EINVAL if the kernel or filesystem doesn't support it */
+    return MAPCACHE_FALSE;
+  }
+  while(written < data->size) {
+    ssize_t n = write(fd, (char*)data->buf + written, data->size - written);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      ctx->set_error(ctx, 500, "failed to write data to file %s: %s", filename, strerror(errno));
+      close(fd);
+      return MAPCACHE_FAILURE;
+    }
+    written += n;
+  }
+  if(cache->fsync && fdatasync(fd) != 0) {
+    ctx->set_error(ctx, 500, "failed to sync file %s: %s", filename, strerror(errno));
+    close(fd);
+    return MAPCACHE_FAILURE;
+  }
+  procname = apr_psprintf(ctx->pool, "/proc/self/fd/%d", fd);
+  if(linkat(AT_FDCWD, procname, AT_FDCWD, filename, AT_SYMLINK_FOLLOW) != 0) {
+    if(errno != EEXIST) {
+      int err = errno;
+      close(fd);
+      if(err == ENOENT) {
+        /* /proc is not mounted */
+        return MAPCACHE_FALSE;
+      }
+      ctx->set_error(ctx, 500, "failed to link file %s: %s", filename, strerror(err));
       return MAPCACHE_FAILURE;
     }
+    /* the tile exists, it can only be replaced atomically by a rename */
+    tmpname = _mapcache_cache_disk_temp_name(ctx, filename);
+    if(linkat(AT_FDCWD, procname, AT_FDCWD, tmpname, AT_SYMLINK_FOLLOW) != 0) {
+      ctx->set_error(ctx, 500, "failed to link file %s: %s", tmpname, strerror(errno));
+    } else if(rename(tmpname, filename) != 0) {
+      ctx->set_error(ctx, 500, "failed to rename %s to %s: %s", tmpname, filename, strerror(errno));
+      unlink(tmpname);
+    }
+  }
+  close(fd);
+  return GC_HAS_ERROR(ctx)?MAPCACHE_FAILURE:MAPCACHE_SUCCESS;
+}
+#endif
+
+/*
+ * writes the tile so that concurrent readers either see the previous version
+ * of the file or the complete new one, never a partially written one.
+ * status is set to the error of the file creation, so that the caller can
+ * recreate a missing tile directory and retry
+ */
+static int _mapcache_cache_disk_write_atomic(mapcache_context *ctx, mapcache_cache_disk *cache, char *dirname,
+    char *filename, mapcache_buffer *data, apr_status_t *status)
+{
+  char errmsg[120];
+  char *tmpname;
+  apr_file_t *f;
+  apr_status_t ret;
+  *status = APR_SUCCESS;
+#ifdef USE_O_TMPFILE
+  ret = _mapcache_cache_disk_write_tmpfile(ctx, cache, dirname, filename, data, status);
+  if(ret != MAPCACHE_FALSE) {
+    return ret;
+  }
+#endif
+  tmpname = _mapcache_cache_disk_temp_name(ctx, filename);
+  if((ret = apr_file_open(&f, tmpname, APR_FOPEN_CREATE|APR_FOPEN_EXCL|APR_FOPEN_WRITE|APR_FOPEN_BINARY,
+                          APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS) {
+    *status = ret;
+    ctx->set_error(ctx, 500, "failed to create file %s: %s", tmpname, apr_strerror(ret,errmsg,120));
+    return MAPCACHE_FAILURE;
+  }
+  if((ret = apr_file_write_full(f, data->buf, data->size, NULL)) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to write data to file %s: %s", tmpname, apr_strerror(ret,errmsg,120));
+  } else if(cache->fsync) {
+    _mapcache_cache_disk_sync(ctx, f, tmpname);
+  }
+  if((ret = apr_file_close(f)) != APR_SUCCESS && !GC_HAS_ERROR(ctx)) {
+    ctx->set_error(ctx, 500, "failed to close file %s: %s", tmpname, apr_strerror(ret,errmsg,120));
+  }
+  if(!GC_HAS_ERROR(ctx) && (ret = apr_file_rename(tmpname, filename, ctx->pool)) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to rename %s to %s: %s", tmpname, filename, apr_strerror(ret,errmsg,120));
+  }
+  if(GC_HAS_ERROR(ctx)) {
+    apr_file_remove(tmpname, ctx->pool);
+    return MAPCACHE_FAILURE;
   }
+  return MAPCACHE_SUCCESS;
 }
 
 /**
@@ -437,14 +665,14 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
  * \private \memberof mapcache_cache_disk
  * \sa mapcache_cache::tile_set()
  */
-static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_disk_tile_set(mapcache_context *ctx, mapcache_cache_disk *cache, mapcache_tile *tile, char **created_dir)
 {
   apr_size_t bytes;
   apr_file_t *f;
   apr_status_t ret;
   char errmsg[120];
   char *filename, *hackptr1, *hackptr2=NULL;
-  const int creation_retry = ((mapcache_cache_disk*)tile->tileset->cache)->creation_retry;
+  const int creation_retry = cache->creation_retry;
   int retry_count_create_file = 0;
 
 #ifdef DEBUG
@@ -459,7 +687,6 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
   }
 #endif
 
-  mapcache_cache_disk* cache = (mapcache_cache_disk*)tile->tileset->cache;
   if (cache->maxzoom>0)  // maxzoom is set
   {
     if (tile->z>cache->maxzoom)
@@ -473,7 +700,7 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
     }
   }
 
-  ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
+  cache->tile_key(ctx, cache, tile, &filename);
   GC_CHECK_ERROR(ctx);
 
   /* find the location of the last '/' in the string */
@@ -485,33 +712,42 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
   }
   *hackptr2 = '\0';
 
-  if(APR_SUCCESS != (ret = apr_dir_make_recursive(filename,APR_OS_DEFAULT,ctx->pool))) {
-    /*
-     * apr_dir_make_recursive sometimes sends back this error, although it should not.
-     * ignore this one
-     */
-    if(!APR_STATUS_IS_EEXIST(ret)) {
-      ctx->set_error(ctx, 500, "failed to create directory %s: %s",filename, apr_strerror(ret,errmsg,120));
-      return;
+  /* the tiles of a metatile are mostly in the same directory, only create it once */
+  if(!created_dir || !*created_dir || strcmp(*created_dir,filename)) {
+    if(APR_SUCCESS != (ret = apr_dir_make_recursive(filename,APR_OS_DEFAULT,ctx->pool))) {
+      /*
+       * apr_dir_make_recursive sometimes sends back this error, although it should not.
+       * ignore this one
+       */
+      if(!APR_STATUS_IS_EEXIST(ret)) {
+        ctx->set_error(ctx, 500, "failed to create directory %s: %s",filename, apr_strerror(ret,errmsg,120));
+        return;
+      }
+    }
+    if(created_dir) {
+      *created_dir = apr_pstrdup(ctx->pool,filename);
     }
   }
   *hackptr2 = '/';
 
-  ret = apr_file_remove(filename,ctx->pool);
-  if(ret != APR_SUCCESS && !APR_STATUS_IS_ENOENT(ret)) {
-    ctx->set_error(ctx, 500,  "failed to remove file %s: %s",filename, apr_strerror(ret,errmsg,120));
+  if(!cache->atomic_writes) {
+    /* with atomic writes, the existing tile is replaced by the rename */
+    ret = apr_file_remove(filename,ctx->pool);
+    if(ret != APR_SUCCESS && !APR_STATUS_IS_ENOENT(ret)) {
+      ctx->set_error(ctx, 500,  "failed to remove file %s: %s",filename, apr_strerror(ret,errmsg,120));
+    }
   }
 
 
 #ifdef HAVE_SYMLINK
-  if(((mapcache_cache_disk*)tile->tileset->cache)->symlink_blank) {
+  if(cache->symlink_blank) {
     if(!tile->raw_image) {
       tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
       GC_CHECK_ERROR(ctx);
     }
     if(mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
       char *blankname;
-      _mapcache_cache_disk_blank_tile_key(ctx,tile,tile->raw_image->data,&blankname);
+      _mapcache_cache_disk_blank_tile_key(ctx,cache,tile,tile->raw_image->data,&blankname);
       if(apr_file_open(&f, blankname, APR_FOPEN_READ, APR_OS_DEFAULT, ctx->pool) != APR_SUCCESS) {
         if(!tile->encoded_data) {
           tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
@@ -519,7 +755,7 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
         }
         /* create the blank file */
         char *blankdirname = apr_psprintf(ctx->pool, "%s/%s/%s/blanks",
-                                          ((mapcache_cache_disk*)tile->tileset->cache)->base_directory,
+                                          cache->base_directory,
                                           tile->tileset->name,
                                           tile->grid_link->grid->name);
         if(APR_SUCCESS != (ret = apr_dir_make_recursive(
@@ -572,6 +808,7 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
        * compute the relative path between tile and blank tile
        */
       char *blankname_rel = NULL;
+      char *linkname = cache->atomic_writes?_mapcache_cache_disk_temp_name(ctx,filename):filename;
       blankname_rel = relative_path(ctx,filename, blankname);
       GC_CHECK_ERROR(ctx);
 
@@ -580,7 +817,7 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
        * this can happen on nfs mounted network storage.
        * the solution is to create the containing directory again and retry the symlink creation.
        */
-      while(symlink(blankname_rel, filename) != 0) {
+      while(symlink(blankname_rel, linkname) != 0) {
         retry_count_create_symlink++;
 
         if(retry_count_create_symlink > creation_retry) {
@@ -600,6 +837,11 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
 
         *hackptr2 = '/';
       }
+      if(linkname != filename && (ret = apr_file_rename(linkname,filename,ctx->pool)) != APR_SUCCESS) {
+        ctx->set_error(ctx, 500, "failed to rename link %s to %s: %s",linkname, filename, apr_strerror(ret,errmsg,120));
+        apr_file_remove(linkname,ctx->pool);
+        return;
+      }
 #ifdef DEBUG
       ctx->log(ctx, MAPCACHE_DEBUG, "linked blank tile %s to %s",filename,blankname);
 #endif
@@ -615,6 +857,27 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
     GC_CHECK_ERROR(ctx);
   }
 
+  if(cache->atomic_writes) {
+    char *dirname;
+    *hackptr2 = '\0';
+    dirname = apr_pstrdup(ctx->pool,filename);
+    *hackptr2 = '/';
+    while(_mapcache_cache_disk_write_atomic(ctx,cache,dirname,filename,tile->encoded_data,&ret) != MAPCACHE_SUCCESS) {
+      retry_count_create_file++;
+      if(!APR_STATUS_IS_ENOENT(ret) || retry_count_create_file > creation_retry) {
+        return;
+      }
+      ctx->clear_errors(ctx);
+      if(APR_SUCCESS != (ret = apr_dir_make_recursive(dirname,APR_OS_DEFAULT,ctx->pool))) {
+        if(!APR_STATUS_IS_EEXIST(ret)) {
+          ctx->set_error(ctx, 500, "failed to create file, can not create directory %s: %s",dirname, apr_strerror(ret,errmsg,120));
+          return;
+        }
+      }
+    }
+    return;
+  }
+
   /*
    * depending on configuration file creation will retry if it fails.
    * this can happen on nfs mounted network storage.
@@ -661,6 +924,21 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
 
 }
 
+static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  _mapcache_cache_disk_tile_set(ctx, (mapcache_cache_disk*)pcache, tile, NULL);
+}
+
+static void _mapcache_cache_disk_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  char *created_dir = NULL;
+  int i;
+  for(i=0; i<ntiles; i++) {
+    _mapcache_cache_disk_tile_set(ctx, (mapcache_cache_disk*)pcache, &tiles[i], &created_dir);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
 /**
  * \private \memberof mapcache_cache_disk
  */
@@ -705,6 +983,24 @@ static void _mapcache_cache_disk_configuration_parse_xml(mapcache_context *ctx,
     }
   }
 
+  if ((cur_node = ezxml_child(node,"atomic_writes")) != NULL) {
+    if(!strcasecmp(cur_node->txt,"true")) {
+      dcache->atomic_writes = 1;
+    } else if(strcasecmp(cur_node->txt,"false")) {
+      ctx->set_error(ctx,400,"failed to parse atomic_writes \"%s\" for cache %s (expecting true or false)",cur_node->txt,cache->name);
+      return;
+    }
+  }
+
+  if ((cur_node = ezxml_child(node,"fsync")) != NULL) {
+    if(!strcasecmp(cur_node->txt,"true")) {
+      dcache->fsync = 1;
+    } else if(strcasecmp(cur_node->txt,"false")) {
+      ctx->set_error(ctx,400,"failed to parse fsync \"%s\" for cache %s (expecting true or false)",cur_node->txt,cache->name);
+      return;
+    }
+  }
+
   if ((cur_node = ezxml_child(node,"creation_retry")) != NULL) {
     dcache->creation_retry = atoi(cur_node->txt);
   }
@@ -750,6 +1046,8 @@ mapcache_cache* mapcache_cache_disk_create(mapcache_context *ctx)
   cache->cache.tile_get = _mapcache_cache_disk_get;
   cache->cache.tile_exists = _mapcache_cache_disk_has_tile;
   cache->cache.tile_set = _mapcache_cache_disk_set;
+  cache->cache.tile_multi_set = _mapcache_cache_disk_multi_set;
+  cache->cache.tile_multi_get = _mapcache_cache_disk_multi_get;
   cache->cache.configuration_post_config = _mapcache_cache_disk_configuration_post_config;
   cache->cache.configuration_parse_xml = _mapcache_cache_disk_configuration_parse_xml;
   return (mapcache_cache*)cache;
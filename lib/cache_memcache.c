@@ -30,41 +30,214 @@
 #ifdef USE_MEMCACHE
 
 #include "mapcache.h"
+#include <apr_md5.h>
 
-static int _mapcache_cache_memcache_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+/*
+ * keys are spread over the servers with consistent (ketama) hashing: each
+ * server is given a number of points on a ring of 32 bit hashes, and a key
+ * goes to the server owning the first point following the key's hash. adding
+ * or removing a server only moves the keys of the ring sections it owns.
+ * the copies of a key are stored on the following distinct servers of the ring.
+ */
+
+#define MEMCACHE_POINTS_PER_SERVER 160
+#define MEMCACHE_MAX_REPLICAS 16
+
+/*
+ * suffix of the small key telling whether a tile exists. memcached can evict
+ * the tile and keep its marker, so tile_exists() may report a tile that is
+ * gone: such markers are removed when tile_get() finds the tile missing
+ */
+#define MEMCACHE_EXISTS_SUFFIX "#exists"
+
+typedef struct {
+  apr_uint32_t point;
+  apr_memcache_server_t *server;
+} _memcache_point;
+
+typedef struct {
+  _memcache_point *points;
+  int npoints;
+  int nservers;
+  int replica; /* index of the copy of the keys this selector returns the server of */
+} _memcache_ring;
+
+static apr_uint32_t _memcache_ketama_hash(void *baton, const char *data, const apr_size_t data_len)
+{
+  unsigned char digest[APR_MD5_DIGESTSIZE];
+  apr_md5(digest, data, data_len);
+  return ((apr_uint32_t)digest[3] << 24) | ((apr_uint32_t)digest[2] << 16) |
+         ((apr_uint32_t)digest[1] << 8) | digest[0];
+}
+
+static int _memcache_point_cmp(const void *a, const void *b)
+{
+  apr_uint32_t pa = ((const _memcache_point*)a)->point;
+  apr_uint32_t pb = ((const _memcache_point*)b)->point;
+  return (pa < pb) ? -1 : (pa > pb);
+}
+
+/*
+ * returns MAPCACHE_TRUE if the server can be used. dead servers are pinged
+ * again every few seconds, as apr_memcache_find_server_hash_default() does
+ */
+static int _memcache_server_live(apr_memcache_t *mc, apr_memcache_server_t *ms)
+{
+  apr_time_t now;
+  int live = MAPCACHE_FALSE;
+  if(ms->status == APR_MC_SERVER_LIVE) return MAPCACHE_TRUE;
+  now = apr_time_now();
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(ms->lock);
+#endif
+  if(ms->status == APR_MC_SERVER_LIVE) {
+    live = MAPCACHE_TRUE;
+  } else if(now - ms->btime > apr_time_from_sec(5)) {
+    apr_pool_t *pool;
+    char *version;
+    ms->btime = now;
+    /* mc->p is shared by all the threads, the reply is read into a scratch pool */
+    if(apr_pool_create(&pool, NULL) == APR_SUCCESS) {
+      if(apr_memcache_version(ms, pool, &version) == APR_SUCCESS) {
+        apr_memcache_enable_server(mc, ms);
+        live = MAPCACHE_TRUE;
+      }
+      apr_pool_destroy(pool);
+    }
+  }
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(ms->lock);
+#endif
+  return live;
+}
+
+static apr_memcache_server_t* _memcache_ketama_server(void *baton, apr_memcache_t *mc, const apr_uint32_t hash)
+{
+  _memcache_ring *ring = (_memcache_ring*)baton;
+  apr_memcache_server_t *found[MEMCACHE_MAX_REPLICAS];
+  int lo = 0, hi = ring->npoints, i, j, nfound = 0;
+  /* first point at or after the hash, wrapping around the ring */
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(ring->points[mid].point < hash) lo = mid + 1;
+    else hi = mid;
+  }
+  /* dead servers are skipped, their keys go to the following live ones */
+  for(i=0; i<ring->npoints; i++) {
+    apr_memcache_server_t *ms = ring->points[(lo + i) % ring->npoints].server;
+    for(j=0; j<nfound && found[j] != ms; j++);
+    if(j < nfound || !_memcache_server_live(mc, ms)) continue;
+    if(nfound == ring->replica) return ms;
+    found[nfound++] = ms;
+  }
+  return NULL;
+}
+
+/*
+ * spread the keys of the given copy with consistent hashing over the servers
+ * of the memcache object
+ */
+static void _memcache_ketama_setup(mapcache_context *ctx, apr_memcache_t *mc, int replica)
+{
+  _memcache_ring *ring = (_memcache_ring*)apr_pcalloc(ctx->pool, sizeof(_memcache_ring));
+  int i, j, k;
+  ring->replica = replica;
+  ring->nservers = mc->ntotal;
+  ring->npoints = mc->ntotal * MEMCACHE_POINTS_PER_SERVER;
+  ring->points = (_memcache_point*)apr_pcalloc(ctx->pool, ring->npoints * sizeof(_memcache_point));
+  for(i=0; i<mc->ntotal; i++) {
+    apr_memcache_server_t *ms = mc->live_servers[i];
+    /* each digest gives 4 points */
+    for(j=0; j<MEMCACHE_POINTS_PER_SERVER/4; j++) {
+      unsigned char digest[APR_MD5_DIGESTSIZE];
+      char *name = apr_psprintf(ctx->pool, "%s:%d-%d", ms->host, ms->port, j);
+      apr_md5(digest, name, strlen(name));
+      for(k=0; k<4; k++) {
+        _memcache_point *point = &ring->points[i*MEMCACHE_POINTS_PER_SERVER + j*4 + k];
+        point->point = ((apr_uint32_t)digest[3+k*4] << 24) | ((apr_uint32_t)digest[2+k*4] << 16) |
+                       ((apr_uint32_t)digest[1+k*4] << 8) | digest[k*4];
+        point->server = ms;
+      }
+    }
+  }
+  qsort(ring->points, ring->npoints, sizeof(_memcache_point), _memcache_point_cmp);
+  mc->hash_func = _memcache_ketama_hash;
+  mc->hash_baton = NULL;
+  mc->server_func = _memcache_ketama_server;
+  mc->server_baton = ring;
+}
+
+/* expiration of the tiles of a tileset, in the form memcached expects it */
+static apr_uint32_t _memcache_expiration(mapcache_tileset *tileset)
+{
+  int expires = 86400; /* one day if the tileset does not say */
+  if(tileset->auto_expire) {
+    expires = tileset->auto_expire;
+  } else if(tileset->expires > 0) {
+    expires = tileset->expires;
+  }
+  /* memcached reads more than 30 days as an absolute unix time */
+  if(expires > 2592000) {
+    return (apr_uint32_t)(apr_time_sec(apr_time_now()) + expires);
+  }
+  return expires;
+}
+
+static int _mapcache_cache_memcache_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *key;
   char *tmpdata;
-  int rv;
-  size_t tmpdatasize;
-  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
+  int i;
+  apr_size_t tmpdatasize;
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
   key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
   if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FALSE;
   }
-  rv = apr_memcache_getp(cache->memcache,ctx->pool,key,&tmpdata,&tmpdatasize,NULL);
-  if(rv != APR_SUCCESS) {
-    return MAPCACHE_FALSE;
-  }
-  if(tmpdatasize == 0) {
-    return MAPCACHE_FALSE;
+  /* look for the small marker stored alongside the tile rather than downloading it */
+  key = apr_pstrcat(ctx->pool, key, MEMCACHE_EXISTS_SUFFIX, NULL);
+  for(i=0; i<cache->nreplicas; i++) {
+    if(apr_memcache_getp(cache->memcache[i],ctx->pool,key,&tmpdata,&tmpdatasize,NULL) == APR_SUCCESS) {
+      return MAPCACHE_TRUE;
+    }
   }
-  return MAPCACHE_TRUE;
+  return MAPCACHE_FALSE;
 }
 
-static void _mapcache_cache_memcache_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_memcache_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *key;
-  int rv;
+  int rv,i;
   char errmsg[120];
-  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
   key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
   GC_CHECK_ERROR(ctx);
-  rv = apr_memcache_delete(cache->memcache,key,0);
-  if(rv != APR_SUCCESS && rv!= APR_NOTFOUND) {
-    int code = 500;
-    ctx->set_error(ctx,code,"memcache: failed to delete key %s: %s", key, apr_strerror(rv,errmsg,120));
+  for(i=0; i<cache->nreplicas; i++) {
+    apr_memcache_delete(cache->memcache[i],apr_pstrcat(ctx->pool, key, MEMCACHE_EXISTS_SUFFIX, NULL),0);
+    rv = apr_memcache_delete(cache->memcache[i],key,0);
+    if(rv != APR_SUCCESS && rv!= APR_NOTFOUND) {
+      int code = 500;
+      ctx->set_error(ctx,code,"memcache: failed to delete key %s: %s", key, apr_strerror(rv,errmsg,120));
+      return;
+    }
+  }
+}
+
+/* strips the modification time appended to the data stored for a tile */
+static int _mapcache_cache_memcache_tile_from_value(mapcache_context *ctx, mapcache_tile *tile)
+{
+  if(tile->encoded_data->size < sizeof(apr_time_t)) {
+    ctx->set_error(ctx,500,"memcache cache returned 0-length data for tile %d %d %d\n",tile->x,tile->y,tile->z);
+    return MAPCACHE_FAILURE;
   }
+  /* extract the tile modification time from the end of the data returned */
+  memcpy(
+    &tile->mtime,
+    &(((char*)tile->encoded_data->buf)[tile->encoded_data->size-sizeof(apr_time_t)]),
+    sizeof(apr_time_t));
+  tile->encoded_data->avail = tile->encoded_data->size;
+  tile->encoded_data->size -= sizeof(apr_time_t);
+  return MAPCACHE_SUCCESS;
 }
 
 /**
@@ -74,33 +247,73 @@ static void _mapcache_cache_memcache_delete(mapcache_context *ctx, mapcache_tile
  * \private \memberof mapcache_cache_memcache
  * \sa mapcache_cache::tile_get()
  */
-static int _mapcache_cache_memcache_get(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_memcache_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *key;
-  int rv;
-  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
+  int rv,i;
+  int evicted[MEMCACHE_MAX_REPLICAS];
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
   key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
   if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FAILURE;
   }
   tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
-  rv = apr_memcache_getp(cache->memcache,ctx->pool,key,(char**)&tile->encoded_data->buf,&tile->encoded_data->size,NULL);
-  if(rv != APR_SUCCESS) {
-    return MAPCACHE_CACHE_MISS;
+  /* the copies are only read from if the first one is missing, e.g. evicted or on a dead server */
+  for(i=0; i<cache->nreplicas; i++) {
+    rv = apr_memcache_getp(cache->memcache[i],ctx->pool,key,(char**)&tile->encoded_data->buf,&tile->encoded_data->size,NULL);
+    if(rv == APR_SUCCESS) {
+      return _mapcache_cache_memcache_tile_from_value(ctx, tile);
+    }
+    evicted[i] = (rv == APR_NOTFOUND);
   }
-  if(tile->encoded_data->size == 0) {
-    ctx->set_error(ctx,500,"memcache cache returned 0-length data for tile %d %d %d\n",tile->x,tile->y,tile->z);
-    return MAPCACHE_FAILURE;
+  /* don't let tile_exists() report the tile through a marker that outlived it */
+  for(i=0; i<cache->nreplicas; i++) {
+    if(evicted[i]) {
+      apr_memcache_delete(cache->memcache[i],apr_pstrcat(ctx->pool, key, MEMCACHE_EXISTS_SUFFIX, NULL),0);
+    }
+  }
+  tile->encoded_data = NULL;
+  return MAPCACHE_CACHE_MISS;
+}
+
+/**
+ * \brief get content of several tiles in a single round trip per memcache server
+ * \private \memberof mapcache_cache_memcache
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_memcache_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles)
+{
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
+  apr_hash_t *values = apr_hash_make(ctx->pool);
+  char **keys = (char**)apr_pcalloc(ctx->pool, ntiles*sizeof(char*));
+  int i;
+  for(i=0; i<ntiles; i++) {
+    keys[i] = mapcache_util_get_tile_key(ctx, tiles[i],NULL," \r\n\t\f\e\a\b","#");
+    GC_CHECK_ERROR(ctx);
+    apr_memcache_add_multget_key(ctx->pool, keys[i], &values);
+  }
+  /* only from the first copy, tiles missing from it are fetched from the other ones by tile_get() */
+  if(apr_memcache_multgetp(cache->memcache[0], ctx->pool, ctx->pool, values) != APR_SUCCESS) {
+    /* not an error, the tiles will be fetched one by one */
+    return;
+  }
+  for(i=0; i<ntiles; i++) {
+    apr_memcache_value_t *value = apr_hash_get(values, keys[i], APR_HASH_KEY_STRING);
+    if(!value || value->status != APR_SUCCESS || !value->data) {
+      /* with a single copy, a key the server answered as missing is a definite miss */
+      if(cache->nreplicas == 1 && value && value->status == APR_NOTFOUND) {
+        tiles[i]->cache_miss = 1;
+      }
+      continue;
+    }
+    tiles[i]->encoded_data = mapcache_buffer_create(0,ctx->pool);
+    tiles[i]->encoded_data->buf = value->data;
+    tiles[i]->encoded_data->size = value->len;
+    if(_mapcache_cache_memcache_tile_from_value(ctx, tiles[i]) != MAPCACHE_SUCCESS) {
+      tiles[i]->encoded_data = NULL;
+      return;
+    }
   }
-  /* extract the tile modification time from the end of the data returned */
-  memcpy(
-    &tile->mtime,
-    &(((char*)tile->encoded_data->buf)[tile->encoded_data->size-sizeof(apr_time_t)]),
-    sizeof(apr_time_t));
-  ((char*)tile->encoded_data->buf)[tile->encoded_data->size+sizeof(apr_time_t)]='\0';
-  tile->encoded_data->avail = tile->encoded_data->size;
-  tile->encoded_data->size -= sizeof(apr_time_t);
-  return MAPCACHE_SUCCESS;
 }
 
 /**
@@ -112,15 +325,12 @@ static int _mapcache_cache_memcache_get(mapcache_context *ctx, mapcache_tile *ti
  * \private \memberof mapcache_cache_memcache
  * \sa mapcache_cache::tile_set()
  */
-static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *key;
-  int rv;
-  /* set expiration to one day if not configured */
-  int expires = 86400;
-  if(tile->tileset->auto_expire)
-    expires = tile->tileset->auto_expire;
-  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
+  int rv,i;
+  apr_uint32_t expires = _memcache_expiration(tile->tileset);
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
   key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
   GC_CHECK_ERROR(ctx);
 
@@ -137,11 +347,20 @@ static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_tile *t
   memcpy(data,tile->encoded_data->buf,tile->encoded_data->size);
   memcpy(&(data[tile->encoded_data->size]),&now,sizeof(apr_time_t));
 
-  rv = apr_memcache_set(cache->memcache,key,data,tile->encoded_data->size+sizeof(apr_time_t),expires,0);
-  if(rv != APR_SUCCESS) {
-    ctx->set_error(ctx,500,"failed to store tile %d %d %d to memcache cache %s",
-                   tile->x,tile->y,tile->z,cache->cache.name);
-    return;
+  for(i=0; i<cache->nreplicas; i++) {
+    rv = apr_memcache_set(cache->memcache[i],key,data,tile->encoded_data->size+sizeof(apr_time_t),expires,0);
+    if(rv != APR_SUCCESS) {
+      ctx->set_error(ctx,500,"failed to store tile %d %d %d to memcache cache %s",
+                     tile->x,tile->y,tile->z,cache->cache.name);
+      return;
+    }
+    /* marker checked by tile_exists(). without it the tile is only reported
+     * missing, e.g. re-rendered by the seeder, so a failure is not fatal */
+    rv = apr_memcache_set(cache->memcache[i],apr_pstrcat(ctx->pool, key, MEMCACHE_EXISTS_SUFFIX, NULL),"1",1,expires,0);
+    if(rv != APR_SUCCESS) {
+      ctx->log(ctx,MAPCACHE_WARN,"failed to store existence marker of tile %d %d %d to memcache cache %s",
+               tile->x,tile->y,tile->z,cache->cache.name);
+    }
   }
 }
 
@@ -152,7 +371,7 @@ static void _mapcache_cache_memcache_configuration_parse_xml(mapcache_context *c
 {
   ezxml_t cur_node;
   mapcache_cache_memcache *dcache = (mapcache_cache_memcache*)cache;
-  int servercount = 0;
+  int servercount = 0, i;
   for(cur_node = ezxml_child(node,"server"); cur_node; cur_node = cur_node->next) {
     servercount++;
   }
@@ -160,10 +379,27 @@ static void _mapcache_cache_memcache_configuration_parse_xml(mapcache_context *c
     ctx->set_error(ctx,400,"memcache cache %s has no <server>s configured",cache->name);
     return;
   }
-  if(APR_SUCCESS != apr_memcache_create(ctx->pool, servercount, 0, &dcache->memcache)) {
-    ctx->set_error(ctx,400,"cache %s: failed to create memcache backend", cache->name);
+  if((cur_node = ezxml_child(node,"replicas")) != NULL) {
+    char *endptr;
+    dcache->nreplicas = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->nreplicas < 1 || dcache->nreplicas > MEMCACHE_MAX_REPLICAS) {
+      ctx->set_error(ctx,400,"failed to parse replicas \"%s\" for memcache cache %s (expecting an integer between 1 and %d)",
+                     cur_node->txt,cache->name,MEMCACHE_MAX_REPLICAS);
+      return;
+    }
+  }
+  if(dcache->nreplicas > servercount) {
+    ctx->set_error(ctx,400,"memcache cache %s: %d replicas need as many <server>s",cache->name,dcache->nreplicas);
     return;
   }
+  /* one memcache object per copy of the keys, all sharing the same servers */
+  dcache->memcache = (apr_memcache_t**)apr_pcalloc(ctx->pool, dcache->nreplicas*sizeof(apr_memcache_t*));
+  for(i=0; i<dcache->nreplicas; i++) {
+    if(APR_SUCCESS != apr_memcache_create(ctx->pool, servercount, 0, &dcache->memcache[i])) {
+      ctx->set_error(ctx,400,"cache %s: failed to create memcache backend", cache->name);
+      return;
+    }
+  }
   for(cur_node = ezxml_child(node,"server"); cur_node; cur_node = cur_node->next) {
     ezxml_t xhost = ezxml_child(cur_node,"host");
     ezxml_t xport = ezxml_child(cur_node,"port");
@@ -193,15 +429,20 @@ static void _mapcache_cache_memcache_configuration_parse_xml(mapcache_context *c
       ctx->set_error(ctx,400,"cache %s: failed to create server %s:%d",cache->name,host,port);
       return;
     }
-    if(APR_SUCCESS != apr_memcache_add_server(dcache->memcache,server)) {
-      ctx->set_error(ctx,400,"cache %s: failed to add server %s:%d",cache->name,host,port);
-      return;
+    for(i=0; i<dcache->nreplicas; i++) {
+      if(APR_SUCCESS != apr_memcache_add_server(dcache->memcache[i],server)) {
+        ctx->set_error(ctx,400,"cache %s: failed to add server %s:%d",cache->name,host,port);
+        return;
+      }
     }
-    if(APR_SUCCESS != apr_memcache_set(dcache->memcache,"mapcache_test_key","mapcache",8,0,0)) {
+    if(APR_SUCCESS != apr_memcache_set(dcache->memcache[0],"mapcache_test_key","mapcache",8,0,0)) {
       ctx->set_error(ctx,400,"cache %s: failed to add test key to server %s:%d",cache->name,host,port);
       return;
     }
   }
+  for(i=0; i<dcache->nreplicas; i++) {
+    _memcache_ketama_setup(ctx, dcache->memcache[i], i);
+  }
 }
 
 /**
@@ -211,7 +452,7 @@ static void _mapcache_cache_memcache_configuration_post_config(mapcache_context
     mapcache_cfg *cfg)
 {
   mapcache_cache_memcache *dcache = (mapcache_cache_memcache*)cache;
-  if(!dcache->memcache || dcache->memcache->ntotal==0) {
+  if(!dcache->memcache || dcache->memcache[0]->ntotal==0) {
     ctx->set_error(ctx,400,"cache %s has no servers configured",cache->name);
   }
 }
@@ -232,9 +473,11 @@ mapcache_cache* mapcache_cache_memcache_create(mapcache_context *ctx)
   cache->cache.tile_get = _mapcache_cache_memcache_get;
   cache->cache.tile_exists = _mapcache_cache_memcache_has_tile;
   cache->cache.tile_set = _mapcache_cache_memcache_set;
+  cache->cache.tile_multi_get = _mapcache_cache_memcache_multi_get;
   cache->cache.tile_delete = _mapcache_cache_memcache_delete;
   cache->cache.configuration_post_config = _mapcache_cache_memcache_configuration_post_config;
   cache->cache.configuration_parse_xml = _mapcache_cache_memcache_configuration_parse_xml;
+  cache->nreplicas = 1;
   return (mapcache_cache*)cache;
 }
 
@@ -37,6 +37,10 @@
 #include <string.h>
 #include <errno.h>
 #include <apr_mmap.h>
+#if APR_HAS_THREADS
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#endif
 
 
 //------------------------------------------------------------------------------
@@ -45,14 +49,16 @@ struct object_userdata
 {
     unsigned char* buffer;   // memory of buffer
     
-    FILE* source;   // source file (or memory-stream) to put to S3
-    int   status;   // status of put: 
+    int   status;   // status of the request: 
                     //     0=ok, 
                     //     1=file not found
                     //     2=other error
     int64_t length;       // size of file / buffer
-    int64_t lastModified; // last modified date
+    int64_t lastModified; // last modified date, in seconds since the epoch (-1 if unknown)
+    char etag[80];        // etag computed by s3 from the object content (empty if unknown)
     
+    mapcache_tile *tile;  // tile of a batched request
+    char *key;            // key of the object
     
     int64_t _memoryPos;    // current memory position (private)
     int     _createbuffer; // create buffer ?
@@ -60,7 +66,16 @@ struct object_userdata
 
 //------------------------------------------------------------------------------
 
-S3Status responsePropertiesCallback(
+static void InitUserdata(object_userdata* data)
+{
+    memset(data, 0, sizeof(object_userdata));
+    data->status = 2; // until the request completes
+    data->lastModified = -1;
+}
+
+//------------------------------------------------------------------------------
+
+static S3Status responsePropertiesCallback(
                 const S3ResponseProperties *properties,
                 void *callbackData)
 {
@@ -69,6 +84,10 @@ S3Status responsePropertiesCallback(
         data->_memoryPos = 0;
         data->length =  properties->contentLength;
         data->lastModified = properties->lastModified;
+        if (properties->eTag)
+        {
+          apr_cpystrn(data->etag, properties->eTag, sizeof(data->etag));
+        }
         
         
         if (data->length > 0 && data->_createbuffer)
@@ -93,7 +112,7 @@ static void responseCompleteCallback(
     {
       data->status = 0;
     }
-    else if (status == S3StatusErrorNoSuchKey)
+    else if (status == S3StatusErrorNoSuchKey || status == S3StatusHttpErrorNotFound)
     {
       data->status = 1;
     }
@@ -106,7 +125,7 @@ static void responseCompleteCallback(
 
 //------------------------------------------------------------------------------
 
-S3ResponseHandler responseHandler =
+static S3ResponseHandler responseHandler =
 {
         &responsePropertiesCallback,
         &responseCompleteCallback
@@ -129,8 +148,7 @@ static S3Status getObjectDataCallback(int bufferSize, const char *buffer, void *
             return S3StatusAbortedByCallback;
         }
         
-        void* dest_adr = data->buffer+data->_memoryPos;
-        memcpy(dest_adr, buffer, bufferSize);
+        memcpy(data->buffer+data->_memoryPos, buffer, bufferSize);
         data->_memoryPos += bufferSize;
         
         return S3StatusOK;
@@ -140,38 +158,51 @@ static S3Status getObjectDataCallback(int bufferSize, const char *buffer, void *
 static int putObjectDataCallback(int bufferSize, char *buffer, void *callbackData)
 {
     object_userdata* data = (object_userdata*)callbackData;
+    int64_t remaining = data->length - data->_memoryPos;
 
-    int ret = 0;
-
-    if (data->_memoryPos >= data->length)
+    if (remaining <= 0)
     {
       return 0;
     }
     
-    if (data->length)
+    if (bufferSize > remaining)
     {
-      memcpy(buffer, data->buffer+data->_memoryPos, bufferSize);
-      data->_memoryPos += bufferSize;
-      return bufferSize;
+      bufferSize = (int)remaining;
     }
-    
-    return 0;
+    memcpy(buffer, data->buffer+data->_memoryPos, bufferSize);
+    data->_memoryPos += bufferSize;
+    return bufferSize;
 }
 
+//------------------------------------------------------------------------------
+
+static S3GetObjectHandler getObjectHandler =
+{
+        { &responsePropertiesCallback, &responseCompleteCallback },
+        &getObjectDataCallback
+};
+
+static S3PutObjectHandler putObjectHandler =
+{
+        { &responsePropertiesCallback, &responseCompleteCallback },
+        &putObjectDataCallback
+};
+
 //------------------------------------------------------------------------------
 // Delete File:
-void DeleteS3(S3BucketContext* bucketContext, char* filename)
+static void DeleteS3(S3BucketContext* bucketContext, char* filename)
 {
   object_userdata tmp;
-  tmp._createbuffer = 1;
+  InitUserdata(&tmp);
   
   S3_delete_object(bucketContext, filename, NULL, &responseHandler, &tmp);
 }
 //------------------------------------------------------------------------------
 // Test if File exists:
-int ExistsS3(S3BucketContext* bucketContext, const char* filename)
+static int ExistsS3(S3BucketContext* bucketContext, const char* filename)
 {
   object_userdata tmp;
+  InitUserdata(&tmp);
   
   tmp._createbuffer = 0; // don't create a buffer!
   
@@ -188,12 +219,10 @@ int ExistsS3(S3BucketContext* bucketContext, const char* filename)
 //------------------------------------------------------------------------------
 // Retrieve File:
 // Don't forget to call free after retrieving the file.
-void GetS3(S3BucketContext* bucketContext, const char* filename, object_userdata* gu)
+// With a request context, the request is only queued and is run by
+// S3_runall_request_context().
+static void GetS3(S3BucketContext* bucketContext, const char* filename, object_userdata* gu, S3RequestContext *requestContext)
 {
-  S3GetObjectHandler getObjectHandler;
-  getObjectHandler.responseHandler = responseHandler;
-  getObjectHandler.getObjectDataCallback = &getObjectDataCallback;
-
   gu->_createbuffer = 1;
   
   S3_get_object(bucketContext,  // S3BucketContext
@@ -201,21 +230,18 @@ void GetS3(S3BucketContext* bucketContext, const char* filename, object_userdata
                   NULL,            // S3GetConditions
                   0,               // Start Byte
                   0,               // Bytecount
-                  NULL,            // S3RequestContext
+                  requestContext,  // S3RequestContext
                   &getObjectHandler, // S3GetObjectHandler
                   gu);            // callbackData
 }
 //------------------------------------------------------------------------------
 // Put File:
-void SetS3(S3BucketContext* bucketContext, const char* filename, object_userdata* gu)
+static void SetS3(S3BucketContext* bucketContext, const char* filename, object_userdata* gu, S3RequestContext *requestContext)
 {
-    S3PutObjectHandler putObjectHandler;
-    putObjectHandler.responseHandler = responseHandler;
-    putObjectHandler.putObjectDataCallback = &putObjectDataCallback;
-
    gu->_createbuffer = 0;
    if (gu->length == 0 || gu->buffer == 0)
    {
+      gu->status = 0;
       return; // nothing to write...
    }
    gu->_memoryPos = 0;
@@ -233,6 +259,8 @@ void SetS3(S3BucketContext* bucketContext, const char* filename, object_userdata
    //---------------------------------------------------------------------
    //---------------------------------------------------------------------
    
+   // the properties are turned into request headers before S3_put_object()
+   // returns, they need not outlive a queued request
    S3PutProperties putprop;
    S3NameValue     storage_class;
    storage_class.name = "storage-class";
@@ -251,7 +279,164 @@ void SetS3(S3BucketContext* bucketContext, const char* filename, object_userdata
    putprop.useServerSideEncryption = 0;
 
    
-   S3_put_object(bucketContext, filename, gu->length, &putprop, NULL, &putObjectHandler, gu);
+   S3_put_object(bucketContext, filename, gu->length, &putprop, requestContext, &putObjectHandler, gu);
+}
+//------------------------------------------------------------------------------
+// Request contexts:
+// each thread runs its requests on its own request context, kept for the
+// lifetime of the thread so that the connections it opened are reused by the
+// following requests.
+#if APR_HAS_THREADS
+static apr_threadkey_t *request_context_key = NULL;
+
+static void DestroyRequestContext(void *data)
+{
+  S3_destroy_request_context((S3RequestContext*)data);
+}
+
+static apr_status_t DeleteRequestContextKey(void *data)
+{
+  apr_threadkey_private_delete(request_context_key);
+  request_context_key = NULL;
+  return APR_SUCCESS;
+}
+#else
+static S3RequestContext *request_context = NULL;
+#endif
+
+static void SetRequestContext(S3RequestContext *requestContext)
+{
+#if APR_HAS_THREADS
+  apr_threadkey_private_set(requestContext, request_context_key);
+#else
+  request_context = requestContext;
+#endif
+}
+
+static S3RequestContext* GetRequestContext(mapcache_context *ctx, mapcache_cache_s3 *cache)
+{
+  S3RequestContext *requestContext;
+  S3Status status;
+#if APR_HAS_THREADS
+  void *data = NULL;
+  if (!request_context_key)
+  {
+    if (ctx->threadlock)
+      apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+    if (!request_context_key)
+    {
+      apr_threadkey_t *key;
+      if (apr_threadkey_private_create(&key, DestroyRequestContext, ctx->process_pool) == APR_SUCCESS)
+      {
+        request_context_key = key;
+        apr_pool_cleanup_register(ctx->process_pool, NULL, DeleteRequestContextKey, apr_pool_cleanup_null);
+      }
+    }
+    if (ctx->threadlock)
+      apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+    if (!request_context_key)
+    {
+      ctx->set_error(ctx, 500, "s3 cache %s: failed to create request context key", cache->cache.name);
+      return NULL;
+    }
+  }
+  apr_threadkey_private_get(&data, request_context_key);
+  requestContext = (S3RequestContext*)data;
+#else
+  requestContext = request_context;
+#endif
+  if (!requestContext)
+  {
+    if ((status = S3_create_request_context(&requestContext)) != S3StatusOK)
+    {
+      ctx->set_error(ctx, 500, "s3 cache %s: failed to create request context: %s",
+                     cache->cache.name, S3_get_status_name(status));
+      return NULL;
+    }
+    SetRequestContext(requestContext);
+  }
+  return requestContext;
+}
+
+//------------------------------------------------------------------------------
+// Run requests concurrently:
+// the requests are queued on the thread's request context, which runs them in
+// parallel. at most max_parallel_requests are run at a time.
+static void RunS3(mapcache_context *ctx, mapcache_cache_s3 *cache, object_userdata *requests, int nrequests, int put)
+{
+  int i, first;
+  S3Status status;
+  S3RequestContext *requestContext = GetRequestContext(ctx, cache);
+  
+  if (!requestContext)
+  {
+    return;
+  }
+  for (first = 0; first < nrequests; first += cache->max_parallel_requests)
+  {
+    int last = MAPCACHE_MIN(nrequests, first + cache->max_parallel_requests);
+    
+    for (i = first; i < last; i++)
+    {
+      if (put)
+      {
+        SetS3(&cache->bucket_context, requests[i].key, &requests[i], requestContext);
+      }
+      else
+      {
+        GetS3(&cache->bucket_context, requests[i].key, &requests[i], requestContext);
+      }
+    }
+    status = S3_runall_request_context(requestContext);
+    if (status != S3StatusOK)
+    {
+      // requests may be left queued on it, the next run gets a new one
+      SetRequestContext(NULL);
+      S3_destroy_request_context(requestContext);
+      ctx->set_error(ctx, 500, "s3 cache %s: failed to run requests: %s",
+                     cache->cache.name, S3_get_status_name(status));
+      return;
+    }
+  }
+}
+//------------------------------------------------------------------------------
+// Fill a tile from a completed get:
+static int TileFromS3(mapcache_context *ctx, mapcache_tile *tile, object_userdata* gu)
+{
+  if (gu->status == 0 && gu->buffer)
+  {
+    // tile downloaded successfully
+    tile->encoded_data = mapcache_buffer_create(sizeof(mapcache_buffer),ctx->pool);
+    tile->encoded_data->buf = (char*)gu->buffer;
+    tile->encoded_data->size = (int)gu->length;
+    tile->encoded_data->avail = (int)gu->length;
+    tile->encoded_data->pool = 0;
+    if (gu->lastModified > 0)
+    {
+      tile->mtime = apr_time_from_sec(gu->lastModified);
+    }
+    // the etag of an object uploaded in one piece is the md5 of its content
+    if (gu->etag[0])
+    {
+      tile->etag = (gu->etag[0] == '"') ? apr_pstrdup(ctx->pool, gu->etag) :
+                   apr_pstrcat(ctx->pool, "\"", gu->etag, "\"", NULL);
+      tile->etag_data = tile->encoded_data;
+    }
+    
+    // custom cleanup buffer: (mem was allocated with malloc...)
+    apr_pool_cleanup_register(ctx->pool, gu->buffer,(void*)free, apr_pool_cleanup_null);
+    return MAPCACHE_SUCCESS;
+  }
+  
+  // partially downloaded
+  free(gu->buffer);
+  gu->buffer = NULL;
+  
+  if (gu->status == 1)
+  {
+    return MAPCACHE_CACHE_MISS; // doesn't exist...
+  }
+  return MAPCACHE_FAILURE;
 }
 //------------------------------------------------------------------------------
 /**
@@ -261,10 +446,10 @@ void SetS3(S3BucketContext* bucketContext, const char* filename, object_userdata
  * \param path pointer to a char* that will contain the filename
  * \private \memberof mapcache_cache_s3
  */
-static void _mapcache_cache_s3_base_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_s3_base_tile_key(mapcache_context *ctx, mapcache_cache_s3 *dcache, mapcache_tile *tile, char **path)
 {
   *path = apr_pstrcat(ctx->pool,
-                      ((mapcache_cache_s3*)tile->tileset->cache)->base_directory,"/",
+                      dcache->base_directory,"/",
                       tile->tileset->name,"/",
                       tile->grid_link->grid->name,
                       NULL);
@@ -288,12 +473,11 @@ static void _mapcache_cache_s3_base_tile_key(mapcache_context *ctx, mapcache_til
  * \param r
  * \private \memberof mapcache_cache_s3
  */
-static void _mapcache_cache_s3_tilecache_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_s3_tilecache_tile_key(mapcache_context *ctx, mapcache_cache_s3 *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_s3 *dcache = (mapcache_cache_s3*)tile->tileset->cache;
   if(dcache->base_directory) {
     char *start;
-    _mapcache_cache_s3_base_tile_key(ctx, tile, &start);
+    _mapcache_cache_s3_base_tile_key(ctx, dcache, tile, &start);
     
     *path = apr_psprintf(ctx->pool,"%s/%u/%u/%u.%s" ,
                          start,
@@ -355,9 +539,8 @@ static void _mapcache_cache_s3_tilecache_tile_key(mapcache_context *ctx, mapcach
 
 //------------------------------------------------------------------------------
 
-static void _mapcache_cache_s3_template_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_s3_template_tile_key(mapcache_context *ctx, mapcache_cache_s3 *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_s3 *dcache = (mapcache_cache_s3*)tile->tileset->cache;
 
   *path = dcache->filename_template;
   *path = mapcache_util_str_replace(ctx->pool,*path, "{tileset}", tile->tileset->name);
@@ -413,12 +596,11 @@ static void _mapcache_cache_s3_template_tile_key(mapcache_context *ctx, mapcache
 
 //------------------------------------------------------------------------------
 
-static void _mapcache_cache_s3_arcgis_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_s3_arcgis_tile_key(mapcache_context *ctx, mapcache_cache_s3 *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_s3 *dcache = (mapcache_cache_s3*)tile->tileset->cache;
   if(dcache->base_directory) {
     char *start;
-    _mapcache_cache_s3_base_tile_key(ctx, tile, &start);
+    _mapcache_cache_s3_base_tile_key(ctx, dcache, tile, &start);
     *path = apr_psprintf(ctx->pool,"%s/L%02d/R%08x/C%08x.%s" ,
                          start,
                          tile->z,
@@ -434,14 +616,14 @@ static void _mapcache_cache_s3_arcgis_tile_key(mapcache_context *ctx, mapcache_t
 
 //------------------------------------------------------------------------------
 // EXISTS ?
-static int _mapcache_cache_s3_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_s3_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   mapcache_cache_s3* cache;
   char *filename;
   apr_finfo_t finfo;
   int rv;
   
-  cache = (mapcache_cache_s3*)tile->tileset->cache;
+  cache = (mapcache_cache_s3*)pcache;
   
   if (cache->maxzoom>0)  // maxzoom is set
   {
@@ -451,20 +633,12 @@ static int _mapcache_cache_s3_has_tile(mapcache_context *ctx, mapcache_tile *til
     }
   }
   
-  cache->tile_key(ctx, tile, &filename);
+  cache->tile_key(ctx, cache, tile, &filename);
   if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FALSE;
   }
   
-  S3BucketContext bucketContext;
-  bucketContext.hostName = cache->host;
-  bucketContext.bucketName = cache->bucket;
-  bucketContext.protocol = S3ProtocolHTTP;
-  bucketContext.uriStyle = S3UriStylePath;
-  bucketContext.accessKeyId = cache->access_key;
-  bucketContext.secretAccessKey = cache->secret_key;
-  
-  if (ExistsS3(&bucketContext, filename))
+  if (ExistsS3(&cache->bucket_context, filename))
   {
     return MAPCACHE_TRUE;
   }
@@ -475,26 +649,18 @@ static int _mapcache_cache_s3_has_tile(mapcache_context *ctx, mapcache_tile *til
 //------------------------------------------------------------------------------
 // Delete Key from S3
 
-static void _mapcache_cache_s3_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_s3_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   apr_status_t ret;
   mapcache_cache_s3* cache;
   char errmsg[120];
   char *filename;
   
-  cache = (mapcache_cache_s3*)tile->tileset->cache;
-  cache->tile_key(ctx, tile, &filename);
+  cache = (mapcache_cache_s3*)pcache;
+  cache->tile_key(ctx, cache, tile, &filename);
   GC_CHECK_ERROR(ctx);
   
-  S3BucketContext bucketContext;
-  bucketContext.hostName = cache->host;
-  bucketContext.bucketName = cache->bucket;
-  bucketContext.protocol = S3ProtocolHTTP;
-  bucketContext.uriStyle = S3UriStylePath;
-  bucketContext.accessKeyId = cache->access_key;
-  bucketContext.secretAccessKey = cache->secret_key;
-
-  DeleteS3(&bucketContext, filename);
+  DeleteS3(&cache->bucket_context, filename);
 
 }
 
@@ -507,13 +673,13 @@ static void _mapcache_cache_s3_delete(mapcache_context *ctx, mapcache_tile *tile
  * \private \memberof mapcache_cache_s3
  * \sa mapcache_cache::tile_get()
  */
-static int _mapcache_cache_s3_get(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_s3_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *filename;
   mapcache_cache_s3* cache;
   
 
-  cache = (mapcache_cache_s3*)tile->tileset->cache;
+  cache = (mapcache_cache_s3*)pcache;
   
   if (cache->maxzoom>0)  // maxzoom is set
   {
@@ -523,7 +689,7 @@ static int _mapcache_cache_s3_get(mapcache_context *ctx, mapcache_tile *tile)
     }
   }
   
-  cache->tile_key(ctx, tile, &filename);
+  cache->tile_key(ctx, cache, tile, &filename);
   if(GC_HAS_ERROR(ctx)) 
   {
     return MAPCACHE_FAILURE;
@@ -531,42 +697,63 @@ static int _mapcache_cache_s3_get(mapcache_context *ctx, mapcache_tile *tile)
   
   //ctx->log(ctx,MAPCACHE_NOTICE,"GET Tile %s", filename);
   
-  S3BucketContext bucketContext;
-  bucketContext.hostName = cache->host;
-  bucketContext.bucketName = cache->bucket;
-  bucketContext.protocol = S3ProtocolHTTP;
-  bucketContext.uriStyle = S3UriStylePath;
-  bucketContext.accessKeyId = cache->access_key;
-  bucketContext.secretAccessKey = cache->secret_key;
-  
   object_userdata gu;
+  InitUserdata(&gu);
   
-  GetS3(&bucketContext, filename, &gu);
-    
-  if (gu.status == 0)
+  GetS3(&cache->bucket_context, filename, &gu, NULL);
+  
+  return TileFromS3(ctx, tile, &gu);
+}
+
+//------------------------------------------------------------------------------
+
+/**
+ * \brief get the content of several tiles with concurrent requests
+ *
+ * \private \memberof mapcache_cache_s3
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_s3_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles)
+{
+  mapcache_cache_s3* cache = (mapcache_cache_s3*)pcache;
+  object_userdata *requests = (object_userdata*)apr_pcalloc(ctx->pool, ntiles*sizeof(object_userdata));
+  int i, nrequests = 0;
+  
+  for (i = 0; i < ntiles; i++)
   {
-    // tile downloaded successfully
-    if (gu.buffer)
+    if (cache->maxzoom>0 && tiles[i]->z>cache->maxzoom)
     {
-      tile->encoded_data = mapcache_buffer_create(sizeof(mapcache_buffer),ctx->pool);
-      tile->encoded_data->buf = (char*)gu.buffer;
-      tile->encoded_data->size = (int)gu.length;
-      tile->encoded_data->avail = (int)gu.length;
-      tile->encoded_data->pool = 0;
-      tile->mtime = 0 ; // gu.lastModified; // #todo this must be converted...
-     
-      // custom cleanup buffer: (mem was allocated with malloc...)
-      apr_pool_cleanup_register(ctx->pool, gu.buffer,(void*)free, apr_pool_cleanup_null);
-      return MAPCACHE_SUCCESS;
+      tiles[i]->cache_miss = 1;
+      continue;
     }
+    InitUserdata(&requests[nrequests]);
+    requests[nrequests].tile = tiles[i];
+    cache->tile_key(ctx, cache, tiles[i], &requests[nrequests].key);
+    GC_CHECK_ERROR(ctx);
+    nrequests++;
   }
-  else if (gu.status == 1)
+  
+  RunS3(ctx, cache, requests, nrequests, 0);
+  if (GC_HAS_ERROR(ctx))
   {
-    return MAPCACHE_CACHE_MISS; // doesn't exist...
+    // not worth failing the request for, the tiles will be fetched one by one
+    ctx->log(ctx, MAPCACHE_WARN, "%s", ctx->get_error_message(ctx));
+    ctx->clear_errors(ctx);
+    for (i = 0; i < nrequests; i++)
+    {
+      free(requests[i].buffer);
+    }
+    return;
   }
   
-  return MAPCACHE_FAILURE;
- 
+  // tiles that failed are left for tile_get()
+  for (i = 0; i < nrequests; i++)
+  {
+    if (TileFromS3(ctx, requests[i].tile, &requests[i]) == MAPCACHE_CACHE_MISS)
+    {
+      requests[i].tile->cache_miss = 1;
+    }
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -580,14 +767,14 @@ static int _mapcache_cache_s3_get(mapcache_context *ctx, mapcache_tile *tile)
  * \private \memberof mapcache_cache_s3
  * \sa mapcache_cache::tile_set()
  */
-static void _mapcache_cache_s3_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_s3_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   apr_size_t bytes;
   char errmsg[120];
   char *filename;
   mapcache_cache_s3* cache;
   
-  cache = (mapcache_cache_s3*)tile->tileset->cache;
+  cache = (mapcache_cache_s3*)pcache;
   
 #ifdef DEBUG
   /* all this should be checked at a higher level */
@@ -601,7 +788,7 @@ static void _mapcache_cache_s3_set(mapcache_context *ctx, mapcache_tile *tile)
   }
 #endif
 
-  cache->tile_key(ctx, tile, &filename);
+  cache->tile_key(ctx, cache, tile, &filename);
   GC_CHECK_ERROR(ctx);
   
   if(!tile->encoded_data) 
@@ -619,21 +806,70 @@ static void _mapcache_cache_s3_set(mapcache_context *ctx, mapcache_tile *tile)
     }
   }
   
-  S3BucketContext bucketContext;
-  bucketContext.hostName = cache->host;
-  bucketContext.bucketName = cache->bucket;
-  bucketContext.protocol = S3ProtocolHTTP;
-  bucketContext.uriStyle = S3UriStylePath;
-  bucketContext.accessKeyId = cache->access_key;
-  bucketContext.secretAccessKey = cache->secret_key;
-  
   object_userdata gu;
-    
+  InitUserdata(&gu);
 
   gu.buffer = (unsigned char*) tile->encoded_data->buf;
   gu.length = tile->encoded_data->size;
    
-  SetS3(&bucketContext,filename, &gu);
+  SetS3(&cache->bucket_context, filename, &gu, NULL);
+  if (gu.status != 0)
+  {
+    ctx->set_error(ctx, 500, "s3 cache %s: failed to put %s", cache->cache.name, filename);
+  }
+}
+
+//------------------------------------------------------------------------------
+
+/**
+ * \brief write the tiles of a metatile to S3 with concurrent requests
+ *
+ * \private \memberof mapcache_cache_s3
+ * \sa mapcache_cache::tile_multi_set()
+ */
+static void _mapcache_cache_s3_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_cache_s3* cache = (mapcache_cache_s3*)pcache;
+  object_userdata *requests = (object_userdata*)apr_pcalloc(ctx->pool, ntiles*sizeof(object_userdata));
+  int i, nrequests = 0, nfailed = 0;
+  
+  /* the tiles of a metatile share their zoom level */
+  if (cache->maxzoom>0 && tiles[0].z>cache->maxzoom)
+  {
+    return;
+  }
+  
+  for (i = 0; i < ntiles; i++)
+  {
+    mapcache_tile *tile = &tiles[i];
+    if(!tile->encoded_data) 
+    {
+      tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+      GC_CHECK_ERROR(ctx);
+    }
+    InitUserdata(&requests[nrequests]);
+    requests[nrequests].tile = tile;
+    requests[nrequests].buffer = (unsigned char*) tile->encoded_data->buf;
+    requests[nrequests].length = tile->encoded_data->size;
+    cache->tile_key(ctx, cache, tile, &requests[nrequests].key);
+    GC_CHECK_ERROR(ctx);
+    nrequests++;
+  }
+  
+  RunS3(ctx, cache, requests, nrequests, 1);
+  GC_CHECK_ERROR(ctx);
+  
+  for (i = 0; i < nrequests; i++)
+  {
+    if (requests[i].status != 0)
+    {
+      nfailed++;
+    }
+  }
+  if (nfailed)
+  {
+    ctx->set_error(ctx, 500, "s3 cache %s: failed to put %d of %d tiles", cache->cache.name, nfailed, nrequests);
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -706,6 +942,36 @@ static void _mapcache_cache_s3_configuration_parse_xml(mapcache_context *ctx, ez
   {
     dcache->maxzoom = atoi(cur_node->txt);
   }
+  
+  if ((cur_node = ezxml_child(node,"protocol")) != NULL) 
+  {
+    if (!strcasecmp(cur_node->txt,"https"))
+    {
+      dcache->protocol = S3ProtocolHTTPS;
+    }
+    else if (!strcasecmp(cur_node->txt,"http"))
+    {
+      dcache->protocol = S3ProtocolHTTP;
+    }
+    else
+    {
+      ctx->set_error(ctx, 400, "unknown protocol \"%s\" for s3 cache \"%s\" (expecting http or https)",
+                     cur_node->txt, cache->name);
+      return;
+    }
+  }
+  
+  if ((cur_node = ezxml_child(node,"max_parallel_requests")) != NULL) 
+  {
+    char *endptr;
+    dcache->max_parallel_requests = (int)strtol(cur_node->txt,&endptr,10);
+    if (*endptr != 0 || dcache->max_parallel_requests <= 0)
+    {
+      ctx->set_error(ctx, 400, "failed to parse max_parallel_requests \"%s\" for s3 cache \"%s\" (expecting a positive integer)",
+                     cur_node->txt, cache->name);
+      return;
+    }
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -731,6 +997,15 @@ static void _mapcache_cache_s3_configuration_post_config(mapcache_context *ctx,
                       dcache->cache.name);
     return;
   }
+  
+  // shared by all the requests to the bucket
+  memset(&dcache->bucket_context, 0, sizeof(S3BucketContext));
+  dcache->bucket_context.hostName = dcache->host;
+  dcache->bucket_context.bucketName = dcache->bucket;
+  dcache->bucket_context.protocol = dcache->protocol;
+  dcache->bucket_context.uriStyle = S3UriStylePath;
+  dcache->bucket_context.accessKeyId = dcache->access_key;
+  dcache->bucket_context.secretAccessKey = dcache->secret_key;
 }
 //------------------------------------------------------------------------------
 /**
@@ -750,12 +1025,16 @@ mapcache_cache* mapcache_cache_s3_create(mapcache_context *ctx)
   cache->host = 0;
   cache->bucket = 0;
   cache->maxzoom = 0;
+  cache->protocol = S3ProtocolHTTP;
+  cache->max_parallel_requests = 16;
   cache->cache.metadata = apr_table_make(ctx->pool,3);
   cache->cache.type = MAPCACHE_CACHE_S3;
   cache->cache.tile_delete = _mapcache_cache_s3_delete;
   cache->cache.tile_get = _mapcache_cache_s3_get;
   cache->cache.tile_exists = _mapcache_cache_s3_has_tile;
   cache->cache.tile_set = _mapcache_cache_s3_set;
+  cache->cache.tile_multi_set = _mapcache_cache_s3_multi_set;
+  cache->cache.tile_multi_get = _mapcache_cache_s3_multi_get;
   cache->cache.configuration_post_config = _mapcache_cache_s3_configuration_post_config;
   cache->cache.configuration_parse_xml = _mapcache_cache_s3_configuration_parse_xml;
   return (mapcache_cache*)cache;
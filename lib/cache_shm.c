@@ -0,0 +1,812 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: shared memory cache tier
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <apr_time.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#if !defined(_WIN32) && defined(_POSIX_THREAD_PROCESS_SHARED) && (_POSIX_THREAD_PROCESS_SHARED > 0)
+#define USE_SHM_CACHE
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <errno.h>
+#if defined(PTHREAD_MUTEX_ROBUST) || (defined(_POSIX_THREAD_ROBUST_PRIO_INHERIT) && _POSIX_THREAD_ROBUST_PRIO_INHERIT > 0)
+#define USE_ROBUST_MUTEX
+#endif
+#endif
+
+#ifdef USE_SHM_CACHE
+
+/*
+ * shm cache: a size bounded cache of encoded tiles in POSIX shared memory,
+ * placed in front of another cache (the backend). All the processes of the
+ * host that use the same shm name share it, so a tile read from the backend
+ * by one apache child, fastcgi process or nginx worker is served from memory
+ * to all the others.
+ *
+ * The segment is split in shards, selected by the hash of the tile key, each
+ * with its own process shared (and if possible robust) mutex, index and log:
+ *  - the tile data is appended to a circular log, and the oldest records are
+ *    evicted to make room (FIFO). A tile that is hit while its record is in
+ *    the oldest quarter of the log is rewritten at its head, so that hot tiles
+ *    stay cached: this approximates CLOCK without having to move data at
+ *    eviction time.
+ *  - the index is a chained hash table of fixed size entries pointing to the
+ *    log records. The full key is stored in the record and compared on lookup.
+ * Entries keep the modification time of their tile: a tile read from the
+ * backend never replaces a newer version written through the cache, and with
+ * a <ttl> entries are dropped after a while so that tiles modified behind the
+ * cache's back are eventually reread.
+ */
+
+#define MAPCACHE_SHM_CACHE_MAGIC 0x4d435443
+#define MAPCACHE_SHM_CACHE_MAX_SHARDS 32
+/* expected minimal average size of a tile, used to size the index */
+#define MAPCACHE_SHM_CACHE_BYTES_PER_ENTRY 2048
+#define MAPCACHE_SHM_CACHE_STATS_INTERVAL 100000
+
+typedef struct {
+  apr_uint64_t hash;
+  apr_time_t mtime;     /* modification time of the tile */
+  apr_time_t stored;    /* when the entry was written */
+  apr_size_t offset;    /* of the record in the log */
+  apr_uint32_t keylen;
+  apr_uint32_t datalen;
+  apr_int32_t next;     /* next entry of the bucket, or of the free list */
+  apr_int32_t used;
+} mapcache_shm_cache_entry;
+
+/* header of a log record, followed by the key and the tile data */
+typedef struct {
+  apr_int32_t entry;    /* index of the entry, -1 for the padding at the end of the log */
+  apr_uint32_t len;     /* length of the record, including this header */
+} mapcache_shm_cache_record;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  apr_uint32_t nbuckets; /* a power of two */
+  apr_uint32_t nentries;
+  apr_size_t log_size;
+  apr_size_t head;      /* where the next record is written */
+  apr_size_t tail;      /* oldest record */
+  apr_size_t used;      /* bytes between tail and head */
+  apr_int32_t free_entries;
+  apr_uint64_t hits, misses, sets, evictions;
+} mapcache_shm_cache_shard;
+
+typedef struct {
+  volatile int magic;   /* set once the shards are initialized */
+  int nshards;
+  apr_size_t size;
+  apr_size_t shard_size;
+  volatile apr_uint64_t lookups;
+} mapcache_shm_cache_header;
+
+typedef struct {
+  mapcache_cache cache;
+  mapcache_cache *backend;
+  char *name;           /* name of the shared memory object */
+  apr_size_t size;
+  apr_size_t max_tile_size;
+  apr_interval_time_t ttl;
+  mapcache_shm_cache_header *header; /* mapping in this process, NULL until first use */
+  int disabled;         /* the segment could not be mapped, requests go to the backend */
+} mapcache_cache_shm;
+
+static apr_size_t _shm_cache_align(apr_size_t v, apr_size_t alignment)
+{
+  return (v + alignment - 1) & ~(alignment - 1);
+}
+
+static apr_int32_t* _shm_cache_buckets(mapcache_shm_cache_shard *shard)
+{
+  return (apr_int32_t*)((char*)shard + _shm_cache_align(sizeof(mapcache_shm_cache_shard),8));
+}
+
+static mapcache_shm_cache_entry* _shm_cache_entries(mapcache_shm_cache_shard *shard)
+{
+  return (mapcache_shm_cache_entry*)((char*)_shm_cache_buckets(shard) +
+                                     _shm_cache_align(shard->nbuckets * sizeof(apr_int32_t),8));
+}
+
+static char* _shm_cache_log(mapcache_shm_cache_shard *shard)
+{
+  return (char*)_shm_cache_entries(shard) + _shm_cache_align(shard->nentries * sizeof(mapcache_shm_cache_entry),8);
+}
+
+static mapcache_shm_cache_shard* _shm_cache_shard(mapcache_shm_cache_header *header, apr_uint64_t hash)
+{
+  char *first = (char*)header + _shm_cache_align(sizeof(mapcache_shm_cache_header),64);
+  return (mapcache_shm_cache_shard*)(first + ((hash >> 32) % header->nshards) * header->shard_size);
+}
+
+static apr_uint64_t _shm_cache_hash(const char *key)
+{
+  /* FNV-1a */
+  apr_uint64_t hash = APR_UINT64_C(14695981039346656037);
+  while(*key) {
+    hash ^= (unsigned char)*key++;
+    hash *= APR_UINT64_C(1099511628211);
+  }
+  return hash;
+}
+
+static void _shm_cache_shard_reset(mapcache_shm_cache_shard *shard)
+{
+  apr_int32_t *buckets = _shm_cache_buckets(shard);
+  mapcache_shm_cache_entry *entries = _shm_cache_entries(shard);
+  apr_uint32_t i;
+  for(i=0; i<shard->nbuckets; i++) {
+    buckets[i] = -1;
+  }
+  for(i=0; i<shard->nentries; i++) {
+    entries[i].used = 0;
+    entries[i].next = (i+1 < shard->nentries)?(apr_int32_t)(i+1):-1;
+  }
+  shard->free_entries = 0;
+  shard->head = shard->tail = shard->used = 0;
+}
+
+/*
+ * returns 0 if the shard is locked, or the error of the lock, in which case
+ * the shard must not be used
+ */
+static int _shm_cache_lock(mapcache_context *ctx, mapcache_cache_shm *cache, mapcache_shm_cache_shard *shard)
+{
+  int rv = pthread_mutex_lock(&shard->mutex);
+#ifdef USE_ROBUST_MUTEX
+  if(rv == EOWNERDEAD) {
+    /* a process died while it was modifying the shard, whose index and log
+       may be inconsistent: start over with an empty shard */
+    _shm_cache_shard_reset(shard);
+    rv = pthread_mutex_consistent(&shard->mutex);
+  }
+#endif
+  if(rv) {
+    ctx->log(ctx, MAPCACHE_ERROR, "shm cache %s: failed to lock shard: %s", cache->cache.name, strerror(rv));
+  }
+  return rv;
+}
+
+static void _shm_cache_unlock(mapcache_shm_cache_shard *shard)
+{
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+static apr_int32_t _shm_cache_lookup(mapcache_shm_cache_shard *shard, apr_uint64_t hash, const char *key, apr_uint32_t keylen)
+{
+  mapcache_shm_cache_entry *entries = _shm_cache_entries(shard);
+  char *log = _shm_cache_log(shard);
+  apr_int32_t e = _shm_cache_buckets(shard)[hash & (shard->nbuckets - 1)];
+  while(e != -1) {
+    mapcache_shm_cache_entry *entry = &entries[e];
+    if(entry->hash == hash && entry->keylen == keylen &&
+        !memcmp(log + entry->offset + sizeof(mapcache_shm_cache_record), key, keylen)) {
+      return e;
+    }
+    e = entry->next;
+  }
+  return -1;
+}
+
+/* unlinks an entry from the index, its record is left in the log until the tail reaches it */
+static void _shm_cache_remove(mapcache_shm_cache_shard *shard, apr_int32_t e)
+{
+  mapcache_shm_cache_entry *entries = _shm_cache_entries(shard);
+  apr_int32_t *prev = &_shm_cache_buckets(shard)[entries[e].hash & (shard->nbuckets - 1)];
+  while(*prev != -1 && *prev != e) {
+    prev = &entries[*prev].next;
+  }
+  if(*prev == e) {
+    *prev = entries[e].next;
+  }
+  entries[e].used = 0;
+  entries[e].next = shard->free_entries;
+  shard->free_entries = e;
+}
+
+/* drops the oldest record of the log */
+static void _shm_cache_evict(mapcache_shm_cache_shard *shard)
+{
+  mapcache_shm_cache_record *record = (mapcache_shm_cache_record*)(_shm_cache_log(shard) + shard->tail);
+  if(record->entry >= 0) {
+    mapcache_shm_cache_entry *entry = &_shm_cache_entries(shard)[record->entry];
+    /* the entry may have been removed, or reused for a newer record */
+    if(entry->used && entry->offset == shard->tail) {
+      _shm_cache_remove(shard, record->entry);
+      shard->evictions++;
+    }
+  }
+  shard->used -= record->len;
+  shard->tail += record->len;
+  if(shard->tail == shard->log_size || !shard->used) {
+    shard->tail = 0;
+  }
+  if(!shard->used) {
+    shard->head = 0;
+  }
+}
+
+/* returns the offset of len contiguous free bytes at the head of the log */
+static apr_size_t _shm_cache_reserve(mapcache_shm_cache_shard *shard, apr_size_t len)
+{
+  apr_size_t offset;
+  while(1) {
+    if(!shard->used) {
+      shard->head = shard->tail = 0;
+      break;
+    }
+    if(shard->head > shard->tail) {
+      /* the free space is after the head, and before the tail */
+      mapcache_shm_cache_record *padding;
+      if(shard->log_size - shard->head >= len) break;
+      padding = (mapcache_shm_cache_record*)(_shm_cache_log(shard) + shard->head);
+      padding->entry = -1;
+      padding->len = shard->log_size - shard->head;
+      shard->used += padding->len;
+      shard->head = 0;
+    } else {
+      if(shard->tail - shard->head >= len) break;
+      _shm_cache_evict(shard);
+    }
+  }
+  offset = shard->head;
+  shard->head += len;
+  shard->used += len;
+  if(shard->head == shard->log_size) {
+    shard->head = 0;
+  }
+  return offset;
+}
+
+static void _shm_cache_insert(mapcache_shm_cache_shard *shard, apr_uint64_t hash, const char *key, apr_uint32_t keylen,
+                              const char *data, apr_uint32_t datalen, apr_time_t mtime, apr_time_t stored)
+{
+  mapcache_shm_cache_entry *entries = _shm_cache_entries(shard);
+  mapcache_shm_cache_entry *entry;
+  mapcache_shm_cache_record *record;
+  apr_int32_t *bucket;
+  apr_size_t len = _shm_cache_align(sizeof(mapcache_shm_cache_record) + keylen + datalen, 8);
+  apr_int32_t e;
+  if(len > shard->log_size) return;
+
+  while(shard->free_entries == -1 && shard->used) {
+    _shm_cache_evict(shard);
+  }
+  if(shard->free_entries == -1) return;
+  e = shard->free_entries;
+  entry = &entries[e];
+  shard->free_entries = entry->next;
+
+  entry->offset = _shm_cache_reserve(shard, len);
+  record = (mapcache_shm_cache_record*)(_shm_cache_log(shard) + entry->offset);
+  record->entry = e;
+  record->len = len;
+  memcpy((char*)record + sizeof(mapcache_shm_cache_record), key, keylen);
+  memcpy((char*)record + sizeof(mapcache_shm_cache_record) + keylen, data, datalen);
+
+  entry->hash = hash;
+  entry->mtime = mtime;
+  entry->stored = stored;
+  entry->keylen = keylen;
+  entry->datalen = datalen;
+  entry->used = 1;
+  bucket = &_shm_cache_buckets(shard)[hash & (shard->nbuckets - 1)];
+  entry->next = *bucket;
+  *bucket = e;
+  shard->sets++;
+}
+
+/*
+ * removes the shared memory object name if it still is the one opened as fd.
+ * the check and the removal are done while holding an exclusive lock on the
+ * object, so that of several processes finding the same stale segment only the
+ * first one removes it, and none of them removes a segment created in its place
+ */
+static void _shm_cache_unlink_stale(const char *name, int fd)
+{
+  struct stat stale, current;
+  int cfd;
+  if(flock(fd, LOCK_EX) != 0) return;
+  if(fstat(fd, &stale) == 0 && (cfd = shm_open(name, O_RDWR, 0600)) >= 0) {
+    if(fstat(cfd, &current) == 0 && current.st_dev == stale.st_dev && current.st_ino == stale.st_ino) {
+      shm_unlink(name);
+    }
+    close(cfd);
+  }
+  flock(fd, LOCK_UN);
+}
+
+/*
+ * maps the shared memory segment, creating it if needed. if recreate is set, a
+ * segment whose creator did not complete its initialization in time (e.g.
+ * because it crashed) is removed and created again
+ */
+static int _shm_cache_init_segment(mapcache_context *ctx, mapcache_cache_shm *cache, int recreate)
+{
+  apr_size_t size = cache->size, header_size = _shm_cache_align(sizeof(mapcache_shm_cache_header),64);
+  int creator = 1, i, fd;
+  void *addr;
+
+  fd = shm_open(cache->name, O_RDWR|O_CREAT|O_EXCL, 0600);
+  if(fd < 0 && errno == EEXIST) {
+    creator = 0;
+    fd = shm_open(cache->name, O_RDWR, 0600);
+  }
+  if(fd < 0) {
+    ctx->set_error(ctx,500,"shm cache %s: failed to open shared memory %s: %s", cache->cache.name, cache->name, strerror(errno));
+    return MAPCACHE_FAILURE;
+  }
+  if(creator && ftruncate(fd, size) != 0) {
+    ctx->set_error(ctx,500,"shm cache %s: failed to size shared memory %s: %s", cache->cache.name, cache->name, strerror(errno));
+    close(fd);
+    shm_unlink(cache->name);
+    return MAPCACHE_FAILURE;
+  }
+  if(!creator) {
+    /* wait for the creating process to size the object */
+    struct stat st;
+    for(i=0; i<1000; i++) {
+      if(fstat(fd,&st) == 0 && st.st_size >= (off_t)header_size) break;
+      apr_sleep(1000);
+    }
+    if(i == 1000) {
+      if(recreate) {
+        ctx->log(ctx, MAPCACHE_WARN, "shm cache %s: shared memory %s was never sized, recreating it", cache->cache.name, cache->name);
+        _shm_cache_unlink_stale(cache->name, fd);
+        close(fd);
+        return _shm_cache_init_segment(ctx, cache, 0);
+      }
+      close(fd);
+      ctx->set_error(ctx,500,"shm cache %s: shared memory %s was not initialized", cache->cache.name, cache->name);
+      return MAPCACHE_FAILURE;
+    }
+    size = st.st_size;
+  }
+  addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(addr == MAP_FAILED) {
+    ctx->set_error(ctx,500,"shm cache %s: failed to map shared memory %s: %s", cache->cache.name, cache->name, strerror(errno));
+    close(fd);
+    return MAPCACHE_FAILURE;
+  }
+
+  if(creator) {
+    mapcache_shm_cache_header *header = addr;
+    pthread_mutexattr_t mattr;
+    apr_size_t shard_header_size = _shm_cache_align(sizeof(mapcache_shm_cache_shard),8);
+    /* each shard must be able to hold a few tiles of the maximum size */
+    int nshards = MAPCACHE_SHM_CACHE_MAX_SHARDS;
+    while(nshards > 1 && (size - header_size) / nshards < 8 * cache->max_tile_size) {
+      nshards /= 2;
+    }
+    header->nshards = nshards;
+    header->size = size;
+    header->shard_size = ((size - header_size) / nshards) & ~((apr_size_t)63);
+    header->lookups = 0;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+#ifdef USE_ROBUST_MUTEX
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+#endif
+    for(i=0; i<nshards; i++) {
+      mapcache_shm_cache_shard *shard = (mapcache_shm_cache_shard*)((char*)addr + header_size + i * header->shard_size);
+      apr_size_t avail = header->shard_size - shard_header_size;
+      shard->nentries = avail / (MAPCACHE_SHM_CACHE_BYTES_PER_ENTRY + sizeof(mapcache_shm_cache_entry));
+      shard->nbuckets = 1;
+      while(shard->nbuckets < shard->nentries) {
+        shard->nbuckets <<= 1;
+      }
+      shard->log_size = (avail - _shm_cache_align(shard->nbuckets * sizeof(apr_int32_t),8)
+                         - _shm_cache_align(shard->nentries * sizeof(mapcache_shm_cache_entry),8)) & ~((apr_size_t)7);
+      shard->hits = shard->misses = shard->sets = shard->evictions = 0;
+      pthread_mutex_init(&shard->mutex, &mattr);
+      _shm_cache_shard_reset(shard);
+    }
+    pthread_mutexattr_destroy(&mattr);
+    __sync_synchronize();
+    header->magic = MAPCACHE_SHM_CACHE_MAGIC;
+  } else {
+    mapcache_shm_cache_header *header = addr;
+    for(i=0; i<5000 && header->magic != MAPCACHE_SHM_CACHE_MAGIC; i++) {
+      apr_sleep(1000);
+    }
+    __sync_synchronize();
+    if(header->magic != MAPCACHE_SHM_CACHE_MAGIC) {
+      munmap(addr, size);
+      if(recreate) {
+        ctx->log(ctx, MAPCACHE_WARN, "shm cache %s: shared memory %s was never initialized, recreating it", cache->cache.name, cache->name);
+        _shm_cache_unlink_stale(cache->name, fd);
+        close(fd);
+        return _shm_cache_init_segment(ctx, cache, 0);
+      }
+      ctx->set_error(ctx,500,"shm cache %s: shared memory %s was not initialized", cache->cache.name, cache->name);
+      close(fd);
+      return MAPCACHE_FAILURE;
+    }
+    /* the segment is laid out by the process that created it */
+    if(header->size != cache->size) {
+      ctx->log(ctx, MAPCACHE_WARN, "shm cache %s: using existing shared memory %s of %d MB instead of the configured %d MB",
+               cache->cache.name, cache->name, (int)(header->size >> 20), (int)(cache->size >> 20));
+    }
+  }
+  close(fd);
+  /* publish the mapping once the segment can be used through it */
+  __sync_synchronize();
+  cache->header = addr;
+  return MAPCACHE_SUCCESS;
+}
+
+static mapcache_shm_cache_header* _shm_cache_get_header(mapcache_context *ctx, mapcache_cache_shm *cache)
+{
+  mapcache_shm_cache_header *header = cache->header;
+  if(!header && !cache->disabled) {
+#ifdef APR_HAS_THREADS
+    if(ctx->threadlock)
+      apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+    if(!cache->header && !cache->disabled) {
+      if(_shm_cache_init_segment(ctx, cache, 1) != MAPCACHE_SUCCESS) {
+        /* serve the requests from the backend only */
+        ctx->log(ctx, MAPCACHE_ERROR, "%s, disabling it", ctx->get_error_message(ctx));
+        ctx->clear_errors(ctx);
+        cache->disabled = 1;
+      }
+    }
+    header = cache->header;
+#ifdef APR_HAS_THREADS
+    if(ctx->threadlock)
+      apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  }
+  /* pairs with the barrier before the mapping is published */
+  __sync_synchronize();
+  return header;
+}
+
+static void _shm_cache_count_lookup(mapcache_context *ctx, mapcache_cache_shm *cache)
+{
+  mapcache_shm_cache_header *header = cache->header;
+  apr_uint64_t hits = 0, misses = 0, sets = 0, evictions = 0;
+  int i;
+  if(__sync_add_and_fetch(&header->lookups, 1) % MAPCACHE_SHM_CACHE_STATS_INTERVAL) {
+    return;
+  }
+  /* the counters are read without locking the shards, the totals are approximate */
+  for(i=0; i<header->nshards; i++) {
+    mapcache_shm_cache_shard *shard = _shm_cache_shard(header, (apr_uint64_t)i << 32);
+    hits += shard->hits;
+    misses += shard->misses;
+    sets += shard->sets;
+    evictions += shard->evictions;
+  }
+  ctx->log(ctx, MAPCACHE_INFO, "shm cache %s: %"APR_UINT64_T_FMT" hits, %"APR_UINT64_T_FMT" misses, %"APR_UINT64_T_FMT
+           " tiles stored, %"APR_UINT64_T_FMT" evicted", cache->cache.name, hits, misses, sets, evictions);
+}
+
+static char* _shm_cache_tile_key(mapcache_context *ctx, mapcache_tile *tile, apr_uint64_t *hash)
+{
+  char *key = mapcache_util_get_tile_key(ctx, tile, NULL, NULL, NULL);
+  *hash = _shm_cache_hash(key);
+  return key;
+}
+
+/* stores the encoded data of a tile, or drops the stale entry if it has none */
+static void _shm_cache_store(mapcache_context *ctx, mapcache_cache_shm *cache, mapcache_tile *tile, int keep_newer)
+{
+  mapcache_shm_cache_header *header = _shm_cache_get_header(ctx, cache);
+  mapcache_shm_cache_shard *shard;
+  apr_uint64_t hash;
+  apr_int32_t e;
+  char *key;
+  if(!header) return;
+  key = _shm_cache_tile_key(ctx, tile, &hash);
+  shard = _shm_cache_shard(header, hash);
+  if(_shm_cache_lock(ctx, cache, shard)) return;
+  e = _shm_cache_lookup(shard, hash, key, strlen(key));
+  if(e != -1) {
+    if(keep_newer && _shm_cache_entries(shard)[e].mtime > tile->mtime) {
+      /* the tile was updated through the cache since it was read from the backend */
+      _shm_cache_unlock(shard);
+      return;
+    }
+    _shm_cache_remove(shard, e);
+  }
+  if(tile->encoded_data && tile->encoded_data->size <= cache->max_tile_size) {
+    _shm_cache_insert(shard, hash, key, strlen(key), tile->encoded_data->buf, tile->encoded_data->size,
+                      tile->mtime, apr_time_now());
+  }
+  _shm_cache_unlock(shard);
+}
+
+static int _mapcache_cache_shm_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  mapcache_shm_cache_header *header = _shm_cache_get_header(ctx, cache);
+  if(header) {
+    mapcache_shm_cache_shard *shard;
+    apr_uint64_t hash;
+    apr_int32_t e;
+    char *key = _shm_cache_tile_key(ctx, tile, &hash);
+    shard = _shm_cache_shard(header, hash);
+    if(!_shm_cache_lock(ctx, cache, shard)) {
+      e = _shm_cache_lookup(shard, hash, key, strlen(key));
+      if(e != -1 && cache->ttl && apr_time_now() - _shm_cache_entries(shard)[e].stored > cache->ttl) {
+        e = -1;
+      }
+      _shm_cache_unlock(shard);
+      if(e != -1) {
+        return MAPCACHE_TRUE;
+      }
+    }
+  }
+  return cache->backend->tile_exists(ctx, cache->backend, tile);
+}
+
+static void _mapcache_cache_shm_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  mapcache_shm_cache_header *header = _shm_cache_get_header(ctx, cache);
+  if(header) {
+    mapcache_shm_cache_shard *shard;
+    apr_uint64_t hash;
+    apr_int32_t e;
+    char *key = _shm_cache_tile_key(ctx, tile, &hash);
+    shard = _shm_cache_shard(header, hash);
+    if(!_shm_cache_lock(ctx, cache, shard)) {
+      e = _shm_cache_lookup(shard, hash, key, strlen(key));
+      if(e != -1) {
+        _shm_cache_remove(shard, e);
+      }
+      _shm_cache_unlock(shard);
+    }
+  }
+  cache->backend->tile_delete(ctx, cache->backend, tile);
+}
+
+/**
+ * \brief get content of given tile
+ *
+ * returns the tile from shared memory if it is there, else from the backend
+ * cache, in which case it is added to the shared memory for the next requests
+ * \private \memberof mapcache_cache_shm
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_shm_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  mapcache_shm_cache_header *header = _shm_cache_get_header(ctx, cache);
+  mapcache_shm_cache_shard *shard;
+  mapcache_shm_cache_entry *entry;
+  apr_uint64_t hash;
+  apr_int32_t e;
+  apr_time_t now;
+  char *key;
+  int ret;
+  if(!header) {
+    return cache->backend->tile_get(ctx, cache->backend, tile);
+  }
+  key = _shm_cache_tile_key(ctx, tile, &hash);
+  shard = _shm_cache_shard(header, hash);
+  now = apr_time_now();
+
+  if(_shm_cache_lock(ctx, cache, shard)) {
+    /* the shard is unusable, treat the tile as a miss */
+    return cache->backend->tile_get(ctx, cache->backend, tile);
+  }
+  e = _shm_cache_lookup(shard, hash, key, strlen(key));
+  if(e != -1 && cache->ttl && now - _shm_cache_entries(shard)[e].stored > cache->ttl) {
+    _shm_cache_remove(shard, e);
+    e = -1;
+  }
+  if(e != -1) {
+    entry = &_shm_cache_entries(shard)[e];
+    tile->encoded_data = mapcache_buffer_create(entry->datalen, ctx->pool);
+    memcpy(tile->encoded_data->buf,
+           _shm_cache_log(shard) + entry->offset + sizeof(mapcache_shm_cache_record) + entry->keylen,
+           entry->datalen);
+    tile->encoded_data->size = entry->datalen;
+    tile->mtime = entry->mtime;
+    shard->hits++;
+    if((entry->offset + shard->log_size - shard->tail) % shard->log_size < shard->log_size / 4) {
+      /* the tile is about to be evicted, move it to the head of the log */
+      apr_time_t stored = entry->stored;
+      _shm_cache_remove(shard, e);
+      _shm_cache_insert(shard, hash, key, strlen(key), tile->encoded_data->buf, tile->encoded_data->size,
+                        tile->mtime, stored);
+    }
+    _shm_cache_unlock(shard);
+    _shm_cache_count_lookup(ctx, cache);
+    return MAPCACHE_SUCCESS;
+  }
+  shard->misses++;
+  _shm_cache_unlock(shard);
+  _shm_cache_count_lookup(ctx, cache);
+
+  ret = cache->backend->tile_get(ctx, cache->backend, tile);
+  if(ret == MAPCACHE_SUCCESS && tile->encoded_data) {
+    _shm_cache_store(ctx, cache, tile, 1);
+  }
+  return ret;
+}
+
+/**
+ * \brief write tile data to the backend cache and to shared memory
+ * \private \memberof mapcache_cache_shm
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_shm_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  cache->backend->tile_set(ctx, cache->backend, tile);
+  GC_CHECK_ERROR(ctx);
+  tile->mtime = apr_time_now();
+  _shm_cache_store(ctx, cache, tile, 0);
+}
+
+static void _mapcache_cache_shm_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  apr_time_t now;
+  int i;
+  if(cache->backend->tile_multi_set) {
+    cache->backend->tile_multi_set(ctx, cache->backend, tiles, ntiles);
+  } else {
+    for(i=0; i<ntiles; i++) {
+      cache->backend->tile_set(ctx, cache->backend, &tiles[i]);
+      GC_CHECK_ERROR(ctx);
+    }
+  }
+  GC_CHECK_ERROR(ctx);
+  now = apr_time_now();
+  for(i=0; i<ntiles; i++) {
+    tiles[i].mtime = now;
+    _shm_cache_store(ctx, cache, &tiles[i], 0);
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_shm
+ */
+static void _mapcache_cache_shm_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *pcache, mapcache_cfg *config)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  ezxml_t cur_node;
+  char *endptr;
+  if((cur_node = ezxml_child(node,"cache")) != NULL) {
+    cache->backend = mapcache_configuration_get_cache(config, cur_node->txt);
+    if(!cache->backend) {
+      ctx->set_error(ctx, 400, "shm cache %s references cache \"%s\", which has not been defined before it",
+                     pcache->name, cur_node->txt);
+      return;
+    }
+  } else {
+    ctx->set_error(ctx, 400, "shm cache %s has no <cache> to put in shared memory", pcache->name);
+    return;
+  }
+  if((cur_node = ezxml_child(node,"name")) != NULL) {
+    if(cur_node->txt[0] != '/' || strchr(cur_node->txt+1,'/')) {
+      ctx->set_error(ctx, 400, "shm cache %s: <name> \"%s\" must start with a / and contain no other /", pcache->name, cur_node->txt);
+      return;
+    }
+    cache->name = apr_pstrdup(ctx->pool, cur_node->txt);
+  } else {
+    /* the configuration file is part of the default name so that two configurations
+     * defining a cache with the same name do not share its segment */
+    cache->name = apr_psprintf(ctx->pool, "/mapcache_%s_%d_%08x",
+                               mapcache_util_str_sanitize(ctx->pool, pcache->name, "/", '#'), (int)getuid(),
+                               (unsigned int)(_shm_cache_hash(config->configFile ? config->configFile : "") & 0xffffffff));
+  }
+  if((cur_node = ezxml_child(node,"size")) != NULL) {
+    long size = strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || size < 1) {
+      ctx->set_error(ctx, 400, "failed to parse shm cache size \"%s\". Expecting a positive number of megabytes, e.g. <size>64</size>",
+                     cur_node->txt);
+      return;
+    }
+    cache->size = (apr_size_t)size << 20;
+  }
+  if((cur_node = ezxml_child(node,"max_tile_size")) != NULL) {
+    long size = strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || size < 1) {
+      ctx->set_error(ctx, 400, "failed to parse shm cache max_tile_size \"%s\". Expecting a positive number of kilobytes, e.g. <max_tile_size>256</max_tile_size>",
+                     cur_node->txt);
+      return;
+    }
+    cache->max_tile_size = (apr_size_t)size << 10;
+  }
+  if(cache->max_tile_size * 8 > cache->size) {
+    ctx->set_error(ctx, 400, "shm cache %s: <size> must be at least 8 times <max_tile_size>", pcache->name);
+    return;
+  }
+  if((cur_node = ezxml_child(node,"ttl")) != NULL) {
+    long ttl = strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || ttl < 0) {
+      ctx->set_error(ctx, 400, "failed to parse shm cache ttl \"%s\". Expecting a positive number of seconds, e.g. <ttl>300</ttl>",
+                     cur_node->txt);
+      return;
+    }
+    cache->ttl = apr_time_from_sec(ttl);
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_shm
+ */
+static void _mapcache_cache_shm_configuration_post_config(mapcache_context *ctx, mapcache_cache *pcache,
+    mapcache_cfg *cfg)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  if(!cache->backend) {
+    ctx->set_error(ctx, 400, "shm cache %s has no <cache> configured", pcache->name);
+  }
+}
+
+/**
+ * \brief creates and initializes a mapcache_cache_shm
+ */
+mapcache_cache* mapcache_cache_shm_create(mapcache_context *ctx)
+{
+  mapcache_cache_shm *cache = apr_pcalloc(ctx->pool, sizeof(mapcache_cache_shm));
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate shm cache");
+    return NULL;
+  }
+  cache->cache.metadata = apr_table_make(ctx->pool,3);
+  cache->cache.type = MAPCACHE_CACHE_SHM;
+  cache->cache.tile_get = _mapcache_cache_shm_get;
+  cache->cache.tile_exists = _mapcache_cache_shm_has_tile;
+  cache->cache.tile_set = _mapcache_cache_shm_set;
+  cache->cache.tile_multi_set = _mapcache_cache_shm_multi_set;
+  cache->cache.tile_delete = _mapcache_cache_shm_delete;
+  cache->cache.configuration_post_config = _mapcache_cache_shm_configuration_post_config;
+  cache->cache.configuration_parse_xml = _mapcache_cache_shm_configuration_parse_xml;
+  cache->size = 64 << 20;
+  cache->max_tile_size = 512 << 10;
+  return (mapcache_cache*)cache;
+}
+
+#else
+
+mapcache_cache* mapcache_cache_shm_create(mapcache_context *ctx)
+{
+  ctx->set_error(ctx, 400, "failed to create shm cache, process shared mutexes are not available on this platform");
+  return NULL;
+}
+
+#endif /* USE_SHM_CACHE */
+
+/* vim: ts=2 sts=2 et sw=2
+*/
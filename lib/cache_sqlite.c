@@ -31,6 +31,7 @@
 
 #include "mapcache.h"
 #include <apr_strings.h>
+#include <apr_lib.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
@@ -46,10 +47,35 @@
 
 #include <sqlite3.h>
 
-static apr_hash_t *ro_connection_pools = NULL;
-static apr_hash_t *rw_connection_pools = NULL;
+/*
+ * each database file of a cache (a single one, unless <dbfile> is a template)
+ * has its own pools of read-only and read-write connections. the databases of
+ * a sharded cache are opened when first used, and the least recently used ones
+ * are closed when more than max_open_dbfiles are opened.
+ */
+struct sqlite_shard {
+  mapcache_cache_sqlite *cache;
+  char *dbfile;
+  apr_pool_t *pool;         /* holds the shard and its connection pools */
+  apr_reslist_t *ro_pool;
+  apr_reslist_t *rw_pool;
+  int refcount;             /* number of connections handed out */
+  int evicted;              /* destroy once no longer referenced */
+  struct sqlite_shard *prev, *next;
+};
+
+struct sqlite_shards {
+  apr_pool_t *pool;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+  apr_hash_t *shards;       /* by dbfile */
+  struct sqlite_shard *head, *tail; /* most recently used first */
+  int count;
+};
 
 struct sqlite_conn {
+  struct sqlite_shard *shard;
   sqlite3 *handle;
   int readonly;
   int nstatements;
@@ -95,17 +121,90 @@ static int _sqlite_set_pragmas(apr_pool_t *pool, mapcache_cache_sqlite* cache, s
   return MAPCACHE_SUCCESS;
 }
 
+/*
+ * a locked database is waited for by the busy handler of the connection, a
+ * statement still failing with SQLITE_BUSY has waited for the whole busy
+ * timeout and is not retried
+ */
+static int _sqlite_exec(struct sqlite_conn *conn, const char *sql)
+{
+  return sqlite3_exec(conn->handle, sql, 0, 0, NULL);
+}
+
+/*
+ * memory mapped i/o is set on every connection. the write-ahead log persists
+ * in the database file, and can only be enabled from a writable connection.
+ * user supplied pragmas are applied afterwards and take precedence.
+ */
+static int _sqlite_set_io_pragmas(apr_pool_t *pool, mapcache_cache_sqlite* cache, struct sqlite_conn *conn, int writable)
+{
+  char *pragma_stmt;
+  if (writable && cache->wal && _sqlite_exec(conn, "PRAGMA journal_mode=WAL") != SQLITE_OK) {
+    conn->errmsg = apr_psprintf(pool,"failed to enable write-ahead log on %s: %s", conn->shard->dbfile, sqlite3_errmsg(conn->handle));
+    return MAPCACHE_FAILURE;
+  }
+  if (cache->mmap_size > 0) {
+    pragma_stmt = apr_psprintf(pool,"PRAGMA mmap_size=%"APR_INT64_T_FMT, cache->mmap_size);
+    if (_sqlite_exec(conn, pragma_stmt) != SQLITE_OK) {
+      conn->errmsg = apr_psprintf(pool,"failed to execute pragma statement %s",pragma_stmt);
+      return MAPCACHE_FAILURE;
+    }
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+/*
+ * prepare the statements used by reads, so that pooled connections are ready
+ * to serve tiles. failures are not fatal, preparation is attempted again on use
+ */
+/*
+ * the get statement also reads the stored hash of the tile. databases that
+ * do not have it (created by older versions, or by other tools) are read with
+ * the legacy statement, and their tiles' etags are computed from their data
+ */
+static sqlite3_stmt* _sqlite_prepare_get_statement(mapcache_cache_sqlite *cache, struct sqlite_conn *conn)
+{
+  if (!conn->prepared_statements[GET_TILE_STMT_IDX] &&
+      sqlite3_prepare(conn->handle, cache->get_stmt.sql, -1, &conn->prepared_statements[GET_TILE_STMT_IDX], NULL) != SQLITE_OK) {
+    sqlite3_prepare(conn->handle, cache->legacy_get_stmt.sql, -1, &conn->prepared_statements[GET_TILE_STMT_IDX], NULL);
+  }
+  return conn->prepared_statements[GET_TILE_STMT_IDX];
+}
+
+static void _sqlite_prepare_read_statements(mapcache_cache_sqlite *cache, struct sqlite_conn *conn)
+{
+  sqlite3_prepare(conn->handle, cache->exists_stmt.sql, -1, &conn->prepared_statements[HAS_TILE_STMT_IDX], NULL);
+  _sqlite_prepare_get_statement(cache, conn);
+}
+
 static apr_status_t _sqlite_reslist_get_rw_connection(void **conn_, void *params, apr_pool_t *pool)
 {
   int ret;
   int flags;  
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) params;
+  struct sqlite_shard *shard = (struct sqlite_shard*) params;
+  mapcache_cache_sqlite *cache = shard->cache;
   struct sqlite_conn *conn = apr_pcalloc(pool, sizeof (struct sqlite_conn));
   *conn_ = conn;
+  conn->shard = shard;
   flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_CREATE;
-  ret = sqlite3_open_v2(cache->dbfile, &conn->handle, flags, NULL);
+  if (cache->sharded) {
+    /* the directory of a shard may not exist yet */
+    char *dirname = apr_pstrdup(pool, shard->dbfile);
+    char *slash = strrchr(dirname, '/');
+    if (slash && slash != dirname) {
+      apr_status_t rv;
+      *slash = '\0';
+      rv = apr_dir_make_recursive(dirname, APR_OS_DEFAULT, pool);
+      if (rv != APR_SUCCESS && !APR_STATUS_IS_EEXIST(rv)) {
+        char errmsg[120];
+        conn->errmsg = apr_psprintf(pool,"failed to create directory %s: %s", dirname, apr_strerror(rv,errmsg,120));
+        return rv;
+      }
+    }
+  }
+  ret = sqlite3_open_v2(shard->dbfile, &conn->handle, flags, NULL);
   if (ret != SQLITE_OK) {
-    conn->errmsg = apr_psprintf(pool,"sqlite backend failed to open db %s: %s", cache->dbfile, sqlite3_errmsg(conn->handle));
+    conn->errmsg = apr_psprintf(pool,"sqlite backend failed to open db %s: %s", shard->dbfile, sqlite3_errmsg(conn->handle));
     return APR_EGENERAL;
   }
   sqlite3_busy_timeout(conn->handle, 300000);
@@ -116,12 +215,19 @@ static apr_status_t _sqlite_reslist_get_rw_connection(void **conn_, void *params
     }
   } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
   if (ret != SQLITE_OK) {
-    conn->errmsg = apr_psprintf(pool, "sqlite backend failed to create db schema on %s: %s", cache->dbfile, sqlite3_errmsg(conn->handle));
+    conn->errmsg = apr_psprintf(pool, "sqlite backend failed to create db schema on %s: %s", shard->dbfile, sqlite3_errmsg(conn->handle));
     sqlite3_close(conn->handle);
     return APR_EGENERAL;
   }
+  if (cache->upgrade_stmt.sql) {
+    /* fails once the database is up to date, e.g. with a duplicate column */
+    _sqlite_exec(conn, cache->upgrade_stmt.sql);
+  }
   conn->readonly = 0;
-  ret = _sqlite_set_pragmas(pool, cache, conn);
+  ret = _sqlite_set_io_pragmas(pool, cache, conn, 1);
+  if(ret == MAPCACHE_SUCCESS) {
+    ret = _sqlite_set_pragmas(pool, cache, conn);
+  }
   if(ret != MAPCACHE_SUCCESS) {
     sqlite3_close(conn->handle);
     return APR_EGENERAL;
@@ -136,16 +242,31 @@ static apr_status_t _sqlite_reslist_get_ro_connection(void **conn_, void *params
 {
   int ret;
   int flags;  
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) params;
+  struct sqlite_shard *shard = (struct sqlite_shard*) params;
+  mapcache_cache_sqlite *cache = shard->cache;
   struct sqlite_conn *conn = apr_pcalloc(pool, sizeof (struct sqlite_conn));
   *conn_ = conn;
+  conn->shard = shard;
   flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX;
-  ret = sqlite3_open_v2(cache->dbfile, &conn->handle, flags, NULL);
+  ret = sqlite3_open_v2(shard->dbfile, &conn->handle, flags, NULL);
+  if (ret != SQLITE_OK && cache->sharded) {
+    /*
+     * shards are only created when tiles are written to them, a missing
+     * shard is reported so that its tiles are treated as cache misses
+     */
+    apr_finfo_t finfo;
+    conn->errmsg = apr_psprintf(pool,"sqlite backend failed to open db %s: %s", shard->dbfile, sqlite3_errmsg(conn->handle));
+    sqlite3_close(conn->handle);
+    if (APR_STATUS_IS_ENOENT(apr_stat(&finfo, shard->dbfile, APR_FINFO_TYPE, pool))) {
+      return APR_ENOENT;
+    }
+    return APR_EGENERAL;
+  }
   if (ret != SQLITE_OK) {
     /* maybe the database file doesn't exist yet. so we create it and setup the schema */
-    ret = sqlite3_open_v2(cache->dbfile, &conn->handle, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+    ret = sqlite3_open_v2(shard->dbfile, &conn->handle, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
     if (ret != SQLITE_OK) {
-      conn->errmsg = apr_psprintf(pool,"sqlite backend failed to open db %s: %s", cache->dbfile, sqlite3_errmsg(conn->handle));
+      conn->errmsg = apr_psprintf(pool,"sqlite backend failed to open db %s: %s", shard->dbfile, sqlite3_errmsg(conn->handle));
       sqlite3_close(conn->handle);
       return APR_EGENERAL;
     }
@@ -157,15 +278,20 @@ static apr_status_t _sqlite_reslist_get_ro_connection(void **conn_, void *params
       }
     } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
     if (ret != SQLITE_OK) {
-      conn->errmsg = apr_psprintf(pool,"sqlite backend failed to create db schema on %s: %s", cache->dbfile, sqlite3_errmsg(conn->handle));
+      conn->errmsg = apr_psprintf(pool,"sqlite backend failed to create db schema on %s: %s", shard->dbfile, sqlite3_errmsg(conn->handle));
+      sqlite3_close(conn->handle);
+      return APR_EGENERAL;
+    }
+    if (cache->wal && _sqlite_exec(conn, "PRAGMA journal_mode=WAL") != SQLITE_OK) {
+      conn->errmsg = apr_psprintf(pool,"failed to enable write-ahead log on %s: %s", shard->dbfile, sqlite3_errmsg(conn->handle));
       sqlite3_close(conn->handle);
       return APR_EGENERAL;
     }
 
     sqlite3_close(conn->handle);
-    ret = sqlite3_open_v2(cache->dbfile, &conn->handle, flags, NULL);
+    ret = sqlite3_open_v2(shard->dbfile, &conn->handle, flags, NULL);
     if (ret != SQLITE_OK) {
-      conn->errmsg = apr_psprintf(pool, "sqlite backend failed to re-open freshly created db %s readonly: %s", cache->dbfile, sqlite3_errmsg(conn->handle));
+      conn->errmsg = apr_psprintf(pool, "sqlite backend failed to re-open freshly created db %s readonly: %s", shard->dbfile, sqlite3_errmsg(conn->handle));
       sqlite3_close(conn->handle);
       return APR_EGENERAL;
     }
@@ -173,13 +299,17 @@ static apr_status_t _sqlite_reslist_get_ro_connection(void **conn_, void *params
   sqlite3_busy_timeout(conn->handle, 300000);
   conn->readonly = 1;
 
-  ret = _sqlite_set_pragmas(pool,cache, conn);
+  ret = _sqlite_set_io_pragmas(pool, cache, conn, 0);
+  if (ret == MAPCACHE_SUCCESS) {
+    ret = _sqlite_set_pragmas(pool,cache, conn);
+  }
   if (ret != MAPCACHE_SUCCESS) {
     sqlite3_close(conn->handle);
     return APR_EGENERAL;
   }
   conn->prepared_statements = calloc(cache->n_prepared_statements,sizeof(sqlite3_stmt*));
   conn->nstatements = cache->n_prepared_statements;
+  _sqlite_prepare_read_statements(cache, conn);
   return APR_SUCCESS;
 }
 
@@ -197,102 +327,297 @@ static apr_status_t _sqlite_reslist_free_connection(void *conn_, void *params, a
   return APR_SUCCESS;
 }
 
-static struct sqlite_conn* _sqlite_get_conn(mapcache_context *ctx, mapcache_tile* tile, int readonly) {
-  apr_status_t rv;
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn;
-  apr_reslist_t *pool = NULL;
-  apr_hash_t *pool_container;
-  if (readonly) {
-    pool_container = ro_connection_pools;
-  } else {
-    pool_container = rw_connection_pools;
+/**
+ * \brief return the database file holding the given tile
+ */
+static char* _sqlite_get_dbfile(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile)
+{
+  char *path = cache->dbfile;
+  if (!cache->sharded) {
+    return path;
   }
-  if(!pool_container || NULL == (pool = apr_hash_get(pool_container,cache->cache.name, APR_HASH_KEY_STRING)) ) {
+  if(strstr(path,"{tileset}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{tileset}", tile->tileset->name);
+  if(strstr(path,"{grid}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{grid}", tile->grid_link->grid->name);
+  if(strstr(path,"{dim}")) {
+    char *dimstring="";
+    if(tile->dimensions) {
+      const apr_array_header_t *elts = apr_table_elts(tile->dimensions);
+      int i = elts->nelts;
+      while(i--) {
+        apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
+        const char *dimval = mapcache_util_str_sanitize(ctx->pool,entry->val,"/.",'#');
+        dimstring = apr_pstrcat(ctx->pool,dimstring,"#",dimval,NULL);
+      }
+    }
+    path = mapcache_util_str_replace(ctx->pool,path, "{dim}", dimstring);
+  }
+  while(strstr(path,"{z}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{z}", apr_itoa(ctx->pool,tile->z));
+  /* index of the shard along each axis */
+  while(strstr(path,"{div_x}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{div_x}", apr_itoa(ctx->pool,tile->x/cache->count_x));
+  while(strstr(path,"{div_y}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{div_y}", apr_itoa(ctx->pool,tile->y/cache->count_y));
+  /* index of the bottom-left tile of the shard */
+  while(strstr(path,"{x}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{x}", apr_itoa(ctx->pool,tile->x/cache->count_x*cache->count_x));
+  while(strstr(path,"{y}"))
+    path = mapcache_util_str_replace(ctx->pool,path, "{y}", apr_itoa(ctx->pool,tile->y/cache->count_y*cache->count_y));
+  return path;
+}
+
+static void _sqlite_shards_lock(struct sqlite_shards *shards)
+{
 #ifdef APR_HAS_THREADS
-    if(ctx->threadlock)
-      apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+  apr_thread_mutex_lock(shards->mutex);
 #endif
-    if(!ro_connection_pools) {
-      ro_connection_pools = apr_hash_make(ctx->process_pool);
-      rw_connection_pools = apr_hash_make(ctx->process_pool);
-    }
-
-    /* probably doesn't exist, unless the previous mutex locked us, so we check */
-    pool = apr_hash_get(ro_connection_pools,cache->cache.name, APR_HASH_KEY_STRING);
-    if(!pool) {
-      /* there where no existing connection pools, create them*/
-      rv = apr_reslist_create(&pool,
-                              0 /* min */,
-                              10 /* soft max */,
-                              200 /* hard max */,
-                              60*1000000 /*60 seconds, ttl*/,
-                              _sqlite_reslist_get_ro_connection, /* resource constructor */
-                              _sqlite_reslist_free_connection, /* resource destructor */
-                              cache, ctx->process_pool);
-      if(rv != APR_SUCCESS) {
-        ctx->set_error(ctx,500,"failed to create bdb ro connection pool");
+}
+
+static void _sqlite_shards_unlock(struct sqlite_shards *shards)
+{
 #ifdef APR_HAS_THREADS
-        if(ctx->threadlock)
-          apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+  apr_thread_mutex_unlock(shards->mutex);
 #endif
-        return NULL;
-      }
-      apr_hash_set(ro_connection_pools,cache->cache.name,APR_HASH_KEY_STRING,pool);
-      rv = apr_reslist_create(&pool,
-                              0 /* min */,
-                              1 /* soft max */,
-                              1 /* hard max */,
-                              60*1000000 /*60 seconds, ttl*/,
-                              _sqlite_reslist_get_rw_connection, /* resource constructor */
-                              _sqlite_reslist_free_connection, /* resource destructor */
-                              cache, ctx->process_pool);
-      if(rv != APR_SUCCESS) {
-        ctx->set_error(ctx,500,"failed to create bdb rw connection pool");
+}
+
+static apr_status_t _sqlite_shards_destroy(void *data)
+{
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) data;
+  struct sqlite_shards *shards = (struct sqlite_shards*) cache->shards;
+  cache->shards = NULL;
+  if (shards) {
+    while (shards->head) {
+      struct sqlite_shard *shard = shards->head;
+      shards->head = shard->next;
+      apr_pool_destroy(shard->pool);
+    }
+    apr_pool_destroy(shards->pool);
+  }
+  return APR_SUCCESS;
+}
+
+/*
+ * return the opened database files of the cache, creating the list on first use
+ */
+static struct sqlite_shards* _sqlite_shards_get(mapcache_context *ctx, mapcache_cache_sqlite *cache)
+{
+  if (cache->shards) return (struct sqlite_shards*) cache->shards;
 #ifdef APR_HAS_THREADS
-        if(ctx->threadlock)
-          apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
 #endif
-        return NULL;
+  if (!cache->shards) {
+    apr_pool_t *pool;
+    if (apr_pool_create(&pool, NULL) == APR_SUCCESS) {
+      struct sqlite_shards *shards = apr_pcalloc(pool, sizeof (struct sqlite_shards));
+      shards->pool = pool;
+      shards->shards = apr_hash_make(pool);
+#ifdef APR_HAS_THREADS
+      if (apr_thread_mutex_create(&shards->mutex, APR_THREAD_MUTEX_DEFAULT, pool) != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        shards = NULL;
       }
-      apr_hash_set(rw_connection_pools,cache->cache.name,APR_HASH_KEY_STRING,pool);
+#endif
+      if (shards) {
+        cache->shards = shards;
+        apr_pool_cleanup_register(ctx->process_pool, cache, _sqlite_shards_destroy, apr_pool_cleanup_null);
+      }
+    }
+    if (!cache->shards) {
+      ctx->set_error(ctx, 500, "failed to create sqlite connection pools for cache %s", cache->cache.name);
     }
+  }
 #ifdef APR_HAS_THREADS
-    if(ctx->threadlock)
-      apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
 #endif
-    if(readonly)
-      pool = apr_hash_get(ro_connection_pools,cache->cache.name, APR_HASH_KEY_STRING);
-    else
-      pool = apr_hash_get(rw_connection_pools,cache->cache.name, APR_HASH_KEY_STRING);
-    assert(pool);
+  return (struct sqlite_shards*) cache->shards;
+}
+
+static struct sqlite_shard* _sqlite_shard_create(mapcache_context *ctx, mapcache_cache_sqlite *cache, const char *dbfile)
+{
+  apr_pool_t *pool;
+  apr_status_t rv;
+  struct sqlite_shard *shard;
+  /* shards are opened and closed on demand, don't keep idle connections to them */
+  int min = cache->sharded ? 0 : cache->min_connections;
+  if (apr_pool_create(&pool, NULL) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to allocate sqlite connection pools for %s", dbfile);
+    return NULL;
+  }
+  shard = apr_pcalloc(pool, sizeof (struct sqlite_shard));
+  shard->pool = pool;
+  shard->cache = cache;
+  shard->dbfile = apr_pstrdup(pool, dbfile);
+  /* the min connections are opened right away, with their statements prepared */
+  rv = apr_reslist_create(&shard->ro_pool,
+                          min /* min */,
+                          MAPCACHE_MAX(10,min) /* soft max */,
+                          MAPCACHE_MAX(200,min) /* hard max */,
+                          60*1000000 /*60 seconds, ttl*/,
+                          _sqlite_reslist_get_ro_connection, /* resource constructor */
+                          _sqlite_reslist_free_connection, /* resource destructor */
+                          shard, pool);
+  if (rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to create sqlite ro connection pool for %s", dbfile);
+    apr_pool_destroy(pool);
+    return NULL;
   }
-  rv = apr_reslist_acquire(pool, (void **) &conn);
+  rv = apr_reslist_create(&shard->rw_pool,
+                          0 /* min */,
+                          1 /* soft max */,
+                          1 /* hard max */,
+                          60*1000000 /*60 seconds, ttl*/,
+                          _sqlite_reslist_get_rw_connection, /* resource constructor */
+                          _sqlite_reslist_free_connection, /* resource destructor */
+                          shard, pool);
   if (rv != APR_SUCCESS) {
-    ctx->set_error(ctx, 500, "failed to aquire connection to sqlite backend: %s", (conn && conn->errmsg)?conn->errmsg:"unknown error");
+    ctx->set_error(ctx, 500, "failed to create sqlite rw connection pool for %s", dbfile);
+    apr_pool_destroy(pool);
+    return NULL;
+  }
+  return shard;
+}
+
+/* must be called with the shards locked */
+static void _sqlite_shard_unlink(struct sqlite_shards *shards, struct sqlite_shard *shard)
+{
+  if (shard->prev) shard->prev->next = shard->next;
+  else shards->head = shard->next;
+  if (shard->next) shard->next->prev = shard->prev;
+  else shards->tail = shard->prev;
+  shard->prev = shard->next = NULL;
+}
+
+/* must be called with the shards locked */
+static void _sqlite_shard_evict(struct sqlite_shards *shards, struct sqlite_shard *shard)
+{
+  _sqlite_shard_unlink(shards, shard);
+  apr_hash_set(shards->shards, shard->dbfile, APR_HASH_KEY_STRING, NULL);
+  shards->count--;
+  shard->evicted = 1;
+  if (!shard->refcount) {
+    apr_pool_destroy(shard->pool);
+  }
+}
+
+static void _sqlite_shard_release(struct sqlite_shards *shards, struct sqlite_shard *shard)
+{
+  _sqlite_shards_lock(shards);
+  if (!--shard->refcount && shard->evicted) {
+    apr_pool_destroy(shard->pool);
+  }
+  _sqlite_shards_unlock(shards);
+}
+
+/*
+ * return a connection to the database file of the tile. for sharded caches,
+ * returns NULL without setting an error if a read-only connection is requested
+ * on a database file that does not exist yet
+ */
+static struct sqlite_conn* _sqlite_get_conn(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile* tile, int readonly) {
+  apr_status_t rv;
+  struct sqlite_conn *conn = NULL;
+  struct sqlite_shards *shards;
+  struct sqlite_shard *shard;
+  char *dbfile;
+
+  shards = _sqlite_shards_get(ctx, cache);
+  if (!shards) {
+    return NULL;
+  }
+  dbfile = _sqlite_get_dbfile(ctx, cache, tile);
+
+  _sqlite_shards_lock(shards);
+  shard = apr_hash_get(shards->shards, dbfile, APR_HASH_KEY_STRING);
+  if (shard) {
+    _sqlite_shard_unlink(shards, shard);
+  } else {
+    shard = _sqlite_shard_create(ctx, cache, dbfile);
+    if (!shard) {
+      _sqlite_shards_unlock(shards);
+      return NULL;
+    }
+    apr_hash_set(shards->shards, shard->dbfile, APR_HASH_KEY_STRING, shard);
+    shards->count++;
+  }
+  shard->prev = NULL;
+  shard->next = shards->head;
+  if (shards->head) shards->head->prev = shard;
+  else shards->tail = shard;
+  shards->head = shard;
+  shard->refcount++;
+  while (shards->count > MAPCACHE_MAX(1,cache->max_open_dbfiles)) {
+    _sqlite_shard_evict(shards, shards->tail);
+  }
+  _sqlite_shards_unlock(shards);
+
+  rv = apr_reslist_acquire(readonly ? shard->ro_pool : shard->rw_pool, (void **) &conn);
+  if (rv != APR_SUCCESS) {
+    _sqlite_shard_release(shards, shard);
+    if (readonly && APR_STATUS_IS_ENOENT(rv)) {
+      /* the shard has not been written to yet, none of its tiles exist */
+      return NULL;
+    }
+    ctx->set_error(ctx, 500, "failed to aquire connection to sqlite backend %s: %s", dbfile, (conn && conn->errmsg)?conn->errmsg:"unknown error");
     return NULL;
   }
   return conn;
 }
 
-static void _sqlite_release_conn(mapcache_context *ctx, mapcache_tile *tile, struct sqlite_conn *conn)
+static void _sqlite_release_conn(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile, struct sqlite_conn *conn)
 {
+  struct sqlite_shard *shard;
   apr_reslist_t *pool;
-  apr_hash_t *pool_container;
-  if(conn->readonly) {
-    pool_container = ro_connection_pools;
-  } else {
-    pool_container = rw_connection_pools;
+  if (!conn) {
+    return;
   }
-  pool = apr_hash_get(pool_container,tile->tileset->cache->name, APR_HASH_KEY_STRING);
+  shard = conn->shard;
+  pool = conn->readonly ? shard->ro_pool : shard->rw_pool;
 
   if (GC_HAS_ERROR(ctx)) {
     apr_reslist_invalidate(pool, (void*) conn);
   } else {
     apr_reslist_release(pool, (void*) conn);
   }
+  _sqlite_shard_release((struct sqlite_shards*) cache->shards, shard);
 }
 
+/*
+ * call func on the tiles grouped by database file, i.e. once with all the
+ * tiles for caches that are not sharded
+ */
+static void _sqlite_batch_by_dbfile(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile **tiles, int ntiles,
+                                    void (*func)(mapcache_context*, mapcache_cache_sqlite*, mapcache_tile**, int))
+{
+  char **dbfiles;
+  mapcache_tile **batch;
+  int i,j,nbatch;
+  if (!cache->sharded) {
+    func(ctx, cache, tiles, ntiles);
+    return;
+  }
+  dbfiles = (char**) apr_pcalloc(ctx->pool, ntiles * sizeof(char*));
+  batch = (mapcache_tile**) apr_pcalloc(ctx->pool, ntiles * sizeof(mapcache_tile*));
+  for (i = 0; i < ntiles; i++) {
+    dbfiles[i] = _sqlite_get_dbfile(ctx, cache, tiles[i]);
+  }
+  for (i = 0; i < ntiles; i++) {
+    if (!dbfiles[i]) continue;
+    nbatch = 0;
+    batch[nbatch++] = tiles[i];
+    for (j = i + 1; j < ntiles; j++) {
+      if (dbfiles[j] && !strcmp(dbfiles[i], dbfiles[j])) {
+        batch[nbatch++] = tiles[j];
+        dbfiles[j] = NULL;
+      }
+    }
+    func(ctx, cache, batch, nbatch);
+    GC_CHECK_ERROR(ctx);
+  }
+}
 
 /**
  * \brief apply appropriate tile properties to the sqlite statement */
@@ -344,6 +669,16 @@ static void _bind_sqlite_params(mapcache_context *ctx, void *vstmt, mapcache_til
       sqlite3_bind_text(stmt, paramidx, "", -1, SQLITE_STATIC);
     }
   }
+
+  /* md5 of the encoded tile, stored so that reads return it as the tile's etag */
+  paramidx = sqlite3_bind_parameter_index(stmt, ":hash");
+  if (paramidx) {
+    if (!tile->encoded_data) {
+      tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+      GC_CHECK_ERROR(ctx);
+    }
+    sqlite3_bind_text(stmt, paramidx, mapcache_util_md5_hex(ctx->pool, tile->encoded_data->buf, tile->encoded_data->size), -1, SQLITE_STATIC);
+  }
 }
 
 static void _bind_mbtiles_params(mapcache_context *ctx, void *vstmt, mapcache_tile *tile)
@@ -361,11 +696,14 @@ static void _bind_mbtiles_params(mapcache_context *ctx, void *vstmt, mapcache_ti
   paramidx = sqlite3_bind_parameter_index(stmt, ":z");
   if (paramidx) sqlite3_bind_int(stmt, paramidx, tile->z);
 
-  /* mbtiles foreign key */
-  paramidx = sqlite3_bind_parameter_index(stmt, ":key");
+  /* mbtiles foreign key, the hash of the encoded tile so identical tiles share their image */
+  paramidx = sqlite3_bind_parameter_index(stmt, ":hash");
   if (paramidx) {
-    char *key = apr_psprintf(ctx->pool,"%d-%d-%d",tile->x,tile->y,tile->z);
-    sqlite3_bind_text(stmt, paramidx, key, -1, SQLITE_STATIC);
+    if (!tile->encoded_data) {
+      tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+      GC_CHECK_ERROR(ctx);
+    }
+    sqlite3_bind_text(stmt, paramidx, mapcache_util_md5_hex(ctx->pool, tile->encoded_data->buf, tile->encoded_data->size), -1, SQLITE_STATIC);
   }
 
   paramidx = sqlite3_bind_parameter_index(stmt, ":color");
@@ -395,14 +733,14 @@ static void _bind_mbtiles_params(mapcache_context *ctx, void *vstmt, mapcache_ti
   }
 }
 
-static int _mapcache_cache_sqlite_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_sqlite_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 1);
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, cache, tile, 1);
   sqlite3_stmt *stmt;
   int ret;
-  if (GC_HAS_ERROR(ctx)) {
-    _sqlite_release_conn(ctx, tile, conn);
+  if (GC_HAS_ERROR(ctx) || !conn) {
+    _sqlite_release_conn(ctx, cache, tile, conn);
     return MAPCACHE_FALSE;
   }
   stmt = conn->prepared_statements[HAS_TILE_STMT_IDX];
@@ -421,20 +759,21 @@ static int _mapcache_cache_sqlite_has_tile(mapcache_context *ctx, mapcache_tile
     ret = MAPCACHE_TRUE;
   }
   sqlite3_reset(stmt);
-  _sqlite_release_conn(ctx, tile, conn);
+  _sqlite_release_conn(ctx, cache, tile, conn);
   return ret;
 }
 
-static void _mapcache_cache_sqlite_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_sqlite_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 0);
-  sqlite3_stmt *stmt = conn->prepared_statements[SQLITE_DEL_TILE_STMT_IDX];
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, cache, tile, 0);
+  sqlite3_stmt *stmt;
   int ret;
   if (GC_HAS_ERROR(ctx)) {
-    _sqlite_release_conn(ctx, tile, conn);
+    _sqlite_release_conn(ctx, cache, tile, conn);
     return;
   }
+  stmt = conn->prepared_statements[SQLITE_DEL_TILE_STMT_IDX];
   if(!stmt) {
     sqlite3_prepare(conn->handle, cache->delete_stmt.sql, -1, &conn->prepared_statements[SQLITE_DEL_TILE_STMT_IDX], NULL);
     stmt = conn->prepared_statements[SQLITE_DEL_TILE_STMT_IDX];
@@ -445,103 +784,118 @@ static void _mapcache_cache_sqlite_delete(mapcache_context *ctx, mapcache_tile *
     ctx->set_error(ctx, 500, "sqlite backend failed on delete: %s", sqlite3_errmsg(conn->handle));
   }
   sqlite3_reset(stmt);
-  _sqlite_release_conn(ctx, tile, conn);
+  _sqlite_release_conn(ctx, cache, tile, conn);
 }
 
 
-static void _mapcache_cache_mbtiles_delete(mapcache_context *ctx, mapcache_tile *tile)
+/**
+ * \brief the tile_id a tile references in the map table
+ * \returns NULL if the tile is not stored
+ */
+static char* _mbtiles_get_tile_id(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile, struct sqlite_conn *conn)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 0);
-  sqlite3_stmt *stmt1,*stmt2,*stmt3;
+  sqlite3_stmt *stmt = conn->prepared_statements[MBTILES_DEL_TILE_SELECT_STMT_IDX];
+  char *tile_id = NULL;
   int ret;
-  const char *tile_id;
-  size_t tile_id_size;
-  if (GC_HAS_ERROR(ctx)) {
-    _sqlite_release_conn(ctx, tile, conn);
-    return;
+  if(!stmt) {
+    sqlite3_prepare(conn->handle, "select tile_id from map where tile_column=:x and tile_row=:y and zoom_level=:z",-1,&conn->prepared_statements[MBTILES_DEL_TILE_SELECT_STMT_IDX], NULL);
+    stmt = conn->prepared_statements[MBTILES_DEL_TILE_SELECT_STMT_IDX];
   }
-  stmt1 = conn->prepared_statements[MBTILES_DEL_TILE_SELECT_STMT_IDX];
-  stmt2 = conn->prepared_statements[MBTILES_DEL_TILE_STMT1_IDX];
-  stmt3 = conn->prepared_statements[MBTILES_DEL_TILE_STMT2_IDX];
-  if(!stmt1) {
-    sqlite3_prepare(conn->handle, "select tile_id from map where tile_col=:x and tile_row=:y and zoom_level=:z",-1,&conn->prepared_statements[MBTILES_DEL_TILE_SELECT_STMT_IDX], NULL);
-    sqlite3_prepare(conn->handle, "delete from map where tile_col=:x and tile_row=:y and zoom_level=:z", -1, &conn->prepared_statements[MBTILES_DEL_TILE_STMT1_IDX], NULL);
-    sqlite3_prepare(conn->handle, "delete from images where tile_id=:foobar", -1, &conn->prepared_statements[MBTILES_DEL_TILE_STMT2_IDX], NULL);
-    stmt1 = conn->prepared_statements[MBTILES_DEL_TILE_SELECT_STMT_IDX];
-    stmt2 = conn->prepared_statements[MBTILES_DEL_TILE_STMT1_IDX];
-    stmt3 = conn->prepared_statements[MBTILES_DEL_TILE_STMT2_IDX];
-  }
-
-  /* first extract tile_id from the tile we will delete. We need this because we do not know
-   * if the tile is empty or not.
-   * If it is empty, we will not delete the image blob data from the images table */
-  cache->bind_stmt(ctx, stmt1, tile);
+  cache->bind_stmt(ctx, stmt, tile);
   do {
-    ret = sqlite3_step(stmt1);
+    ret = sqlite3_step(stmt);
     if (ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
-      ctx->set_error(ctx, 500, "sqlite backend failed on mbtile del 1: %s", sqlite3_errmsg(conn->handle));
-      sqlite3_reset(stmt1);
-      _sqlite_release_conn(ctx, tile, conn);
-      return;
+      ctx->set_error(ctx, 500, "sqlite backend failed on mbtile id select: %s", sqlite3_errmsg(conn->handle));
+      break;
     }
   } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
-  if (ret == SQLITE_DONE) { /* tile does not exist, ignore */
-    sqlite3_reset(stmt1);
-    _sqlite_release_conn(ctx, tile, conn);
+  if (ret == SQLITE_ROW) {
+    tile_id = apr_pstrndup(ctx->pool, (const char*) sqlite3_column_text(stmt, 0), sqlite3_column_bytes(stmt, 0));
+  }
+  sqlite3_reset(stmt);
+  return tile_id;
+}
+
+/**
+ * \brief remove an image from the images table once no tile references it anymore
+ *
+ * images are shared between identical tiles. the ones of uniform tiles, keyed
+ * by their color, are always kept
+ */
+static void _mbtiles_delete_image(mapcache_context *ctx, struct sqlite_conn *conn, const char *tile_id)
+{
+  sqlite3_stmt *stmt = conn->prepared_statements[MBTILES_DEL_TILE_STMT2_IDX];
+  int paramidx, ret;
+  if (tile_id[0] == '#') {
     return;
-  } else {
-    tile_id = (const char*) sqlite3_column_text(stmt1, 0);
-    tile_id_size = sqlite3_column_bytes(stmt1, 0);
   }
+  if(!stmt) {
+    sqlite3_prepare(conn->handle, "delete from images where tile_id=:foobar and not exists (select 1 from map where tile_id=:foobar)", -1, &conn->prepared_statements[MBTILES_DEL_TILE_STMT2_IDX], NULL);
+    stmt = conn->prepared_statements[MBTILES_DEL_TILE_STMT2_IDX];
+  }
+  paramidx = sqlite3_bind_parameter_index(stmt, ":foobar");
+  if (paramidx) {
+    sqlite3_bind_text(stmt, paramidx, tile_id, -1, SQLITE_STATIC);
+  }
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE && ret != SQLITE_ROW) {
+    ctx->set_error(ctx, 500, "sqlite backend failed on mbtile image del: %s", sqlite3_errmsg(conn->handle));
+  }
+  sqlite3_reset(stmt);
+}
 
+static void _mapcache_cache_mbtiles_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, cache, tile, 0);
+  sqlite3_stmt *stmt;
+  int ret;
+  char *tile_id;
+  if (GC_HAS_ERROR(ctx)) {
+    _sqlite_release_conn(ctx, cache, tile, conn);
+    return;
+  }
 
-  /* delete the tile from the "map" table */
-  cache->bind_stmt(ctx,stmt2, tile);
-  ret = sqlite3_step(stmt2);
-  if (ret != SQLITE_DONE && ret != SQLITE_ROW) {
-    ctx->set_error(ctx, 500, "sqlite backend failed on mbtile del 2: %s", sqlite3_errmsg(conn->handle));
-    sqlite3_reset(stmt1);
-    sqlite3_reset(stmt2);
-    _sqlite_release_conn(ctx, tile, conn);
+  /* first extract tile_id from the tile we will delete, to then remove its
+   * image if no other tile shares it */
+  tile_id = _mbtiles_get_tile_id(ctx, cache, tile, conn);
+  if (GC_HAS_ERROR(ctx) || !tile_id) { /* tile does not exist, ignore */
+    _sqlite_release_conn(ctx, cache, tile, conn);
     return;
   }
 
-  if(tile_id[0] != '#') {
-    /* the tile isn't empty, we must also delete from the images table */
-    int paramidx = sqlite3_bind_parameter_index(stmt3, ":foobar");
-    if (paramidx) {
-      sqlite3_bind_text(stmt3, paramidx, tile_id, tile_id_size, SQLITE_STATIC);
-    }
-    ret = sqlite3_step(stmt3);
-    if (ret != SQLITE_DONE && ret != SQLITE_ROW) {
-      ctx->set_error(ctx, 500, "sqlite backend failed on mbtile del 3: %s", sqlite3_errmsg(conn->handle));
-      sqlite3_reset(stmt1);
-      sqlite3_reset(stmt2);
-      sqlite3_reset(stmt3);
-      _sqlite_release_conn(ctx, tile, conn);
-      return;
-    }
+  /* delete the tile from the "map" table */
+  stmt = conn->prepared_statements[MBTILES_DEL_TILE_STMT1_IDX];
+  if(!stmt) {
+    sqlite3_prepare(conn->handle, "delete from map where tile_column=:x and tile_row=:y and zoom_level=:z", -1, &conn->prepared_statements[MBTILES_DEL_TILE_STMT1_IDX], NULL);
+    stmt = conn->prepared_statements[MBTILES_DEL_TILE_STMT1_IDX];
+  }
+  cache->bind_stmt(ctx,stmt, tile);
+  ret = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  if (ret != SQLITE_DONE && ret != SQLITE_ROW) {
+    ctx->set_error(ctx, 500, "sqlite backend failed on mbtile del: %s", sqlite3_errmsg(conn->handle));
+    _sqlite_release_conn(ctx, cache, tile, conn);
+    return;
   }
 
-  sqlite3_reset(stmt1);
-  sqlite3_reset(stmt2);
-  sqlite3_reset(stmt3);
-  _sqlite_release_conn(ctx, tile, conn);
+  _mbtiles_delete_image(ctx, conn, tile_id);
+  _sqlite_release_conn(ctx, cache, tile, conn);
 }
 
 
 
-static void _single_mbtile_set(mapcache_context *ctx, mapcache_tile *tile, struct sqlite_conn *conn)
+static void _single_mbtile_set(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile, struct sqlite_conn *conn)
 {
   sqlite3_stmt *stmt1,*stmt2;
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)tile->tileset->cache;
+  char *old_tile_id;
   int ret;
-  if(!tile->raw_image) {
-    tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
-    GC_CHECK_ERROR(ctx);
-  }
-  if(mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
+  /*
+   * uniform tiles are keyed by their color. tiles that were handed to us
+   * already encoded are not decoded to check for that, their hash key
+   * deduplicates them just as well
+   */
+  if(tile->raw_image && mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
     stmt1 = conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT1_IDX];
     stmt2 = conn->prepared_statements[MBTILES_SET_EMPTY_TILE_STMT2_IDX];
     if(!stmt1) {
@@ -561,10 +915,10 @@ static void _single_mbtile_set(mapcache_context *ctx, mapcache_tile *tile, struc
     stmt2 = conn->prepared_statements[MBTILES_SET_TILE_STMT2_IDX];
     if(!stmt1) {
       sqlite3_prepare(conn->handle,
-                      "insert or replace into images(tile_id,tile_data) values (:key,:data);",
+                      "insert or ignore into images(tile_id,tile_data) values (:hash,:data);",
                       -1, &conn->prepared_statements[MBTILES_SET_TILE_STMT1_IDX], NULL);
       sqlite3_prepare(conn->handle,
-                      "insert or replace into map(tile_column,tile_row,zoom_level,tile_id) values (:x,:y,:z,:key);",
+                      "insert or replace into map(tile_column,tile_row,zoom_level,tile_id) values (:x,:y,:z,:hash);",
                       -1, &conn->prepared_statements[MBTILES_SET_TILE_STMT2_IDX], NULL);
       stmt1 = conn->prepared_statements[MBTILES_SET_TILE_STMT1_IDX];
       stmt2 = conn->prepared_statements[MBTILES_SET_TILE_STMT2_IDX];
@@ -572,6 +926,10 @@ static void _single_mbtile_set(mapcache_context *ctx, mapcache_tile *tile, struc
     cache->bind_stmt(ctx, stmt1, tile);
     cache->bind_stmt(ctx, stmt2, tile);
   }
+  GC_CHECK_ERROR(ctx);
+  /* the image the tile referenced until now, removed below if nothing else uses it */
+  old_tile_id = _mbtiles_get_tile_id(ctx, cache, tile, conn);
+  GC_CHECK_ERROR(ctx);
   do {
     ret = sqlite3_step(stmt1);
     if (ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
@@ -596,37 +954,26 @@ static void _single_mbtile_set(mapcache_context *ctx, mapcache_tile *tile, struc
   }
   sqlite3_reset(stmt1);
   sqlite3_reset(stmt2);
+  if (ret == SQLITE_DONE && old_tile_id) {
+    _mbtiles_delete_image(ctx, conn, old_tile_id);
+  }
 }
 
-static int _mapcache_cache_sqlite_get(mapcache_context *ctx, mapcache_tile *tile)
+static int _single_sqlitetile_get(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile, struct sqlite_conn *conn)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn;
-  sqlite3_stmt *stmt;
+  sqlite3_stmt *stmt = _sqlite_prepare_get_statement(cache, conn);
   int ret;
-  conn = _sqlite_get_conn(ctx, tile, 1);
-  if (GC_HAS_ERROR(ctx)) {
-    if(conn) _sqlite_release_conn(ctx, tile, conn);
-    return MAPCACHE_FAILURE;
-  }
-  stmt = conn->prepared_statements[GET_TILE_STMT_IDX];
-  if(!stmt) {
-    sqlite3_prepare(conn->handle, cache->get_stmt.sql, -1, &conn->prepared_statements[GET_TILE_STMT_IDX], NULL);
-    stmt = conn->prepared_statements[GET_TILE_STMT_IDX];
-  }
   cache->bind_stmt(ctx, stmt, tile);
   do {
     ret = sqlite3_step(stmt);
     if (ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
       ctx->set_error(ctx, 500, "sqlite backend failed on get: %s", sqlite3_errmsg(conn->handle));
       sqlite3_reset(stmt);
-      _sqlite_release_conn(ctx, tile, conn);
       return MAPCACHE_FAILURE;
     }
   } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
   if (ret == SQLITE_DONE) {
     sqlite3_reset(stmt);
-    _sqlite_release_conn(ctx, tile, conn);
     return MAPCACHE_CACHE_MISS;
   } else {
     const void *blob = sqlite3_column_blob(stmt, 0);
@@ -634,19 +981,88 @@ static int _mapcache_cache_sqlite_get(mapcache_context *ctx, mapcache_tile *tile
     tile->encoded_data = mapcache_buffer_create(size, ctx->pool);
     memcpy(tile->encoded_data->buf, blob, size);
     tile->encoded_data->size = size;
-    if (sqlite3_column_count(stmt) > 1) {
+    if (sqlite3_column_count(stmt) > 1 && sqlite3_column_type(stmt, 1) != SQLITE_NULL) {
       time_t mtime = sqlite3_column_int64(stmt, 1);
       apr_time_ansi_put(&(tile->mtime), mtime);
     }
+    /*
+     * the md5 of the tile data. uniform mbtiles tiles are keyed by their color
+     * instead, and files written by older versions or other tools can have any
+     * other id: those are left for the data to be hashed
+     */
+    if (sqlite3_column_count(stmt) > 2 && sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+      const char *hash = (const char*) sqlite3_column_text(stmt, 2);
+      int i;
+      for (i = 0; i < 32 && apr_isxdigit(hash[i]); i++);
+      if (i == 32 && !hash[32]) {
+        tile->etag = apr_pstrcat(ctx->pool, "\"", hash, "\"", NULL);
+        tile->etag_data = tile->encoded_data;
+      }
+    }
     sqlite3_reset(stmt);
-    _sqlite_release_conn(ctx, tile, conn);
     return MAPCACHE_SUCCESS;
   }
 }
 
-static void _single_sqlitetile_set(mapcache_context *ctx, mapcache_tile *tile, struct sqlite_conn *conn)
+static int _mapcache_cache_sqlite_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  struct sqlite_conn *conn;
+  int ret;
+  conn = _sqlite_get_conn(ctx, cache, tile, 1);
+  if (GC_HAS_ERROR(ctx)) {
+    if(conn) _sqlite_release_conn(ctx, cache, tile, conn);
+    return MAPCACHE_FAILURE;
+  }
+  if (!conn) {
+    /* the tile's shard does not exist */
+    return MAPCACHE_CACHE_MISS;
+  }
+  ret = _single_sqlitetile_get(ctx, cache, tile, conn);
+  _sqlite_release_conn(ctx, cache, tile, conn);
+  return ret;
+}
+
+/**
+ * \brief get several tiles with a single connection and prepared statement
+ *
+ * the lookups are done inside a single read transaction, so the database lock
+ * is only taken once
+ */
+static void _sqlite_multi_get(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile **tiles, int ntiles)
+{
+  struct sqlite_conn *conn;
+  int i;
+  conn = _sqlite_get_conn(ctx, cache, tiles[0], 1);
+  if (GC_HAS_ERROR(ctx)) {
+    _sqlite_release_conn(ctx, cache, tiles[0], conn);
+    return;
+  }
+  if (!conn) {
+    /* the tiles' shard does not exist */
+    for (i = 0; i < ntiles; i++) {
+      tiles[i]->cache_miss = 1;
+    }
+    return;
+  }
+  sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
+  for (i = 0; i < ntiles; i++) {
+    if (_single_sqlitetile_get(ctx, cache, tiles[i], conn) == MAPCACHE_CACHE_MISS) {
+      tiles[i]->cache_miss = 1;
+    }
+    if(GC_HAS_ERROR(ctx)) break;
+  }
+  sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
+  _sqlite_release_conn(ctx, cache, tiles[0], conn);
+}
+
+static void _mapcache_cache_sqlite_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles)
+{
+  _sqlite_batch_by_dbfile(ctx, (mapcache_cache_sqlite*) pcache, tiles, ntiles, _sqlite_multi_get);
+}
+
+static void _single_sqlitetile_set(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile, struct sqlite_conn *conn)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
   sqlite3_stmt *stmt = conn->prepared_statements[SQLITE_SET_TILE_STMT_IDX];
   int ret;
 
@@ -668,29 +1084,29 @@ static void _single_sqlitetile_set(mapcache_context *ctx, mapcache_tile *tile, s
   sqlite3_reset(stmt);
 }
 
-static void _mapcache_cache_sqlite_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_sqlite_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 0);
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, cache, tile, 0);
   GC_CHECK_ERROR(ctx);
   sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
-  _single_sqlitetile_set(ctx,tile,conn);
+  _single_sqlitetile_set(ctx,cache,tile,conn);
   if (GC_HAS_ERROR(ctx)) {
     sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
   } else {
     sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
   }
-  _sqlite_release_conn(ctx, tile, conn);
+  _sqlite_release_conn(ctx, cache, tile, conn);
 }
 
-static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_tile *tiles, int ntiles)
+static void _sqlite_multi_set(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile **tiles, int ntiles)
 {
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, &tiles[0], 0);
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, cache, tiles[0], 0);
   int i;
   GC_CHECK_ERROR(ctx);
   sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
   for (i = 0; i < ntiles; i++) {
-    mapcache_tile *tile = &tiles[i];
-    _single_sqlitetile_set(ctx,tile,conn);
+    _single_sqlitetile_set(ctx,cache,tiles[i],conn);
     if(GC_HAS_ERROR(ctx)) break;
   }
   if (GC_HAS_ERROR(ctx)) {
@@ -698,54 +1114,50 @@ static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_til
   } else {
     sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
   }
-  _sqlite_release_conn(ctx, &tiles[0], conn);
+  _sqlite_release_conn(ctx, cache, tiles[0], conn);
 }
 
-static void _mapcache_cache_mbtiles_set(mapcache_context *ctx, mapcache_tile *tile)
+/*
+ * return pointers to the tiles of a tile_multi_set call
+ */
+static mapcache_tile** _sqlite_tile_pointers(mapcache_context *ctx, mapcache_tile *tiles, int ntiles)
 {
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 0);
-  GC_CHECK_ERROR(ctx);
-  if(!tile->raw_image) {
-    tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
-    if(GC_HAS_ERROR(ctx)) {
-      _sqlite_release_conn(ctx, tile, conn);
-      return;
-    }
+  mapcache_tile **ptiles = (mapcache_tile**) apr_pcalloc(ctx->pool, ntiles * sizeof(mapcache_tile*));
+  int i;
+  for (i = 0; i < ntiles; i++) {
+    ptiles[i] = &tiles[i];
   }
+  return ptiles;
+}
+
+static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  _sqlite_batch_by_dbfile(ctx, (mapcache_cache_sqlite*) pcache, _sqlite_tile_pointers(ctx, tiles, ntiles), ntiles, _sqlite_multi_set);
+}
+
+static void _mapcache_cache_mbtiles_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, cache, tile, 0);
+  GC_CHECK_ERROR(ctx);
   sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
-  _single_mbtile_set(ctx,tile,conn);
+  _single_mbtile_set(ctx,cache,tile,conn);
   if (GC_HAS_ERROR(ctx)) {
     sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
   } else {
     sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
   }
-  _sqlite_release_conn(ctx, tile, conn);
+  _sqlite_release_conn(ctx, cache, tile, conn);
 }
 
-static void _mapcache_cache_mbtiles_multi_set(mapcache_context *ctx, mapcache_tile *tiles, int ntiles)
+static void _mbtiles_multi_set(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile **tiles, int ntiles)
 {
-  struct sqlite_conn *conn = NULL;
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, cache, tiles[0], 0);
   int i;
-
-  /* decode/encode image data before going into the sqlite write lock */
-  for (i = 0; i < ntiles; i++) {
-    mapcache_tile *tile = &tiles[i];
-    if(!tile->raw_image) {
-      tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
-      GC_CHECK_ERROR(ctx);
-    }
-    /* only encode to image format if tile is not blank */
-    if (mapcache_image_blank_color(tile->raw_image) != MAPCACHE_TRUE && !tile->encoded_data) {
-      tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
-      GC_CHECK_ERROR(ctx);
-    }
-  }
-  conn = _sqlite_get_conn(ctx, &tiles[0], 0);
-
+  GC_CHECK_ERROR(ctx);
   sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
   for (i = 0; i < ntiles; i++) {
-    mapcache_tile *tile = &tiles[i];
-    _single_mbtile_set(ctx,tile,conn);
+    _single_mbtile_set(ctx,cache,tiles[i],conn);
     if(GC_HAS_ERROR(ctx)) break;
   }
   if (GC_HAS_ERROR(ctx)) {
@@ -753,7 +1165,26 @@ static void _mapcache_cache_mbtiles_multi_set(mapcache_context *ctx, mapcache_ti
   } else {
     sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
   }
-  _sqlite_release_conn(ctx, &tiles[0], conn);
+  _sqlite_release_conn(ctx, cache, tiles[0], conn);
+}
+
+static void _mapcache_cache_mbtiles_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) pcache;
+  int i;
+
+  /*
+   * encode image data before going into the sqlite write lock. blank tiles
+   * are detected on the raw image before that, and are encoded when bound
+   */
+  for (i = 0; i < ntiles; i++) {
+    mapcache_tile *tile = &tiles[i];
+    if (!tile->encoded_data && mapcache_image_blank_color(tile->raw_image) != MAPCACHE_TRUE) {
+      tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+      GC_CHECK_ERROR(ctx);
+    }
+  }
+  _sqlite_batch_by_dbfile(ctx, cache, _sqlite_tile_pointers(ctx, tiles, ntiles), ntiles, _mbtiles_multi_set);
 }
 
 static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *cache, mapcache_cfg *config)
@@ -791,6 +1222,59 @@ static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx
       cur_node = cur_node->next;
     }
   }
+  if (dcache->dbfile && strchr(dcache->dbfile, '{')) {
+    dcache->sharded = 1;
+  }
+  if ((cur_node = ezxml_child(node, "xcount")) != NULL) {
+    char *endptr;
+    dcache->count_x = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->count_x <= 0) {
+      ctx->set_error(ctx, 400, "failed to parse xcount \"%s\" for sqlite cache %s", cur_node->txt, cache->name);
+      return;
+    }
+  }
+  if ((cur_node = ezxml_child(node, "ycount")) != NULL) {
+    char *endptr;
+    dcache->count_y = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->count_y <= 0) {
+      ctx->set_error(ctx, 400, "failed to parse ycount \"%s\" for sqlite cache %s", cur_node->txt, cache->name);
+      return;
+    }
+  }
+  if ((cur_node = ezxml_child(node, "max_open_dbfiles")) != NULL) {
+    char *endptr;
+    dcache->max_open_dbfiles = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->max_open_dbfiles <= 0) {
+      ctx->set_error(ctx, 400, "failed to parse max_open_dbfiles \"%s\" for sqlite cache %s", cur_node->txt, cache->name);
+      return;
+    }
+  }
+  if ((cur_node = ezxml_child(node, "min_connections")) != NULL) {
+    char *endptr;
+    dcache->min_connections = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->min_connections < 0) {
+      ctx->set_error(ctx, 400, "failed to parse min_connections \"%s\" for sqlite cache %s", cur_node->txt, cache->name);
+      return;
+    }
+  }
+  if ((cur_node = ezxml_child(node, "wal")) != NULL) {
+    if (!strcasecmp(cur_node->txt, "false")) {
+      dcache->wal = 0;
+    } else if (!strcasecmp(cur_node->txt, "true")) {
+      dcache->wal = 1;
+    } else {
+      ctx->set_error(ctx, 400, "failed to parse wal \"%s\" for sqlite cache %s (expecting true or false)", cur_node->txt, cache->name);
+      return;
+    }
+  }
+  if ((cur_node = ezxml_child(node, "mmap_size")) != NULL) {
+    char *endptr;
+    dcache->mmap_size = apr_strtoi64(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->mmap_size < 0) {
+      ctx->set_error(ctx, 400, "failed to parse mmap_size \"%s\" for sqlite cache %s", cur_node->txt, cache->name);
+      return;
+    }
+  }
   if (!dcache->dbfile) {
     ctx->set_error(ctx, 500, "sqlite cache \"%s\" is missing <dbfile> entry", cache->name);
     return;
@@ -853,20 +1337,30 @@ mapcache_cache* mapcache_cache_sqlite_create(mapcache_context *ctx)
   cache->cache.tile_exists = _mapcache_cache_sqlite_has_tile;
   cache->cache.tile_set = _mapcache_cache_sqlite_set;
   cache->cache.tile_multi_set = _mapcache_cache_sqlite_multi_set;
+  cache->cache.tile_multi_get = _mapcache_cache_sqlite_multi_get;
   cache->cache.configuration_post_config = _mapcache_cache_sqlite_configuration_post_config;
   cache->cache.configuration_parse_xml = _mapcache_cache_sqlite_configuration_parse_xml;
   cache->create_stmt.sql = apr_pstrdup(ctx->pool,
-                                       "create table if not exists tiles(tileset text, grid text, x integer, y integer, z integer, data blob, dim text, ctime datetime, primary key(tileset,grid,x,y,z,dim))");
+                                       "create table if not exists tiles(tileset text, grid text, x integer, y integer, z integer, data blob, dim text, ctime datetime, hash text, primary key(tileset,grid,x,y,z,dim))");
+  cache->upgrade_stmt.sql = apr_pstrdup(ctx->pool,
+                                        "alter table tiles add column hash text");
   cache->exists_stmt.sql = apr_pstrdup(ctx->pool,
                                        "select 1 from tiles where x=:x and y=:y and z=:z and dim=:dim and tileset=:tileset and grid=:grid");
   cache->get_stmt.sql = apr_pstrdup(ctx->pool,
+                                    "select data,strftime(\"%s\",ctime),hash from tiles where tileset=:tileset and grid=:grid and x=:x and y=:y and z=:z and dim=:dim");
+  cache->legacy_get_stmt.sql = apr_pstrdup(ctx->pool,
                                     "select data,strftime(\"%s\",ctime) from tiles where tileset=:tileset and grid=:grid and x=:x and y=:y and z=:z and dim=:dim");
   cache->set_stmt.sql = apr_pstrdup(ctx->pool,
-                                    "insert or replace into tiles(tileset,grid,x,y,z,data,dim,ctime) values (:tileset,:grid,:x,:y,:z,:data,:dim,datetime('now'))");
+                                    "insert or replace into tiles(tileset,grid,x,y,z,data,dim,ctime,hash) values (:tileset,:grid,:x,:y,:z,:data,:dim,datetime('now'),:hash)");
   cache->delete_stmt.sql = apr_pstrdup(ctx->pool,
                                        "delete from tiles where x=:x and y=:y and z=:z and dim=:dim and tileset=:tileset and grid=:grid");
   cache->n_prepared_statements = 4;
   cache->bind_stmt = _bind_sqlite_params;
+  cache->wal = 1;
+  cache->count_x = cache->count_y = 256;
+  cache->max_open_dbfiles = 32;
+  /* don't exhaust the address space of 32 bit processes, which map the file once per connection */
+  cache->mmap_size = (sizeof(void*) >= 8) ? 256*1024*1024 : 0;
   return (mapcache_cache*) cache;
 }
 
@@ -891,8 +1385,18 @@ mapcache_cache* mapcache_cache_mbtiles_create(mapcache_context *ctx)
                                       );
   cache->exists_stmt.sql = apr_pstrdup(ctx->pool,
                                        "select 1 from tiles where tile_column=:x and tile_row=:y and zoom_level=:z");
+  /* the tile_id of deduplicated tiles is the md5 of their data */
   cache->get_stmt.sql = apr_pstrdup(ctx->pool,
+                                    "select tile_data,NULL,(select tile_id from map where tile_column=:x and tile_row=:y and zoom_level=:z) from tiles where tile_column=:x and tile_row=:y and zoom_level=:z");
+  cache->legacy_get_stmt.sql = apr_pstrdup(ctx->pool,
                                     "select tile_data from tiles where tile_column=:x and tile_row=:y and zoom_level=:z");
+  /*
+   * lets the check for other references to an image, done each time a tile is
+   * replaced or deleted, use an index instead of scanning the map. also run on
+   * existing files, and ignored if their map cannot be indexed (e.g. a view)
+   */
+  cache->upgrade_stmt.sql = apr_pstrdup(ctx->pool,
+                                        "create index if not exists map_tile_id on map(tile_id)");
   cache->delete_stmt.sql = apr_pstrdup(ctx->pool,
                                        "delete from tiles where tile_column=:x and tile_row=:y and zoom_level=:z");
   cache->n_prepared_statements = 9;
@@ -37,6 +37,15 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <tiffio.h>
+#include <apr_hash.h>
+#include <apr_portable.h>
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+#endif
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #ifdef USE_GEOTIFF
 #include "xtiffio.h"
@@ -61,9 +70,8 @@
  * \param r
  * \private \memberof mapcache_cache_tiff
  */
-static void _mapcache_cache_tiff_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_tiff_tile_key(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
   *path = dcache->filename_template;
 
   /*
@@ -131,9 +139,8 @@ static void _mapcache_cache_tiff_tile_key(mapcache_context *ctx, mapcache_tile *
 }
 
 #ifdef DEBUG
-static void check_tiff_format(mapcache_context *ctx, mapcache_tile *tile, TIFF *hTIFF, const char *filename)
+static void check_tiff_format(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile, TIFF *hTIFF, const char *filename)
 {
-  mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
   uint32 imwidth,imheight,tilewidth,tileheight;
   int16 planarconfig,orientation;
   uint16 compression;
@@ -212,109 +219,178 @@ static void check_tiff_format(mapcache_context *ctx, mapcache_tile *tile, TIFF *
 }
 #endif
 
-static int _mapcache_cache_tiff_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+/*
+ * index of the tile inside the list of tiles of its tiff file
+ */
+static int _mapcache_cache_tiff_tile_index(mapcache_cache_tiff *dcache, mapcache_tile *tile)
 {
-  char *filename;
-  TIFF *hTIFF;
-  mapcache_cache_tiff *dcache;
-  _mapcache_cache_tiff_tile_key(ctx, tile, &filename);
-  dcache = (mapcache_cache_tiff*)tile->tileset->cache;
-  if(GC_HAS_ERROR(ctx)) {
-    return MAPCACHE_FALSE;
-  }
-  hTIFF = MyTIFFOpen(filename,"r");
+  int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
+  /*
+   * compute the width and height of the full tiff file. This
+   * is not simply the tile size times the number of tiles per
+   * file for lower zoom levels
+   */
+  mapcache_grid_level *level = tile->grid_link->grid->levels[tile->z];
+  int ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
+  int ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
 
-  if(hTIFF) {
-    do {
-      uint32 nSubType = 0;
-      int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
-      int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
+  /* x offset of the tile along a row */
+  tiff_offx = tile->x % ntilesx;
 
-      mapcache_grid_level *level;
-      int ntilesx;
-      int ntilesy;
-      toff_t  *offsets=NULL, *sizes=NULL;
+  /*
+   * y offset of the requested row. we inverse it as the rows are ordered
+   * from top to bottom, whereas the tile y is bottom to top
+   */
+  tiff_offy = ntilesy - (tile->y % ntilesy) -1;
+  return tiff_offy * ntilesx + tiff_offx;
+}
 
-      if( !TIFFGetField(hTIFF, TIFFTAG_SUBFILETYPE, &nSubType) )
-        nSubType = 0;
+/*
+ * opened tiff files are kept in a per-process lru, so that reading a tile
+ * does not require opening the file and parsing its directory each time.
+ * a container holds the tile offsets and sizes, the jpeg tables and an open
+ * file, and is dropped as soon as the modification time or the size of the
+ * file change.
+ */
+typedef struct _tiff_container _tiff_container;
+typedef struct _tiff_container_lru _tiff_container_lru;
 
-      /* skip overviews and masks */
-      if( (nSubType & FILETYPE_REDUCEDIMAGE) ||
-          (nSubType & FILETYPE_MASK) )
-        continue;
+struct _tiff_container {
+  apr_pool_t *pool;          /* holds the container, destroying it closes the file */
+  _tiff_container_lru *lru;  /* NULL if the container is not shared */
+  char *filename;
+  apr_time_t mtime;
+  apr_off_t size;
+  apr_file_t *f;
+  uint32 ntiles;
+  toff_t *offsets;
+  toff_t *sizes;
+  unsigned char *jpegtable;
+  uint32 jpegtable_size;
+  int refcount;
+  int evicted;               /* destroy once no longer referenced */
+  _tiff_container *prev, *next;
+};
+
+struct _tiff_container_lru {
+  apr_pool_t *pool;
+#if APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+  apr_hash_t *containers;
+  _tiff_container *head, *tail; /* most recently used first */
+  int count;
+};
 
+static void _tiff_lru_lock(_tiff_container_lru *lru)
+{
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(lru->mutex);
+#endif
+}
 
-#ifdef DEBUG
-      check_tiff_format(ctx,tile,hTIFF,filename);
-      if(GC_HAS_ERROR(ctx)) {
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FALSE;
-      }
+static void _tiff_lru_unlock(_tiff_container_lru *lru)
+{
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(lru->mutex);
 #endif
-      level = tile->grid_link->grid->levels[tile->z];
-      ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
-      ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
-
-      /* x offset of the tile along a row */
-      tiff_offx = tile->x % ntilesx;
-
-      /*
-       * y offset of the requested row. we inverse it as the rows are ordered
-       * from top to bottom, whereas the tile y is bottom to top
-       */
-      tiff_offy = ntilesy - (tile->y % ntilesy) -1;
-      tiff_off = tiff_offy * ntilesx + tiff_offx;
-
-      if(1 != TIFFGetField( hTIFF, TIFFTAG_TILEOFFSETS, &offsets )) {
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FALSE;
-      }
-      if(1 != TIFFGetField( hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes )) {
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FALSE;
-      }
-      MyTIFFClose(hTIFF);
-      if( offsets[tiff_off] > 0 && sizes[tiff_off] > 0 ) {
-        return MAPCACHE_TRUE;
-      } else {
-        return MAPCACHE_FALSE;
-      }
-    } while( TIFFReadDirectory( hTIFF ) );
-    return MAPCACHE_FALSE; /* TIFF only contains overviews ? */
-  } else
-    return MAPCACHE_FALSE;
 }
 
-static void _mapcache_cache_tiff_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _tiff_lru_unlink(_tiff_container_lru *lru, _tiff_container *c)
 {
-  ctx->set_error(ctx,500,"TIFF cache tile deleting not implemented");
+  if(c->prev) c->prev->next = c->next;
+  else lru->head = c->next;
+  if(c->next) c->next->prev = c->prev;
+  else lru->tail = c->prev;
+  c->prev = c->next = NULL;
 }
 
+static void _tiff_lru_push(_tiff_container_lru *lru, _tiff_container *c)
+{
+  c->prev = NULL;
+  c->next = lru->head;
+  if(lru->head) lru->head->prev = c;
+  else lru->tail = c;
+  lru->head = c;
+}
 
-/**
- * \brief get file content of given tile
- *
- * fills the mapcache_tile::data of the given tile with content stored in the file
- * \private \memberof mapcache_cache_tiff
- * \sa mapcache_cache::tile_get()
- */
-static int _mapcache_cache_tiff_get(mapcache_context *ctx, mapcache_tile *tile)
+/* drop a container from the lru. must be called with the lru locked */
+static void _tiff_lru_remove(_tiff_container_lru *lru, _tiff_container *c)
 {
-  char *filename;
-  TIFF *hTIFF = NULL;
-  int rv;
-  mapcache_cache_tiff *dcache;
-  _mapcache_cache_tiff_tile_key(ctx, tile, &filename);
-  dcache = (mapcache_cache_tiff*)tile->tileset->cache;
-  if(GC_HAS_ERROR(ctx)) {
-    return MAPCACHE_FALSE;
+  _tiff_lru_unlink(lru,c);
+  apr_hash_set(lru->containers,c->filename,APR_HASH_KEY_STRING,NULL);
+  lru->count--;
+  c->evicted = 1;
+  if(!c->refcount) {
+    apr_pool_destroy(c->pool);
   }
-#ifdef DEBUG
-  ctx->log(ctx,MAPCACHE_DEBUG,"tile (%d,%d,%d) => filename %s)",
-           tile->x,tile->y,tile->z,filename);
+}
+
+static apr_status_t _tiff_lru_destroy(void *data)
+{
+  mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)data;
+  _tiff_container_lru *lru = (_tiff_container_lru*)dcache->open_files;
+  dcache->open_files = NULL;
+  if(lru) {
+    while(lru->head) {
+      _tiff_container *c = lru->head;
+      lru->head = c->next;
+      apr_pool_destroy(c->pool);
+    }
+    apr_pool_destroy(lru->pool);
+  }
+  return APR_SUCCESS;
+}
+
+/*
+ * return the lru of the cache, creating it on first use.
+ * returns NULL if containers are not to be kept opened
+ */
+static _tiff_container_lru* _tiff_lru_get(mapcache_context *ctx, mapcache_cache_tiff *dcache)
+{
+  if(dcache->open_files || dcache->max_open_files <= 0) return (_tiff_container_lru*)dcache->open_files;
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+  if(!dcache->open_files && dcache->max_open_files > 0) {
+    apr_pool_t *pool;
+    if(apr_pool_create(&pool,NULL) == APR_SUCCESS) {
+      _tiff_container_lru *lru = (_tiff_container_lru*)apr_pcalloc(pool,sizeof(_tiff_container_lru));
+      lru->pool = pool;
+      lru->containers = apr_hash_make(pool);
+#if APR_HAS_THREADS
+      if(apr_thread_mutex_create(&lru->mutex,APR_THREAD_MUTEX_DEFAULT,pool) != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        lru = NULL;
+      }
 #endif
+      if(lru) {
+        dcache->open_files = lru;
+        apr_pool_cleanup_register(ctx->process_pool,dcache,_tiff_lru_destroy,apr_pool_cleanup_null);
+      }
+    }
+    if(!dcache->open_files) {
+      ctx->log(ctx,MAPCACHE_WARN,"tiff cache %s: failed to create the list of opened files, disabling it",
+               dcache->cache.name);
+      dcache->max_open_files = 0;
+    }
+  }
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+  return (_tiff_container_lru*)dcache->open_files;
+}
 
-  hTIFF = MyTIFFOpen(filename,"r");
+/*
+ * open a tiff file and read the tables needed to extract its tiles
+ */
+static int _tiff_container_load(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile,
+                                const char *filename, _tiff_container **container)
+{
+  apr_pool_t *pool;
+  apr_finfo_t finfo;
+  apr_status_t rv;
+  _tiff_container *c;
+  int ret = MAPCACHE_CACHE_MISS;
+  TIFF *hTIFF = MyTIFFOpen(filename,"r");
 
   /*
    * we currrently have no way of knowing if the opening failed because the tif
@@ -325,219 +401,350 @@ static int _mapcache_cache_tiff_get(mapcache_context *ctx, mapcache_tile *tile)
    * we ignore this case here and hope that further parts of the code will be
    * able to detect what's happening more precisely
    */
+  if(!hTIFF) {
+    return MAPCACHE_CACHE_MISS;
+  }
+  if(apr_pool_create(&pool,NULL) != APR_SUCCESS) {
+    MyTIFFClose(hTIFF);
+    ctx->set_error(ctx,500,"failed to allocate tiff container");
+    return MAPCACHE_FAILURE;
+  }
+  c = (_tiff_container*)apr_pcalloc(pool,sizeof(_tiff_container));
+  c->pool = pool;
+  c->filename = apr_pstrdup(pool,filename);
 
-  if(hTIFF) {
-    do {
-      uint32 nSubType = 0;
-      int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
-      int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
-
-      mapcache_grid_level *level;
-      int ntilesx;
-      int ntilesy;
-      toff_t  *offsets=NULL, *sizes=NULL;
-
-      if( !TIFFGetField(hTIFF, TIFFTAG_SUBFILETYPE, &nSubType) )
-        nSubType = 0;
+  do {
+    uint32 nSubType = 0;
+    toff_t *offsets=NULL, *sizes=NULL;
+    uint32 jpegtable_size = 0;
+    unsigned char* jpegtable_ptr = NULL;
 
-      /* skip overviews */
-      if( nSubType & FILETYPE_REDUCEDIMAGE )
-        continue;
+    if( !TIFFGetField(hTIFF, TIFFTAG_SUBFILETYPE, &nSubType) )
+      nSubType = 0;
 
+    /* skip overviews and masks */
+    if( (nSubType & FILETYPE_REDUCEDIMAGE) ||
+        (nSubType & FILETYPE_MASK) )
+      continue;
 
 #ifdef DEBUG
-      check_tiff_format(ctx,tile,hTIFF,filename);
-      if(GC_HAS_ERROR(ctx)) {
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FAILURE;
-      }
+    check_tiff_format(ctx,dcache,tile,hTIFF,filename);
+    if(GC_HAS_ERROR(ctx)) {
+      ret = MAPCACHE_FAILURE;
+      break;
+    }
 #endif
-      /*
-       * compute the width and height of the full tiff file. This
-       * is not simply the tile size times the number of tiles per
-       * file for lower zoom levels
-       */
-      level = tile->grid_link->grid->levels[tile->z];
-      ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
-      ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
-
-      /* x offset of the tile along a row */
-      tiff_offx = tile->x % ntilesx;
-
-      /*
-       * y offset of the requested row. we inverse it as the rows are ordered
-       * from top to bottom, whereas the tile y is bottom to top
-       */
-      tiff_offy = ntilesy - (tile->y % ntilesy) -1;
-      tiff_off = tiff_offy * ntilesx + tiff_offx;
-
-      /* get the offset of the jpeg data from the start of the file for each tile */
-      rv = TIFFGetField( hTIFF, TIFFTAG_TILEOFFSETS, &offsets );
-      if( rv != 1 ) {
-        ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile offsets",
-                       filename);
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FAILURE;
-      }
 
-      /* get the size of the jpeg data for each tile */
-      rv = TIFFGetField( hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes );
-      if( rv != 1 ) {
-        ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile sizes",
-                       filename);
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FAILURE;
-      }
+    /* get the offset of the jpeg data from the start of the file for each tile */
+    if(1 != TIFFGetField( hTIFF, TIFFTAG_TILEOFFSETS, &offsets )) {
+      ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile offsets",
+                     filename);
+      ret = MAPCACHE_FAILURE;
+      break;
+    }
 
-      /*
-       * the tile data exists for the given tiff_off if both offsets and size
-       * are not zero for that index.
-       * if not, the tiff file is sparse and is missing the requested tile
-       */
-      if( offsets[tiff_off] > 0 && sizes[tiff_off] > 0 ) {
-        apr_file_t *f;
-        apr_finfo_t finfo;
-        apr_status_t ret;
-
-        /* read the jpeg header (common to all tiles) */
-        uint32 jpegtable_size = 0;
-        unsigned char* jpegtable_ptr;
-        rv = TIFFGetField( hTIFF, TIFFTAG_JPEGTABLES, &jpegtable_size, &jpegtable_ptr );
-        if( rv != 1 || !jpegtable_ptr || !jpegtable_size) {
-          /* there is no common jpeg header in the tiff tags */
-          ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" jpeg table",
-                         filename);
-          MyTIFFClose(hTIFF);
-          return MAPCACHE_FAILURE;
-        }
-
-        /*
-         * open the tiff file directly to access the jpeg image data with the given
-         * offset
-         */
-        if((ret=apr_file_open(&f, filename,
-                              APR_FOPEN_READ|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,APR_OS_DEFAULT,
-                              ctx->pool)) == APR_SUCCESS) {
-          char *bufptr;
-          apr_off_t off;
-          apr_size_t bytes;
-          ret = apr_file_info_get(&finfo, APR_FINFO_MTIME, f);
-          if(ret == APR_SUCCESS) {
-            /*
-             * extract the file modification time. this isn't guaranteed to be the
-             * modification time of the actual tile, but it's the best we can do
-             */
-            tile->mtime = finfo.mtime;
-          }
-
-          /* create a memory buffer to contain the jpeg data */
-          tile->encoded_data = mapcache_buffer_create((jpegtable_size+sizes[tiff_off]-4),ctx->pool);
-
-          /*
-           * copy the jpeg header to the beginning of the memory buffer,
-           * omitting the last 2 bytes
-           */
-          memcpy(tile->encoded_data->buf,jpegtable_ptr,(jpegtable_size-2));
-
-          /* advance the data pointer to after the header data */
-          bufptr = tile->encoded_data->buf + (jpegtable_size-2);
-
-
-          /* go to the specified offset in the tiff file, plus 2 bytes */
-          off = offsets[tiff_off]+2;
-          apr_file_seek(f,APR_SET,&off);
-
-          /*
-           * copy the jpeg body at the end of the memory buffer, accounting
-           * for the two bytes we omitted in the previous step
-           */
-          bytes = sizes[tiff_off]-2;
-          apr_file_read(f,bufptr,&bytes);
-
-          /* check we have correctly read the requested number of bytes */
-          if(bytes !=  sizes[tiff_off]-2) {
-            ctx->set_error(ctx,500,"failed to read jpeg body in \"%s\".\
-                        (read %d of %d bytes)", filename,bytes,sizes[tiff_off]-2);
-            MyTIFFClose(hTIFF);
-            return MAPCACHE_FAILURE;
-          }
-
-          tile->encoded_data->size = (jpegtable_size+sizes[tiff_off]-4);
-
-          /* finalize and cleanup */
-          apr_file_close(f);
-          MyTIFFClose(hTIFF);
-          return MAPCACHE_SUCCESS;
-        } else {
-          /* shouldn't usually happen. we managed to open the file with TIFFOpen,
-           * but apr_file_open failed to do so.
-           * nothing much to do except bail out.
-           */
-          ctx->set_error(ctx,500,"apr_file_open failed on already open tiff file \"%s\", giving up .... ",
-                         filename);
-          MyTIFFClose(hTIFF);
-          return MAPCACHE_FAILURE;
-        }
-      } else {
-        /* sparse tiff file without the requested tile */
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_CACHE_MISS;
-      }
-    } /* loop through the tiff directories if there are multiple ones */
-    while( TIFFReadDirectory( hTIFF ) );
+    /* get the size of the jpeg data for each tile */
+    if(1 != TIFFGetField( hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes )) {
+      ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile sizes",
+                     filename);
+      ret = MAPCACHE_FAILURE;
+      break;
+    }
+    c->ntiles = TIFFNumberOfTiles(hTIFF);
+    c->offsets = (toff_t*)apr_pmemdup(pool,offsets,c->ntiles*sizeof(toff_t));
+    c->sizes = (toff_t*)apr_pmemdup(pool,sizes,c->ntiles*sizeof(toff_t));
+
+    /* the jpeg header common to all tiles, only required when reading a tile */
+    if(1 == TIFFGetField( hTIFF, TIFFTAG_JPEGTABLES, &jpegtable_size, &jpegtable_ptr ) &&
+        jpegtable_ptr && jpegtable_size) {
+      c->jpegtable = (unsigned char*)apr_pmemdup(pool,jpegtable_ptr,jpegtable_size);
+      c->jpegtable_size = jpegtable_size;
+    }
+    ret = MAPCACHE_SUCCESS;
+    break;
+  } /* loop through the tiff directories if there are multiple ones */
+  while( TIFFReadDirectory( hTIFF ) );
+  MyTIFFClose(hTIFF);
 
+  if(ret == MAPCACHE_SUCCESS) {
     /*
-     * should not happen?
-     * finished looping through directories and didn't find anything suitable.
-     * does the file only contain overviews?
+     * open the tiff file directly to access the jpeg image data with the given
+     * offset
      */
-    MyTIFFClose(hTIFF);
-    return MAPCACHE_CACHE_MISS;
+    if((rv = apr_file_open(&c->f, filename, APR_FOPEN_READ|APR_FOPEN_BINARY, APR_OS_DEFAULT, pool)) != APR_SUCCESS ||
+        (rv = apr_file_info_get(&finfo, APR_FINFO_MTIME|APR_FINFO_SIZE, c->f)) != APR_SUCCESS) {
+      char errmsg[120];
+      ctx->set_error(ctx,500,"failed to open already parsed tiff file \"%s\": %s",
+                     filename, apr_strerror(rv,errmsg,120));
+      ret = MAPCACHE_FAILURE;
+    } else {
+      c->mtime = finfo.mtime;
+      c->size = finfo.size;
+    }
+  }
+  if(ret != MAPCACHE_SUCCESS) {
+    /* failure, or the file only contains overviews */
+    apr_pool_destroy(pool);
+    return ret;
+  }
+  *container = c;
+  return MAPCACHE_SUCCESS;
+}
+
+/*
+ * return the opened container of a tiff file, from the lru if it is still
+ * up to date. the container must be released once done with.
+ */
+static int _tiff_container_acquire(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile,
+                                   const char *filename, _tiff_container **container)
+{
+  _tiff_container_lru *lru = _tiff_lru_get(ctx,dcache);
+  _tiff_container *c, *loaded;
+  apr_finfo_t finfo;
+  int ret;
+
+  if(lru) {
+    if(apr_stat(&finfo,filename,APR_FINFO_MTIME|APR_FINFO_SIZE,ctx->pool) != APR_SUCCESS) {
+      return MAPCACHE_CACHE_MISS;
+    }
+    _tiff_lru_lock(lru);
+    c = (_tiff_container*)apr_hash_get(lru->containers,filename,APR_HASH_KEY_STRING);
+    if(c && (c->mtime != finfo.mtime || c->size != finfo.size)) {
+      /* the file has been modified since it was opened */
+      _tiff_lru_remove(lru,c);
+      c = NULL;
+    }
+    if(c) {
+      _tiff_lru_unlink(lru,c);
+      _tiff_lru_push(lru,c);
+      c->refcount++;
+    }
+    _tiff_lru_unlock(lru);
+    if(c) {
+      *container = c;
+      return MAPCACHE_SUCCESS;
+    }
+  }
+
+  ret = _tiff_container_load(ctx,dcache,tile,filename,&loaded);
+  if(ret != MAPCACHE_SUCCESS) {
+    return ret;
+  }
+  if(!lru) {
+    loaded->refcount = 1;
+    loaded->evicted = 1;
+    *container = loaded;
+    return MAPCACHE_SUCCESS;
+  }
+
+  _tiff_lru_lock(lru);
+  c = (_tiff_container*)apr_hash_get(lru->containers,filename,APR_HASH_KEY_STRING);
+  if(c && c->mtime == loaded->mtime && c->size == loaded->size) {
+    /* another thread opened the same file in the meantime */
+    apr_pool_destroy(loaded->pool);
+    _tiff_lru_unlink(lru,c);
+  } else {
+    if(c) {
+      _tiff_lru_remove(lru,c);
+    }
+    c = loaded;
+    c->lru = lru;
+    apr_hash_set(lru->containers,c->filename,APR_HASH_KEY_STRING,c);
+    lru->count++;
+    while(lru->count > dcache->max_open_files) {
+      _tiff_lru_remove(lru,lru->tail);
+    }
+  }
+  _tiff_lru_push(lru,c);
+  c->refcount++;
+  _tiff_lru_unlock(lru);
+  *container = c;
+  return MAPCACHE_SUCCESS;
+}
+
+static void _tiff_container_release(_tiff_container *c)
+{
+  _tiff_container_lru *lru = c->lru;
+  if(lru) _tiff_lru_lock(lru);
+  if(!--c->refcount && c->evicted) {
+    apr_pool_destroy(c->pool);
+  }
+  if(lru) _tiff_lru_unlock(lru);
+}
+
+/*
+ * read len bytes at the given offset of the container's file. the file is
+ * shared between threads, so its file pointer is left untouched
+ */
+static apr_status_t _tiff_container_read(_tiff_container *c, apr_pool_t *pool, apr_off_t offset, char *buf, apr_size_t len)
+{
+#ifndef _WIN32
+  apr_os_file_t fd;
+  apr_size_t done = 0;
+  apr_os_file_get(&fd, c->f);
+  while(done < len) {
+    ssize_t n = pread(fd, buf + done, len - done, offset + done);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return APR_FROM_OS_ERROR(errno);
+    }
+    if(n == 0) return APR_EOF;
+    done += n;
   }
-  /* failed to open tiff file */
-  return MAPCACHE_CACHE_MISS;
+  return APR_SUCCESS;
+#else
+  apr_file_t *f;
+  apr_status_t rv = apr_file_open(&f, c->filename, APR_FOPEN_READ|APR_FOPEN_BINARY, APR_OS_DEFAULT, pool);
+  if(rv != APR_SUCCESS) return rv;
+  if((rv = apr_file_seek(f, APR_SET, &offset)) == APR_SUCCESS) {
+    rv = apr_file_read_full(f, buf, len, NULL);
+  }
+  apr_file_close(f);
+  return rv;
+#endif
 }
 
+static int _mapcache_cache_tiff_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  char *filename;
+  _tiff_container *c;
+  int tiff_off;
+  int ret;
+  mapcache_cache_tiff *dcache;
+  dcache = (mapcache_cache_tiff*)pcache;
+  _mapcache_cache_tiff_tile_key(ctx, dcache, tile, &filename);
+  if(GC_HAS_ERROR(ctx)) {
+    return MAPCACHE_FALSE;
+  }
+  ret = _tiff_container_acquire(ctx, dcache, tile, filename, &c);
+  if(ret != MAPCACHE_SUCCESS) {
+    if(ret == MAPCACHE_FAILURE) {
+      ctx->clear_errors(ctx);
+    }
+    return MAPCACHE_FALSE;
+  }
+  tiff_off = _mapcache_cache_tiff_tile_index(dcache, tile);
+  ret = (tiff_off < c->ntiles && c->offsets[tiff_off] > 0 && c->sizes[tiff_off] > 0) ? MAPCACHE_TRUE : MAPCACHE_FALSE;
+  _tiff_container_release(c);
+  return ret;
+}
+
+static void _mapcache_cache_tiff_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  ctx->set_error(ctx,500,"TIFF cache tile deleting not implemented");
+}
+
+
 /**
- * \brief write tile data to tiff
+ * \brief get file content of given tile
  *
- * writes the content of mapcache_tile::data to tiff.
- * \returns MAPCACHE_FAILURE if there is no data to write, or if the tile isn't locked
- * \returns MAPCACHE_SUCCESS if the tile has been successfully written to tiff
+ * fills the mapcache_tile::data of the given tile with content stored in the file
  * \private \memberof mapcache_cache_tiff
- * \sa mapcache_cache::tile_set()
+ * \sa mapcache_cache::tile_get()
  */
-static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_tiff_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-#ifdef USE_TIFF_WRITE
   char *filename;
+  _tiff_container *c;
+  int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
+  int ret;
+  apr_status_t rv;
+  apr_size_t size;
+  mapcache_cache_tiff *dcache;
+  dcache = (mapcache_cache_tiff*)pcache;
+  _mapcache_cache_tiff_tile_key(ctx, dcache, tile, &filename);
+  if(GC_HAS_ERROR(ctx)) {
+    return MAPCACHE_FALSE;
+  }
+#ifdef DEBUG
+  ctx->log(ctx,MAPCACHE_DEBUG,"tile (%d,%d,%d) => filename %s)",
+           tile->x,tile->y,tile->z,filename);
+#endif
+
+  ret = _tiff_container_acquire(ctx, dcache, tile, filename, &c);
+  if(ret != MAPCACHE_SUCCESS) {
+    return ret;
+  }
+  tiff_off = _mapcache_cache_tiff_tile_index(dcache, tile);
+
+  /*
+   * the tile data exists for the given tiff_off if both offsets and size
+   * are not zero for that index.
+   * if not, the tiff file is sparse and is missing the requested tile
+   */
+  if(tiff_off >= c->ntiles || !c->offsets[tiff_off] || !c->sizes[tiff_off]) {
+    _tiff_container_release(c);
+    return MAPCACHE_CACHE_MISS;
+  }
+  if(!c->jpegtable) {
+    /* there is no common jpeg header in the tiff tags */
+    ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" jpeg table",
+                   filename);
+    _tiff_container_release(c);
+    return MAPCACHE_FAILURE;
+  }
+
+  /* create a memory buffer to contain the jpeg data */
+  size = c->sizes[tiff_off];
+  tile->encoded_data = mapcache_buffer_create((c->jpegtable_size+size-4),ctx->pool);
+
+  /*
+   * copy the jpeg header to the beginning of the memory buffer,
+   * omitting the last 2 bytes
+   */
+  memcpy(tile->encoded_data->buf,c->jpegtable,(c->jpegtable_size-2));
+
+  /*
+   * copy the jpeg body found at the specified offset in the tiff file plus 2
+   * bytes, at the end of the memory buffer, accounting for the two bytes we
+   * omitted in the previous step
+   */
+  rv = _tiff_container_read(c, ctx->pool, c->offsets[tiff_off]+2,
+                            (char*)tile->encoded_data->buf + (c->jpegtable_size-2), size-2);
+  if(rv != APR_SUCCESS) {
+    char errmsg[120];
+    ctx->set_error(ctx,500,"failed to read jpeg body in \"%s\": %s", filename, apr_strerror(rv,errmsg,120));
+    _tiff_container_release(c);
+    return MAPCACHE_FAILURE;
+  }
+  tile->encoded_data->size = (c->jpegtable_size+size-4);
+
+  /*
+   * the file modification time. this isn't guaranteed to be the
+   * modification time of the actual tile, but it's the best we can do
+   */
+  tile->mtime = c->mtime;
+  _tiff_container_release(c);
+  return MAPCACHE_SUCCESS;
+}
+
+#ifdef USE_TIFF_WRITE
+/*
+ * write tiles that all belong to the given tiff file, in a single
+ * open/write/directory rewrite cycle
+ */
+static void _mapcache_cache_tiff_write(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile **tiles, int ntiles, char *filename)
+{
   TIFF *hTIFF = NULL;
   int rv;
   int create;
   char errmsg[120];
-  mapcache_cache_tiff *dcache;
   mapcache_image_format_jpeg *format;
+  mapcache_tile *tile = tiles[0];
   char *hackptr1,*hackptr2;
   int tilew;
   int tileh;
   unsigned char *rgb;
-  int r,c;
+  int i,r,c;
   apr_finfo_t finfo;
   mapcache_grid_level *level;
   int ntilesx;
   int ntilesy;
-  int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
-  int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
 
-  _mapcache_cache_tiff_tile_key(ctx, tile, &filename);
-  dcache = (mapcache_cache_tiff*)tile->tileset->cache;
   format = (mapcache_image_format_jpeg*) dcache->format;
-  if(GC_HAS_ERROR(ctx)) {
-    return;
-  }
 #ifdef DEBUG
-  ctx->log(ctx,MAPCACHE_DEBUG,"tile write (%d,%d,%d) => filename %s)",
-           tile->x,tile->y,tile->z,filename);
+  ctx->log(ctx,MAPCACHE_DEBUG,"%d tile write (%d,%d,%d) => filename %s)",
+           ntiles,tile->x,tile->y,tile->z,filename);
 #endif
 
   /*
@@ -568,22 +775,33 @@ static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
   tilew = tile->grid_link->grid->tile_sx;
   tileh = tile->grid_link->grid->tile_sy;
 
-  if(!tile->raw_image) {
-    tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
-    GC_CHECK_ERROR(ctx);
+  /*
+   * remap xrgb to rgb for all the tiles before locking the file, so as to
+   * hold the lock as little as possible
+   */
+  rgb = (unsigned char*)malloc(ntiles*tilew*tileh*3);
+  if(!rgb) {
+    ctx->set_error(ctx,500,"failed to allocate rgb buffer for %d tiles",ntiles);
+    return;
   }
-
-  /* remap xrgb to rgb */
-  rgb = (unsigned char*)malloc(tilew*tileh*3);
-  for(r=0; r<tile->raw_image->h; r++) {
-    unsigned char *imptr = tile->raw_image->data + r * tile->raw_image->stride;
-    unsigned char *rgbptr = rgb + r * tilew * 3;
-    for(c=0; c<tile->raw_image->w; c++) {
-      rgbptr[0] = imptr[2];
-      rgbptr[1] = imptr[1];
-      rgbptr[2] = imptr[0];
-      rgbptr += 3;
-      imptr += 4;
+  for(i=0; i<ntiles; i++) {
+    if(!tiles[i]->raw_image) {
+      tiles[i]->raw_image = mapcache_imageio_decode(ctx, tiles[i]->encoded_data);
+      if(GC_HAS_ERROR(ctx)) {
+        free(rgb);
+        return;
+      }
+    }
+    for(r=0; r<tiles[i]->raw_image->h; r++) {
+      unsigned char *imptr = tiles[i]->raw_image->data + r * tiles[i]->raw_image->stride;
+      unsigned char *rgbptr = rgb + (i * tileh + r) * tilew * 3;
+      for(c=0; c<tiles[i]->raw_image->w; c++) {
+        rgbptr[0] = imptr[2];
+        rgbptr[1] = imptr[1];
+        rgbptr[2] = imptr[0];
+        rgbptr += 3;
+        imptr += 4;
+      }
     }
   }
 
@@ -702,22 +920,13 @@ static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
   }
   TIFFSetField( hTIFF, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
 
-  /* x offset of the tile along a row */
-  tiff_offx = tile->x % ntilesx;
-
-  /*
-   * y offset of the requested row. we inverse it as the rows are ordered
-   * from top to bottom, whereas the tile y is bottom to top
-   */
-  tiff_offy = ntilesy - (tile->y % ntilesy) -1;
-  tiff_off = tiff_offy * ntilesx + tiff_offx;
-
-
-  rv = TIFFWriteEncodedTile(hTIFF, tiff_off, rgb, tilew*tileh*3);
-  free(rgb);
-  if(!rv) {
-    ctx->set_error(ctx,500,"failed TIFFWriteEncodedTile to %s",filename);
-    goto close_tiff;
+  for(i=0; i<ntiles; i++) {
+    rv = TIFFWriteEncodedTile(hTIFF, _mapcache_cache_tiff_tile_index(dcache,tiles[i]),
+                              rgb + i * tilew * tileh * 3, tilew*tileh*3);
+    if(!rv) {
+      ctx->set_error(ctx,500,"failed TIFFWriteEncodedTile to %s",filename);
+      goto close_tiff;
+    }
   }
   rv = TIFFWriteCheck( hTIFF, 1, "cache_set()");
   if(!rv) {
@@ -734,15 +943,139 @@ static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
   }
 
 close_tiff:
+  free(rgb);
   if(hTIFF)
     MyTIFFClose(hTIFF);
   mapcache_unlock_resource(ctx,filename);
+}
+
+#if APR_HAS_THREADS
+typedef struct {
+  mapcache_context *ctx;
+  mapcache_cache_tiff *dcache;
+  mapcache_tile **tiles;
+  int ntiles;
+  char *filename;
+} _tiff_write_job;
+
+static void* APR_THREAD_FUNC _tiff_write_thread(apr_thread_t *thread, void *data)
+{
+  _tiff_write_job *job = (_tiff_write_job*)data;
+  _mapcache_cache_tiff_write(job->ctx, job->dcache, job->tiles, job->ntiles, job->filename);
+  apr_thread_exit(thread, APR_SUCCESS);
+  return NULL;
+}
+#endif
+#endif
+
+/**
+ * \brief write tile data to tiff
+ *
+ * writes the content of mapcache_tile::data to tiff.
+ * \returns MAPCACHE_FAILURE if there is no data to write, or if the tile isn't locked
+ * \returns MAPCACHE_SUCCESS if the tile has been successfully written to tiff
+ * \private \memberof mapcache_cache_tiff
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+#ifdef USE_TIFF_WRITE
+  char *filename;
+  mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)pcache;
+  _mapcache_cache_tiff_tile_key(ctx, dcache, tile, &filename);
+  GC_CHECK_ERROR(ctx);
+  _mapcache_cache_tiff_write(ctx, dcache, &tile, 1, filename);
 #else
   ctx->set_error(ctx,500,"tiff write support disabled by default");
 #endif
 
 }
 
+/**
+ * \brief write the tiles of a metatile
+ *
+ * the tiles are grouped by tiff file, each file being written to once. when
+ * the tiles span several files, these are written to in parallel.
+ * \private \memberof mapcache_cache_tiff
+ * \sa mapcache_cache::tile_multi_set()
+ */
+static void _mapcache_cache_tiff_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+#ifdef USE_TIFF_WRITE
+  mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)pcache;
+  char **filenames = (char**)apr_pcalloc(ctx->pool, ntiles*sizeof(char*));
+  mapcache_tile **grouped = (mapcache_tile**)apr_pcalloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+  int *group_start = (int*)apr_pcalloc(ctx->pool, (ntiles+1)*sizeof(int));
+  int ngroups = 0, ngrouped = 0;
+  int i,j;
+#if APR_HAS_THREADS
+  _tiff_write_job *jobs;
+  apr_thread_t **threads;
+  apr_status_t rv;
+#endif
+
+  for(i=0; i<ntiles; i++) {
+    _mapcache_cache_tiff_tile_key(ctx, dcache, &tiles[i], &filenames[i]);
+    GC_CHECK_ERROR(ctx);
+  }
+  /* group the tiles by file, the first tile of a group giving its filename */
+  for(i=0; i<ntiles; i++) {
+    if(!filenames[i]) continue;
+    group_start[ngroups++] = ngrouped;
+    grouped[ngrouped++] = &tiles[i];
+    for(j=i+1; j<ntiles; j++) {
+      if(filenames[j] && !strcmp(filenames[i],filenames[j])) {
+        grouped[ngrouped++] = &tiles[j];
+        filenames[j] = NULL;
+      }
+    }
+  }
+  group_start[ngroups] = ngrouped;
+  for(i=0, j=0; i<ntiles; i++) {
+    if(filenames[i]) filenames[j++] = filenames[i];
+  }
+
+#if APR_HAS_THREADS
+  if(ngroups > 1) {
+    /* the first file is written by this thread, the other ones by threads of their own */
+    jobs = (_tiff_write_job*)apr_pcalloc(ctx->pool, ngroups*sizeof(_tiff_write_job));
+    threads = (apr_thread_t**)apr_pcalloc(ctx->pool, ngroups*sizeof(apr_thread_t*));
+    for(i=1; i<ngroups; i++) {
+      jobs[i].ctx = ctx->clone(ctx);
+      jobs[i].dcache = dcache;
+      jobs[i].tiles = grouped + group_start[i];
+      jobs[i].ntiles = group_start[i+1] - group_start[i];
+      jobs[i].filename = filenames[i];
+      if(apr_thread_create(&threads[i], NULL, _tiff_write_thread, &jobs[i], ctx->pool) != APR_SUCCESS) {
+        /* write it from this thread instead */
+        threads[i] = NULL;
+      }
+    }
+    _mapcache_cache_tiff_write(ctx, dcache, grouped, group_start[1], filenames[0]);
+    for(i=1; i<ngroups; i++) {
+      if(threads[i]) {
+        apr_thread_join(&rv, threads[i]);
+      } else if(!GC_HAS_ERROR(ctx)) {
+        _mapcache_cache_tiff_write(jobs[i].ctx, dcache, jobs[i].tiles, jobs[i].ntiles, jobs[i].filename);
+      }
+      if(GC_HAS_ERROR(jobs[i].ctx) && !GC_HAS_ERROR(ctx)) {
+        /* transfer error message from the writer to the main context */
+        ctx->set_error(ctx,jobs[i].ctx->get_error(jobs[i].ctx),
+                       jobs[i].ctx->get_error_message(jobs[i].ctx));
+      }
+    }
+    return;
+  }
+#endif
+  for(i=0; i<ngroups; i++) {
+    _mapcache_cache_tiff_write(ctx, dcache, grouped + group_start[i], group_start[i+1] - group_start[i], filenames[i]);
+    GC_CHECK_ERROR(ctx);
+  }
+#else
+  ctx->set_error(ctx,500,"tiff write support disabled by default");
+#endif
+}
+
 /**
  * \private \memberof mapcache_cache_tiff
  */
@@ -813,6 +1146,14 @@ static void _mapcache_cache_tiff_configuration_parse_xml(mapcache_context *ctx,
       return;
     }
   }
+  if((cur_node = ezxml_child(node,"max_open_files")) != NULL) {
+    char *endptr;
+    dcache->max_open_files = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->max_open_files < 0) {
+      ctx->set_error(ctx,400,"failed to parse max_open_files value %s for tiff cache %s", cur_node->txt,cache->name);
+      return;
+    }
+  }
   xformat = ezxml_child(node,"format");
   if(xformat && xformat->txt && *xformat->txt) {
     format_name = xformat->txt;
@@ -868,10 +1209,12 @@ mapcache_cache* mapcache_cache_tiff_create(mapcache_context *ctx)
   cache->cache.tile_get = _mapcache_cache_tiff_get;
   cache->cache.tile_exists = _mapcache_cache_tiff_has_tile;
   cache->cache.tile_set = _mapcache_cache_tiff_set;
+  cache->cache.tile_multi_set = _mapcache_cache_tiff_multi_set;
   cache->cache.configuration_post_config = _mapcache_cache_tiff_configuration_post_config;
   cache->cache.configuration_parse_xml = _mapcache_cache_tiff_configuration_parse_xml;
   cache->count_x = 10;
   cache->count_y = 10;
+  cache->max_open_files = 32;
   cache->x_fmt = cache->y_fmt = cache->z_fmt
                                 = cache->inv_x_fmt = cache->inv_y_fmt
                                     = cache->div_x_fmt = cache->div_y_fmt
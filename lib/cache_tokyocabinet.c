@@ -48,11 +48,10 @@ struct tc_conn {
   TCBDB *bdb;
   int readonly;
 };
-static struct tc_conn _tc_get_conn(mapcache_context *ctx, mapcache_tile* tile, int readonly) {
+static struct tc_conn _tc_get_conn(mapcache_context *ctx, mapcache_cache_tc *cache, mapcache_tile* tile, int readonly) {
   struct tc_conn conn;
   /* create the object */
   conn.bdb = tcbdbnew();
-  mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
 
   /* open the database */
   if(!readonly) {
@@ -86,14 +85,14 @@ static void _tc_release_conn(mapcache_context *ctx, mapcache_tile *tile, struct
   tcbdbdel(conn.bdb);
 }
 
-static int _mapcache_cache_tc_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_tc_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   int ret;
   struct tc_conn conn;
   int nrecords = 0;
-  mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
+  mapcache_cache_tc *cache = (mapcache_cache_tc*)pcache;
   char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
-  conn = _tc_get_conn(ctx,tile,1);
+  conn = _tc_get_conn(ctx,cache,tile,1);
   if(GC_HAS_ERROR(ctx)) return MAPCACHE_FALSE;
   nrecords = tcbdbvnum2(conn.bdb, skey);
   if(nrecords == 0)
@@ -104,25 +103,25 @@ static int _mapcache_cache_tc_has_tile(mapcache_context *ctx, mapcache_tile *til
   return ret;
 }
 
-static void _mapcache_cache_tc_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_tc_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   struct tc_conn conn;
-  mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
+  mapcache_cache_tc *cache = (mapcache_cache_tc*)pcache;
   char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
-  conn = _tc_get_conn(ctx,tile,0);
+  conn = _tc_get_conn(ctx,cache,tile,0);
   GC_CHECK_ERROR(ctx);
   tcbdbout2(conn.bdb, skey);
   _tc_release_conn(ctx,tile,conn);
 }
 
 
-static int _mapcache_cache_tc_get(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_tc_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   int ret;
   struct tc_conn conn;
-  mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
+  mapcache_cache_tc *cache = (mapcache_cache_tc*)pcache;
   char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
-  conn = _tc_get_conn(ctx,tile,1);
+  conn = _tc_get_conn(ctx,cache,tile,1);
   int size;
   if(GC_HAS_ERROR(ctx)) return MAPCACHE_FAILURE;
   tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
@@ -140,13 +139,40 @@ static int _mapcache_cache_tc_get(mapcache_context *ctx, mapcache_tile *tile)
   return ret;
 }
 
-static void _mapcache_cache_tc_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_tc_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles)
 {
+  int i,size;
   struct tc_conn conn;
-  mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
+  mapcache_cache_tc *cache = (mapcache_cache_tc*)pcache;
+  conn = _tc_get_conn(ctx,cache,tiles[0],1);
+  GC_CHECK_ERROR(ctx);
+  for(i=0; i<ntiles; i++) {
+    mapcache_tile *tile = tiles[i];
+    char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
+    void *buf;
+    if(GC_HAS_ERROR(ctx)) break;
+    buf = tcbdbget(conn.bdb, skey, strlen(skey), &size);
+    if(!buf) {
+      tile->cache_miss = 1;
+      continue;
+    }
+    tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
+    tile->encoded_data->buf = buf;
+    tile->encoded_data->avail = size;
+    tile->encoded_data->size = size - sizeof(apr_time_t);
+    apr_pool_cleanup_register(ctx->pool, tile->encoded_data->buf,(void*)free, apr_pool_cleanup_null);
+    tile->mtime = *((apr_time_t*)(&tile->encoded_data->buf[tile->encoded_data->size]));
+  }
+  _tc_release_conn(ctx,tiles[0],conn);
+}
+
+static void _mapcache_cache_tc_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  struct tc_conn conn;
+  mapcache_cache_tc *cache = (mapcache_cache_tc*)pcache;
   char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
   apr_time_t now = apr_time_now();
-  conn = _tc_get_conn(ctx,tile,0);
+  conn = _tc_get_conn(ctx,cache,tile,0);
   GC_CHECK_ERROR(ctx);
 
   if(!tile->encoded_data) {
@@ -209,6 +235,7 @@ mapcache_cache* mapcache_cache_tc_create(mapcache_context *ctx)
   cache->cache.tile_get = _mapcache_cache_tc_get;
   cache->cache.tile_exists = _mapcache_cache_tc_has_tile;
   cache->cache.tile_set = _mapcache_cache_tc_set;
+  cache->cache.tile_multi_get = _mapcache_cache_tc_multi_get;
   cache->cache.configuration_post_config = _mapcache_cache_tc_configuration_post_config;
   cache->cache.configuration_parse_xml = _mapcache_cache_tc_configuration_parse_xml;
   cache->basedir = NULL;
@@ -252,6 +252,9 @@ mapcache_cfg* mapcache_configuration_create(apr_pool_t *pool)
   /* default retry interval is 1/100th of a second, i.e. 10000 microseconds */
   cfg->lock_retry_interval = 10000;
 
+  cfg->fetch_threads = 8;
+  cfg->fetch_queue_size = 64;
+
   cfg->loglevel = MAPCACHE_WARN;
   cfg->autoreload = 0;
 
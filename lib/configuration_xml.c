@@ -529,6 +529,15 @@ void parseCache(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
     ctx->set_error(ctx,400, "failed to add cache \"%s\": s3 support is not available on this build",name);
     return;
 #endif
+  } else if(!strcmp(type,"shm")) {
+    cache = mapcache_cache_shm_create(ctx);
+    GC_CHECK_ERROR(ctx);
+  } else if(!strcmp(type,"composite")) {
+    cache = mapcache_cache_composite_create(ctx);
+  } else if(!strcmp(type,"bundle")) {
+    cache = mapcache_cache_bundle_create(ctx);
+  } else if(!strcmp(type,"bloom")) {
+    cache = mapcache_cache_bloom_create(ctx);
   } else {
     ctx->set_error(ctx, 400, "unknown cache type %s for cache \"%s\"", type, name);
     return;
@@ -868,6 +877,13 @@ void mapcache_configuration_parse_xml(mapcache_context *ctx, const char *filenam
 {
   ezxml_t doc, node;
   const char *mode;
+  if(!config->configFile) {
+    char *path;
+    if(apr_filepath_merge(&path, NULL, filename, APR_FILEPATH_TRUENAME, ctx->pool) == APR_SUCCESS)
+      config->configFile = path;
+    else
+      config->configFile = apr_pstrdup(ctx->pool, filename);
+  }
   doc = ezxml_parse_file(filename);
   if (doc == NULL) {
     ctx->set_error(ctx,400, "failed to parse file %s. Is it valid XML?", filename);
@@ -1047,6 +1063,34 @@ void mapcache_configuration_parse_xml(mapcache_context *ctx, const char *filenam
     }
   }
 
+  if((node = ezxml_child(doc,"locker")) != NULL) {
+    ezxml_t cur_node;
+    const char *type = ezxml_attr(node,"type");
+    if(!type || !strcmp(type,"disk")) {
+      config->locker = mapcache_locker_disk_create(ctx);
+    } else if(!strcmp(type,"shm")) {
+      config->locker = mapcache_locker_shm_create(ctx);
+    } else {
+      ctx->set_error(ctx, 400, "unknown locker type \"%s\" (allowed values: disk, shm)", type);
+      return;
+    }
+    if(GC_HAS_ERROR(ctx)) return;
+    if((cur_node = ezxml_child(node,"timeout")) != NULL) {
+      char *endptr;
+      long timeout = strtol(cur_node->txt,&endptr,10);
+      if(*endptr != 0 || timeout < 0) {
+        ctx->set_error(ctx, 400, "failed to parse locker timeout \"%s\". Expecting a positive number of seconds, e.g. <timeout>120</timeout>",
+                       cur_node->txt);
+        return;
+      }
+      config->locker->timeout = apr_time_from_sec(timeout);
+    }
+    config->locker->configuration_parse_xml(ctx, config->locker, node);
+    if(GC_HAS_ERROR(ctx)) return;
+  } else {
+    config->locker = mapcache_locker_disk_create(ctx);
+  }
+
   if((node = ezxml_child(doc,"threaded_fetching")) != NULL) {
     if(!strcasecmp(node->txt,"true")) {
       config->threaded_fetching = 1;
@@ -1056,6 +1100,24 @@ void mapcache_configuration_parse_xml(mapcache_context *ctx, const char *filenam
     }
   }
 
+  if((node = ezxml_child(doc,"fetch_threads")) != NULL) {
+    char *endptr;
+    config->fetch_threads = (int)strtol(node->txt,&endptr,10);
+    if(*endptr != 0 || config->fetch_threads < 1) {
+      ctx->set_error(ctx, 400, "failed to parse fetch_threads \"%s\". Expecting a positive integer, e.g. <fetch_threads>8</fetch_threads>",node->txt);
+      return;
+    }
+  }
+
+  if((node = ezxml_child(doc,"fetch_queue_size")) != NULL) {
+    char *endptr;
+    config->fetch_queue_size = (int)strtol(node->txt,&endptr,10);
+    if(*endptr != 0 || config->fetch_queue_size < 0) {
+      ctx->set_error(ctx, 400, "failed to parse fetch_queue_size \"%s\". Expecting a positive integer, e.g. <fetch_queue_size>64</fetch_queue_size>",node->txt);
+      return;
+    }
+  }
+
   if((node = ezxml_child(doc,"log_level")) != NULL) {
     if(!strcasecmp(node->txt,"debug")) {
       config->loglevel = MAPCACHE_DEBUG;
@@ -31,37 +31,197 @@
 #include <apr_strings.h>
 #include "mapcache.h"
 #if APR_HAS_THREADS
-#include "apu_version.h"
-
-#if (APU_MAJOR_VERSION <= 1 && APU_MINOR_VERSION <= 3)
-#define USE_THREADPOOL 0
-#else
-#define USE_THREADPOOL 1
-#endif
-
-/* use a thread pool if using 1.3.12 or higher apu */
-#if !USE_THREADPOOL
 #include <apr_thread_proc.h>
-#else
-#include <apr_thread_pool.h>
-#endif
+#include <apr_thread_mutex.h>
+#include <apr_hash.h>
+#include <apr_thread_cond.h>
+
+/*
+ * tiles of a request are fetched by a per-process pool of long-lived worker
+ * threads. each call to mapcache_prefetch_tiles queues a batch containing one
+ * job per metatile. the workers and the requesting thread itself claim jobs
+ * from the batch until it is exhausted, and the requesting thread then waits
+ * for the jobs still running in the workers (the batch latch).
+ *
+ * the pool is shared by all the configurations loaded in the process, and is
+ * sized by the <fetch_threads> and <fetch_queue_size> of the first one using it.
+ */
+typedef struct _fetch_batch _fetch_batch;
 
 typedef struct {
   mapcache_tile *tile;
-  mapcache_context *ctx;
   int launch;
 } _thread_tile;
 
-static void* APR_THREAD_FUNC _thread_get_tile(apr_thread_t *thread, void *data)
+struct _fetch_batch {
+  _thread_tile **jobs;
+  int njobs;
+  int next;        /* index of the next unclaimed job */
+  int pending;     /* number of jobs that have not finished yet */
+  int queued;      /* is the batch still in the pool queue */
+  int failed;      /* a job has failed, skip the remaining ones */
+  mapcache_context *error_ctx; /* the context holding the first error of a worker */
+  mapcache_context **ctxs;     /* stack of free contexts for the workers */
+  int nctxs;
+  _fetch_batch *prev, *nextb;
+};
+
+typedef struct {
+  apr_pool_t *pool;
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *work;     /* signalled when a batch is queued or on shutdown */
+  apr_thread_cond_t *finished; /* signalled when the last job of a batch has finished */
+  _fetch_batch *head, *tail;
+  int nqueued, max_queued;
+  apr_thread_t **threads;
+  int nthreads;
+  int shutdown;
+  apr_hash_t *configs; /* configurations that have used the pool, to warn once about their sizes */
+} _fetch_pool;
+
+static _fetch_pool *fetch_pool = NULL;
+
+/* must be called with the pool mutex held */
+static void _fetch_batch_dequeue(_fetch_pool *fp, _fetch_batch *batch)
+{
+  if(!batch->queued) return;
+  if(batch->prev) batch->prev->nextb = batch->nextb;
+  else fp->head = batch->nextb;
+  if(batch->nextb) batch->nextb->prev = batch->prev;
+  else fp->tail = batch->prev;
+  batch->prev = batch->nextb = NULL;
+  batch->queued = 0;
+  fp->nqueued--;
+}
+
+/* must be called with the pool mutex held */
+static _thread_tile* _fetch_batch_claim(_fetch_pool *fp, _fetch_batch *batch)
 {
-  _thread_tile* t = (_thread_tile*)data;
-  mapcache_tileset_tile_get(t->ctx, t->tile);
-#if !USE_THREADPOOL
+  _thread_tile *job;
+  if(batch->next >= batch->njobs) return NULL;
+  job = batch->jobs[batch->next++];
+  if(batch->next == batch->njobs) {
+    /* nothing left to claim, no need to keep the batch visible to the workers */
+    _fetch_batch_dequeue(fp,batch);
+  }
+  return job;
+}
+
+static void* APR_THREAD_FUNC _fetch_worker(apr_thread_t *thread, void *data)
+{
+  _fetch_pool *fp = (_fetch_pool*)data;
+  apr_thread_mutex_lock(fp->mutex);
+  while(1) {
+    _fetch_batch *batch;
+    _thread_tile *job;
+    mapcache_context *jctx;
+    while(!fp->shutdown && !fp->head) {
+      apr_thread_cond_wait(fp->work, fp->mutex);
+    }
+    if(fp->shutdown) break;
+    batch = fp->head;
+    job = _fetch_batch_claim(fp,batch);
+    /* there are at most nthreads workers on a batch, and as many contexts */
+    jctx = batch->ctxs[--batch->nctxs];
+    if(!batch->failed) {
+      apr_thread_mutex_unlock(fp->mutex);
+      mapcache_tileset_tile_get(jctx, job->tile);
+      apr_thread_mutex_lock(fp->mutex);
+      if(GC_HAS_ERROR(jctx) && !batch->failed) {
+        batch->failed = 1;
+        batch->error_ctx = jctx;
+      }
+    }
+    batch->ctxs[batch->nctxs++] = jctx;
+    if(--batch->pending == 0) {
+      apr_thread_cond_broadcast(fp->finished);
+    }
+  }
+  apr_thread_mutex_unlock(fp->mutex);
   apr_thread_exit(thread, APR_SUCCESS);
-#endif
   return NULL;
 }
 
+static apr_status_t _fetch_pool_destroy(void *data)
+{
+  _fetch_pool *fp = (_fetch_pool*)data;
+  apr_status_t rv;
+  int i;
+  apr_thread_mutex_lock(fp->mutex);
+  fp->shutdown = 1;
+  apr_thread_cond_broadcast(fp->work);
+  apr_thread_mutex_unlock(fp->mutex);
+  for(i=0; i<fp->nthreads; i++) {
+    apr_thread_join(&rv, fp->threads[i]);
+  }
+  fetch_pool = NULL;
+  apr_pool_destroy(fp->pool);
+  return APR_SUCCESS;
+}
+
+/*
+ * return the process wide fetch pool, creating it on first use.
+ * returns NULL if the pool could not be created, in which case the tiles
+ * are fetched sequentially by the requesting thread
+ */
+static _fetch_pool* _fetch_pool_get(mapcache_context *ctx)
+{
+  apr_pool_t *pool;
+  _fetch_pool *fp;
+  mapcache_cfg **cfg;
+  int i;
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+  if(fetch_pool) {
+    fp = fetch_pool;
+    if(!apr_hash_get(fp->configs, &ctx->config, sizeof(mapcache_cfg*))) {
+      cfg = (mapcache_cfg**)apr_palloc(fp->pool, sizeof(mapcache_cfg*));
+      *cfg = ctx->config;
+      apr_hash_set(fp->configs, cfg, sizeof(mapcache_cfg*), cfg);
+      if(ctx->config->fetch_threads != fp->nthreads || ctx->config->fetch_queue_size != fp->max_queued) {
+        ctx->log(ctx,MAPCACHE_WARN,"fetch thread pool already created with %d threads and a queue of %d by another "
+                 "configuration, ignoring <fetch_threads> %d and <fetch_queue_size> %d",
+                 fp->nthreads, fp->max_queued, ctx->config->fetch_threads, ctx->config->fetch_queue_size);
+      }
+    }
+  } else if(apr_pool_create(&pool,NULL) == APR_SUCCESS) {
+    fp = (_fetch_pool*)apr_pcalloc(pool,sizeof(_fetch_pool));
+    fp->pool = pool;
+    fp->configs = apr_hash_make(pool);
+    fp->nthreads = ctx->config->fetch_threads;
+    fp->max_queued = ctx->config->fetch_queue_size;
+    fp->threads = (apr_thread_t**)apr_pcalloc(pool,fp->nthreads*sizeof(apr_thread_t*));
+    if(apr_thread_mutex_create(&fp->mutex,APR_THREAD_MUTEX_DEFAULT,pool) != APR_SUCCESS ||
+        apr_thread_cond_create(&fp->work,pool) != APR_SUCCESS ||
+        apr_thread_cond_create(&fp->finished,pool) != APR_SUCCESS) {
+      ctx->log(ctx,MAPCACHE_WARN,"failed to create fetch thread pool synchronization primitives");
+      apr_pool_destroy(pool);
+    } else {
+      for(i=0; i<fp->nthreads; i++) {
+        if(apr_thread_create(&fp->threads[i],NULL,_fetch_worker,fp,pool) != APR_SUCCESS) {
+          ctx->log(ctx,MAPCACHE_WARN,"failed to create fetch thread %d of %d",i,fp->nthreads);
+          break;
+        }
+      }
+      fp->nthreads = i;
+      if(fp->nthreads == 0) {
+        apr_pool_destroy(pool);
+      } else {
+        /* the pool lives in its own unmanaged pool, so its threads are joined before anything is freed */
+        apr_pool_cleanup_register(ctx->process_pool,fp,_fetch_pool_destroy,apr_pool_cleanup_null);
+        cfg = (mapcache_cfg**)apr_palloc(pool, sizeof(mapcache_cfg*));
+        *cfg = ctx->config;
+        apr_hash_set(fp->configs, cfg, sizeof(mapcache_cfg*), cfg);
+        fetch_pool = fp;
+      }
+    }
+  }
+  fp = fetch_pool;
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+  return fp;
+}
+
 #endif
 
 
@@ -75,23 +235,44 @@ mapcache_http_response *mapcache_http_response_create(apr_pool_t *pool)
   return response;
 }
 
-void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles)
+/* quoted md5 of the response data, used as entity tag when the cache did not provide one */
+static char* _mapcache_core_data_etag(mapcache_context *ctx, mapcache_buffer *data)
 {
+  return apr_pstrcat(ctx->pool, "\"", mapcache_util_md5_hex(ctx->pool, data->buf, data->size), "\"", NULL);
+}
 
-  apr_thread_t **threads;
-  apr_threadattr_t *thread_attrs;
-  int nthreads;
+int mapcache_core_etag_matches(mapcache_http_response *response, const char *if_none_match)
+{
+  const char *tag = if_none_match;
+  apr_size_t len;
+  if(!response->etag || !if_none_match) return MAPCACHE_FALSE;
+  len = strlen(response->etag);
+  /* comma separated list of entity tags, compared with the weak comparison function */
+  while(1) {
+    tag += strspn(tag, " \t,");
+    if(!*tag) return MAPCACHE_FALSE;
+    if(*tag == '*') return MAPCACHE_TRUE;
+    if(!strncmp(tag, "W/", 2)) tag += 2;
+    if(!strncmp(tag, response->etag, len) && (!tag[len] || strchr(" \t,", tag[len]))) return MAPCACHE_TRUE;
+    tag += strcspn(tag, ",");
+  }
+}
+
+static void _mapcache_fetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles)
+{
 #if !APR_HAS_THREADS
   int i;
   for(i=0; i<ntiles; i++) {
-    mapcache_tileset_tile_get(ctx, tiles[i], readonly);
+    mapcache_tileset_tile_get(ctx, tiles[i]);
     GC_CHECK_ERROR(ctx);
   }
 #else
-  int i,rv;
+  int i;
   _thread_tile* thread_tiles;
-  if(ntiles==1 || ctx->config->threaded_fetching == 0) {
-    /* if threads disabled, or only fetching a single tile, don't launch a thread for the operation */
+  _fetch_pool *fp;
+  _fetch_batch *batch;
+  if(ntiles==1 || ctx->config->threaded_fetching == 0 || !(fp = _fetch_pool_get(ctx))) {
+    /* if threads disabled, or only fetching a single tile, don't dispatch the operation to the thread pool */
     for(i=0; i<ntiles; i++) {
       mapcache_tileset_tile_get(ctx, tiles[i]);
       GC_CHECK_ERROR(ctx);
@@ -99,22 +280,18 @@ void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int n
     return;
   }
 
-
   /* allocate a thread struct for each tile. Not all will be used */
   thread_tiles = (_thread_tile*)apr_pcalloc(ctx->pool,ntiles*sizeof(_thread_tile));
-#if 1 || !USE_THREADPOOL
-  /* use multiple threads, to fetch from multiple metatiles and/or multiple tilesets */
-  apr_threadattr_create(&thread_attrs, ctx->pool);
-  threads = (apr_thread_t**)apr_pcalloc(ctx->pool, ntiles*sizeof(apr_thread_t*));
-  nthreads = 0;
+  batch = (_fetch_batch*)apr_pcalloc(ctx->pool,sizeof(_fetch_batch));
+  batch->jobs = (_thread_tile**)apr_pcalloc(ctx->pool,ntiles*sizeof(_thread_tile*));
   for(i=0; i<ntiles; i++) {
     int j;
     thread_tiles[i].tile = tiles[i];
     thread_tiles[i].launch = 1;
     j=i-1;
     /*
-     * we only launch one thread per metatile as in the unseeded case the threads
-     * for a same metatile will lock while only a single thread launches the actual
+     * we only queue one job per metatile as in the unseeded case the jobs
+     * for a same metatile will lock while only a single one launches the actual
      * rendering request
      */
     while(j>=0) {
@@ -125,71 +302,93 @@ void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int n
            thread_tiles[j].tile->x / thread_tiles[j].tile->tileset->metasize_x)&&
           (thread_tiles[i].tile->y / thread_tiles[i].tile->tileset->metasize_y  ==
            thread_tiles[j].tile->y / thread_tiles[j].tile->tileset->metasize_y)) {
-        thread_tiles[i].launch = 0; /* this tile will not have a thread spawned for it */
+        thread_tiles[i].launch = 0; /* this tile will not have a job queued for it */
         break;
       }
       j--;
     }
     if(thread_tiles[i].launch)
-      thread_tiles[i].ctx = ctx->clone(ctx);
+      batch->jobs[batch->njobs++] = &thread_tiles[i];
   }
-  for(i=0; i<ntiles; i++) {
-    if(!thread_tiles[i].launch) continue; /* skip tiles that have been marked */
-    rv = apr_thread_create(&threads[i], thread_attrs, _thread_get_tile, (void*)&(thread_tiles[i]), thread_tiles[i].ctx->pool);
-    if(rv != APR_SUCCESS) {
-      ctx->set_error(ctx,500, "failed to create thread %d of %d\n",i,ntiles);
-      break;
-    }
-    nthreads++;
+  batch->pending = batch->njobs;
+
+  /*
+   * one context per worker that can run concurrently on this batch. contexts
+   * are reused by the successive jobs a worker picks up, and are cloned here as
+   * the request pool must not be used concurrently
+   */
+  batch->nctxs = (batch->njobs < fp->nthreads) ? batch->njobs : fp->nthreads;
+  batch->ctxs = (mapcache_context**)apr_pcalloc(ctx->pool,batch->nctxs*sizeof(mapcache_context*));
+  for(i=0; i<batch->nctxs; i++) {
+    batch->ctxs[i] = ctx->clone(ctx);
   }
 
-  /* wait for launched threads to finish */
-  for(i=0; i<ntiles; i++) {
-    if(!thread_tiles[i].launch) continue;
-    apr_thread_join(&rv, threads[i]);
-    if(rv != APR_SUCCESS) {
-      ctx->set_error(ctx,500, "thread %d of %d failed on exit\n",i,ntiles);
-    }
-    if(GC_HAS_ERROR(thread_tiles[i].ctx)) {
-      /* transfer error message from child thread to main context */
-      ctx->set_error(ctx,thread_tiles[i].ctx->get_error(thread_tiles[i].ctx),
-                     thread_tiles[i].ctx->get_error_message(thread_tiles[i].ctx));
+  apr_thread_mutex_lock(fp->mutex);
+  if(fp->nqueued < fp->max_queued) {
+    batch->prev = fp->tail;
+    if(fp->tail) fp->tail->nextb = batch;
+    else fp->head = batch;
+    fp->tail = batch;
+    batch->queued = 1;
+    fp->nqueued++;
+    apr_thread_cond_broadcast(fp->work);
+  }
+  /* else the queue is full: this thread does all the work itself */
+
+  /* work on our own batch while the workers are busy */
+  while(1) {
+    _thread_tile *job = _fetch_batch_claim(fp,batch);
+    if(!job) break;
+    if(!batch->failed) {
+      apr_thread_mutex_unlock(fp->mutex);
+      mapcache_tileset_tile_get(ctx, job->tile);
+      apr_thread_mutex_lock(fp->mutex);
+      if(GC_HAS_ERROR(ctx)) batch->failed = 1;
     }
+    batch->pending--;
+  }
+
+  /* wait for the jobs that were picked up by the workers */
+  while(batch->pending > 0) {
+    apr_thread_cond_wait(fp->finished, fp->mutex);
+  }
+  apr_thread_mutex_unlock(fp->mutex);
+
+  GC_CHECK_ERROR(ctx);
+  if(batch->error_ctx) {
+    /* transfer error message from the worker to the main context */
+    ctx->set_error(ctx,batch->error_ctx->get_error(batch->error_ctx),
+                   batch->error_ctx->get_error_message(batch->error_ctx));
+    return;
   }
+
   for(i=0; i<ntiles; i++) {
-    /* fetch the tiles that did not get a thread launched for them */
+    /* fetch the tiles that did not get a job queued for them */
     if(thread_tiles[i].launch) continue;
     mapcache_tileset_tile_get(ctx, tiles[i]);
     GC_CHECK_ERROR(ctx);
   }
-#else
-  /* experimental version using a threadpool, disabled for stability reasons */
-  apr_thread_pool_t *thread_pool;
-  apr_thread_pool_create(&thread_pool,2,ctx->config->download_threads,ctx->pool);
-  for(i=0; i<ntiles; i++) {
-    ctx->log(ctx,MAPCACHE_DEBUG,"starting thread for tile %s",tiles[i]->tileset->name);
-    thread_tiles[i].tile = tiles[i];
-    thread_tiles[i].ctx = ctx->clone(ctx);
-    rv = apr_thread_pool_push(thread_pool,_thread_get_tile,(void*)&(thread_tiles[i]), 0,NULL);
-    if(rv != APR_SUCCESS) {
-      ctx->set_error(ctx,500, "failed to push thread %d of %d in thread pool\n",i,ntiles);
-      break;
+#endif
+}
+
+void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles)
+{
+  if(ntiles > 1) {
+    /* first read all the tiles we can with batched cache lookups */
+    mapcache_tile **missing;
+    int nmissing = 0, i;
+    int *found = mapcache_tileset_tile_multi_get_cached(ctx, tiles, ntiles);
+    GC_CHECK_ERROR(ctx);
+    missing = (mapcache_tile**)apr_pcalloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+    for(i=0; i<ntiles; i++) {
+      if(!found[i]) missing[nmissing++] = tiles[i];
     }
+    tiles = missing;
+    ntiles = nmissing;
   }
-  GC_CHECK_ERROR(ctx);
-  while(apr_thread_pool_tasks_run_count(thread_pool) != ntiles || apr_thread_pool_busy_count(thread_pool)>0)
-    apr_sleep(10000);
-  apr_thread_pool_destroy(thread_pool);
-  for(i=0; i<ntiles; i++) {
-    if(GC_HAS_ERROR(thread_tiles[i].ctx)) {
-      ctx->set_error(ctx,thread_tiles[i].ctx->get_error(thread_tiles[i].ctx),
-                     thread_tiles[i].ctx->get_error_message(thread_tiles[i].ctx));
-    }
+  if(ntiles) {
+    _mapcache_fetch_tiles(ctx, tiles, ntiles);
   }
-#endif
-
-#endif
-
 }
 
 mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_request_get_tile *req_tile)
@@ -276,9 +475,20 @@ mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_r
     if(GC_HAS_ERROR(ctx)) {
       return NULL;
     }
+    response->etag = _mapcache_core_data_etag(ctx, response->data);
   } else {
-    response->data = req_tile->tiles[first]->encoded_data;
-    format = req_tile->tiles[first]->tileset->format;
+    mapcache_tile *tile = req_tile->tiles[first];
+    response->data = tile->encoded_data;
+    format = tile->tileset->format;
+    /* the tile is sent unmodified, the front end can send it from the file it was read from */
+    if(tile->encoded_file && tile->encoded_file->data == response->data) {
+      response->file = tile->encoded_file;
+    }
+    if(tile->etag && tile->etag_data == response->data) {
+      response->etag = tile->etag;
+    } else {
+      response->etag = _mapcache_core_data_etag(ctx, response->data);
+    }
   }
 
   /* compute the content-type */
@@ -421,7 +631,8 @@ mapcache_http_response *mapcache_core_get_map(mapcache_context *ctx, mapcache_re
         return NULL;
       }
     }
-    basemap->tileset->source->render_map(ctx, basemap);
+    /* request all the layers at once */
+    mapcache_source_render_maps(ctx, req_map->maps, req_map->nmaps);
     if(GC_HAS_ERROR(ctx)) return NULL;
     if(req_map->nmaps>1) {
       if(!basemap->raw_image) {
@@ -430,8 +641,6 @@ mapcache_http_response *mapcache_core_get_map(mapcache_context *ctx, mapcache_re
       }
       for(i=1; i<req_map->nmaps; i++) {
         mapcache_map *overlaymap = req_map->maps[i];
-        overlaymap->tileset->source->render_map(ctx, overlaymap);
-        if(GC_HAS_ERROR(ctx)) return NULL;
         if(!overlaymap->raw_image) {
           overlaymap->raw_image = mapcache_imageio_decode(ctx,overlaymap->encoded_data);
           if(GC_HAS_ERROR(ctx)) return NULL;
@@ -488,6 +697,7 @@ mapcache_http_response *mapcache_core_get_map(mapcache_context *ctx, mapcache_re
   }
 
   response->mtime = basemap->mtime;
+  response->etag = _mapcache_core_data_etag(ctx, response->data);
   return response;
 }
 
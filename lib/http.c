@@ -32,14 +32,254 @@
 #include <apr_hash.h>
 #include <apr_strings.h>
 #include <ctype.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#endif
 
 #define MAX_STRING_LEN 10000
 
+/* number of idle handles kept per host when no <max_connections> is configured */
+#define MAPCACHE_HTTP_MAX_IDLE_HANDLES 16
+
+/* log the connection reuse statistics of a host every so many requests */
+#define MAPCACHE_HTTP_STATS_INTERVAL 1000
+
 struct _header_struct {
   apr_table_t *headers;
   mapcache_context *ctx;
 };
 
+/*
+ * per-process pool of curl easy handles, one per upstream host (scheme://host:port).
+ * the handles of a host share their DNS cache, TLS sessions and, if the curl
+ * version allows it, their connection cache, so that upstream connections
+ * survive from one request to the next
+ */
+typedef struct {
+  char *key;
+  CURLSH *share;
+  CURL **idle; /* stack of handles not in use */
+  int nidle, max_idle;
+  int nbusy; /* handles currently performing a request */
+  int max_connections;
+  /* statistics */
+  apr_uint64_t requests, reused, connections;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *released; /* signalled when a handle is released */
+  apr_thread_mutex_t *share_locks[CURL_LOCK_DATA_LAST];
+#endif
+} mapcache_http_endpoint;
+
+/* hash table key = scheme://host:port, value = mapcache_http_endpoint */
+static apr_hash_t *http_endpoints = NULL;
+
+#ifdef APR_HAS_THREADS
+static void _mapcache_http_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+  mapcache_http_endpoint *ep = (mapcache_http_endpoint*)userptr;
+  apr_thread_mutex_lock(ep->share_locks[data]);
+}
+
+static void _mapcache_http_share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+  mapcache_http_endpoint *ep = (mapcache_http_endpoint*)userptr;
+  apr_thread_mutex_unlock(ep->share_locks[data]);
+}
+#endif
+
+static apr_status_t _mapcache_http_endpoints_cleanup(void *data)
+{
+  apr_hash_index_t *hi;
+  for(hi = apr_hash_first(NULL,http_endpoints); hi; hi = apr_hash_next(hi)) {
+    mapcache_http_endpoint *ep;
+    int i;
+    apr_hash_this(hi,NULL,NULL,(void**)&ep);
+    for(i=0; i<ep->nidle; i++) {
+      curl_easy_cleanup(ep->idle[i]);
+    }
+    curl_share_cleanup(ep->share);
+  }
+  http_endpoints = NULL;
+  return APR_SUCCESS;
+}
+
+/*
+ * extract the scheme://host:port part of an url
+ */
+static char* _mapcache_http_endpoint_key(mapcache_context *ctx, const char *url)
+{
+  const char *start = strstr(url,"://"), *end;
+  char *key, *c;
+  start = start ? start+3 : url;
+  end = start + strcspn(start,"/?#");
+  key = apr_pstrndup(ctx->pool,url,end-url);
+  for(c=key; *c; c++) *c = tolower(*c);
+  return key;
+}
+
+static mapcache_http_endpoint* _mapcache_http_endpoint_create(mapcache_context *ctx, mapcache_http *req, char *key)
+{
+  mapcache_http_endpoint *ep = apr_pcalloc(ctx->process_pool,sizeof(mapcache_http_endpoint));
+  ep->key = apr_pstrdup(ctx->process_pool,key);
+  ep->max_connections = req->max_connections;
+  ep->max_idle = req->max_connections ? req->max_connections : MAPCACHE_HTTP_MAX_IDLE_HANDLES;
+  ep->idle = apr_pcalloc(ctx->process_pool,ep->max_idle*sizeof(CURL*));
+  ep->share = curl_share_init();
+  if(!ep->share) {
+    ctx->set_error(ctx,500,"failed to create curl share for %s",key);
+    return NULL;
+  }
+#ifdef APR_HAS_THREADS
+  {
+    int i;
+    apr_status_t rv = apr_thread_mutex_create(&ep->mutex,APR_THREAD_MUTEX_DEFAULT,ctx->process_pool);
+    if(rv == APR_SUCCESS)
+      rv = apr_thread_cond_create(&ep->released,ctx->process_pool);
+    for(i=0; i<CURL_LOCK_DATA_LAST && rv == APR_SUCCESS; i++) {
+      rv = apr_thread_mutex_create(&ep->share_locks[i],APR_THREAD_MUTEX_DEFAULT,ctx->process_pool);
+    }
+    if(rv != APR_SUCCESS) {
+      char errmsg[120];
+      ctx->set_error(ctx,500,"failed to create connection pool locks for %s: %s",key,apr_strerror(rv,errmsg,120));
+      curl_share_cleanup(ep->share);
+      return NULL;
+    }
+  }
+  curl_share_setopt(ep->share, CURLSHOPT_LOCKFUNC, _mapcache_http_share_lock);
+  curl_share_setopt(ep->share, CURLSHOPT_UNLOCKFUNC, _mapcache_http_share_unlock);
+  curl_share_setopt(ep->share, CURLSHOPT_USERDATA, ep);
+#endif
+  curl_share_setopt(ep->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(ep->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+  curl_share_setopt(ep->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+  return ep;
+}
+
+static mapcache_http_endpoint* _mapcache_http_endpoint_get(mapcache_context *ctx, mapcache_http *req)
+{
+  mapcache_http_endpoint *ep = NULL;
+  char *key = _mapcache_http_endpoint_key(ctx,req->url);
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  if(!http_endpoints) {
+    http_endpoints = apr_hash_make(ctx->process_pool);
+    apr_pool_cleanup_register(ctx->process_pool,NULL,_mapcache_http_endpoints_cleanup,apr_pool_cleanup_null);
+  }
+  ep = apr_hash_get(http_endpoints,key,APR_HASH_KEY_STRING);
+  if(!ep) {
+    ep = _mapcache_http_endpoint_create(ctx,req,key);
+    if(ep)
+      apr_hash_set(http_endpoints,ep->key,APR_HASH_KEY_STRING,ep);
+  } else if(req->max_connections && (!ep->max_connections || req->max_connections < ep->max_connections)) {
+    /* the host is shared by <http> blocks with different limits: the smallest one applies */
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_lock(ep->mutex);
+#endif
+    ep->max_connections = req->max_connections;
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_unlock(ep->mutex);
+#endif
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return ep;
+}
+
+/*
+ * get an idle handle for the host, or create one. if the host already has
+ * max_connections requests running, waits for a handle to be released, or
+ * returns NULL without setting an error if block is false
+ */
+static CURL* _mapcache_http_handle_acquire(mapcache_context *ctx, mapcache_http_endpoint *ep, int block)
+{
+  CURL *curl_handle = NULL;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(ep->mutex);
+#endif
+  while(ep->max_connections && ep->nbusy >= ep->max_connections) {
+    if(!block) {
+#ifdef APR_HAS_THREADS
+      apr_thread_mutex_unlock(ep->mutex);
+#endif
+      return NULL;
+    }
+#ifdef APR_HAS_THREADS
+    apr_thread_cond_wait(ep->released,ep->mutex);
+#else
+    break;
+#endif
+  }
+  if(ep->nidle) {
+    curl_handle = ep->idle[--ep->nidle];
+  }
+  ep->nbusy++;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(ep->mutex);
+#endif
+  if(curl_handle) {
+    /* keeps the live connections and the share */
+    curl_easy_reset(curl_handle);
+  } else {
+    curl_handle = curl_easy_init();
+    if(!curl_handle) {
+      ctx->set_error(ctx,500,"failed to create curl handle for %s",ep->key);
+#ifdef APR_HAS_THREADS
+      apr_thread_mutex_lock(ep->mutex);
+#endif
+      ep->nbusy--;
+#ifdef APR_HAS_THREADS
+      apr_thread_cond_signal(ep->released);
+      apr_thread_mutex_unlock(ep->mutex);
+#endif
+      return NULL;
+    }
+  }
+  curl_easy_setopt(curl_handle, CURLOPT_SHARE, ep->share);
+  return curl_handle;
+}
+
+static void _mapcache_http_handle_release(mapcache_context *ctx, mapcache_http_endpoint *ep, CURL *curl_handle, int keep)
+{
+  long nconnects = 0;
+  int log_stats;
+  apr_uint64_t requests, reused, connections;
+  curl_easy_getinfo(curl_handle, CURLINFO_NUM_CONNECTS, &nconnects);
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(ep->mutex);
+#endif
+  ep->nbusy--;
+  ep->requests++;
+  if(nconnects) ep->connections += nconnects;
+  else ep->reused++;
+  if(keep && ep->nidle < ep->max_idle) {
+    ep->idle[ep->nidle++] = curl_handle;
+    curl_handle = NULL;
+  }
+  log_stats = (ep->requests % MAPCACHE_HTTP_STATS_INTERVAL) == 0;
+  requests = ep->requests;
+  reused = ep->reused;
+  connections = ep->connections;
+#ifdef APR_HAS_THREADS
+  apr_thread_cond_signal(ep->released);
+  apr_thread_mutex_unlock(ep->mutex);
+#endif
+  if(curl_handle) {
+    curl_easy_cleanup(curl_handle);
+  }
+  if(log_stats) {
+    ctx->log(ctx, MAPCACHE_INFO, "http connections to %s: %"APR_UINT64_T_FMT" requests, %"APR_UINT64_T_FMT
+             " reused a connection, %"APR_UINT64_T_FMT" new connections", ep->key, requests, reused, connections);
+  }
+}
+
 size_t _mapcache_curl_memory_callback(void *ptr, size_t size, size_t nmemb, void *data)
 {
   mapcache_buffer *buffer = (mapcache_buffer*)data;
@@ -73,14 +313,14 @@ size_t _mapcache_curl_header_callback( void *ptr, size_t size, size_t nmemb,  vo
   return size*nmemb;
 }
 
-void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcache_buffer *data, apr_table_t *headers, long *http_code)
+/*
+ * set the options of a request on a (reset) curl handle. the returned header list
+ * must be freed once the request has been performed
+ */
+static struct curl_slist* _mapcache_http_setup_handle(mapcache_context *ctx, CURL *curl_handle, mapcache_http *req,
+    mapcache_buffer *data, struct _header_struct *h, char *error_msg, int failonerror)
 {
-  CURL *curl_handle;
-  char error_msg[CURL_ERROR_SIZE];
-  int ret;
   struct curl_slist *curl_headers=NULL;
-  curl_handle = curl_easy_init();
-
 
   /* specify URL to get */
   curl_easy_setopt(curl_handle, CURLOPT_URL, req->url);
@@ -93,21 +333,33 @@ void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcach
   /* we pass our mapcache_buffer struct to the callback function */
   curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)data);
 
-  if(headers != NULL) {
+  if(h != NULL) {
     /* intercept headers */
-    struct _header_struct h;
-    h.headers = headers;
-    h.ctx=ctx;
     curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, _mapcache_curl_header_callback);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEHEADER, (void*)(&h));
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEHEADER, (void*)h);
   }
 
   curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, error_msg);
   curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1);
   curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT, req->connection_timeout);
   curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1);
+  if(failonerror)
+    curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1);
 
-
+  if(req->keepalive) {
+#if LIBCURL_VERSION_NUM >= 0x071900
+    curl_easy_setopt(curl_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+  } else {
+    curl_easy_setopt(curl_handle, CURLOPT_FORBID_REUSE, 1L);
+  }
+#if LIBCURL_VERSION_NUM >= 0x072f00
+  if(req->http2) {
+    curl_easy_setopt(curl_handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    /* wait for an existing connection to multiplex on rather than opening a new one */
+    curl_easy_setopt(curl_handle, CURLOPT_PIPEWAIT, 1L);
+  }
+#endif
 
   if(req->headers) {
     const apr_array_header_t *array = apr_table_elts(req->headers);
@@ -121,18 +373,211 @@ void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcach
     curl_headers = curl_slist_append(curl_headers, "User-Agent: "MAPCACHE_USERAGENT);
   }
   curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, curl_headers);
+  return curl_headers;
+}
+
+void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcache_buffer *data, apr_table_t *headers, long *http_code)
+{
+  CURL *curl_handle;
+  char error_msg[CURL_ERROR_SIZE];
+  int ret;
+  struct curl_slist *curl_headers;
+  struct _header_struct h;
+  mapcache_http_endpoint *ep;
+  ep = _mapcache_http_endpoint_get(ctx,req);
+  GC_CHECK_ERROR(ctx);
+  curl_handle = _mapcache_http_handle_acquire(ctx,ep,1);
+  GC_CHECK_ERROR(ctx);
+
+  h.headers = headers;
+  h.ctx = ctx;
+  curl_headers = _mapcache_http_setup_handle(ctx, curl_handle, req, data, headers ? &h : NULL, error_msg, !http_code);
+
   /* get it! */
   ret = curl_easy_perform(curl_handle);
   if(http_code)
     curl_easy_getinfo (curl_handle, CURLINFO_RESPONSE_CODE, http_code);
-  else
-    curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1);
 
   if(ret != CURLE_OK) {
     ctx->set_error(ctx, 502, "curl failed to request url %s : %s", req->url, error_msg);
   }
-  /* cleanup curl stuff */
-  curl_easy_cleanup(curl_handle);
+  /* give the handle back to the pool, keeping its connection open for the next request */
+  _mapcache_http_handle_release(ctx, ep, curl_handle, ret == CURLE_OK);
+  curl_slist_free_all(curl_headers);
+}
+
+struct mapcache_http_limit {
+  int max_in_flight;
+  int in_flight;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *released;
+#endif
+};
+
+mapcache_http_limit* mapcache_http_limit_create(mapcache_context *ctx, int max_in_flight)
+{
+  mapcache_http_limit *limit = apr_pcalloc(ctx->pool, sizeof(mapcache_http_limit));
+  limit->max_in_flight = max_in_flight;
+#ifdef APR_HAS_THREADS
+  if(apr_thread_mutex_create(&limit->mutex,APR_THREAD_MUTEX_DEFAULT,ctx->pool) != APR_SUCCESS ||
+      apr_thread_cond_create(&limit->released,ctx->pool) != APR_SUCCESS) {
+    ctx->set_error(ctx,500,"failed to create http request limit");
+    return NULL;
+  }
+#endif
+  return limit;
+}
+
+/*
+ * take a request slot. if none is available, waits for one to be released,
+ * or returns MAPCACHE_FALSE if block is false
+ */
+static int _mapcache_http_limit_acquire(mapcache_http_limit *limit, int block)
+{
+  if(!limit || !limit->max_in_flight) return MAPCACHE_TRUE;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(limit->mutex);
+#endif
+  while(limit->in_flight >= limit->max_in_flight) {
+    if(!block) {
+#ifdef APR_HAS_THREADS
+      apr_thread_mutex_unlock(limit->mutex);
+#endif
+      return MAPCACHE_FALSE;
+    }
+#ifdef APR_HAS_THREADS
+    apr_thread_cond_wait(limit->released,limit->mutex);
+#else
+    break;
+#endif
+  }
+  limit->in_flight++;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(limit->mutex);
+#endif
+  return MAPCACHE_TRUE;
+}
+
+static void _mapcache_http_limit_release(mapcache_http_limit *limit)
+{
+  if(!limit || !limit->max_in_flight) return;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(limit->mutex);
+#endif
+  limit->in_flight--;
+#ifdef APR_HAS_THREADS
+  apr_thread_cond_signal(limit->released);
+  apr_thread_mutex_unlock(limit->mutex);
+#endif
+}
+
+typedef struct {
+  mapcache_http_transfer *transfer;
+  mapcache_http_endpoint *ep;
+  CURL *curl_handle;
+  struct curl_slist *curl_headers;
+  char error_msg[CURL_ERROR_SIZE];
+} _mapcache_http_running_transfer;
+
+/*
+ * start a transfer on the multi handle. returns MAPCACHE_FALSE if it cannot be
+ * started without waiting and block is false
+ */
+static int _mapcache_http_transfer_start(mapcache_context *ctx, CURLM *multi, _mapcache_http_running_transfer *rt,
+    mapcache_http_limit *limit, int block)
+{
+  if(!_mapcache_http_limit_acquire(limit, block)) {
+    return MAPCACHE_FALSE;
+  }
+  rt->ep = _mapcache_http_endpoint_get(ctx, rt->transfer->req);
+  if(GC_HAS_ERROR(ctx)) {
+    _mapcache_http_limit_release(limit);
+    return MAPCACHE_FALSE;
+  }
+  rt->curl_handle = _mapcache_http_handle_acquire(ctx, rt->ep, block);
+  if(!rt->curl_handle) {
+    _mapcache_http_limit_release(limit);
+    return MAPCACHE_FALSE;
+  }
+  rt->curl_headers = _mapcache_http_setup_handle(ctx, rt->curl_handle, rt->transfer->req, rt->transfer->data,
+                     NULL, rt->error_msg, 1);
+  curl_easy_setopt(rt->curl_handle, CURLOPT_PRIVATE, rt);
+  if(curl_multi_add_handle(multi, rt->curl_handle) != CURLM_OK) {
+    ctx->set_error(ctx, 500, "failed to add request for %s to curl multi handle", rt->transfer->req->url);
+    curl_slist_free_all(rt->curl_headers);
+    _mapcache_http_handle_release(ctx, rt->ep, rt->curl_handle, 0);
+    _mapcache_http_limit_release(limit);
+    return MAPCACHE_FALSE;
+  }
+  return MAPCACHE_TRUE;
+}
+
+void mapcache_http_do_requests(mapcache_context *ctx, mapcache_http_transfer **transfers, int ntransfers,
+                               mapcache_http_limit *limit)
+{
+  CURLM *multi;
+  _mapcache_http_running_transfer *rts;
+  int next = 0, running = 0;
+
+  if(ntransfers == 1 && (!limit || !limit->max_in_flight)) {
+    /* no need for the multi machinery */
+    mapcache_http_do_request(ctx, transfers[0]->req, transfers[0]->data, NULL, NULL);
+    GC_CHECK_ERROR(ctx);
+    if(transfers[0]->done)
+      transfers[0]->done(ctx, transfers[0]);
+    return;
+  }
+
+  multi = curl_multi_init();
+  if(!multi) {
+    ctx->set_error(ctx, 500, "failed to create curl multi handle");
+    return;
+  }
+#if LIBCURL_VERSION_NUM >= 0x072b00
+  curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+  rts = apr_pcalloc(ctx->pool, ntransfers * sizeof(_mapcache_http_running_transfer));
+
+  while(1) {
+    int still_running, nmsgs;
+    CURLMsg *msg;
+
+    /* start as many transfers as the limits allow. only block on a limit if
+     * there is nothing else to wait for */
+    while(next < ntransfers && !GC_HAS_ERROR(ctx)) {
+      rts[next].transfer = transfers[next];
+      if(!_mapcache_http_transfer_start(ctx, multi, &rts[next], limit, running == 0))
+        break;
+      next++;
+      running++;
+    }
+    if(!running) break;
+
+    curl_multi_perform(multi, &still_running);
+    while((msg = curl_multi_info_read(multi, &nmsgs)) != NULL) {
+      _mapcache_http_running_transfer *rt;
+      if(msg->msg != CURLMSG_DONE) continue;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&rt);
+      curl_multi_remove_handle(multi, rt->curl_handle);
+      if(!GC_HAS_ERROR(ctx)) {
+        if(msg->data.result != CURLE_OK) {
+          ctx->set_error(ctx, 502, "curl failed to request url %s : %s", rt->transfer->req->url, rt->error_msg);
+        } else if(rt->transfer->done) {
+          /* process the response while the other transfers are running */
+          rt->transfer->done(ctx, rt->transfer);
+        }
+      }
+      _mapcache_http_handle_release(ctx, rt->ep, rt->curl_handle, msg->data.result == CURLE_OK);
+      curl_slist_free_all(rt->curl_headers);
+      _mapcache_http_limit_release(limit);
+      running--;
+    }
+    if(running && still_running) {
+      curl_multi_wait(multi, NULL, 0, 1000, NULL);
+    }
+  }
+  curl_multi_cleanup(multi);
 }
 
 void mapcache_http_do_request_with_params(mapcache_context *ctx, mapcache_http *req, apr_table_t *params,
@@ -344,6 +789,37 @@ mapcache_http* mapcache_http_configuration_parse_xml(mapcache_context *ctx, ezxm
     req->connection_timeout = 30;
   }
 
+  if ((http_node = ezxml_child(node,"max_connections")) != NULL) {
+    char *endptr;
+    req->max_connections = (int)strtol(http_node->txt,&endptr,10);
+    if(*endptr != 0 || req->max_connections<0) {
+      ctx->set_error(ctx,400,"invalid <http> <max_connections> \"%s\" (positive integer expected, 0 for unlimited)",
+                     http_node->txt);
+      return NULL;
+    }
+  }
+
+  req->keepalive = 1;
+  if ((http_node = ezxml_child(node,"keepalive")) != NULL) {
+    if(!strcasecmp(http_node->txt,"false")) {
+      req->keepalive = 0;
+    } else if(strcasecmp(http_node->txt,"true")) {
+      ctx->set_error(ctx,400,"invalid <http> <keepalive> \"%s\" (true or false expected)",
+                     http_node->txt);
+      return NULL;
+    }
+  }
+
+  if ((http_node = ezxml_child(node,"http2")) != NULL) {
+    if(!strcasecmp(http_node->txt,"true")) {
+      req->http2 = 1;
+    } else if(strcasecmp(http_node->txt,"false")) {
+      ctx->set_error(ctx,400,"invalid <http> <http2> \"%s\" (true or false expected)",
+                     http_node->txt);
+      return NULL;
+    }
+  }
+
   req->headers = apr_table_make(ctx->pool,1);
   if((http_node = ezxml_child(node,"headers")) != NULL) {
     ezxml_t header_node;
@@ -362,6 +838,9 @@ mapcache_http* mapcache_http_clone(mapcache_context *ctx, mapcache_http *orig)
   ret->headers = apr_table_clone(ctx->pool,orig->headers);
   ret->url = apr_pstrdup(ctx->pool, orig->url);
   ret->connection_timeout = orig->connection_timeout;
+  ret->max_connections = orig->max_connections;
+  ret->keepalive = orig->keepalive;
+  ret->http2 = orig->http2;
   return ret;
 }
 
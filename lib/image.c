@@ -32,6 +32,20 @@
 #include <pixman.h>
 #else
 #include <math.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MAPCACHE_IMAGE_SSE2
+#include <emmintrin.h>
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+/* AVX2 kernels are compiled with a function target attribute and selected at runtime */
+#define MAPCACHE_IMAGE_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(MAPCACHE_ENABLE_NEON) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+/* the NEON kernel has not been checked against the scalar merge yet, it is only
+ * built when requested with CFLAGS=-DMAPCACHE_ENABLE_NEON */
+#define MAPCACHE_IMAGE_NEON
+#include <arm_neon.h>
+#endif
 #endif
 
 mapcache_image* mapcache_image_create(mapcache_context *ctx)
@@ -76,6 +90,173 @@ int mapcache_image_has_alpha(mapcache_image *img)
   }
 }
 
+#ifndef USE_PIXMAN
+/*
+ * compositing of a row of overlay pixels onto base pixels. for each channel,
+ * including alpha: c = o + (((255-oa)*b)>>8), pixels with a null alpha leave
+ * the base untouched. the vector kernels must give the same results as the
+ * scalar version
+ */
+typedef void (*_image_merge_row_func)(unsigned char *bptr, const unsigned char *optr, int n);
+
+static void _image_merge_row(unsigned char *bptr, const unsigned char *optr, int n)
+{
+  int j;
+  for(j=0; j<n; j++) {
+    if(optr[3]) { /* if overlay is not completely transparent */
+      if(optr[3] == 255) {
+        bptr[0]=optr[0];
+        bptr[1]=optr[1];
+        bptr[2]=optr[2];
+        bptr[3]=optr[3];
+      } else {
+        unsigned int br = bptr[0];
+        unsigned int bg = bptr[1];
+        unsigned int bb = bptr[2];
+        unsigned int ba = bptr[3];
+        unsigned int or = optr[0];
+        unsigned int og = optr[1];
+        unsigned int ob = optr[2];
+        unsigned int oa = optr[3];
+        bptr[0] = (unsigned char)(or + (((255-oa)*br)>>8));
+        bptr[1] = (unsigned char)(og + (((255-oa)*bg)>>8));
+        bptr[2] = (unsigned char)(ob + (((255-oa)*bb)>>8));
+
+        bptr[3] = oa+((ba*(255-oa))>>8);
+      }
+    }
+    bptr+=4;
+    optr+=4;
+  }
+}
+
+#ifdef MAPCACHE_IMAGE_SSE2
+/* blend 2 pixels unpacked to 16 bits */
+static inline __m128i _image_merge_blend_sse2(__m128i o, __m128i b)
+{
+  __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(o, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+  __m128i inva = _mm_sub_epi16(_mm_set1_epi16(255), a);
+  __m128i c = _mm_add_epi16(o, _mm_srli_epi16(_mm_mullo_epi16(inva, b), 8));
+  /* the scalar version truncates to 8 bits, packus would saturate */
+  return _mm_and_si128(c, _mm_set1_epi16(0xff));
+}
+
+static void _image_merge_row_sse2(unsigned char *bptr, const unsigned char *optr, int n)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i opaque = _mm_set1_epi32(0xff);
+  int j;
+  for(j=0; j+4<=n; j+=4, bptr+=16, optr+=16) {
+    __m128i o = _mm_loadu_si128((const __m128i*)optr);
+    __m128i a = _mm_srli_epi32(o, 24);
+    __m128i transparent = _mm_cmpeq_epi32(a, zero);
+    int tmask = _mm_movemask_epi8(transparent);
+    __m128i b, c;
+    if(tmask == 0xffff) continue;
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(a, opaque)) == 0xffff) {
+      _mm_storeu_si128((__m128i*)bptr, o);
+      continue;
+    }
+    b = _mm_loadu_si128((const __m128i*)bptr);
+    c = _mm_packus_epi16(_image_merge_blend_sse2(_mm_unpacklo_epi8(o, zero), _mm_unpacklo_epi8(b, zero)),
+                         _image_merge_blend_sse2(_mm_unpackhi_epi8(o, zero), _mm_unpackhi_epi8(b, zero)));
+    if(tmask) {
+      /* keep the base pixels under transparent overlay pixels */
+      c = _mm_or_si128(_mm_and_si128(transparent, b), _mm_andnot_si128(transparent, c));
+    }
+    _mm_storeu_si128((__m128i*)bptr, c);
+  }
+  _image_merge_row(bptr, optr, n-j);
+}
+#endif
+
+#ifdef MAPCACHE_IMAGE_AVX2
+__attribute__((target("avx2")))
+static inline __m256i _image_merge_blend_avx2(__m256i o, __m256i b)
+{
+  const __m256i alpha = _mm256_setr_epi8(6,7,6,7,6,7,6,7,14,15,14,15,14,15,14,15,
+                                         6,7,6,7,6,7,6,7,14,15,14,15,14,15,14,15);
+  __m256i inva = _mm256_sub_epi16(_mm256_set1_epi16(255), _mm256_shuffle_epi8(o, alpha));
+  __m256i c = _mm256_add_epi16(o, _mm256_srli_epi16(_mm256_mullo_epi16(inva, b), 8));
+  return _mm256_and_si256(c, _mm256_set1_epi16(0xff));
+}
+
+__attribute__((target("avx2")))
+static void _image_merge_row_avx2(unsigned char *bptr, const unsigned char *optr, int n)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i opaque = _mm256_set1_epi32(0xff);
+  int j;
+  for(j=0; j+8<=n; j+=8, bptr+=32, optr+=32) {
+    __m256i o = _mm256_loadu_si256((const __m256i*)optr);
+    __m256i a = _mm256_srli_epi32(o, 24);
+    __m256i transparent = _mm256_cmpeq_epi32(a, zero);
+    unsigned int tmask = (unsigned int)_mm256_movemask_epi8(transparent);
+    __m256i b, c;
+    if(tmask == 0xffffffffu) continue;
+    if((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, opaque)) == 0xffffffffu) {
+      _mm256_storeu_si256((__m256i*)bptr, o);
+      continue;
+    }
+    b = _mm256_loadu_si256((const __m256i*)bptr);
+    /* unpack and pack work within 128 bit lanes, so the pixel order is preserved */
+    c = _mm256_packus_epi16(_image_merge_blend_avx2(_mm256_unpacklo_epi8(o, zero), _mm256_unpacklo_epi8(b, zero)),
+                            _image_merge_blend_avx2(_mm256_unpackhi_epi8(o, zero), _mm256_unpackhi_epi8(b, zero)));
+    if(tmask) {
+      c = _mm256_blendv_epi8(c, b, transparent);
+    }
+    _mm256_storeu_si256((__m256i*)bptr, c);
+  }
+  _image_merge_row(bptr, optr, n-j);
+}
+#endif
+
+#ifdef MAPCACHE_IMAGE_NEON
+static void _image_merge_row_neon(unsigned char *bptr, const unsigned char *optr, int n)
+{
+  int j;
+  for(j=0; j+4<=n; j+=4, bptr+=16, optr+=16) {
+    uint8x16_t o = vld1q_u8(optr);
+    uint32x4_t a = vshrq_n_u32(vreinterpretq_u32_u8(o), 24);
+    uint32x4_t transparent = vceqq_u32(a, vdupq_n_u32(0));
+    uint32x4_t opaque = vceqq_u32(a, vdupq_n_u32(0xff));
+    uint64x2_t t64 = vreinterpretq_u64_u32(transparent);
+    uint64x2_t o64 = vreinterpretq_u64_u32(opaque);
+    uint8x16_t b, inva, c;
+    if((vgetq_lane_u64(t64,0) & vgetq_lane_u64(t64,1)) == ~(uint64_t)0) continue;
+    if((vgetq_lane_u64(o64,0) & vgetq_lane_u64(o64,1)) == ~(uint64_t)0) {
+      vst1q_u8(bptr, o);
+      continue;
+    }
+    b = vld1q_u8(bptr);
+    /* replicate the alpha to the 4 channels, and invert it: 255-a == ~a */
+    inva = vmvnq_u8(vreinterpretq_u8_u32(vmulq_n_u32(a, 0x01010101)));
+    c = vcombine_u8(vshrn_n_u16(vmull_u8(vget_low_u8(inva), vget_low_u8(b)), 8),
+                    vshrn_n_u16(vmull_u8(vget_high_u8(inva), vget_high_u8(b)), 8));
+    /* 8 bit addition wraps like the scalar truncation */
+    c = vaddq_u8(o, c);
+    c = vbslq_u8(vreinterpretq_u8_u32(transparent), b, c);
+    vst1q_u8(bptr, c);
+  }
+  _image_merge_row(bptr, optr, n-j);
+}
+#endif
+
+static _image_merge_row_func _image_get_merge_row_func(void)
+{
+#ifdef MAPCACHE_IMAGE_AVX2
+  if(__builtin_cpu_supports("avx2")) return _image_merge_row_avx2;
+#endif
+#if defined(MAPCACHE_IMAGE_SSE2)
+  return _image_merge_row_sse2;
+#elif defined(MAPCACHE_IMAGE_NEON)
+  return _image_merge_row_neon;
+#else
+  return _image_merge_row;
+#endif
+}
+#endif
+
 void mapcache_image_merge(mapcache_context *ctx, mapcache_image *base, mapcache_image *overlay)
 {
   if (base->is_elevation ==  MC_ELEVATION_YES || overlay->is_elevation ==  MC_ELEVATION_YES) {
@@ -84,8 +265,9 @@ void mapcache_image_merge(mapcache_context *ctx, mapcache_image *base, mapcache_
   
   int starti,startj;
 #ifndef USE_PIXMAN
-  int i,j;
-  unsigned char *browptr, *orowptr, *bptr, *optr;
+  int i;
+  unsigned char *browptr, *orowptr;
+  _image_merge_row_func merge_row;
 #endif
 
   if(base->w < overlay->w || base->h < overlay->h) {
@@ -112,37 +294,11 @@ void mapcache_image_merge(mapcache_context *ctx, mapcache_image *base, mapcache_
 #else
 
 
+  merge_row = _image_get_merge_row_func();
   browptr = base->data + starti * base->stride + startj*4;
   orowptr = overlay->data;
   for(i=0; i<overlay->h; i++) {
-    bptr = browptr;
-    optr = orowptr;
-    for(j=0; j<overlay->w; j++) {
-      if(optr[3]) { /* if overlay is not completely transparent */
-        if(optr[3] == 255) {
-          bptr[0]=optr[0];
-          bptr[1]=optr[1];
-          bptr[2]=optr[2];
-          bptr[3]=optr[3];
-        } else if(optr[3] != 0) {
-          unsigned int br = bptr[0];
-          unsigned int bg = bptr[1];
-          unsigned int bb = bptr[2];
-          unsigned int ba = bptr[3];
-          unsigned int or = optr[0];
-          unsigned int og = optr[1];
-          unsigned int ob = optr[2];
-          unsigned int oa = optr[3];
-          bptr[0] = (unsigned char)(or + (((255-oa)*br)>>8));
-          bptr[1] = (unsigned char)(og + (((255-oa)*bg)>>8));
-          bptr[2] = (unsigned char)(ob + (((255-oa)*bb)>>8));
-
-          bptr[3] = oa+((ba*(255-oa))>>8);
-        }
-      }
-      bptr+=4;
-      optr+=4;
-    }
+    merge_row(browptr, orowptr, overlay->w);
     browptr += base->stride;
     orowptr += overlay->stride;
   }
@@ -150,46 +306,170 @@ void mapcache_image_merge(mapcache_context *ctx, mapcache_image *base, mapcache_
 }
 
 #ifndef USE_PIXMAN
-#ifndef _WIN32
-static inline void bilinear_pixel(mapcache_image *img, double x, double y, unsigned char *dst)
+/*
+ * the resamplers map destination pixel x to source coordinate (x-off)/scale.
+ * the per-column source positions and weights are computed once per call
+ * instead of once per pixel, and only the span of destination columns that
+ * falls inside the source image is visited. as the mapping is monotonic, that
+ * span is contiguous.
+ */
+
+typedef void (*_image_nearest_row_func)(unsigned int *dst, const unsigned int *src, const int *xidx, int n);
+
+static void _image_nearest_row(unsigned int *dst, const unsigned int *src, const int *xidx, int n)
 {
-#else
-static __inline void bilinear_pixel(mapcache_image *img, double x, double y, unsigned char *dst)
+  int i;
+  for(i=0; i<n; i++) {
+    dst[i] = src[xidx[i]];
+  }
+}
+
+#ifdef MAPCACHE_IMAGE_AVX2
+__attribute__((target("avx2")))
+static void _image_nearest_row_avx2(unsigned int *dst, const unsigned int *src, const int *xidx, int n)
+{
+  int i;
+  for(i=0; i+8<=n; i+=8) {
+    __m256i idx = _mm256_loadu_si256((const __m256i*)(xidx+i));
+    _mm256_storeu_si256((__m256i*)(dst+i), _mm256_i32gather_epi32((const int*)src, idx, 4));
+  }
+  _image_nearest_row(dst+i, src, xidx+i, n-i);
+}
+#endif
+
+/*
+ * bilinear interpolation is done in two separable passes with 8 bit weights:
+ *  - horizontal: each needed source row is interpolated at the destination
+ *    columns into 16 bit values (p0*(256-wx) + p1*wx)
+ *  - vertical: two such rows are blended into the destination row
+ *    ((h0*(256-wy) + h1*wy) >> 16)
+ * the horizontal rows are cached, so that when upscaling consecutive
+ * destination rows reuse them, and when downscaling only the source rows
+ * that are actually sampled get interpolated.
+ */
+typedef void (*_image_bilinear_vrow_func)(unsigned char *dst, const unsigned short *h0, const unsigned short *h1,
+    unsigned int wy, int n);
+
+static void _image_bilinear_hrow(unsigned short *h, const unsigned char *src, const int *xofs, const int *xofs1,
+                                 const unsigned short *wx, int n)
+{
+  int i,c;
+  for(i=0; i<n; i++) {
+    const unsigned char *p0 = src + xofs[i], *p1 = src + xofs1[i];
+    unsigned int w1 = wx[i], w0 = 256 - w1;
+    for(c=0; c<4; c++) {
+      h[c] = (unsigned short)(p0[c]*w0 + p1[c]*w1);
+    }
+    h += 4;
+  }
+}
+
+static void _image_bilinear_vrow(unsigned char *dst, const unsigned short *h0, const unsigned short *h1,
+                                 unsigned int wy, int n)
+{
+  int i;
+  unsigned int wy0 = 256 - wy;
+  for(i=0; i<n; i++) {
+    dst[i] = (unsigned char)((h0[i]*wy0 + h1[i]*wy) >> 16);
+  }
+}
+
+#ifdef MAPCACHE_IMAGE_SSE2
+/* 8 channels: (h0*w0 + h1*w1) >> 16, as 32 bit */
+static inline __m128i _image_bilinear_vblend_sse2(__m128i h0, __m128i h1, __m128i w0, __m128i w1,
+    __m128i *hi)
+{
+  __m128i l0 = _mm_mullo_epi16(h0, w0), u0 = _mm_mulhi_epu16(h0, w0);
+  __m128i l1 = _mm_mullo_epi16(h1, w1), u1 = _mm_mulhi_epu16(h1, w1);
+  *hi = _mm_srli_epi32(_mm_add_epi32(_mm_unpackhi_epi16(l0, u0), _mm_unpackhi_epi16(l1, u1)), 16);
+  return _mm_srli_epi32(_mm_add_epi32(_mm_unpacklo_epi16(l0, u0), _mm_unpacklo_epi16(l1, u1)), 16);
+}
+
+static void _image_bilinear_vrow_sse2(unsigned char *dst, const unsigned short *h0, const unsigned short *h1,
+                                      unsigned int wy, int n)
+{
+  /* 256 does not fit the signed saturating packs, but the weights are only used in unsigned multiplies */
+  const __m128i w0 = _mm_set1_epi16((short)(256 - wy)), w1 = _mm_set1_epi16((short)wy);
+  int i;
+  for(i=0; i+16<=n; i+=16) {
+    __m128i a_hi, b_hi, a, b;
+    a = _image_bilinear_vblend_sse2(_mm_loadu_si128((const __m128i*)(h0+i)), _mm_loadu_si128((const __m128i*)(h1+i)),
+                                    w0, w1, &a_hi);
+    b = _image_bilinear_vblend_sse2(_mm_loadu_si128((const __m128i*)(h0+i+8)), _mm_loadu_si128((const __m128i*)(h1+i+8)),
+                                    w0, w1, &b_hi);
+    /* values are <= 255, the signed packs cannot saturate */
+    _mm_storeu_si128((__m128i*)(dst+i), _mm_packus_epi16(_mm_packs_epi32(a, a_hi), _mm_packs_epi32(b, b_hi)));
+  }
+  _image_bilinear_vrow(dst+i, h0+i, h1+i, wy, n-i);
+}
+#endif
+
+#ifdef MAPCACHE_IMAGE_AVX2
+__attribute__((target("avx2")))
+static inline __m256i _image_bilinear_vblend_avx2(__m256i h0, __m256i h1, __m256i w0, __m256i w1,
+    __m256i *hi)
+{
+  __m256i l0 = _mm256_mullo_epi16(h0, w0), u0 = _mm256_mulhi_epu16(h0, w0);
+  __m256i l1 = _mm256_mullo_epi16(h1, w1), u1 = _mm256_mulhi_epu16(h1, w1);
+  *hi = _mm256_srli_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(l0, u0), _mm256_unpackhi_epi16(l1, u1)), 16);
+  return _mm256_srli_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(l0, u0), _mm256_unpacklo_epi16(l1, u1)), 16);
+}
+
+__attribute__((target("avx2")))
+static void _image_bilinear_vrow_avx2(unsigned char *dst, const unsigned short *h0, const unsigned short *h1,
+                                      unsigned int wy, int n)
 {
+  const __m256i w0 = _mm256_set1_epi16((short)(256 - wy)), w1 = _mm256_set1_epi16((short)wy);
+  int i;
+  for(i=0; i+32<=n; i+=32) {
+    __m256i a_hi, b_hi, a, b;
+    a = _image_bilinear_vblend_avx2(_mm256_loadu_si256((const __m256i*)(h0+i)), _mm256_loadu_si256((const __m256i*)(h1+i)),
+                                    w0, w1, &a_hi);
+    b = _image_bilinear_vblend_avx2(_mm256_loadu_si256((const __m256i*)(h0+i+16)), _mm256_loadu_si256((const __m256i*)(h1+i+16)),
+                                    w0, w1, &b_hi);
+    /* the unpacks and packs are all lane local, so the element order is restored */
+    _mm256_storeu_si256((__m256i*)(dst+i), _mm256_permute4x64_epi64(
+                          _mm256_packus_epi16(_mm256_packs_epi32(a, a_hi), _mm256_packs_epi32(b, b_hi)),
+                          _MM_SHUFFLE(3,1,2,0)));
+  }
+  _image_bilinear_vrow(dst+i, h0+i, h1+i, wy, n-i);
+}
 #endif
+static _image_nearest_row_func _image_get_nearest_row_func(void)
+{
+#ifdef MAPCACHE_IMAGE_AVX2
+  if(__builtin_cpu_supports("avx2")) return _image_nearest_row_avx2;
+#endif
+  return _image_nearest_row;
+}
 
-  int px,py;
-  int px1, py1;
-  unsigned char *p1, *p2, *p3, *p4;
-  float fx, fy, fx1, fy1;
-  int w1, w2, w3, w4;
-  px = (int)x;
-  py = (int)y;
-
-  px1 = (px==(img->w-1))?(px):(px+1);
-  py1 = (py==(img->h-1))?(py):(py+1);
-
-  p1 = &img->data[py*img->stride+px*4];
-  p2 = &img->data[py*img->stride+px1*4];
-  p3 = &img->data[py1*img->stride+px*4];
-  p4 = &img->data[py1*img->stride+px1*4];
-
-  // Calculate the weights for each pixel
-  fx = x - px;
-  fy = y - py;
-  fx1 = 1.0f - fx;
-  fy1 = 1.0f - fy;
-
-  w1 = fx1 * fy1 * 256.0f;
-  w2 = fx  * fy1 * 256.0f;
-  w3 = fx1 * fy  * 256.0f;
-  w4 = fx  * fy  * 256.0f;
-
-  // Calculate the weighted sum of pixels (for each color channel)
-  dst[0] = (p1[0] * w1 + p2[0] * w2 + p3[0] * w3 + p4[0] * w4) >> 8;
-  dst[1] = (p1[1] * w1 + p2[1] * w2 + p3[1] * w3 + p4[1] * w4) >> 8;
-  dst[2] = (p1[2] * w1 + p2[2] * w2 + p3[2] * w3 + p4[2] * w4) >> 8;
-  dst[3] = (p1[3] * w1 + p2[3] * w2 + p3[3] * w3 + p4[3] * w4) >> 8;
+static _image_bilinear_vrow_func _image_get_bilinear_vrow_func(void)
+{
+#ifdef MAPCACHE_IMAGE_AVX2
+  if(__builtin_cpu_supports("avx2")) return _image_bilinear_vrow_avx2;
+#endif
+#if defined(MAPCACHE_IMAGE_SSE2)
+  return _image_bilinear_vrow_sse2;
+#else
+  return _image_bilinear_vrow;
+#endif
+}
+
+/*
+ * returns the horizontally interpolated source row py, from one of the two
+ * cached rows if it is there, else computed into the slot that is not used
+ * by the other row needed for the current destination row
+ */
+static unsigned short* _image_bilinear_cached_hrow(mapcache_image *src, unsigned short **rows, int *keys, int py, int keep,
+    const int *xofs, const int *xofs1, const unsigned short *wx, int n)
+{
+  int slot;
+  if(keys[0] == py) return rows[0];
+  if(keys[1] == py) return rows[1];
+  slot = (keys[0] == keep)?1:0;
+  _image_bilinear_hrow(rows[slot], src->data + py*src->stride, xofs, xofs1, wx, n);
+  keys[slot] = py;
+  return rows[slot];
 }
 #endif
 
@@ -211,19 +491,39 @@ void mapcache_image_copy_resampled_nearest(mapcache_context *ctx, mapcache_image
   pixman_image_unref(si);
   pixman_image_unref(bi);
 #else
-  int dstx,dsty;
-  unsigned char *dstrowptr = dst->data;
+  int dstx,dsty,x0,x1,n;
+  int prevy = -1;
+  int *xidx;
+  unsigned char *dstrowptr = dst->data, *prevrowptr = NULL;
+  _image_nearest_row_func nearest_row;
+
+  /* source column of each destination column, and the span of valid ones */
+  xidx = apr_palloc(ctx->pool, dst->w * sizeof(int));
+  x0 = x1 = 0;
+  for(dstx=0; dstx<dst->w; dstx++) {
+    int srcx = (int)(((dstx-off_x)/scale_x)+0.5);
+    if(srcx >= 0 && srcx < src->w) {
+      if(x1 == x0) x0 = dstx;
+      xidx[dstx] = srcx;
+      x1 = dstx + 1;
+    }
+  }
+  n = x1 - x0;
+  if(n <= 0) return;
+  nearest_row = _image_get_nearest_row_func();
+
   for(dsty=0; dsty<dst->h; dsty++) {
-    int *dstptr = (int*)dstrowptr;
     int srcy = (int)(((dsty-off_y)/scale_y)+0.5);
     if(srcy >= 0 && srcy < src->h) {
-      for(dstx=0; dstx<dst->w; dstx++) {
-        int srcx = (int)(((dstx-off_x)/scale_x)+0.5);
-        if(srcx >= 0 && srcx < src->w) {
-          *dstptr = *((int*)&(src->data[srcy*src->stride+srcx*4]));
-        }
-        dstptr ++;
+      unsigned int *dstptr = ((unsigned int*)dstrowptr) + x0;
+      if(srcy == prevy) {
+        /* upscaling, the row is the same as the previous one */
+        memcpy(dstptr, ((unsigned int*)prevrowptr) + x0, n * 4);
+      } else {
+        nearest_row(dstptr, (const unsigned int*)(src->data + srcy*src->stride), xidx + x0, n);
       }
+      prevy = srcy;
+      prevrowptr = dstrowptr;
     }
     dstrowptr += dst->stride;
   }
@@ -249,19 +549,44 @@ void mapcache_image_copy_resampled_bilinear(mapcache_context *ctx, mapcache_imag
   pixman_image_unref(si);
   pixman_image_unref(bi);
 #else
-  int dstx,dsty;
+  int dstx,dsty,x0,x1,n;
+  int *xofs, *xofs1;
+  unsigned short *wx, *rows[2];
+  int keys[2] = {-1,-1};
   unsigned char *dstrowptr = dst->data;
+  _image_bilinear_vrow_func vrow;
+
+  /* source columns and 8 bit weights of each destination column of the valid span */
+  xofs = apr_palloc(ctx->pool, dst->w * sizeof(int));
+  xofs1 = apr_palloc(ctx->pool, dst->w * sizeof(int));
+  wx = apr_palloc(ctx->pool, dst->w * sizeof(unsigned short));
+  x0 = x1 = 0;
+  for(dstx=0; dstx<dst->w; dstx++) {
+    double srcx = (dstx-off_x)/scale_x;
+    if(srcx >= 0 && srcx < src->w) {
+      int px = (int)srcx;
+      if(x1 == x0) x0 = dstx;
+      n = dstx - x0;
+      xofs[n] = px*4;
+      xofs1[n] = (px==(src->w-1))?(px*4):(px*4+4);
+      wx[n] = (unsigned short)((srcx - px) * 256);
+      x1 = dstx + 1;
+    }
+  }
+  n = x1 - x0;
+  if(n <= 0) return;
+  rows[0] = apr_palloc(ctx->pool, n * 4 * sizeof(unsigned short));
+  rows[1] = apr_palloc(ctx->pool, n * 4 * sizeof(unsigned short));
+  vrow = _image_get_bilinear_vrow_func();
+
   for(dsty=0; dsty<dst->h; dsty++) {
-    unsigned char *dstptr = dstrowptr;
     double srcy = (dsty-off_y)/scale_y;
     if(srcy >= 0 && srcy < src->h) {
-      for(dstx=0; dstx<dst->w; dstx++) {
-        double srcx = (dstx-off_x)/scale_x;
-        if(srcx >= 0 && srcx < src->w) {
-          bilinear_pixel(src,srcx,srcy,dstptr);
-        }
-        dstptr += 4;
-      }
+      int py = (int)srcy;
+      int py1 = (py==(src->h-1))?(py):(py+1);
+      unsigned short *h0 = _image_bilinear_cached_hrow(src, rows, keys, py, py1, xofs, xofs1, wx, n);
+      unsigned short *h1 = _image_bilinear_cached_hrow(src, rows, keys, py1, py, xofs, xofs1, wx, n);
+      vrow(dstrowptr + x0*4, h0, h1, (unsigned int)((srcy - py) * 256), n*4);
     }
     dstrowptr += dst->stride;
   }
@@ -31,6 +31,28 @@
 #include <apr_file_io.h>
 #include <apr_strings.h>
 #include <apr_time.h>
+#include <apr_portable.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/file.h>
+#include <errno.h>
+#endif
+
+#if !defined(_WIN32) && defined(_POSIX_THREAD_PROCESS_SHARED) && (_POSIX_THREAD_PROCESS_SHARED > 0)
+#define USE_SHM_LOCKER
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <stdio.h>
+#if defined(PTHREAD_MUTEX_ROBUST) || (defined(_POSIX_THREAD_ROBUST_PRIO_INHERIT) && _POSIX_THREAD_ROBUST_PRIO_INHERIT > 0)
+#define USE_ROBUST_MUTEX
+#endif
+#endif
 
 char* lock_filename_for_resource(mapcache_context *ctx, const char *resource)
 {
@@ -46,7 +68,12 @@ char* lock_filename_for_resource(mapcache_context *ctx, const char *resource)
                       ctx->config->lockdir,saferes);
 }
 
-int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource)
+/*
+ * disk locker: the lock is a file created with O_EXCL in the lock directory,
+ * waiters poll for its removal every lock_retry microseconds.
+ */
+
+static int _mapcache_locker_disk_lock_or_wait(mapcache_context *ctx, mapcache_locker *self, char *resource)
 {
   char *lockname = lock_filename_for_resource(ctx,resource);
   apr_file_t *lockfile;
@@ -55,19 +82,24 @@ int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource)
   rv = apr_file_open(&lockfile,lockname,APR_WRITE|APR_CREATE|APR_EXCL|APR_XTHREAD,APR_OS_DEFAULT,ctx->pool);
 
   /* if the file already exists, wait for it to disappear */
-  /* TODO: check the lock isn't stale (i.e. too old) */
   if( rv != APR_SUCCESS ) {
     apr_finfo_t info;
-    rv = apr_stat(&info,lockname,0,ctx->pool);
+    rv = apr_stat(&info,lockname,APR_FINFO_MTIME,ctx->pool);
 #ifdef DEBUG
     if(!APR_STATUS_IS_ENOENT(rv)) {
       ctx->log(ctx, MAPCACHE_DEBUG, "waiting on resource lock %s", resource);
     }
 #endif
     while(!APR_STATUS_IS_ENOENT(rv)) {
+      if(rv == APR_SUCCESS && self && self->timeout > 0 && apr_time_now() - info.mtime > self->timeout) {
+        /* the process holding the lock has crashed or is hanging, take it over */
+        ctx->log(ctx, MAPCACHE_WARN, "removing stale lockfile %s", lockname);
+        apr_file_remove(lockname,ctx->pool);
+        return _mapcache_locker_disk_lock_or_wait(ctx,self,resource);
+      }
       /* sleep for the configured number of micro-seconds (default is 1/100th of a second) */
       apr_sleep(ctx->config->lock_retry_interval);
-      rv = apr_stat(&info,lockname,0,ctx->pool);
+      rv = apr_stat(&info,lockname,APR_FINFO_MTIME,ctx->pool);
     }
     return MAPCACHE_FALSE;
   } else {
@@ -77,11 +109,492 @@ int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource)
   }
 }
 
-void mapcache_unlock_resource(mapcache_context *ctx, char *resource)
+static void _mapcache_locker_disk_unlock(mapcache_context *ctx, mapcache_locker *self, char *resource)
 {
   char *lockname = lock_filename_for_resource(ctx,resource);
   apr_file_remove(lockname,ctx->pool);
 }
 
+static void _mapcache_locker_disk_configuration_parse_xml(mapcache_context *ctx, mapcache_locker *self, ezxml_t node)
+{
+  /* the lock directory and retry interval are set by the global <lock_dir> and <lock_retry> */
+}
+
+mapcache_locker* mapcache_locker_disk_create(mapcache_context *ctx)
+{
+  mapcache_locker *locker = apr_pcalloc(ctx->pool, sizeof(mapcache_locker));
+  locker->type = MAPCACHE_LOCKER_DISK;
+  locker->timeout = apr_time_from_sec(120);
+  locker->lock_or_wait = _mapcache_locker_disk_lock_or_wait;
+  locker->unlock = _mapcache_locker_disk_unlock;
+  locker->configuration_parse_xml = _mapcache_locker_disk_configuration_parse_xml;
+  return locker;
+}
+
+#ifdef USE_SHM_LOCKER
+
+/*
+ * shm locker: a hash table of lock slots in POSIX shared memory, shared by
+ * all the processes on the host that use the same shm name. Each slot is
+ * protected by a process shared (and if possible robust) mutex and has a
+ * condition variable that is signaled when one of its locks is released,
+ * so waiters wake up as soon as the tile is rendered instead of polling.
+ * Resources are identified by a 64 bit hash of their name; a (very unlikely)
+ * collision only makes a request wait for an unrelated render.
+ */
+
+#define MAPCACHE_SHM_LOCK_MAGIC 0x4d434c32
+#define MAPCACHE_SHM_LOCK_ENTRIES 8
+
+typedef struct {
+  apr_uint64_t hash;  /* 0 for an unused entry */
+  pid_t pid;          /* process holding the lock */
+  apr_uint64_t pidns; /* pid namespace of the process, 0 if unknown */
+  apr_uint64_t start; /* start time of the process, 0 if unknown */
+  apr_time_t time;    /* when the lock was acquired */
+} mapcache_shm_lock_entry;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t released;
+  mapcache_shm_lock_entry entries[MAPCACHE_SHM_LOCK_ENTRIES];
+} mapcache_shm_lock_slot;
+
+typedef struct {
+  volatile int magic; /* set once the slots are initialized */
+  int nslots;
+} mapcache_shm_lock_header;
+
+typedef struct {
+  mapcache_shm_lock_header *header;
+  mapcache_shm_lock_slot *slots;
+  int nslots;
+} mapcache_shm_lock_table;
+
+typedef struct {
+  mapcache_locker locker;
+  char *name;   /* name of the shared memory object */
+  int nslots;   /* configured number of slots of the hash table */
+  /* mapping of the table in this process, published once it is fully
+     initialized: table.header is NULL until then */
+  mapcache_shm_lock_table table;
+} mapcache_locker_shm;
+
+static apr_uint64_t _mapcache_shm_lock_hash(const char *resource)
+{
+  /* FNV-1a */
+  apr_uint64_t hash = APR_UINT64_C(14695981039346656037);
+  while(*resource) {
+    hash ^= (unsigned char)*resource++;
+    hash *= APR_UINT64_C(1099511628211);
+  }
+  return hash ? hash : 1;
+}
+
+/*
+ * removes the shared memory object name if it still is the one opened as fd.
+ * the check and the removal are done while holding an exclusive lock on the
+ * object, so that of several processes finding the same stale object only the
+ * first one removes it, and none of them removes an object created in its place
+ */
+static void _mapcache_shm_lock_unlink_stale(const char *name, int fd)
+{
+  struct stat stale, current;
+  int cfd;
+  if(flock(fd, LOCK_EX) != 0) return;
+  if(fstat(fd, &stale) == 0 && (cfd = shm_open(name, O_RDWR, 0600)) >= 0) {
+    if(fstat(cfd, &current) == 0 && current.st_dev == stale.st_dev && current.st_ino == stale.st_ino) {
+      shm_unlink(name);
+    }
+    close(cfd);
+  }
+  flock(fd, LOCK_UN);
+}
+
+/*
+ * maps the lock table, creating it if needed, into table. if recreate is set,
+ * a table whose creator did not complete its initialization in time (e.g.
+ * because it crashed) is removed and created again
+ */
+static int _mapcache_shm_lock_init_table(mapcache_context *ctx, mapcache_locker_shm *shm,
+    mapcache_shm_lock_table *table, int recreate)
+{
+  size_t size = sizeof(mapcache_shm_lock_header) + shm->nslots * sizeof(mapcache_shm_lock_slot);
+  mapcache_shm_lock_header *header;
+  mapcache_shm_lock_slot *slots;
+  int creator = 1, i, fd;
+  void *addr;
+
+  fd = shm_open(shm->name, O_RDWR|O_CREAT|O_EXCL, 0600);
+  if(fd < 0 && errno == EEXIST) {
+    creator = 0;
+    fd = shm_open(shm->name, O_RDWR, 0600);
+  }
+  if(fd < 0) {
+    ctx->set_error(ctx,500,"shm locker: failed to open shared memory %s: %s", shm->name, strerror(errno));
+    return MAPCACHE_FAILURE;
+  }
+  if(creator && ftruncate(fd, size) != 0) {
+    ctx->set_error(ctx,500,"shm locker: failed to size shared memory %s: %s", shm->name, strerror(errno));
+    close(fd);
+    shm_unlink(shm->name);
+    return MAPCACHE_FAILURE;
+  }
+  if(!creator) {
+    /* wait for the creating process to size the object */
+    struct stat st;
+    for(i=0; i<1000; i++) {
+      if(fstat(fd,&st) == 0 && st.st_size >= (off_t)sizeof(mapcache_shm_lock_header)) break;
+      apr_sleep(1000);
+    }
+    if(i == 1000) {
+      if(recreate) {
+        ctx->log(ctx, MAPCACHE_WARN, "shm locker: shared memory %s was never sized, recreating it", shm->name);
+        _mapcache_shm_lock_unlink_stale(shm->name, fd);
+        close(fd);
+        return _mapcache_shm_lock_init_table(ctx, shm, table, 0);
+      }
+      ctx->set_error(ctx,500,"shm locker: shared memory %s was not initialized", shm->name);
+      close(fd);
+      return MAPCACHE_FAILURE;
+    }
+    size = st.st_size;
+  }
+  addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(addr == MAP_FAILED) {
+    ctx->set_error(ctx,500,"shm locker: failed to map shared memory %s: %s", shm->name, strerror(errno));
+    close(fd);
+    return MAPCACHE_FAILURE;
+  }
+  header = addr;
+  slots = (mapcache_shm_lock_slot*)((char*)addr + sizeof(mapcache_shm_lock_header));
+
+  if(creator) {
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+#ifdef USE_ROBUST_MUTEX
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+#endif
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    for(i=0; i<shm->nslots; i++) {
+      pthread_mutex_init(&slots[i].mutex, &mattr);
+      pthread_cond_init(&slots[i].released, &cattr);
+      memset(slots[i].entries, 0, sizeof(slots[i].entries));
+    }
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_destroy(&cattr);
+    header->nslots = shm->nslots;
+    __sync_synchronize();
+    header->magic = MAPCACHE_SHM_LOCK_MAGIC;
+  } else {
+    for(i=0; i<1000 && header->magic != MAPCACHE_SHM_LOCK_MAGIC; i++) {
+      apr_sleep(1000);
+    }
+    __sync_synchronize();
+    if(header->magic != MAPCACHE_SHM_LOCK_MAGIC) {
+      munmap(addr, size);
+      if(recreate) {
+        ctx->log(ctx, MAPCACHE_WARN, "shm locker: shared memory %s was never initialized, recreating it", shm->name);
+        _mapcache_shm_lock_unlink_stale(shm->name, fd);
+        close(fd);
+        return _mapcache_shm_lock_init_table(ctx, shm, table, 0);
+      }
+      ctx->set_error(ctx,500,"shm locker: shared memory %s was not initialized", shm->name);
+      close(fd);
+      return MAPCACHE_FAILURE;
+    }
+  }
+  close(fd);
+  table->header = header;
+  table->slots = slots;
+  /* the table is sized by the process that created it */
+  table->nslots = header->nslots;
+  return MAPCACHE_SUCCESS;
+}
+
+static mapcache_shm_lock_slot* _mapcache_shm_lock_get_slot(mapcache_context *ctx, mapcache_locker_shm *shm, apr_uint64_t hash)
+{
+  if(!shm->table.header) {
+#ifdef APR_HAS_THREADS
+    if(ctx->threadlock)
+      apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+    if(!shm->table.header) {
+      mapcache_shm_lock_table table;
+      if(_mapcache_shm_lock_init_table(ctx, shm, &table, 1) == MAPCACHE_SUCCESS) {
+        shm->table.slots = table.slots;
+        shm->table.nslots = table.nslots;
+        /* publish the mapping once the slots can be used through it */
+        __sync_synchronize();
+        shm->table.header = table.header;
+      }
+    }
+#ifdef APR_HAS_THREADS
+    if(ctx->threadlock)
+      apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+    if(GC_HAS_ERROR(ctx)) return NULL;
+  }
+  __sync_synchronize();
+  return &shm->table.slots[hash % shm->table.nslots];
+}
+
+/*
+ * checks the result of locking the slot mutex, or of waiting on its condition.
+ * returns 0 if the mutex is held
+ */
+static int _mapcache_shm_lock_recover(mapcache_shm_lock_slot *slot, int rv)
+{
+#ifdef USE_ROBUST_MUTEX
+  if(rv == EOWNERDEAD) {
+    /* a process died while holding the slot mutex. the entries are only
+       modified with complete stores, so the slot is consistent */
+    return pthread_mutex_consistent(&slot->mutex);
+  }
+#endif
+  return rv;
+}
+
+/* returns 0 if the slot mutex is held, the error otherwise */
+static int _mapcache_shm_lock_mutex(mapcache_shm_lock_slot *slot)
+{
+  return _mapcache_shm_lock_recover(slot, pthread_mutex_lock(&slot->mutex));
+}
+
+/* identifier of the pid namespace of the calling process, 0 if unknown */
+static apr_uint64_t _mapcache_shm_lock_pidns(void)
+{
+  struct stat st;
+  if(stat("/proc/self/ns/pid", &st) == 0) return st.st_ino;
+  return 0;
+}
+
+/* start time of a process, in clock ticks since boot, 0 if unknown */
+static apr_uint64_t _mapcache_shm_lock_start_time(pid_t pid)
+{
+  char path[64], buf[1024], *p;
+  apr_uint64_t start = 0;
+  size_t len;
+  FILE *f;
+  int i;
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  if((f = fopen(path, "r")) == NULL) return 0;
+  len = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[len] = 0;
+  /* the starttime is the 22nd field, the 20th after the command name */
+  if((p = strrchr(buf, ')')) == NULL) return 0;
+  for(i=0; i<20 && p; i++) {
+    p = strchr(p + 1, ' ');
+  }
+  if(p) start = apr_atoi64(p + 1);
+  return start;
+}
+
+/*
+ * an entry is stale if its process is gone, or if it has been held too long.
+ * the process is only looked up if it runs in the same pid namespace, and
+ * its start time tells a live process from another one that reused its pid
+ */
+static int _mapcache_shm_lock_is_stale(mapcache_locker *self, mapcache_shm_lock_entry *entry, apr_time_t now)
+{
+  if(entry->pidns == _mapcache_shm_lock_pidns()) {
+    apr_uint64_t start;
+    if(kill(entry->pid, 0) != 0 && errno == ESRCH) return 1;
+    if(entry->start && (start = _mapcache_shm_lock_start_time(entry->pid)) != 0 && start != entry->start) return 1;
+  }
+  return self->timeout > 0 && now - entry->time > self->timeout;
+}
+
+static int _mapcache_locker_shm_lock_or_wait(mapcache_context *ctx, mapcache_locker *self, char *resource)
+{
+  mapcache_locker_shm *shm = (mapcache_locker_shm*)self;
+  apr_uint64_t hash = _mapcache_shm_lock_hash(resource);
+  mapcache_shm_lock_slot *slot = _mapcache_shm_lock_get_slot(ctx, shm, hash);
+  int waited = 0, rv;
+  if(!slot) {
+    /* fall back to the disk locker so the request can still be served */
+    ctx->log(ctx, MAPCACHE_ERROR, "%s, falling back to disk locking", ctx->get_error_message(ctx));
+    ctx->clear_errors(ctx);
+    return _mapcache_locker_disk_lock_or_wait(ctx, self, resource);
+  }
+
+  if((rv = _mapcache_shm_lock_mutex(slot)) != 0) {
+    ctx->log(ctx, MAPCACHE_ERROR, "shm locker: failed to lock slot: %s, falling back to disk locking", strerror(rv));
+    return _mapcache_locker_disk_lock_or_wait(ctx, self, resource);
+  }
+  while(1) {
+    mapcache_shm_lock_entry *held = NULL, *free_entry = NULL;
+    apr_time_t now = apr_time_now();
+    struct timespec deadline;
+    int i;
+    for(i=0; i<MAPCACHE_SHM_LOCK_ENTRIES; i++) {
+      mapcache_shm_lock_entry *entry = &slot->entries[i];
+      if(entry->hash && _mapcache_shm_lock_is_stale(self, entry, now)) {
+        ctx->log(ctx, MAPCACHE_WARN, "shm locker: removing stale lock held by process %d", (int)entry->pid);
+        if(entry->hash == hash) {
+          /* nobody will render the resource we were waiting on, take it over */
+          waited = 0;
+        }
+        entry->hash = 0;
+        pthread_cond_broadcast(&slot->released);
+      }
+      if(entry->hash == hash) {
+        held = entry;
+      } else if(!entry->hash && !free_entry) {
+        free_entry = entry;
+      }
+    }
+    if(!held) {
+      if(waited) {
+        /* the lock we were waiting on has been released */
+        pthread_mutex_unlock(&slot->mutex);
+        return MAPCACHE_FALSE;
+      }
+      if(free_entry) {
+        free_entry->pid = getpid();
+        free_entry->pidns = _mapcache_shm_lock_pidns();
+        free_entry->start = _mapcache_shm_lock_start_time(free_entry->pid);
+        free_entry->time = now;
+        free_entry->hash = hash;
+        pthread_mutex_unlock(&slot->mutex);
+        return MAPCACHE_TRUE;
+      }
+      /* all the entries of the slot are in use, wait for one to be released */
+    } else {
+#ifdef DEBUG
+      if(!waited) {
+        ctx->log(ctx, MAPCACHE_DEBUG, "waiting on resource lock %s", resource);
+      }
+#endif
+      waited = 1;
+    }
+    /* wake up at least once a second to check for stale locks */
+    now += apr_time_from_sec(1);
+    deadline.tv_sec = apr_time_sec(now);
+    deadline.tv_nsec = apr_time_usec(now) * 1000;
+    rv = pthread_cond_timedwait(&slot->released, &slot->mutex, &deadline);
+    if(rv != 0 && rv != ETIMEDOUT && (rv = _mapcache_shm_lock_recover(slot, rv)) != 0) {
+      /* the mutex is not held anymore */
+      ctx->log(ctx, MAPCACHE_ERROR, "shm locker: failed to wait on slot: %s, falling back to disk locking", strerror(rv));
+      return _mapcache_locker_disk_lock_or_wait(ctx, self, resource);
+    }
+  }
+}
+
+static void _mapcache_locker_shm_unlock(mapcache_context *ctx, mapcache_locker *self, char *resource)
+{
+  mapcache_locker_shm *shm = (mapcache_locker_shm*)self;
+  apr_uint64_t hash = _mapcache_shm_lock_hash(resource);
+  mapcache_shm_lock_slot *slot;
+  int i;
+  if(!shm->table.header) {
+    /* the table could not be created, the lock was taken by the disk locker */
+    _mapcache_locker_disk_unlock(ctx, self, resource);
+    return;
+  }
+  __sync_synchronize();
+  slot = &shm->table.slots[hash % shm->table.nslots];
+  if(_mapcache_shm_lock_mutex(slot) != 0) {
+    /* the slot is unusable, the lock can only have been taken by the disk locker */
+    _mapcache_locker_disk_unlock(ctx, self, resource);
+    return;
+  }
+  for(i=0; i<MAPCACHE_SHM_LOCK_ENTRIES; i++) {
+    if(slot->entries[i].hash == hash) {
+      slot->entries[i].hash = 0;
+      break;
+    }
+  }
+  pthread_cond_broadcast(&slot->released);
+  pthread_mutex_unlock(&slot->mutex);
+  if(i == MAPCACHE_SHM_LOCK_ENTRIES) {
+    /* not held in the table, it was taken by the disk locker while the slot was unusable */
+    _mapcache_locker_disk_unlock(ctx, self, resource);
+  }
+}
+
+static void _mapcache_locker_shm_configuration_parse_xml(mapcache_context *ctx, mapcache_locker *self, ezxml_t node)
+{
+  mapcache_locker_shm *shm = (mapcache_locker_shm*)self;
+  ezxml_t cur_node;
+  if((cur_node = ezxml_child(node,"name")) != NULL) {
+    if(cur_node->txt[0] != '/' || strchr(cur_node->txt+1,'/')) {
+      ctx->set_error(ctx, 400, "shm locker: <name> \"%s\" must start with a / and contain no other /", cur_node->txt);
+      return;
+    }
+    shm->name = apr_pstrdup(ctx->pool, cur_node->txt);
+  }
+  if((cur_node = ezxml_child(node,"slots")) != NULL) {
+    char *endptr;
+    shm->nslots = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || shm->nslots < 1) {
+      ctx->set_error(ctx, 400, "failed to parse locker slots \"%s\". Expecting a positive integer, e.g. <slots>1024</slots>",
+                     cur_node->txt);
+      return;
+    }
+  }
+}
+
+mapcache_locker* mapcache_locker_shm_create(mapcache_context *ctx)
+{
+  mapcache_locker_shm *shm = apr_pcalloc(ctx->pool, sizeof(mapcache_locker_shm));
+  shm->locker.type = MAPCACHE_LOCKER_SHM;
+  shm->locker.timeout = apr_time_from_sec(120);
+  shm->locker.lock_or_wait = _mapcache_locker_shm_lock_or_wait;
+  shm->locker.unlock = _mapcache_locker_shm_unlock;
+  shm->locker.configuration_parse_xml = _mapcache_locker_shm_configuration_parse_xml;
+  shm->name = apr_psprintf(ctx->pool, "/mapcache_locks_%d", (int)getuid());
+  shm->nslots = 1024;
+  return (mapcache_locker*)shm;
+}
+
+#else
+
+mapcache_locker* mapcache_locker_shm_create(mapcache_context *ctx)
+{
+  ctx->set_error(ctx, 400, "failed to create shm locker, process shared mutexes are not available on this platform");
+  return NULL;
+}
+
+#endif /* USE_SHM_LOCKER */
+
+int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource)
+{
+  mapcache_locker *locker = ctx->config->locker;
+  if(!locker) {
+    return _mapcache_locker_disk_lock_or_wait(ctx, NULL, resource);
+  }
+  return locker->lock_or_wait(ctx, locker, resource);
+}
+
+apr_status_t mapcache_lock_file(apr_file_t *f)
+{
+#ifndef _WIN32
+  /* flock locks belong to the open file, not to the process */
+  apr_os_file_t fd;
+  apr_os_file_get(&fd, f);
+  while(flock(fd, LOCK_EX) != 0) {
+    if(errno != EINTR) return APR_FROM_OS_ERROR(errno);
+  }
+  return APR_SUCCESS;
+#else
+  return apr_file_lock(f, APR_FLOCK_EXCLUSIVE);
+#endif
+}
+
+void mapcache_unlock_resource(mapcache_context *ctx, char *resource)
+{
+  mapcache_locker *locker = ctx->config->locker;
+  if(!locker) {
+    _mapcache_locker_disk_unlock(ctx, NULL, resource);
+    return;
+  }
+  locker->unlock(ctx, locker, resource);
+}
+
 /* vim: ts=2 sts=2 et sw=2
 */
@@ -38,5 +38,31 @@ void mapcache_source_init(mapcache_context *ctx, mapcache_source *source)
   source->metadata = apr_table_make(ctx->pool,3);
   source->is_elevation = FALSE;
 }
+void mapcache_source_render_maps(mapcache_context *ctx, mapcache_map **maps, int nmaps)
+{
+  mapcache_map **batch = apr_pcalloc(ctx->pool, nmaps*sizeof(mapcache_map*));
+  char *done = apr_pcalloc(ctx->pool, nmaps);
+  int i,j;
+  for(i=0; i<nmaps; i++) {
+    mapcache_source *source = maps[i]->tileset->source;
+    int nbatch = 0;
+    if(done[i]) continue;
+    if(!source->render_maps) {
+      source->render_map(ctx, maps[i]);
+      GC_CHECK_ERROR(ctx);
+      continue;
+    }
+    /* group all the maps of this source in a single call */
+    for(j=i; j<nmaps; j++) {
+      if(!done[j] && maps[j]->tileset->source == source) {
+        batch[nbatch++] = maps[j];
+        done[j] = 1;
+      }
+    }
+    source->render_maps(ctx, batch, nbatch);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
 /* vim: ts=2 sts=2 et sw=2
 */
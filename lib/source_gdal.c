@@ -31,6 +31,10 @@
 #include "ezxml.h"
 #include <apr_tables.h>
 #include <apr_strings.h>
+#include <apr_hash.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
 
 #ifdef USE_GDAL
 
@@ -41,6 +45,16 @@
 #include "cpl_string.h"
 #include "ogr_srs_api.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GDAL_RESAMPLE_SSE2
+#include <emmintrin.h>
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+/* AVX2 kernels are compiled with a function target attribute and selected at runtime */
+#define GDAL_RESAMPLE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
 //------------------------------------------------------------------------------
 // This is an optimized dataset transformation based on OpenWebGlobe 
 // data processing code (which is usually faster than WMS-Requests)
@@ -81,40 +95,6 @@ inline double Clamp(double x, double minval, double maxval)
   return (x < minval ? minval : (x > maxval ? maxval : x));
 }
 //------------------------------------------------------------------------------
-inline void _ReadImageDataMemBGR(unsigned char* buffer, int bufferwidth, 
-                                 int bufferheight, int x, int y, 
-                                 unsigned char* r, unsigned char* g, 
-                                 unsigned char* b, unsigned char* a)
-{
-  if (x<0 || y<0 || x>bufferwidth-1 || y>bufferheight-1) 
-  { 
-     *b=0; *g=0; *r=0; *a=0;
-     return;
-  }
-  
-  *b = buffer[bufferwidth*3*y+3*x+2];
-  *g = buffer[bufferwidth*3*y+3*x+1];
-  *r = buffer[bufferwidth*3*y+3*x];
-  *a = 255;
-}
-//------------------------------------------------------------------------------
-inline void _ReadImageDataMemBGRA(unsigned char* buffer, int bufferwidth, 
-                                 int bufferheight, int x, int y, 
-                                 unsigned char* r, unsigned char* g, 
-                                 unsigned char* b, unsigned char* a)
-{
-  if (x<0 || y<0 || x>bufferwidth-1 || y>bufferheight-1) 
-  { 
-     *b=0; *g=0; *r=0; *a=0;
-     return;
-  }
-  
-  *b = buffer[bufferwidth*4*y+4*x+2];
-  *g = buffer[bufferwidth*4*y+4*x+1];
-  *r = buffer[bufferwidth*4*y+4*x];
-  *a = buffer[bufferwidth*4*y+4*x+3];
-}
-//------------------------------------------------------------------------------
 // Approximate RGB values for mapping elevation to visible 
 // wavelengths between 380 nm and 780nm
 // based on: http://www.physics.sfasu.edu/astro/color/spectra.html
@@ -167,83 +147,13 @@ inline void _CalcSpectrumColor(double value, double mine, double maxe, char* r,
   
 }
 //------------------------------------------------------------------------------
-inline void _ReadImageDataMemGray(unsigned char* buffer, int bufferwidth, 
-                                 int bufferheight, int x, int y, 
-                                 unsigned char* r, unsigned char* g, 
-                                 unsigned char* b, unsigned char* a, float NODATA, int datatype)
+inline void _GrayValueToColor(double value, unsigned char* r, unsigned char* g, 
+                              unsigned char* b, unsigned char* a)
 {
-  if (x<0 || y<0 || x>bufferwidth-1 || y>bufferheight-1) 
-  { 
-     *b=0; *g=0; *r=0; *a=0;
-     return;
-  }
-  
-  unsigned int ui_value;
-  int i_value;
-  float f_value;
-  double d_value;
-  unsigned short us_value;
-  short s_value;
-  char b_value;
-  
-  double value = 0.0;
-  
-  switch(datatype)
-  {
-    case 1:  // GDT_UInt32
-      ui_value = ((unsigned int*)buffer)[bufferwidth*y+x];
-      value = (double) ui_value;
-      break;
-    case 2:  // GDT_Int32
-      i_value = ((int*)buffer)[bufferwidth*y+x];
-      value = (double) i_value;
-      break;
-    case 3:  // GDT_Float32
-      f_value = ((float*)buffer)[bufferwidth*y+x];
-      value = (double) f_value;
-      break;
-    case 4:  // GDT_Float64
-      d_value = ((double*)buffer)[bufferwidth*y+x];
-      value = d_value;
-      break;
-    case 5: 
-      us_value = ((unsigned short*)buffer)[bufferwidth*y+x];
-      value = (double) us_value;
-    break;
-    case 6:  
-      s_value = ((short*)buffer)[bufferwidth*y+x];
-      value = (double) s_value;
-    break;
-    case 7:  
-      b_value = ((char*)buffer)[bufferwidth*y+x];
-      value = (double) b_value;
-    break;
-    default:
-      return;
-  }
- 
-  
-  if (fabs(value-NODATA)<GM_EPSILONFLT || value<-9000)
-  {
-    *b=0; *g=0; *r=0; *a=0;
-  }
-  else
-  {
-    value = (double)Clamp(value,0.0,8000);
-    _CalcSpectrumColor(value, 0.0, 8000.00, r,g,b);
-    *a = 255;
-    //*b = (unsigned char)Clamp(value,0.0,255.0);
-    //*g = *b;
-    //*r = *b;
-    //*a = 255;
-  }
-  
-  if (value != 0)
-  {
-    int stop = 1;
-    int stop2 = 1;
-  }
- 
+  *b=0; *g=0; *r=0;
+  value = (double)Clamp(value,0.0,8000);
+  _CalcSpectrumColor(value, 0.0, 8000.00, (char*)r,(char*)g,(char*)b);
+  *a = 255;
 }
 //
 //------------------------------------------------------------------------------
@@ -359,177 +269,1369 @@ int InvertGeoMatrix(double* mGeoMatrix, double* mInvGeoMatrix)
   return TRUE;
 } 
 //------------------------------------------------------------------------------
-inline void CreateMapBGR(mapcache_context *ctx, mapcache_map *map, 
-      datasetinfo* pSrcDataset, datasetinfo* pDstDataset, 
-      int sourcetilewidth, int sourcetileheight, mapcache_source_gdal* gdal, 
-      OGRCoordinateTransformationH pCTBack, OGRCoordinateTransformationH pCTWGS84, 
-      double minx_data_wgs84, double miny_data_wgs84,
-      double maxx_data_wgs84,double maxy_data_wgs84, int nXOff,
-      int nYOff, double scalex, double scaley, unsigned char* pData)
+// Dataset cache
+//
+// Opening a dataset, parsing both spatial reference systems and creating the
+// coordinate transformations is expensive compared to the rendering of a
+// small metatile. The opened handles are therefore kept in a process wide
+// cache (one per source), keyed by data string, source srs and grid srs.
+// GDAL handles are not thread safe, so an entry is used by a single render
+// at a time: concurrent renders on the same key open additional entries,
+// and idle entries are evicted in least recently used order once more than
+// mapcache_source_gdal::max_open_datasets are opened.
+//------------------------------------------------------------------------------
+typedef struct gdal_dataset_entry gdal_dataset_entry;
+typedef struct gdal_dataset_cache gdal_dataset_cache;
+
+struct gdal_dataset_entry
+{
+   char *key;
+   GDALDatasetH hDataset;
+   OGRSpatialReferenceH srcref;
+   OGRSpatialReferenceH dstref;
+   OGRSpatialReferenceH wgs84ref;
+   OGRCoordinateTransformationH pCT;
+   OGRCoordinateTransformationH pCTBack;
+   OGRCoordinateTransformationH pCTWGS84;
+   datasetinfo oSrcDataset;
+   int in_use;
+   gdal_dataset_entry *prev; // towards most recently used
+   gdal_dataset_entry *next; // towards least recently used
+};
+
+struct gdal_dataset_cache
+{
+   gdal_dataset_entry *head;
+   gdal_dataset_entry *tail;
+   int nentries;
+   int max_entries;
+   unsigned int hits;
+   unsigned int misses;
+   unsigned int evictions;
+#ifdef APR_HAS_THREADS
+   apr_thread_mutex_t *mutex;
+#endif
+};
+
+/* hash table key = source->name, value = gdal_dataset_cache */
+static apr_hash_t *dataset_caches = NULL;
+
+//------------------------------------------------------------------------------
+static void _gdal_dataset_entry_free(gdal_dataset_entry *entry)
+{
+  if (entry->pCTWGS84) OCTDestroyCoordinateTransformation(entry->pCTWGS84);
+  if (entry->pCTBack) OCTDestroyCoordinateTransformation(entry->pCTBack);
+  if (entry->pCT) OCTDestroyCoordinateTransformation(entry->pCT);
+  if (entry->wgs84ref) OSRDestroySpatialReference(entry->wgs84ref);
+  if (entry->dstref) OSRDestroySpatialReference(entry->dstref);
+  if (entry->srcref) OSRDestroySpatialReference(entry->srcref);
+  if (entry->hDataset) GDALClose(entry->hDataset);
+  free(entry->key);
+  free(entry);
+}
+//------------------------------------------------------------------------------
+static void _gdal_dataset_cache_unlink(gdal_dataset_cache *cache, gdal_dataset_entry *entry)
+{
+  if (entry->prev) entry->prev->next = entry->next;
+  else cache->head = entry->next;
+  if (entry->next) entry->next->prev = entry->prev;
+  else cache->tail = entry->prev;
+  entry->prev = entry->next = NULL;
+  cache->nentries--;
+}
+//------------------------------------------------------------------------------
+static void _gdal_dataset_cache_push_front(gdal_dataset_cache *cache, gdal_dataset_entry *entry)
+{
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head) cache->head->prev = entry;
+  cache->head = entry;
+  if (!cache->tail) cache->tail = entry;
+  cache->nentries++;
+}
+//------------------------------------------------------------------------------
+// must be called with the cache mutex held
+static void _gdal_dataset_cache_evict(gdal_dataset_cache *cache)
+{
+  gdal_dataset_entry *entry = cache->tail;
+  while (entry && cache->nentries > cache->max_entries)
+  {
+    gdal_dataset_entry *prev = entry->prev;
+    if (!entry->in_use)
+    {
+      _gdal_dataset_cache_unlink(cache, entry);
+      _gdal_dataset_entry_free(entry);
+      cache->evictions++;
+    }
+    entry = prev;
+  }
+}
+//------------------------------------------------------------------------------
+static void _gdal_dataset_cache_lock(gdal_dataset_cache *cache)
+{
+#ifdef APR_HAS_THREADS
+  if (cache->mutex)
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+}
+//------------------------------------------------------------------------------
+static void _gdal_dataset_cache_unlock(gdal_dataset_cache *cache)
+{
+#ifdef APR_HAS_THREADS
+  if (cache->mutex)
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+}
+//------------------------------------------------------------------------------
+// the hash is shared by all the threads of the process, it is only accessed
+// with the process thread lock held
+static gdal_dataset_cache* _gdal_get_dataset_cache(mapcache_context *ctx, mapcache_source_gdal *gdal)
+{
+  gdal_dataset_cache *cache = NULL;
+#ifdef APR_HAS_THREADS
+  if (ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  if (!dataset_caches)
+  {
+    dataset_caches = apr_hash_make(ctx->process_pool);
+  }
+  cache = apr_hash_get(dataset_caches, gdal->source.name, APR_HASH_KEY_STRING);
+  if (!cache)
+  {
+    cache = apr_pcalloc(ctx->process_pool, sizeof(gdal_dataset_cache));
+    cache->max_entries = gdal->max_open_datasets;
+#ifdef APR_HAS_THREADS
+    if (apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool) != APR_SUCCESS)
+    {
+      ctx->set_error(ctx, 500, "failed to create dataset cache mutex for gdal source %s", gdal->source.name);
+      cache = NULL;
+    }
+#endif
+    if (cache)
+      apr_hash_set(dataset_caches, gdal->source.name, APR_HASH_KEY_STRING, cache);
+  }
+#ifdef APR_HAS_THREADS
+  if (ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return cache;
+}
+//------------------------------------------------------------------------------
+// open the dataset and setup the spatial reference systems and transformations
+static gdal_dataset_entry* _gdal_dataset_entry_create(mapcache_context *ctx, mapcache_source_gdal *gdal,
+      const char *gridsrs, char *key)
+{
+  const char *srcSRS = "";
+  gdal_dataset_entry *entry = calloc(1, sizeof(gdal_dataset_entry));
+  datasetinfo *src = &entry->oSrcDataset;
+  entry->key = strdup(key);
+  
+  // Setup GDAL
+  GDALAllRegister();
+  CPLErrorReset();
+  
+  // Setup Destination Spatial Reference System
+  entry->dstref = OSRNewSpatialReference(NULL);
+  if (OSRSetFromUserInput(entry->dstref, gridsrs) != OGRERR_NONE) 
+  {
+    ctx->set_error(ctx,500, "failed to parse gdal srs %s", gridsrs);
+    goto error;
+  }
+  
+  // Open Dataset
+  entry->hDataset = GDALOpen( gdal->datastr, GA_ReadOnly );
+  if( entry->hDataset == NULL ) {
+    ctx->set_error(ctx,500,"GDAL failed to open %s",gdal->datastr);
+    goto error;
+  }  
+  
+  // Retrieve Spatial Reference System of Source Dataset
+  if (gdal->srs == NULL)
+  {
+      if( GDALGetProjectionRef( entry->hDataset ) != NULL && strlen(GDALGetProjectionRef( entry->hDataset )) > 0 )
+         srcSRS = GDALGetProjectionRef( entry->hDataset );
+      else if( GDALGetGCPProjection( entry->hDataset ) != NULL && strlen(GDALGetGCPProjection(entry->hDataset)) > 0 && GDALGetGCPCount( entry->hDataset ) > 1 )
+         srcSRS = GDALGetGCPProjection( entry->hDataset );
+  }
+  else
+  {
+      srcSRS = gdal->srs;
+  }
+      
+  // Setup Source SRS
+  entry->srcref = OSRNewSpatialReference(NULL);
+  if (OSRSetFromUserInput(entry->srcref, srcSRS) != OGRERR_NONE)
+  {
+     ctx->set_error(ctx,500,"Error: can't create spatial reference of source");
+     goto error;
+  }
+  
+  if (gdal->extent != NULL)
+  {
+    entry->wgs84ref = OSRNewSpatialReference(NULL);
+    if (OSRImportFromEPSG(entry->wgs84ref, 4326) != OGRERR_NONE)
+    {
+      ctx->set_error(ctx,500,"Error: can't create spatial reference for WGS84");
+      goto error;
+    }
+  }
+  
+  // Handle GeoTransform:
+  GDALGetGeoTransform(entry->hDataset, src->affineTransformation);
+   
+  if (!InvertGeoMatrix(src->affineTransformation, src->affineTransformation_inverse))
+  {
+     ctx->set_error(ctx,500,"Error: can't create inverse of affine transformation (src)");
+     goto error;
+  }
+  
+  // Setup source dataset
+  src->nBands = GDALGetRasterCount(entry->hDataset);
+  src->nSizeX = GDALGetRasterXSize(entry->hDataset);
+  src->nSizeY = GDALGetRasterYSize(entry->hDataset);
+  src->pixelwidth  = src->affineTransformation[1];
+  src->pixelheight = src->affineTransformation[5];
+  src->ulx = src->affineTransformation[0];
+  src->uly = src->affineTransformation[3];
+  src->lrx = src->ulx + src->affineTransformation[1] * src->nSizeX;
+  src->lry = src->uly + src->affineTransformation[5] * src->nSizeY;
+
+  // Create Coordinate transformation:
+  entry->pCT        = OCTNewCoordinateTransformation(entry->srcref, entry->dstref);
+  entry->pCTBack    = OCTNewCoordinateTransformation(entry->dstref, entry->srcref);
+  if (gdal->extent != NULL)
+  {
+    entry->pCTWGS84   = OCTNewCoordinateTransformation(entry->dstref, entry->wgs84ref);
+    if (!entry->pCTWGS84)
+    {
+      ctx->set_error(ctx,500,"Error: can't create transformation to WGS84");
+      goto error;
+    }
+  }
+  
+  if (!entry->pCT)
+  {
+   ctx->set_error(ctx,500,"Error: can't create forward transformation");
+   goto error;
+  }
+  
+  if (!entry->pCTBack)
+  {
+   ctx->set_error(ctx,500,"Error: can't create backward transformation");
+   goto error;
+  }
+  return entry;
+
+error:
+  _gdal_dataset_entry_free(entry);
+  return NULL;
+}
+//------------------------------------------------------------------------------
+/**
+ * \brief get an opened dataset and its transformations for the given grid
+ *
+ * the returned entry is reserved for the caller until it is handed back with
+ * _gdal_release_dataset()
+ */
+static gdal_dataset_entry* _gdal_acquire_dataset(mapcache_context *ctx, mapcache_source_gdal *gdal, mapcache_grid *grid)
+{
+  gdal_dataset_entry *entry;
+  char *key;
+  gdal_dataset_cache *cache = _gdal_get_dataset_cache(ctx, gdal);
+  if (GC_HAS_ERROR(ctx)) return NULL;
+  
+  key = apr_pstrcat(ctx->pool, gdal->datastr, "|", gdal->srs ? gdal->srs : "", "|", grid->srs, NULL);
+  
+  _gdal_dataset_cache_lock(cache);
+  for (entry = cache->head; entry; entry = entry->next)
+  {
+    if (!entry->in_use && !strcmp(entry->key, key))
+    {
+      break;
+    }
+  }
+  if (entry)
+  {
+    entry->in_use = 1;
+    cache->hits++;
+    _gdal_dataset_cache_unlink(cache, entry);
+    _gdal_dataset_cache_push_front(cache, entry);
+    _gdal_dataset_cache_unlock(cache);
+    return entry;
+  }
+  cache->misses++;
+  ctx->log(ctx, MAPCACHE_DEBUG, "gdal source %s: dataset cache miss for %s (hits: %u, misses: %u, evictions: %u)",
+           gdal->source.name, key, cache->hits, cache->misses, cache->evictions);
+  _gdal_dataset_cache_unlock(cache);
+  
+  /* open outside of the lock, this may take a while */
+  entry = _gdal_dataset_entry_create(ctx, gdal, grid->srs, key);
+  if (!entry) return NULL;
+  entry->in_use = 1;
+  
+  _gdal_dataset_cache_lock(cache);
+  _gdal_dataset_cache_push_front(cache, entry);
+  _gdal_dataset_cache_evict(cache);
+  _gdal_dataset_cache_unlock(cache);
+  return entry;
+}
+//------------------------------------------------------------------------------
+/**
+ * \brief hand an entry obtained by _gdal_acquire_dataset() back to the cache
+ *
+ * the entry is discarded if an error occured while it was in use
+ */
+static void _gdal_release_dataset(mapcache_context *ctx, mapcache_source_gdal *gdal, gdal_dataset_entry *entry)
+{
+  gdal_dataset_cache *cache = _gdal_get_dataset_cache(ctx, gdal);
+  assert(cache);
+  _gdal_dataset_cache_lock(cache);
+  entry->in_use = 0;
+  if (GC_HAS_ERROR(ctx))
+  {
+    _gdal_dataset_cache_unlink(cache, entry);
+    _gdal_dataset_entry_free(entry);
+  }
+  else
+  {
+    _gdal_dataset_cache_evict(cache);
+  }
+  _gdal_dataset_cache_unlock(cache);
+}
+//------------------------------------------------------------------------------
+// Reprojection
+//
+// For every pixel of the destination tile the corresponding (fractional)
+// pixel position in the source dataset is needed. Transforming each pixel
+// with OCTTransform is very expensive, so only a coarse grid of control
+// points (every reprojection_grid pixels) is transformed exactly and the
+// positions in between are interpolated bilinearly. A cell of the grid is
+// subdivided as long as the interpolation error measured at its center and
+// edge midpoints exceeds reprojection_tolerance (in source pixels). Cells
+// that are only partially inside the dataset (failed transformations or
+// outside of the configured WGS84 extent) are transformed exactly.
+// The control points are transformed once, the positions are then computed
+// one band of rows (a row of grid cells) at a time, into buffers that only
+// hold that band.
+//
+// warning: the WGS84 extent check is not always valid. For now this is
+// restricted to projections like mercator -> wgs84. only use the "extent"
+// tag for such datasets.
+//------------------------------------------------------------------------------
+typedef struct gdal_reprojection gdal_reprojection;
+
+struct gdal_reprojection
+{
+   datasetinfo *pSrcDataset;
+   datasetinfo *pDstDataset;
+   OGRCoordinateTransformationH pCTBack;
+   OGRCoordinateTransformationH pCTWGS84; // NULL if no extent check
+   mapcache_extent *extent_wgs84;
+   int width;
+   int height;
+   double tolerance;
+   double *srcx;          // source pixel x positions of the rows of the band
+   double *srcy;          // source pixel y positions of the rows of the band
+   unsigned char *valid;  // 0 if the pixel is outside the data
+   int band_y0, band_y1;  // rows held by srcx/srcy/valid (none if band_y1 < band_y0)
+   int band_rows;         // maximum number of rows of a band
+   // control points, every step pixels. NULL if all pixels are transformed exactly
+   int step, ncx, ncy;
+   double *gx, *gy;
+   int *gok;
+   // scratch buffers for batched transformations, width+1 entries
+   double *tx, *ty, *wx, *wy;
+   int *tok, *wok;
+};
+
+//------------------------------------------------------------------------------
+// transform n destination pixel positions (in place) to source pixel positions
+static void _gdal_transform_points(gdal_reprojection *r, int n, double *x, double *y, int *ok)
+{
+  datasetinfo *dst = r->pDstDataset;
+  double *inv = r->pSrcDataset->affineTransformation_inverse;
+  int i;
+  for (i=0;i<n;i++)
+  {
+    x[i] = dst->ulx + x[i]*dst->pixelwidth;
+    y[i] = dst->uly - y[i]*dst->pixelheight;
+    ok[i] = TRUE;
+  }
+  
+  // note: non-global datasets may have too large numbers (overflow) to
+  //       process on a global system. Therefore this additional check is
+  //       implemented
+  if (r->pCTWGS84)
+  {
+    memcpy(r->wx, x, n*sizeof(double));
+    memcpy(r->wy, y, n*sizeof(double));
+    OCTTransformEx(r->pCTWGS84, n, r->wx, r->wy, NULL, r->wok);
+    for (i=0;i<n;i++)
+    {
+      ok[i] = r->wok[i] &&
+              r->wx[i]>=r->extent_wgs84->minx && r->wx[i]<=r->extent_wgs84->maxx &&
+              r->wy[i]>=r->extent_wgs84->miny && r->wy[i]<=r->extent_wgs84->maxy;
+    }
+  }
+  
+  OCTTransformEx(r->pCTBack, n, x, y, NULL, r->wok);
+  for (i=0;i<n;i++)
+  {
+    double gx = x[i], gy = y[i];
+    ok[i] = ok[i] && r->wok[i];
+    x[i] = inv[0] + gx * inv[1] + gy * inv[2];
+    y[i] = inv[3] + gx * inv[4] + gy * inv[5];
+  }
+}
+//------------------------------------------------------------------------------
+// transform all pixels of the rectangle [x0,x1]x[y0,y1], one batch per row
+static void _gdal_reproject_exact(gdal_reprojection *r, int x0, int y0, int x1, int y1)
+{
+  int x,y,n = x1-x0+1;
+  for (y=y0;y<=y1;y++)
+  {
+    int offset = (y-r->band_y0)*r->width + x0;
+    for (x=0;x<n;x++)
+    {
+      r->tx[x] = x0+x;
+      r->ty[x] = y;
+    }
+    _gdal_transform_points(r, n, r->tx, r->ty, r->tok);
+    memcpy(r->srcx+offset, r->tx, n*sizeof(double));
+    memcpy(r->srcy+offset, r->ty, n*sizeof(double));
+    for (x=0;x<n;x++)
+    {
+      r->valid[offset+x] = r->tok[x];
+    }
+  }
+}
+//------------------------------------------------------------------------------
+// fill the rectangle [x0,x1]x[y0,y1] by bilinear interpolation of its corners
+// (upper left, upper right, lower left, lower right)
+static void _gdal_reproject_interpolate(gdal_reprojection *r, int x0, int y0, int x1, int y1,
+      const double *cx, const double *cy)
 {
-  //----------------------------------------------------------------------------
-  map->raw_image = mapcache_image_create(ctx);
-  map->raw_image->w = map->width;
-  map->raw_image->h = map->height;
-  map->raw_image->stride = 4 * map->width;
-  map->raw_image->data = malloc(map->width*map->height*4);
   int x,y;
-  for (y=0;y<map->height;y++)
+  double dy = (y1>y0) ? 1.0/(y1-y0) : 0;
+  double dx = (x1>x0) ? 1.0/(x1-x0) : 0;
+  for (y=y0;y<=y1;y++)
+  {
+    double ty = (y-y0)*dy;
+    double lx = cx[0] + (cx[2]-cx[0])*ty;
+    double ly = cy[0] + (cy[2]-cy[0])*ty;
+    double stepx = ((cx[1] + (cx[3]-cx[1])*ty) - lx)*dx;
+    double stepy = ((cy[1] + (cy[3]-cy[1])*ty) - ly)*dx;
+    int offset = (y-r->band_y0)*r->width;
+    for (x=x0;x<=x1;x++)
+    {
+      r->srcx[offset+x] = lx;
+      r->srcy[offset+x] = ly;
+      r->valid[offset+x] = 1;
+      lx += stepx;
+      ly += stepy;
+    }
+  }
+}
+//------------------------------------------------------------------------------
+static void _gdal_reproject_cell(gdal_reprojection *r, int x0, int y0, int x1, int y1,
+      const double *cx, const double *cy, const int *cok)
+{
+  int i,mx,my;
+  double px[5], py[5];
+  int pok[5];
+  double err = 0;
+  
+  if (!cok[0] || !cok[1] || !cok[2] || !cok[3])
+  {
+    // cell is (partially) outside of the data
+    _gdal_reproject_exact(r, x0, y0, x1, y1);
+    return;
+  }
+  
+  if (x1-x0 < 2 && y1-y0 < 2)
+  {
+    // all pixels of the cell are corners
+    _gdal_reproject_interpolate(r, x0, y0, x1, y1, cx, cy);
+    return;
+  }
+  
+  // check interpolation error at the center and edge midpoints
+  mx = (x0+x1)/2;
+  my = (y0+y1)/2;
+  px[0] = mx; py[0] = y0;
+  px[1] = x0; py[1] = my;
+  px[2] = mx; py[2] = my;
+  px[3] = x1; py[3] = my;
+  px[4] = mx; py[4] = y1;
+  memcpy(r->tx, px, sizeof(px));
+  memcpy(r->ty, py, sizeof(py));
+  _gdal_transform_points(r, 5, r->tx, r->ty, pok);
+  for (i=0;i<5;i++)
+  {
+    double tx = (x1>x0) ? (px[i]-x0)/(x1-x0) : 0;
+    double ty = (y1>y0) ? (py[i]-y0)/(y1-y0) : 0;
+    double ix = (1-ty)*((1-tx)*cx[0] + tx*cx[1]) + ty*((1-tx)*cx[2] + tx*cx[3]);
+    double iy = (1-ty)*((1-tx)*cy[0] + tx*cy[1]) + ty*((1-tx)*cy[2] + tx*cy[3]);
+    if (!pok[i])
+    {
+      err = r->tolerance + 1;
+      break;
+    }
+    err = GM_MAX(err, GM_MAX(fabs(ix-r->tx[i]), fabs(iy-r->ty[i])));
+  }
+  
+  if (err <= r->tolerance)
+  {
+    _gdal_reproject_interpolate(r, x0, y0, x1, y1, cx, cy);
+  }
+  else if (i<5 || (x1-x0 <= 2 && y1-y0 <= 2))
+  {
+    _gdal_reproject_exact(r, x0, y0, x1, y1);
+  }
+  else
+  {
+    // subdivide into four cells, reusing the transformed midpoints
+    double mxs[9], mys[9];
+    int oks[4] = {TRUE,TRUE,TRUE,TRUE};
+    double qx[4], qy[4];
+    // 3x3 grid of points: corners, edge midpoints and center
+    mxs[0] = cx[0];     mys[0] = cy[0];
+    mxs[1] = r->tx[0];  mys[1] = r->ty[0];
+    mxs[2] = cx[1];     mys[2] = cy[1];
+    mxs[3] = r->tx[1];  mys[3] = r->ty[1];
+    mxs[4] = r->tx[2];  mys[4] = r->ty[2];
+    mxs[5] = r->tx[3];  mys[5] = r->ty[3];
+    mxs[6] = cx[2];     mys[6] = cy[2];
+    mxs[7] = r->tx[4];  mys[7] = r->ty[4];
+    mxs[8] = cx[3];     mys[8] = cy[3];
+#define GDAL_SUBCELL(a,b,c,d,sx0,sy0,sx1,sy1) \
+    qx[0]=mxs[a]; qy[0]=mys[a]; qx[1]=mxs[b]; qy[1]=mys[b]; \
+    qx[2]=mxs[c]; qy[2]=mys[c]; qx[3]=mxs[d]; qy[3]=mys[d]; \
+    _gdal_reproject_cell(r, sx0, sy0, sx1, sy1, qx, qy, oks);
+    GDAL_SUBCELL(0,1,3,4, x0,y0,mx,my)
+    GDAL_SUBCELL(1,2,4,5, mx,y0,x1,my)
+    GDAL_SUBCELL(3,4,6,7, x0,my,mx,y1)
+    GDAL_SUBCELL(4,5,7,8, mx,my,x1,y1)
+#undef GDAL_SUBCELL
+  }
+}
+//------------------------------------------------------------------------------
+// number of rows of a band when every pixel is transformed exactly
+#define GDAL_REPROJECTION_EXACT_ROWS 16
+/**
+ * \brief prepare the computation of the source pixel positions of the pixels of the destination dataset
+ *
+ * the control points are transformed here, the positions are then obtained
+ * row by row with _gdal_reproject_row()
+ */
+static gdal_reprojection* _gdal_reproject(mapcache_context *ctx, mapcache_source_gdal *gdal,
+      datasetinfo* pSrcDataset, datasetinfo* pDstDataset,
+      OGRCoordinateTransformationH pCTBack, OGRCoordinateTransformationH pCTWGS84)
+{
+  int i,j;
+  int w = pDstDataset->nSizeX, h = pDstDataset->nSizeY;
+  int step = gdal->reprojection_grid;
+  gdal_reprojection *r = apr_pcalloc(ctx->pool, sizeof(gdal_reprojection));
+  r->pSrcDataset = pSrcDataset;
+  r->pDstDataset = pDstDataset;
+  r->pCTBack = pCTBack;
+  r->pCTWGS84 = (gdal->extent != NULL) ? pCTWGS84 : NULL;
+  r->extent_wgs84 = gdal->extent;
+  r->width = w;
+  r->height = h;
+  r->tolerance = gdal->reprojection_tolerance;
+  r->band_y0 = 0;
+  r->band_y1 = -1;
+  r->tx = apr_palloc(ctx->pool, (w+6)*sizeof(double));
+  r->ty = apr_palloc(ctx->pool, (w+6)*sizeof(double));
+  r->wx = apr_palloc(ctx->pool, (w+6)*sizeof(double));
+  r->wy = apr_palloc(ctx->pool, (w+6)*sizeof(double));
+  r->tok = apr_palloc(ctx->pool, (w+6)*sizeof(int));
+  r->wok = apr_palloc(ctx->pool, (w+6)*sizeof(int));
+  
+  if (r->tolerance <= 0 || step <= 1 || w < 2 || h < 2)
+  {
+    r->band_rows = GM_MIN(GDAL_REPROJECTION_EXACT_ROWS, h);
+  }
+  else
+  {
+    // control points: every step pixels, always including the last row/column
+    r->step = step;
+    r->ncx = (w-2)/step + 2;
+    r->ncy = (h-2)/step + 2;
+    r->gx = apr_palloc(ctx->pool, r->ncx*r->ncy*sizeof(double));
+    r->gy = apr_palloc(ctx->pool, r->ncx*r->ncy*sizeof(double));
+    r->gok = apr_palloc(ctx->pool, r->ncx*r->ncy*sizeof(int));
+    for (j=0;j<r->ncy;j++)
+    {
+      int y = GM_MIN(j*step, h-1);
+      for (i=0;i<r->ncx;i++)
+      {
+        r->gx[j*r->ncx+i] = GM_MIN(i*step, w-1);
+        r->gy[j*r->ncx+i] = y;
+      }
+      _gdal_transform_points(r, r->ncx, r->gx+j*r->ncx, r->gy+j*r->ncx, r->gok+j*r->ncx);
+    }
+    // a row of cells, including the control points of both its edges
+    r->band_rows = GM_MIN(step+1, h);
+  }
+  r->srcx = apr_palloc(ctx->pool, w*r->band_rows*sizeof(double));
+  r->srcy = apr_palloc(ctx->pool, w*r->band_rows*sizeof(double));
+  r->valid = apr_palloc(ctx->pool, w*r->band_rows);
+  return r;
+}
+//------------------------------------------------------------------------------
+/**
+ * \brief source pixel positions of a row of the destination dataset
+ *
+ * computes the band holding row y if needed, and returns the offset of the
+ * row in srcx/srcy/valid. the rows are best requested in increasing order
+ */
+static int _gdal_reproject_row(gdal_reprojection *r, int y)
+{
+  int i,j;
+  if (y >= r->band_y0 && y <= r->band_y1)
+  {
+    return (y-r->band_y0)*r->width;
+  }
+  if (!r->gx)
+  {
+    r->band_y0 = y;
+    r->band_y1 = GM_MIN(y+r->band_rows-1, r->height-1);
+    _gdal_reproject_exact(r, 0, r->band_y0, r->width-1, r->band_y1);
+    return 0;
+  }
+  j = GM_MIN(y/r->step, r->ncy-2);
+  r->band_y0 = j*r->step;
+  r->band_y1 = GM_MIN((j+1)*r->step, r->height-1);
+  for (i=0;i<r->ncx-1;i++)
+  {
+    int x0 = i*r->step, x1 = GM_MIN((i+1)*r->step, r->width-1);
+    int c[4];
+    double cx[4], cy[4];
+    int cok[4], k;
+    c[0] = j*r->ncx+i;     c[1] = j*r->ncx+i+1;
+    c[2] = (j+1)*r->ncx+i; c[3] = (j+1)*r->ncx+i+1;
+    for (k=0;k<4;k++)
+    {
+      cx[k] = r->gx[c[k]];
+      cy[k] = r->gy[c[k]];
+      cok[k] = r->gok[c[k]];
+    }
+    _gdal_reproject_cell(r, x0, r->band_y0, x1, r->band_y1, cx, cy, cok);
+  }
+  return (y-r->band_y0)*r->width;
+}
+//------------------------------------------------------------------------------
+// Resampling
+//
+// The window read from the dataset is resampled to the tile one row at a
+// time. RGB and RGBA windows are both read as RGBA (alpha preset to 255),
+// single band windows as float. The SSE2 and AVX2 variants of the RGBA
+// kernels do the same fixed point (bilinear), single precision (cubic) or
+// integer (average) arithmetic as the scalar code, in the same order, so the
+// rendered tiles do not depend on the instruction set of the machine.
+//------------------------------------------------------------------------------
+typedef struct gdal_resampler gdal_resampler;
+
+struct gdal_resampler
+{
+   void *data;            // RGBA bytes or floats
+   int width;             // size of the window in pixels
+   int height;
+   int nXOff;             // position of the window in the dataset
+   int nYOff;
+   double scalex;         // window pixels per dataset pixel
+   double scaley;
+   float nodata;          // single band windows only
+};
+
+typedef void (*gdal_resample_rgba_func)(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, unsigned char *dst);
+typedef void (*gdal_resample_float_func)(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, float *dst, unsigned char *dstvalid);
+
+static const unsigned char _gdal_transparent[4] = {0,0,0,0};
+
+//------------------------------------------------------------------------------
+// position of a destination pixel in the window, FALSE if it is outside
+static inline int _gdal_window_position(gdal_resampler *rs, gdal_reprojection *pReproj, int i,
+      double *fx, double *fy)
+{
+  *fx = (pReproj->srcx[i] - rs->nXOff) * rs->scalex;
+  *fy = (pReproj->srcy[i] - rs->nYOff) * rs->scaley;
+  return pReproj->valid[i] && *fx >= 0 && *fy >= 0 && *fx < rs->width && *fy < rs->height;
+}
+//------------------------------------------------------------------------------
+static inline int _gdal_clamp_index(int v, int size)
+{
+  return (v < 0) ? 0 : ((v > size-1) ? size-1 : v);
+}
+//------------------------------------------------------------------------------
+// footprint of a destination pixel in the window, estimated from its
+// neighbour in the row. assumes the reprojection is locally conformal.
+static inline void _gdal_footprint(gdal_resampler *rs, gdal_reprojection *pReproj, int offset,
+      int i, int n, double *hx, double *hy)
+{
+  int j = (i+1<n) ? i+1 : i-1;
+  double fw = 0;
+  if (j >= 0 && pReproj->valid[offset+i] && pReproj->valid[offset+j])
+  {
+    double dx = pReproj->srcx[offset+j] - pReproj->srcx[offset+i];
+    double dy = pReproj->srcy[offset+j] - pReproj->srcy[offset+i];
+    fw = sqrt(dx*dx + dy*dy);
+  }
+  *hx = 0.5 * fw * rs->scalex;
+  *hy = 0.5 * fw * rs->scaley;
+}
+//------------------------------------------------------------------------------
+// box of window pixels covered by a destination pixel
+static inline int _gdal_average_box(gdal_resampler *rs, gdal_reprojection *pReproj, int offset,
+      int i, int n, int *x0, int *y0, int *x1, int *y1)
+{
+  double fx, fy, hx, hy;
+  if (!_gdal_window_position(rs, pReproj, offset+i, &fx, &fy))
+    return FALSE;
+  _gdal_footprint(rs, pReproj, offset, i, n, &hx, &hy);
+  *x0 = (int)floor(fx - hx);
+  *y0 = (int)floor(fy - hy);
+  *x1 = GM_MAX(*x0, (int)ceil(fx + hx) - 1);
+  *y1 = GM_MAX(*y0, (int)ceil(fy + hy) - 1);
+  *x0 = _gdal_clamp_index(*x0, rs->width);
+  *y0 = _gdal_clamp_index(*y0, rs->height);
+  *x1 = _gdal_clamp_index(*x1, rs->width);
+  *y1 = _gdal_clamp_index(*y1, rs->height);
+  return TRUE;
+}
+//------------------------------------------------------------------------------
+// the four taps and 8 bit fixed point weights of a bilinear sample
+static inline int _gdal_bilinear_taps(gdal_resampler *rs, gdal_reprojection *pReproj, int i,
+      const unsigned char **p, int *wx, int *wy)
+{
+  const unsigned char *data = rs->data;
+  double fx, fy;
+  int x0, y0, x1, y1;
+  if (!_gdal_window_position(rs, pReproj, i, &fx, &fy))
+  {
+    p[0] = p[1] = p[2] = p[3] = _gdal_transparent;
+    *wx = *wy = 0;
+    return FALSE;
+  }
+  // sample between the centers of the window pixels
+  fx -= 0.5;
+  fy -= 0.5;
+  x0 = (int)floor(fx);
+  y0 = (int)floor(fy);
+  *wx = (int)((fx - x0)*256 + 0.5);
+  *wy = (int)((fy - y0)*256 + 0.5);
+  x1 = _gdal_clamp_index(x0+1, rs->width);
+  y1 = _gdal_clamp_index(y0+1, rs->height);
+  x0 = _gdal_clamp_index(x0, rs->width);
+  y0 = _gdal_clamp_index(y0, rs->height);
+  p[0] = data + 4*(y0*rs->width + x0);
+  p[1] = data + 4*(y0*rs->width + x1);
+  p[2] = data + 4*(y1*rs->width + x0);
+  p[3] = data + 4*(y1*rs->width + x1);
+  return TRUE;
+}
+//------------------------------------------------------------------------------
+// Catmull-Rom spline (a = -0.5)
+static inline void _gdal_cubic_weights(float t, float *w)
+{
+  float t2 = t*t, t3 = t2*t;
+  w[0] = -0.5f*t3 + t2 - 0.5f*t;
+  w[1] = 1.5f*t3 - 2.5f*t2 + 1.0f;
+  w[2] = -1.5f*t3 + 2.0f*t2 + 0.5f*t;
+  w[3] = 0.5f*t3 - 0.5f*t2;
+}
+//------------------------------------------------------------------------------
+// the 4x4 taps and weights of a bicubic sample (taps in rows)
+static inline int _gdal_cubic_taps(gdal_resampler *rs, gdal_reprojection *pReproj, int i,
+      const unsigned char **p, float *wx, float *wy)
+{
+  const unsigned char *data = rs->data;
+  double fx, fy;
+  int x0, y0, j, k, xs[4];
+  if (!_gdal_window_position(rs, pReproj, i, &fx, &fy))
+  {
+    for (j=0;j<16;j++)
+      p[j] = _gdal_transparent;
+    wx[0] = wx[2] = wx[3] = 0; wx[1] = 1;
+    wy[0] = wy[2] = wy[3] = 0; wy[1] = 1;
+    return FALSE;
+  }
+  fx -= 0.5;
+  fy -= 0.5;
+  x0 = (int)floor(fx);
+  y0 = (int)floor(fy);
+  _gdal_cubic_weights((float)(fx - x0), wx);
+  _gdal_cubic_weights((float)(fy - y0), wy);
+  for (k=0;k<4;k++)
+    xs[k] = 4*_gdal_clamp_index(x0-1+k, rs->width);
+  for (j=0;j<4;j++)
+  {
+    const unsigned char *row = data + 4*rs->width*_gdal_clamp_index(y0-1+j, rs->height);
+    for (k=0;k<4;k++)
+      p[4*j+k] = row + xs[k];
+  }
+  return TRUE;
+}
+//------------------------------------------------------------------------------
+// RGBA window -> BGRA tile, scalar kernels
+//------------------------------------------------------------------------------
+static void _gdal_resample_row_nearest(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, unsigned char *dst)
+{
+  const unsigned char *data = rs->data;
+  int i;
+  for (i=0;i<n;i++,dst+=4)
+  {
+    // note: truncation (and not floor) to pick the same pixels as before
+    int x = (int)((pReproj->srcx[offset+i] - rs->nXOff) * rs->scalex);
+    int y = (int)((pReproj->srcy[offset+i] - rs->nYOff) * rs->scaley);
+    const unsigned char *p;
+    if (!pReproj->valid[offset+i] || x<0 || y<0 || x>rs->width-1 || y>rs->height-1)
+    {
+      p = _gdal_transparent;
+    }
+    else
+    {
+      p = data + 4*(y*rs->width + x);
+    }
+    dst[0] = p[2];
+    dst[1] = p[1];
+    dst[2] = p[0];
+    dst[3] = p[3];
+  }
+}
+//------------------------------------------------------------------------------
+static inline void _gdal_bilinear_pixel(const unsigned char **p, int wx, int wy, unsigned char *dst)
+{
+  int c;
+  for (c=0;c<4;c++)
+  {
+    int s = (c<3) ? 2-c : 3;
+    int top = (p[0][s]*(256-wx) + p[1][s]*wx + 128) >> 8;
+    int bottom = (p[2][s]*(256-wx) + p[3][s]*wx + 128) >> 8;
+    dst[c] = (unsigned char)((top*(256-wy) + bottom*wy + 128) >> 8);
+  }
+}
+//------------------------------------------------------------------------------
+static void _gdal_resample_row_bilinear(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, unsigned char *dst)
+{
+  int i;
+  for (i=0;i<n;i++)
+  {
+    const unsigned char *p[4];
+    int wx, wy;
+    _gdal_bilinear_taps(rs, pReproj, offset+i, p, &wx, &wy);
+    _gdal_bilinear_pixel(p, wx, wy, dst+4*i);
+  }
+}
+//------------------------------------------------------------------------------
+static inline void _gdal_cubic_pixel(const unsigned char **p, const float *wx, const float *wy, unsigned char *dst)
+{
+  int c, j;
+  for (c=0;c<4;c++)
+  {
+    int s = (c<3) ? 2-c : 3;
+    float acc = 0;
+    for (j=0;j<4;j++)
+    {
+      const unsigned char **q = p+4*j;
+      float row = q[0][s]*wx[0];
+      row = row + q[1][s]*wx[1];
+      row = row + q[2][s]*wx[2];
+      row = row + q[3][s]*wx[3];
+      acc = (j==0) ? row*wy[0] : acc + row*wy[j];
+    }
+    acc = (acc < 0) ? 0 : ((acc > 255) ? 255 : acc);
+    dst[c] = (unsigned char)(int)(acc + 0.5f);
+  }
+}
+//------------------------------------------------------------------------------
+static void _gdal_resample_row_cubic(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, unsigned char *dst)
+{
+  int i;
+  for (i=0;i<n;i++)
+  {
+    const unsigned char *p[16];
+    float wx[4], wy[4];
+    _gdal_cubic_taps(rs, pReproj, offset+i, p, wx, wy);
+    _gdal_cubic_pixel(p, wx, wy, dst+4*i);
+  }
+}
+//------------------------------------------------------------------------------
+static inline void _gdal_average_store(const unsigned int *sum, unsigned int count, unsigned char *dst)
+{
+  dst[0] = (unsigned char)((sum[2] + count/2) / count);
+  dst[1] = (unsigned char)((sum[1] + count/2) / count);
+  dst[2] = (unsigned char)((sum[0] + count/2) / count);
+  dst[3] = (unsigned char)((sum[3] + count/2) / count);
+}
+//------------------------------------------------------------------------------
+static void _gdal_resample_row_average(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, unsigned char *dst)
+{
+  const unsigned char *data = rs->data;
+  int i, x, y, x0, y0, x1, y1;
+  for (i=0;i<n;i++,dst+=4)
+  {
+    unsigned int sum[4] = {0,0,0,0};
+    if (!_gdal_average_box(rs, pReproj, offset, i, n, &x0, &y0, &x1, &y1))
+    {
+      dst[0] = dst[1] = dst[2] = dst[3] = 0;
+      continue;
+    }
+    for (y=y0;y<=y1;y++)
+    {
+      const unsigned char *p = data + 4*(y*rs->width + x0);
+      for (x=x0;x<=x1;x++,p+=4)
+      {
+        sum[0] += p[0];
+        sum[1] += p[1];
+        sum[2] += p[2];
+        sum[3] += p[3];
+      }
+    }
+    _gdal_average_store(sum, (x1-x0+1)*(y1-y0+1), dst);
+  }
+}
+#ifdef GDAL_RESAMPLE_SSE2
+//------------------------------------------------------------------------------
+// RGBA window -> BGRA tile, SSE2 kernels
+//------------------------------------------------------------------------------
+static inline __m128i _gdal_load_rgba(const unsigned char *p)
+{
+  int v;
+  memcpy(&v, p, 4);
+  return _mm_cvtsi32_si128(v);
+}
+//------------------------------------------------------------------------------
+// two pixels per iteration, 16 bit lanes
+static void _gdal_resample_row_bilinear_sse2(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, unsigned char *dst)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i c128 = _mm_set1_epi16(128);
+  const __m128i c256 = _mm_set1_epi16(256);
+  int i;
+  for (i=0;i+1<n;i+=2)
+  {
+    const unsigned char *pa[4], *pb[4];
+    int wxa, wya, wxb, wyb, k;
+    __m128i p[4], wx, wy, iwx, iwy, top, bottom, v;
+    _gdal_bilinear_taps(rs, pReproj, offset+i, pa, &wxa, &wya);
+    _gdal_bilinear_taps(rs, pReproj, offset+i+1, pb, &wxb, &wyb);
+    for (k=0;k<4;k++)
+      p[k] = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_gdal_load_rgba(pa[k]), _gdal_load_rgba(pb[k])), zero);
+    wx = _mm_set_epi16(wxb,wxb,wxb,wxb,wxa,wxa,wxa,wxa);
+    wy = _mm_set_epi16(wyb,wyb,wyb,wyb,wya,wya,wya,wya);
+    iwx = _mm_sub_epi16(c256, wx);
+    iwy = _mm_sub_epi16(c256, wy);
+    // products stay below 2^16: 255*(256-w) + 255*w + 128 < 65536
+    top = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(p[0], iwx), _mm_mullo_epi16(p[1], wx)), c128), 8);
+    bottom = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(p[2], iwx), _mm_mullo_epi16(p[3], wx)), c128), 8);
+    v = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(top, iwy), _mm_mullo_epi16(bottom, wy)), c128), 8);
+    // RGBA -> BGRA
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(3,0,1,2));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(3,0,1,2));
+    _mm_storel_epi64((__m128i*)(dst+4*i), _mm_packus_epi16(v, v));
+  }
+  if (i<n)
+    _gdal_resample_row_bilinear(rs, pReproj, offset+i, 1, dst+4*i);
+}
+//------------------------------------------------------------------------------
+static inline __m128 _gdal_load_rgba_ps(const unsigned char *p)
+{
+  const __m128i zero = _mm_setzero_si128();
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_gdal_load_rgba(p), zero), zero));
+}
+//------------------------------------------------------------------------------
+// one pixel per iteration, the four channels in one register
+static void _gdal_resample_row_cubic_sse2(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, unsigned char *dst)
+{
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 c255 = _mm_set1_ps(255.0f);
+  const __m128 half = _mm_set1_ps(0.5f);
+  int i, j, k;
+  for (i=0;i<n;i++)
+  {
+    const unsigned char *p[16];
+    float wx[4], wy[4];
+    __m128 acc = zero;
+    __m128i v;
+    _gdal_cubic_taps(rs, pReproj, offset+i, p, wx, wy);
+    for (j=0;j<4;j++)
+    {
+      const unsigned char **q = p+4*j;
+      __m128 row = _mm_mul_ps(_gdal_load_rgba_ps(q[0]), _mm_set1_ps(wx[0]));
+      row = _mm_add_ps(row, _mm_mul_ps(_gdal_load_rgba_ps(q[1]), _mm_set1_ps(wx[1])));
+      row = _mm_add_ps(row, _mm_mul_ps(_gdal_load_rgba_ps(q[2]), _mm_set1_ps(wx[2])));
+      row = _mm_add_ps(row, _mm_mul_ps(_gdal_load_rgba_ps(q[3]), _mm_set1_ps(wx[3])));
+      acc = (j==0) ? _mm_mul_ps(row, _mm_set1_ps(wy[0])) : _mm_add_ps(acc, _mm_mul_ps(row, _mm_set1_ps(wy[j])));
+    }
+    acc = _mm_add_ps(_mm_min_ps(_mm_max_ps(acc, zero), c255), half);
+    acc = _mm_shuffle_ps(acc, acc, _MM_SHUFFLE(3,0,1,2));
+    v = _mm_cvttps_epi32(acc);
+    v = _mm_packs_epi32(v, v);
+    v = _mm_packus_epi16(v, v);
+    k = _mm_cvtsi128_si32(v);
+    memcpy(dst+4*i, &k, 4);
+  }
+}
+//------------------------------------------------------------------------------
+// 32 bit accumulators for the four channels
+static void _gdal_resample_row_average_sse2(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, unsigned char *dst)
+{
+  const unsigned char *data = rs->data;
+  const __m128i zero = _mm_setzero_si128();
+  int i, x, y, x0, y0, x1, y1;
+  for (i=0;i<n;i++,dst+=4)
+  {
+    unsigned int sum[4];
+    __m128i acc = zero;
+    if (!_gdal_average_box(rs, pReproj, offset, i, n, &x0, &y0, &x1, &y1))
+    {
+      dst[0] = dst[1] = dst[2] = dst[3] = 0;
+      continue;
+    }
+    for (y=y0;y<=y1;y++)
+    {
+      const unsigned char *p = data + 4*(y*rs->width + x0);
+      __m128i acc16 = zero;
+      // 16 bit sums of up to 128 pixels, two pixels per step
+      for (x=x0;x+1<=x1;x+=2,p+=8)
+      {
+        acc16 = _mm_add_epi16(acc16, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), zero));
+        if (((x-x0) & 254) == 254)
+        {
+          acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(acc16, zero));
+          acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(acc16, zero));
+          acc16 = zero;
+        }
+      }
+      if (x==x1)
+        acc16 = _mm_add_epi16(acc16, _mm_unpacklo_epi8(_gdal_load_rgba(p), zero));
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(acc16, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(acc16, zero));
+    }
+    _mm_storeu_si128((__m128i*)sum, acc);
+    _gdal_average_store(sum, (x1-x0+1)*(y1-y0+1), dst);
+  }
+}
+#endif // GDAL_RESAMPLE_SSE2
+#ifdef GDAL_RESAMPLE_AVX2
+//------------------------------------------------------------------------------
+// RGBA window -> BGRA tile, AVX2 kernels
+//------------------------------------------------------------------------------
+// four pixels per iteration, 16 bit lanes
+__attribute__((target("avx2")))
+static void _gdal_resample_row_bilinear_avx2(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, unsigned char *dst)
+{
+  const __m256i c128 = _mm256_set1_epi16(128);
+  const __m256i c256 = _mm256_set1_epi16(256);
+  int i;
+  for (i=0;i+3<n;i+=4)
+  {
+    const unsigned char *t[4][4];
+    int w[2][4], k;
+    __m256i p[4], wx, wy, iwx, iwy, top, bottom, v;
+    for (k=0;k<4;k++)
+      _gdal_bilinear_taps(rs, pReproj, offset+i+k, t[k], &w[0][k], &w[1][k]);
+    for (k=0;k<4;k++)
+    {
+      int a, b, c, d;
+      memcpy(&a, t[0][k], 4);
+      memcpy(&b, t[1][k], 4);
+      memcpy(&c, t[2][k], 4);
+      memcpy(&d, t[3][k], 4);
+      p[k] = _mm256_cvtepu8_epi16(_mm_set_epi32(d, c, b, a));
+    }
+    // each 64 bit lane holds the weight of one pixel, four times
+    wx = _mm256_set_epi64x(w[0][3]*0x0001000100010001LL, w[0][2]*0x0001000100010001LL,
+                           w[0][1]*0x0001000100010001LL, w[0][0]*0x0001000100010001LL);
+    wy = _mm256_set_epi64x(w[1][3]*0x0001000100010001LL, w[1][2]*0x0001000100010001LL,
+                           w[1][1]*0x0001000100010001LL, w[1][0]*0x0001000100010001LL);
+    iwx = _mm256_sub_epi16(c256, wx);
+    iwy = _mm256_sub_epi16(c256, wy);
+    top = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(p[0], iwx), _mm256_mullo_epi16(p[1], wx)), c128), 8);
+    bottom = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(p[2], iwx), _mm256_mullo_epi16(p[3], wx)), c128), 8);
+    v = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(top, iwy), _mm256_mullo_epi16(bottom, wy)), c128), 8);
+    v = _mm256_shufflelo_epi16(v, _MM_SHUFFLE(3,0,1,2));
+    v = _mm256_shufflehi_epi16(v, _MM_SHUFFLE(3,0,1,2));
+    v = _mm256_packus_epi16(v, v);
+    v = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3,1,2,0));
+    _mm_storeu_si128((__m128i*)(dst+4*i), _mm256_castsi256_si128(v));
+  }
+  if (i<n)
+    _gdal_resample_row_bilinear(rs, pReproj, offset+i, n-i, dst+4*i);
+}
+//------------------------------------------------------------------------------
+__attribute__((target("avx2")))
+static inline __m256 _gdal_load_rgba2_ps(const unsigned char *a, const unsigned char *b)
+{
+  int va, vb;
+  memcpy(&va, a, 4);
+  memcpy(&vb, b, 4);
+  return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_set_epi32(0, 0, vb, va)));
+}
+//------------------------------------------------------------------------------
+// two pixels per iteration, one in each 128 bit lane
+__attribute__((target("avx2")))
+static void _gdal_resample_row_cubic_avx2(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, unsigned char *dst)
+{
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 c255 = _mm256_set1_ps(255.0f);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  int i, j, k;
+  for (i=0;i+1<n;i+=2)
+  {
+    const unsigned char *pa[16], *pb[16];
+    float wxa[4], wya[4], wxb[4], wyb[4];
+    __m256 acc = zero;
+    __m256i v;
+    __m128i v16;
+    _gdal_cubic_taps(rs, pReproj, offset+i, pa, wxa, wya);
+    _gdal_cubic_taps(rs, pReproj, offset+i+1, pb, wxb, wyb);
+    for (j=0;j<4;j++)
+    {
+      __m256 row = zero;
+      for (k=0;k<4;k++)
+      {
+        __m256 w = _mm256_setr_ps(wxa[k],wxa[k],wxa[k],wxa[k],wxb[k],wxb[k],wxb[k],wxb[k]);
+        __m256 t = _mm256_mul_ps(_gdal_load_rgba2_ps(pa[4*j+k], pb[4*j+k]), w);
+        row = (k==0) ? t : _mm256_add_ps(row, t);
+      }
+      row = _mm256_mul_ps(row, _mm256_setr_ps(wya[j],wya[j],wya[j],wya[j],wyb[j],wyb[j],wyb[j],wyb[j]));
+      acc = (j==0) ? row : _mm256_add_ps(acc, row);
+    }
+    acc = _mm256_add_ps(_mm256_min_ps(_mm256_max_ps(acc, zero), c255), half);
+    acc = _mm256_shuffle_ps(acc, acc, _MM_SHUFFLE(3,0,1,2));
+    v = _mm256_cvttps_epi32(acc);
+    v16 = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    _mm_storel_epi64((__m128i*)(dst+4*i), _mm_packus_epi16(v16, v16));
+  }
+  if (i<n)
+    _gdal_resample_row_cubic(rs, pReproj, offset+i, 1, dst+4*i);
+}
+#endif // GDAL_RESAMPLE_AVX2
+//------------------------------------------------------------------------------
+static gdal_resample_rgba_func _gdal_get_rgba_resampler(mapcache_resample_mode mode)
+{
+#ifdef GDAL_RESAMPLE_AVX2
+  int avx2 = __builtin_cpu_supports("avx2");
+#endif
+  switch (mode)
+  {
+    case MAPCACHE_RESAMPLE_BILINEAR:
+#ifdef GDAL_RESAMPLE_AVX2
+      if (avx2) return _gdal_resample_row_bilinear_avx2;
+#endif
+#ifdef GDAL_RESAMPLE_SSE2
+      return _gdal_resample_row_bilinear_sse2;
+#else
+      return _gdal_resample_row_bilinear;
+#endif
+    case MAPCACHE_RESAMPLE_CUBIC:
+#ifdef GDAL_RESAMPLE_AVX2
+      if (avx2) return _gdal_resample_row_cubic_avx2;
+#endif
+#ifdef GDAL_RESAMPLE_SSE2
+      return _gdal_resample_row_cubic_sse2;
+#else
+      return _gdal_resample_row_cubic;
+#endif
+    case MAPCACHE_RESAMPLE_AVERAGE:
+#ifdef GDAL_RESAMPLE_SSE2
+      return _gdal_resample_row_average_sse2;
+#else
+      return _gdal_resample_row_average;
+#endif
+    default:
+      return _gdal_resample_row_nearest;
+  }
+}
+//------------------------------------------------------------------------------
+// single band float window, scalar kernels. taps with the nodata value are
+// not interpolated: bilinear and cubic fall back to nearest, average skips them
+//------------------------------------------------------------------------------
+static inline int _gdal_is_nodata(float value, float NODATA)
+{
+  return fabs(value-NODATA)<GM_EPSILONFLT || value<-9000;
+}
+//------------------------------------------------------------------------------
+static inline int _gdal_sample_float_nearest(gdal_resampler *rs, gdal_reprojection *pReproj, int i, float *value)
+{
+  const float *data = rs->data;
+  int x = (int)((pReproj->srcx[i] - rs->nXOff) * rs->scalex);
+  int y = (int)((pReproj->srcy[i] - rs->nYOff) * rs->scaley);
+  if (!pReproj->valid[i] || x<0 || y<0 || x>rs->width-1 || y>rs->height-1)
+    return FALSE;
+  *value = data[y*rs->width + x];
+  return !_gdal_is_nodata(*value, rs->nodata);
+}
+//------------------------------------------------------------------------------
+static void _gdal_resample_row_float_nearest(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, float *dst, unsigned char *dstvalid)
+{
+  int i;
+  for (i=0;i<n;i++)
+    dstvalid[i] = _gdal_sample_float_nearest(rs, pReproj, offset+i, dst+i);
+}
+//------------------------------------------------------------------------------
+static void _gdal_resample_row_float_interpolate(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, float *dst, unsigned char *dstvalid, int ntaps)
+{
+  const float *data = rs->data;
+  int i, j, k;
+  for (i=0;i<n;i++)
+  {
+    double fx, fy;
+    float wx[4], wy[4], acc = 0;
+    int x0, y0, xs[4], ys[4], ok = TRUE;
+    if (!_gdal_window_position(rs, pReproj, offset+i, &fx, &fy))
+    {
+      dstvalid[i] = FALSE;
+      continue;
+    }
+    fx -= 0.5;
+    fy -= 0.5;
+    x0 = (int)floor(fx);
+    y0 = (int)floor(fy);
+    if (ntaps == 2)
+    {
+      wx[1] = (float)(fx - x0); wx[0] = 1 - wx[1];
+      wy[1] = (float)(fy - y0); wy[0] = 1 - wy[1];
+    }
+    else
+    {
+      _gdal_cubic_weights((float)(fx - x0), wx);
+      _gdal_cubic_weights((float)(fy - y0), wy);
+      x0--;
+      y0--;
+    }
+    for (k=0;k<ntaps;k++)
+    {
+      xs[k] = _gdal_clamp_index(x0+k, rs->width);
+      ys[k] = _gdal_clamp_index(y0+k, rs->height);
+    }
+    for (j=0;j<ntaps && ok;j++)
+    {
+      const float *row = data + ys[j]*rs->width;
+      float sum = 0;
+      for (k=0;k<ntaps;k++)
+      {
+        if (_gdal_is_nodata(row[xs[k]], rs->nodata))
+        {
+          ok = FALSE;
+          break;
+        }
+        sum += row[xs[k]]*wx[k];
+      }
+      acc += sum*wy[j];
+    }
+    if (ok)
+    {
+      dst[i] = acc;
+      dstvalid[i] = TRUE;
+    }
+    else
+    {
+      dstvalid[i] = _gdal_sample_float_nearest(rs, pReproj, offset+i, dst+i);
+    }
+  }
+}
+//------------------------------------------------------------------------------
+static void _gdal_resample_row_float_bilinear(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, float *dst, unsigned char *dstvalid)
+{
+  _gdal_resample_row_float_interpolate(rs, pReproj, offset, n, dst, dstvalid, 2);
+}
+//------------------------------------------------------------------------------
+static void _gdal_resample_row_float_cubic(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, float *dst, unsigned char *dstvalid)
+{
+  _gdal_resample_row_float_interpolate(rs, pReproj, offset, n, dst, dstvalid, 4);
+}
+//------------------------------------------------------------------------------
+static void _gdal_resample_row_float_average(gdal_resampler *rs, gdal_reprojection *pReproj,
+      int offset, int n, float *dst, unsigned char *dstvalid)
+{
+  const float *data = rs->data;
+  int i, x, y, x0, y0, x1, y1;
+  for (i=0;i<n;i++)
+  {
+    double sum = 0;
+    int count = 0;
+    if (_gdal_average_box(rs, pReproj, offset, i, n, &x0, &y0, &x1, &y1))
+    {
+      for (y=y0;y<=y1;y++)
+      {
+        const float *p = data + y*rs->width;
+        for (x=x0;x<=x1;x++)
+        {
+          if (!_gdal_is_nodata(p[x], rs->nodata))
+          {
+            sum += p[x];
+            count++;
+          }
+        }
+      }
+    }
+    dstvalid[i] = (count > 0);
+    if (count > 0)
+      dst[i] = (float)(sum/count);
+  }
+}
+//------------------------------------------------------------------------------
+static gdal_resample_float_func _gdal_get_float_resampler(mapcache_resample_mode mode)
+{
+  switch (mode)
   {
-     for (x=0;x<map->width;x++)
-     {
-       unsigned char r,g,b,a; 
-       double x_coord = pDstDataset->ulx + ((double)x)*pDstDataset->pixelwidth;
-       double y_coord = pDstDataset->uly - ((double)y)*pDstDataset->pixelheight;
-       
-       // note: non-global datasets may have too large numbers (overflow) to
-       //       process on a global system. Therefore this additional check is
-       //       implemented
-       if (gdal->extent != NULL)
-       {
-            double x_wgs84 = x_coord;
-            double y_wgs84 = y_coord;
-            OCTTransform(pCTWGS84, 1, &x_wgs84, &y_wgs84, NULL);
-            
-            if (x_wgs84>=minx_data_wgs84 &&
-                x_wgs84<=maxx_data_wgs84 &&
-                y_wgs84>=miny_data_wgs84 &&
-                y_wgs84<=maxy_data_wgs84)
-            {
-              // pixel will be inside dataset!
-              OCTTransform(pCTBack, 1, &x_coord, &y_coord, NULL);            
-              double xx = pSrcDataset->affineTransformation_inverse[0] + x_coord * pSrcDataset->affineTransformation_inverse[1] + y_coord * pSrcDataset->affineTransformation_inverse[2];
-              double yy = pSrcDataset->affineTransformation_inverse[3] + x_coord * pSrcDataset->affineTransformation_inverse[4] + y_coord * pSrcDataset->affineTransformation_inverse[5];
-              xx -= nXOff;
-              yy -= nYOff;
-              xx *= scalex;
-              yy *= scaley;
-            
-              _ReadImageDataMemBGR(pData, sourcetilewidth, 
-                                              sourcetileheight, (int)(xx), (int)(yy), 
-                                              &r,&g,&b,&a);
-            }
-            else
-            {  // outside global extent -> completely transparent...
-               r=0;
-               g=0;
-               b=0;
-               a=0;
-            }
-       }
-       else
-       {
-          OCTTransform(pCTBack, 1, &x_coord, &y_coord, NULL);            
-          double xx = pSrcDataset->affineTransformation_inverse[0] + x_coord * pSrcDataset->affineTransformation_inverse[1] + y_coord * pSrcDataset->affineTransformation_inverse[2];
-          double yy = pSrcDataset->affineTransformation_inverse[3] + x_coord * pSrcDataset->affineTransformation_inverse[4] + y_coord * pSrcDataset->affineTransformation_inverse[5];
-          xx -= nXOff;
-          yy -= nYOff;
-          xx *= scalex;
-          yy *= scaley;
-         
-          _ReadImageDataMemBGR(pData, sourcetilewidth, 
-                                          sourcetileheight, (int)(xx), (int)(yy), 
-                                          &r,&g,&b,&a);
-       }
-       
-       map->raw_image->data[4*map->width*y+4*x+0] = b;
-       map->raw_image->data[4*map->width*y+4*x+1] = g;
-       map->raw_image->data[4*map->width*y+4*x+2] = r;
-       map->raw_image->data[4*map->width*y+4*x+3] = a;
-     }
+    case MAPCACHE_RESAMPLE_BILINEAR:
+      return _gdal_resample_row_float_bilinear;
+    case MAPCACHE_RESAMPLE_CUBIC:
+      return _gdal_resample_row_float_cubic;
+    case MAPCACHE_RESAMPLE_AVERAGE:
+      return _gdal_resample_row_float_average;
+    default:
+      return _gdal_resample_row_float_nearest;
   }
 }
 //------------------------------------------------------------------------------
 inline void CreateMapBGRA(mapcache_context *ctx, mapcache_map *map, 
-      datasetinfo* pSrcDataset, datasetinfo* pDstDataset, 
-      int sourcetilewidth, int sourcetileheight, mapcache_source_gdal* gdal, 
-      OGRCoordinateTransformationH pCTBack, OGRCoordinateTransformationH pCTWGS84, 
-      double minx_data_wgs84, double miny_data_wgs84,
-      double maxx_data_wgs84,double maxy_data_wgs84, int nXOff,
-      int nYOff, double scalex, double scaley, unsigned char* pData)
+      gdal_reprojection *pReproj, gdal_resampler *pResampler, mapcache_resample_mode mode)
 {
   //----------------------------------------------------------------------------
+  gdal_resample_rgba_func resample = _gdal_get_rgba_resampler(mode);
   map->raw_image = mapcache_image_create(ctx);
   map->raw_image->w = map->width;
   map->raw_image->h = map->height;
   map->raw_image->stride = 4 * map->width;
   map->raw_image->data = malloc(map->width*map->height*4);
-  int x,y;
+  int y;
   for (y=0;y<map->height;y++)
   {
-     for (x=0;x<map->width;x++)
-     {
-       unsigned char r,g,b,a; 
-       double x_coord = pDstDataset->ulx + ((double)x)*pDstDataset->pixelwidth;
-       double y_coord = pDstDataset->uly - ((double)y)*pDstDataset->pixelheight;
-       
-       // note: non-global datasets may have too large numbers (overflow) to
-       //       process on a global system. Therefore this additional check is
-       //       implemented
-       if (gdal->extent != NULL)
-       {
-            double x_wgs84 = x_coord;
-            double y_wgs84 = y_coord;
-            OCTTransform(pCTWGS84, 1, &x_wgs84, &y_wgs84, NULL);
-            
-            if (x_wgs84>=minx_data_wgs84 &&
-                x_wgs84<=maxx_data_wgs84 &&
-                y_wgs84>=miny_data_wgs84 &&
-                y_wgs84<=maxy_data_wgs84)
-            {
-              // pixel will be inside dataset!
-              OCTTransform(pCTBack, 1, &x_coord, &y_coord, NULL);            
-              double xx = pSrcDataset->affineTransformation_inverse[0] + x_coord * pSrcDataset->affineTransformation_inverse[1] + y_coord * pSrcDataset->affineTransformation_inverse[2];
-              double yy = pSrcDataset->affineTransformation_inverse[3] + x_coord * pSrcDataset->affineTransformation_inverse[4] + y_coord * pSrcDataset->affineTransformation_inverse[5];
-              xx -= nXOff;
-              yy -= nYOff;
-              xx *= scalex;
-              yy *= scaley;
-            
-              _ReadImageDataMemBGRA(pData, sourcetilewidth, 
-                                              sourcetileheight, (int)(xx), (int)(yy), 
-                                              &r,&g,&b,&a);
-            }
-            else
-            {  // outside global extent -> completely transparent...
-               r=0;
-               g=0;
-               b=0;
-               a=0;
-            }
-       }
-       else
-       {
-          OCTTransform(pCTBack, 1, &x_coord, &y_coord, NULL);            
-          double xx = pSrcDataset->affineTransformation_inverse[0] + x_coord * pSrcDataset->affineTransformation_inverse[1] + y_coord * pSrcDataset->affineTransformation_inverse[2];
-          double yy = pSrcDataset->affineTransformation_inverse[3] + x_coord * pSrcDataset->affineTransformation_inverse[4] + y_coord * pSrcDataset->affineTransformation_inverse[5];
-          xx -= nXOff;
-          yy -= nYOff;
-          xx *= scalex;
-          yy *= scaley;
-         
-          _ReadImageDataMemBGRA(pData, sourcetilewidth, 
-                                          sourcetileheight, (int)(xx), (int)(yy), 
-                                          &r,&g,&b,&a);
-       }
-       
-       map->raw_image->data[4*map->width*y+4*x+0] = b;
-       map->raw_image->data[4*map->width*y+4*x+1] = g;
-       map->raw_image->data[4*map->width*y+4*x+2] = r;
-       map->raw_image->data[4*map->width*y+4*x+3] = a;
-     }
+     resample(pResampler, pReproj, _gdal_reproject_row(pReproj, y), map->width,
+              map->raw_image->data + map->raw_image->stride*y);
   }
 }
 //------------------------------------------------------------------------------
 inline void CreateMapGray(mapcache_context *ctx, mapcache_map *map, 
-      datasetinfo* pSrcDataset, datasetinfo* pDstDataset, 
-      int sourcetilewidth, int sourcetileheight, mapcache_source_gdal* gdal, 
-      OGRCoordinateTransformationH pCTBack, OGRCoordinateTransformationH pCTWGS84, 
-      double minx_data_wgs84, double miny_data_wgs84,
-      double maxx_data_wgs84,double maxy_data_wgs84, int nXOff,
-      int nYOff, double scalex, double scaley, unsigned char* pData, float NODATA, int datatype)
+      gdal_reprojection *pReproj, gdal_resampler *pResampler, mapcache_resample_mode mode)
 {
   //----------------------------------------------------------------------------
+  gdal_resample_float_func resample = _gdal_get_float_resampler(mode);
+  float *values = apr_palloc(ctx->pool, map->width*sizeof(float));
+  unsigned char *valid = apr_palloc(ctx->pool, map->width);
   map->raw_image = mapcache_image_create(ctx);
   map->raw_image->w = map->width;
   map->raw_image->h = map->height;
@@ -538,60 +1640,21 @@ inline void CreateMapGray(mapcache_context *ctx, mapcache_map *map,
   int x,y;
   for (y=0;y<map->height;y++)
   {
+     resample(pResampler, pReproj, _gdal_reproject_row(pReproj, y), map->width, values, valid);
      for (x=0;x<map->width;x++)
      {
        unsigned char r,g,b,a; 
-       double x_coord = pDstDataset->ulx + ((double)x)*pDstDataset->pixelwidth;
-       double y_coord = pDstDataset->uly - ((double)y)*pDstDataset->pixelheight;
        
-       // note: non-global datasets may have too large numbers (overflow) to
-       //       process on a global system. Therefore this additional check is
-       //       implemented
-       if (gdal->extent != NULL)
+       if (valid[x])
        {
-            double x_wgs84 = x_coord;
-            double y_wgs84 = y_coord;
-            OCTTransform(pCTWGS84, 1, &x_wgs84, &y_wgs84, NULL);
-            
-            if (x_wgs84>=minx_data_wgs84 &&
-                x_wgs84<=maxx_data_wgs84 &&
-                y_wgs84>=miny_data_wgs84 &&
-                y_wgs84<=maxy_data_wgs84)
-            {
-              // pixel will be inside dataset!
-              OCTTransform(pCTBack, 1, &x_coord, &y_coord, NULL);            
-              double xx = pSrcDataset->affineTransformation_inverse[0] + x_coord * pSrcDataset->affineTransformation_inverse[1] + y_coord * pSrcDataset->affineTransformation_inverse[2];
-              double yy = pSrcDataset->affineTransformation_inverse[3] + x_coord * pSrcDataset->affineTransformation_inverse[4] + y_coord * pSrcDataset->affineTransformation_inverse[5];
-              xx -= nXOff;
-              yy -= nYOff;
-              xx *= scalex;
-              yy *= scaley;
-            
-              _ReadImageDataMemGray(pData, sourcetilewidth, 
-                                              sourcetileheight, (int)(xx), (int)(yy), 
-                                              &r,&g,&b,&a, NODATA, datatype);
-            }
-            else
-            {  // outside global extent -> completely transparent...
-               r=0;
-               g=0;
-               b=0;
-               a=0;
-            }
+          _GrayValueToColor(values[x], &r,&g,&b,&a);
        }
        else
-       {
-          OCTTransform(pCTBack, 1, &x_coord, &y_coord, NULL);            
-          double xx = pSrcDataset->affineTransformation_inverse[0] + x_coord * pSrcDataset->affineTransformation_inverse[1] + y_coord * pSrcDataset->affineTransformation_inverse[2];
-          double yy = pSrcDataset->affineTransformation_inverse[3] + x_coord * pSrcDataset->affineTransformation_inverse[4] + y_coord * pSrcDataset->affineTransformation_inverse[5];
-          xx -= nXOff;
-          yy -= nYOff;
-          xx *= scalex;
-          yy *= scaley;
-         
-          _ReadImageDataMemGray(pData, sourcetilewidth, 
-                                          sourcetileheight, (int)(xx), (int)(yy), 
-                                          &r,&g,&b,&a, NODATA, datatype);
+       {  // outside dataset, global extent or nodata -> completely transparent...
+          r=0;
+          g=0;
+          b=0;
+          a=0;
        }
        
        map->raw_image->data[4*map->width*y+4*x+0] = b;
@@ -605,27 +1668,18 @@ inline void CreateMapGray(mapcache_context *ctx, mapcache_map *map,
 /**
  * \private \memberof mapcache_source_gdal
  */
-void _mapcache_source_gdal_render_map_image(mapcache_context *ctx, mapcache_map *map)
+void _mapcache_source_gdal_render_map_image(mapcache_context *ctx, mapcache_map *map, gdal_dataset_entry *entry)
 {
   double minx, miny, maxx, maxy;
-  double minx_data_wgs84, miny_data_wgs84, maxx_data_wgs84, maxy_data_wgs84;
 
   //double gminx, gminy, gmaxx, gmaxy;
   int tilewidth, tileheight;
-  char *dstSRS;
-  char *srcSRS = "";
   datasetinfo oSrcDataset;
   datasetinfo oDstDataset;
   
-  OGRCoordinateTransformationH pCT;
   OGRCoordinateTransformationH pCTBack;
   OGRCoordinateTransformationH pCTWGS84 = NULL;
   
-  double quality = 2;
-  
-  OGRSpatialReferenceH srcref;
-  OGRSpatialReferenceH dstref;
-  OGRSpatialReferenceH wgs84ref = NULL;
   GDALDatasetH hDataset;
   
   mapcache_source_gdal *gdal = (mapcache_source_gdal*)map->tileset->source;
@@ -641,83 +1695,11 @@ void _mapcache_source_gdal_render_map_image(mapcache_context *ctx, mapcache_map
   tileheight = map->height;
   
  
-  // Setup GDAL
-  GDALAllRegister();
-  CPLErrorReset();
-  
-  // Setup Destination Spatial Reference System
-  dstref = OSRNewSpatialReference(NULL);
-  if (OSRSetFromUserInput (dstref, map->grid_link->grid->srs ) == OGRERR_NONE) 
-  {
-     OSRExportToWkt(dstref, &dstSRS);   
-  }
-  else 
-  {
-    ctx->set_error(ctx,500, "failed to parse gdal srs %s", map->grid_link->grid->srs);
-    return;
-  }
-  
-  // Open Dataset
-  hDataset = GDALOpen( gdal->datastr, GA_ReadOnly );
-   if( hDataset == NULL ) {
-    ctx->set_error(ctx,500,"GDAL failed to open %s",gdal->datastr);
-    return;
-   }  
-  
-  // Retrieve Spatial Reference System of Source Dataset
-  if (gdal->srs == NULL)
-  {
-      if( GDALGetProjectionRef( hDataset ) != NULL && strlen(GDALGetProjectionRef( hDataset )) > 0 )
-         srcSRS = apr_pstrdup(ctx->pool,GDALGetProjectionRef( hDataset ));
-      else if( GDALGetGCPProjection( hDataset ) != NULL && strlen(GDALGetGCPProjection(hDataset)) > 0 && GDALGetGCPCount( hDataset ) > 1 )
-         srcSRS = apr_pstrdup(ctx->pool,GDALGetGCPProjection( hDataset ));
-  }
-  else
-  {
-      srcSRS = apr_pstrdup(ctx->pool,gdal->srs);
-      //ctx->log(ctx,MAPCACHE_NOTICE,"**Source SRS: %s", srcSRS);
-  }
-      
-  // Setup Source SRS
-  srcref = OSRNewSpatialReference(NULL);
-  if (OSRSetFromUserInput(srcref, srcSRS) != OGRERR_NONE)
-  {
-     ctx->set_error(ctx,500,"Error: can't create spatial reference of source");
-     return; 
-  }
-  
-  if (gdal->extent != NULL)
-  {
-    wgs84ref = OSRNewSpatialReference(NULL);
-    if (OSRImportFromEPSG(wgs84ref, 4326) != OGRERR_NONE)
-    {
-      ctx->set_error(ctx,500,"Error: can't create spatial reference for WGS84");
-      return; 
-    }
-  }
-  
-  // Handle GeoTransform:
-  GDALGetGeoTransform(hDataset, oSrcDataset.affineTransformation);
-   
-  if (!InvertGeoMatrix(oSrcDataset.affineTransformation, oSrcDataset.affineTransformation_inverse))
-  {
-     ctx->set_error(ctx,500,"Error: can't create inverse of affine transformation (src)");
-     return;  
-  }
+  hDataset = entry->hDataset;
+  pCTBack = entry->pCTBack;
+  pCTWGS84 = entry->pCTWGS84;
+  oSrcDataset = entry->oSrcDataset;
   
-  // Setup source dataset
-  oSrcDataset.nBands = GDALGetRasterCount(hDataset);
-  oSrcDataset.nSizeX = GDALGetRasterXSize(hDataset);
-  oSrcDataset.nSizeY = GDALGetRasterYSize(hDataset);
-  oSrcDataset.pixelwidth  = oSrcDataset.affineTransformation[1];
-  oSrcDataset.pixelheight = oSrcDataset.affineTransformation[5];
-  oSrcDataset.ulx = oSrcDataset.affineTransformation[0];
-  oSrcDataset.uly = oSrcDataset.affineTransformation[3];
-  oSrcDataset.lrx = oSrcDataset.ulx + oSrcDataset.affineTransformation[1] * oSrcDataset.nSizeX;
-  oSrcDataset.lry = oSrcDataset.uly + oSrcDataset.affineTransformation[5] * oSrcDataset.nSizeY;
-  
-  //ctx->log(ctx,MAPCACHE_NOTICE,"Src Dataset: (%f,%f)-(%f,%f)", oSrcDataset.ulx,oSrcDataset.uly,oSrcDataset.lrx,oSrcDataset.lry);
-
   // Setup destination dataset (=Tile to be cached)  
   oDstDataset.nBands = 4;
   oDstDataset.nSizeX = tilewidth;
@@ -741,41 +1723,7 @@ void _mapcache_source_gdal_render_map_image(mapcache_context *ctx, mapcache_map
      return;  
   }
 
-  // Create Coordinate transformation:
-  pCT        = OCTNewCoordinateTransformation(srcref, dstref);
-  pCTBack    = OCTNewCoordinateTransformation(dstref, srcref);
-  if (gdal->extent != NULL)
-  {
-    pCTWGS84   = OCTNewCoordinateTransformation(dstref, wgs84ref);
-    if (!pCTWGS84)
-    {
-      ctx->set_error(ctx,500,"Error: can't create transformation to WGS84");
-      return;  
-    }
-  }
-  
-  if (!pCT)
-  {
-   ctx->set_error(ctx,500,"Error: can't create forward transformation");
-   return;  
-  }
-  
-  if (!pCTBack)
-  {
-   ctx->set_error(ctx,500,"Error: can't create backward transformation");
-   return;  
-  }
   
-  // warning: this is not always valid. For now this is restricted
-  // to projections like mercator -> wgs84.
-  // only use the "extent" tag for such datasets.
-  if (gdal->extent != NULL)
-  {
-    minx_data_wgs84 = gdal->extent->minx;
-    miny_data_wgs84 = gdal->extent->miny;
-    maxx_data_wgs84 = gdal->extent->maxx;
-    maxy_data_wgs84 = gdal->extent->maxy;
-  }
   // Rectangle within source required for tile
   double dest_ulx = 1e20;
   double dest_lry = 1e20;
@@ -851,11 +1799,6 @@ void _mapcache_source_gdal_render_map_image(mapcache_context *ctx, mapcache_map
     memset(map->raw_image->data, 0, map->width*map->height*4);
     apr_pool_cleanup_register(ctx->pool, map->raw_image->data,(void*)free, apr_pool_cleanup_null);
     
-    OCTDestroyCoordinateTransformation(pCT);   
-    OCTDestroyCoordinateTransformation(pCTBack); 
-    OSRDestroySpatialReference(dstref);
-    OSRDestroySpatialReference(srcref);
-    GDALClose(hDataset);
     return;
   }
   
@@ -902,11 +1845,6 @@ void _mapcache_source_gdal_render_map_image(mapcache_context *ctx, mapcache_map
     memset(map->raw_image->data, 0, map->width*map->height*4);
     apr_pool_cleanup_register(ctx->pool, map->raw_image->data,(void*)free, apr_pool_cleanup_null);
     
-    OCTDestroyCoordinateTransformation(pCT);   
-    OCTDestroyCoordinateTransformation(pCTBack); 
-    OSRDestroySpatialReference(dstref);
-    OSRDestroySpatialReference(srcref);
-    GDALClose(hDataset);
     return;
   }
     
@@ -914,8 +1852,16 @@ void _mapcache_source_gdal_render_map_image(mapcache_context *ctx, mapcache_map
   int sourcetileheight; // nYSize would be 100%
   
   double aspect = (double)nXSize/(double)nYSize;
-  sourcetilewidth = quality * GM_MAX(tilewidth, tileheight);
+  sourcetilewidth = gdal->oversampling * GM_MAX(tilewidth, tileheight);
   sourcetileheight = (int)((double)sourcetilewidth/aspect);
+  if (gdal->resample_mode != MAPCACHE_RESAMPLE_NEAREST && sourcetilewidth > nXSize)
+  {
+    // interpolating kernels: don't let GDAL upsample the window by nearest neighbour
+    sourcetilewidth = nXSize;
+    sourcetileheight = nYSize;
+  }
+  if (sourcetilewidth < 1) sourcetilewidth = 1;
+  if (sourcetileheight < 1) sourcetileheight = 1;
   
   double scalex = (double)sourcetilewidth/(double)nXSize;
   double scaley = (double)sourcetileheight/(double)nYSize;
@@ -930,49 +1876,27 @@ void _mapcache_source_gdal_render_map_image(mapcache_context *ctx, mapcache_map
   ctx->log(ctx,MAPCACHE_NOTICE,"Reading Tile-Size: (%i, %i)", sourcetilewidth, sourcetileheight);*/
   
   // Retrieve data from source
-  unsigned char *pData = NULL;
-  int bands = 0;
-  float NODATA = -9999;
-  int datatype_bytes;
-  int datatype;
-  
- 
-  if (oSrcDataset.nBands == 3)
+  gdal_resampler oResampler;
+  oResampler.width = sourcetilewidth;
+  oResampler.height = sourcetileheight;
+  oResampler.nXOff = nXOff;
+  oResampler.nYOff = nYOff;
+  oResampler.scalex = scalex;
+  oResampler.scaley = scaley;
+  oResampler.nodata = -9999;
+  
+  if (oSrcDataset.nBands == 3 || oSrcDataset.nBands == 4)
   {
-  
-    bands = 3;
-    pData = apr_palloc(ctx->pool,sourcetilewidth*sourcetileheight*3);
+    // RGB is read as RGBA with opaque alpha
+    unsigned char *pData = apr_palloc(ctx->pool,sourcetilewidth*sourcetileheight*4);
     if (pData == NULL)
     {
-      ctx->set_error(ctx,500,"Error: Cant allocate memory: %i bytes", sourcetilewidth*sourcetileheight*3);
+      ctx->set_error(ctx,500,"Error: Cant allocate memory: %i bytes", sourcetilewidth*sourcetileheight*4);
       return; 
     }
-    
-    if (CE_None != GDALDatasetRasterIO(hDataset, GF_Read, 
-           nXOff, nYOff,    // Pixel position in source dataset 
-           nXSize, nYSize,  // width/height in source dataset
-           pData,           // target buffer
-           sourcetilewidth, sourcetileheight, // dimension of target buffer
-           GDT_Byte,        // reading bytes...
-           oSrcDataset.nBands, // number of input bands
-           NULL,            // band map is ignored
-           3,               // pixelspace
-           3*sourcetilewidth, //linespace, 
-           1                  //bandspace.
-    ))
-    {
-      ctx->set_error(ctx,500,"Error: GDALDatasetRasterIO failed!");
-      return;  
-    }
-  }
-  else if (oSrcDataset.nBands == 4)
-  {
-    bands = 4;
-    pData = apr_palloc(ctx->pool,sourcetilewidth*sourcetileheight*4);
-    if (pData == NULL)
+    if (oSrcDataset.nBands == 3)
     {
-      ctx->set_error(ctx,500,"Error: Cant allocate memory: %i bytes", sourcetilewidth*sourcetileheight*4);
-      return; 
+      memset(pData, 255, sourcetilewidth*sourcetileheight*4);
     }
     
     if (CE_None != GDALDatasetRasterIO(hDataset, GF_Read, 
@@ -991,59 +1915,23 @@ void _mapcache_source_gdal_render_map_image(mapcache_context *ctx, mapcache_map
       ctx->set_error(ctx,500,"Error: GDALDatasetRasterIO failed!");
       return;  
     }
+    oResampler.data = pData;
   }
   else if (oSrcDataset.nBands == 1)
   {
-    bands = 1;
     int success;
     GDALRasterBandH hBand = GDALGetRasterBand(hDataset, 1); 
     if (hBand)
     {
-      NODATA = (float)GDALGetRasterNoDataValue(hBand, &success);
+      oResampler.nodata = (float)GDALGetRasterNoDataValue(hBand, &success);
       //ctx->log(ctx,MAPCACHE_NOTICE,"**NODATA Value: %f", NODATA);
     }
     
-    GDALDataType rdd = GDALGetRasterDataType(hBand);
-    
-    switch (rdd)
-    {
-      case GDT_Byte:
-        datatype = 7;
-        datatype_bytes = 1;
-      break;
-      case GDT_UInt16:
-        datatype = 5;
-        datatype_bytes = GDALGetDataTypeSize(GDT_UInt16) / 8;
-      break;
-      case GDT_Int16:
-        datatype = 6;
-        datatype_bytes = GDALGetDataTypeSize(GDT_Int16) / 8;
-      break;
-      case GDT_UInt32:
-        datatype = 1;
-        datatype_bytes = GDALGetDataTypeSize(GDT_UInt32) / 8;
-      break;
-      case GDT_Int32:
-        datatype = 2;
-        datatype_bytes = GDALGetDataTypeSize(GDT_Int32) / 8;
-      break;
-      case GDT_Float32:
-        datatype = 3;
-        datatype_bytes = GDALGetDataTypeSize(GDT_Float32) / 8;
-      break;
-      case GDT_Float64:
-        datatype = 4;
-        datatype_bytes = GDALGetDataTypeSize(GDT_Float64) / 8;
-      break;
-      default:
-         ctx->set_error(ctx,500,"Error: Unsupported Raster Data Type");
-      return;
-      }
-    
-    pData = apr_palloc(ctx->pool,sourcetilewidth*sourcetileheight*datatype_bytes);
+    // single band data of any type is read as float
+    float *pData = apr_palloc(ctx->pool,sourcetilewidth*sourcetileheight*sizeof(float));
     if (pData == NULL)
     {
-      ctx->set_error(ctx,500,"Error: Cant allocate memory: %i bytes", sourcetilewidth*sourcetileheight*datatype_bytes);
+      ctx->set_error(ctx,500,"Error: Cant allocate memory: %i bytes", (int)(sourcetilewidth*sourcetileheight*sizeof(float)));
       return; 
     } 
  
@@ -1052,59 +1940,37 @@ void _mapcache_source_gdal_render_map_image(mapcache_context *ctx, mapcache_map
            nXSize, nYSize,  // width/height in source dataset
            pData,        // target buffer
            sourcetilewidth, sourcetileheight, // dimension of target buffer
-           rdd,      
+           GDT_Float32,      
            oSrcDataset.nBands, // number of input bands
            NULL,            // band map is ignored
-           datatype_bytes,  // pixelspace
-           datatype_bytes*sourcetilewidth, //linespace, 
+           sizeof(float),  // pixelspace
+           sizeof(float)*sourcetilewidth, //linespace, 
            1                  //bandspace.
     ))
     {
       ctx->set_error(ctx,500,"Error: GDALDatasetRasterIO failed!");
       return;  
     }
+    oResampler.data = pData;
   }
   else
   {
-    bands = 0;
     ctx->set_error(ctx,500,"Error: Unsupported number of bands");
     return; 
   }
-  // Close Dataset
-  GDALClose( hDataset );
 
-  if (bands == 3)
-  {
-    CreateMapBGR(ctx, map, &oSrcDataset, &oDstDataset, 
-                 sourcetilewidth, sourcetileheight, gdal, pCTBack, pCTWGS84,
-                 minx_data_wgs84,miny_data_wgs84,maxx_data_wgs84,maxy_data_wgs84,
-                 nXOff, nYOff, scalex, scaley, pData
-                );
-   
-  }
-  else if (bands == 4)
+  // source pixel positions of the destination pixels
+  gdal_reprojection *pReproj = _gdal_reproject(ctx, gdal, &oSrcDataset, &oDstDataset, pCTBack, pCTWGS84);
+
+  if (oSrcDataset.nBands == 1)
   {
-    CreateMapBGRA(ctx, map, &oSrcDataset, &oDstDataset, 
-                 sourcetilewidth, sourcetileheight, gdal, pCTBack, pCTWGS84,
-                 minx_data_wgs84,miny_data_wgs84,maxx_data_wgs84,maxy_data_wgs84,
-                 nXOff, nYOff, scalex, scaley, pData
-                );
+    CreateMapGray(ctx, map, pReproj, &oResampler, gdal->resample_mode);
   }
-  else if (bands == 1)
+  else
   {
-    CreateMapGray(ctx, map, &oSrcDataset, &oDstDataset, 
-                 sourcetilewidth, sourcetileheight, gdal, pCTBack, pCTWGS84,
-                 minx_data_wgs84,miny_data_wgs84,maxx_data_wgs84,maxy_data_wgs84,
-                 nXOff, nYOff, scalex, scaley, pData, NODATA, datatype);
+    CreateMapBGRA(ctx, map, pReproj, &oResampler, gdal->resample_mode);
   }
   
-  
-  // free SRS
-  OCTDestroyCoordinateTransformation(pCT);   
-  OCTDestroyCoordinateTransformation(pCTBack); 
-  OSRDestroySpatialReference(dstref);
-  OSRDestroySpatialReference(srcref);
-  
   apr_pool_cleanup_register(ctx->pool, map->raw_image->data,(void*)free, apr_pool_cleanup_null);
 }
 
@@ -1112,25 +1978,18 @@ void _mapcache_source_gdal_render_map_image(mapcache_context *ctx, mapcache_map
 /**
  * \private \memberof mapcache_source_gdal
  */
-void _mapcache_source_gdal_render_map_elevation(mapcache_context *ctx, mapcache_map *map)
+void _mapcache_source_gdal_render_map_elevation(mapcache_context *ctx, mapcache_map *map, gdal_dataset_entry *entry)
 {
   int elevationblock = map->grid_link->grid->elevationblock;
   double minx, miny, maxx, maxy;
-  double minx_data_wgs84, miny_data_wgs84, maxx_data_wgs84, maxy_data_wgs84;
 
   //double gminx, gminy, gmaxx, gmaxy;
   int tilewidth, tileheight;
-  char *dstSRS;
-  char *srcSRS = "";
   datasetinfo oSrcDataset;
   datasetinfo oDstDataset;
   
-  OGRCoordinateTransformationH pCT;
   OGRCoordinateTransformationH pCTBack;
   
-  OGRSpatialReferenceH srcref;
-  OGRSpatialReferenceH dstref;
-  OGRSpatialReferenceH wgs84ref = NULL;
   GDALDatasetH hDataset;
   
   mapcache_source_gdal *gdal = (mapcache_source_gdal*)map->tileset->source;
@@ -1145,83 +2004,10 @@ void _mapcache_source_gdal_render_map_elevation(mapcache_context *ctx, mapcache_
   // heoight of tile (pixel)
   tileheight = elevationblock;
   
-  // Setup GDAL
-  GDALAllRegister();
-  CPLErrorReset();
-  
-  // Setup Destination Spatial Reference System
-  dstref = OSRNewSpatialReference(NULL);
-  if (OSRSetFromUserInput (dstref, map->grid_link->grid->srs ) == OGRERR_NONE) 
-  {
-     OSRExportToWkt(dstref, &dstSRS);   
-  }
-  else 
-  {
-    ctx->set_error(ctx,500, "failed to parse gdal srs %s", map->grid_link->grid->srs);
-    return;
-  }
-  
-  // Open Dataset
-  hDataset = GDALOpen( gdal->datastr, GA_ReadOnly );
-   if( hDataset == NULL ) {
-    ctx->set_error(ctx,500,"GDAL failed to open %s",gdal->datastr);
-    return;
-   }  
-  
-  // Retrieve Spatial Reference System of Source Dataset
-  if (gdal->srs == NULL)
-  {
-      if( GDALGetProjectionRef( hDataset ) != NULL && strlen(GDALGetProjectionRef( hDataset )) > 0 )
-         srcSRS = apr_pstrdup(ctx->pool,GDALGetProjectionRef( hDataset ));
-      else if( GDALGetGCPProjection( hDataset ) != NULL && strlen(GDALGetGCPProjection(hDataset)) > 0 && GDALGetGCPCount( hDataset ) > 1 )
-         srcSRS = apr_pstrdup(ctx->pool,GDALGetGCPProjection( hDataset ));
-  }
-  else
-  {
-      srcSRS = apr_pstrdup(ctx->pool,gdal->srs);
-      //ctx->log(ctx,MAPCACHE_NOTICE,"**Source SRS: %s", srcSRS);
-  }
-      
-  // Setup Source SRS
-  srcref = OSRNewSpatialReference(NULL);
-  if (OSRSetFromUserInput(srcref, srcSRS) != OGRERR_NONE)
-  {
-     ctx->set_error(ctx,500,"Error: can't create spatial reference of source");
-     return; 
-  }
-  
-  if (gdal->extent != NULL)
-  {
-    wgs84ref = OSRNewSpatialReference(NULL);
-    if (OSRImportFromEPSG(wgs84ref, 4326) != OGRERR_NONE)
-    {
-      ctx->set_error(ctx,500,"Error: can't create spatial reference for WGS84");
-      return; 
-    }
-  }
-  
-  // Handle GeoTransform:
-  GDALGetGeoTransform(hDataset, oSrcDataset.affineTransformation);
-   
-  if (!InvertGeoMatrix(oSrcDataset.affineTransformation, oSrcDataset.affineTransformation_inverse))
-  {
-     ctx->set_error(ctx,500,"Error: can't create inverse of affine transformation (src)");
-     return;  
-  }
+  hDataset = entry->hDataset;
+  pCTBack = entry->pCTBack;
+  oSrcDataset = entry->oSrcDataset;
   
-  // Setup source dataset
-  oSrcDataset.nBands = GDALGetRasterCount(hDataset);
-  oSrcDataset.nSizeX = GDALGetRasterXSize(hDataset);
-  oSrcDataset.nSizeY = GDALGetRasterYSize(hDataset);
-  oSrcDataset.pixelwidth  = oSrcDataset.affineTransformation[1];
-  oSrcDataset.pixelheight = oSrcDataset.affineTransformation[5];
-  oSrcDataset.ulx = oSrcDataset.affineTransformation[0];
-  oSrcDataset.uly = oSrcDataset.affineTransformation[3];
-  oSrcDataset.lrx = oSrcDataset.ulx + oSrcDataset.affineTransformation[1] * oSrcDataset.nSizeX;
-  oSrcDataset.lry = oSrcDataset.uly + oSrcDataset.affineTransformation[5] * oSrcDataset.nSizeY;
-  
-  //ctx->log(ctx,MAPCACHE_NOTICE,"Src Dataset: (%f,%f)-(%f,%f)", oSrcDataset.ulx,oSrcDataset.uly,oSrcDataset.lrx,oSrcDataset.lry);
-
   // Setup destination dataset (=Tile to be cached)  
   oDstDataset.nBands = 4;
   oDstDataset.nSizeX = tilewidth;
@@ -1245,21 +2031,6 @@ void _mapcache_source_gdal_render_map_elevation(mapcache_context *ctx, mapcache_
      return;  
   }
 
-  // Create Coordinate transformation:
-  pCT        = OCTNewCoordinateTransformation(srcref, dstref);
-  pCTBack    = OCTNewCoordinateTransformation(dstref, srcref);
-  
-  if (!pCT)
-  {
-   ctx->set_error(ctx,500,"Error: can't create forward transformation");
-   return;  
-  }
-  
-  if (!pCTBack)
-  {
-   ctx->set_error(ctx,500,"Error: can't create backward transformation");
-   return;  
-  }
   
   // Retrieve data from source
   unsigned char *pData = NULL;
@@ -1336,23 +2107,21 @@ void _mapcache_source_gdal_render_map_elevation(mapcache_context *ctx, mapcache_
     map->raw_image->data = malloc(elevationblock*elevationblock*4);
     apr_pool_cleanup_register(ctx->pool, map->raw_image->data,(void*)free, apr_pool_cleanup_null);
   
+    // source pixel positions of the elevation samples
+    gdal_reprojection *pReproj = _gdal_reproject(ctx, gdal, &oSrcDataset, &oDstDataset, pCTBack, NULL);
+  
     int x,y;
     for (y=0;y<elevationblock;y++)
     {
+      int offset = _gdal_reproject_row(pReproj, y);
       for (x=0;x<elevationblock;x++)
       {       
         unsigned char r,g,b,a; 
-        double x_coord = oDstDataset.ulx + ((double)x)*oDstDataset.pixelwidth;
-        double y_coord = oDstDataset.uly - ((double)y)*oDstDataset.pixelheight; 
-        
-        OCTTransform(pCTBack, 1, &x_coord, &y_coord, NULL);            
-        double xx = oSrcDataset.affineTransformation_inverse[0] + x_coord * oSrcDataset.affineTransformation_inverse[1] + y_coord * oSrcDataset.affineTransformation_inverse[2];
-        double yy = oSrcDataset.affineTransformation_inverse[3] + x_coord * oSrcDataset.affineTransformation_inverse[4] + y_coord * oSrcDataset.affineTransformation_inverse[5];
-
-        int xxi = (int)xx;
-        int yyi = (int)yy;
+        int xxi = (int)pReproj->srcx[offset+x];
+        int yyi = (int)pReproj->srcy[offset+x];
         // is it inside dataset ?
-        if (xxi < 0 || xxi > oSrcDataset.nSizeX-1 ||
+        if (!pReproj->valid[offset+x] ||
+            xxi < 0 || xxi > oSrcDataset.nSizeX-1 ||
             yyi < 0 || yyi > oSrcDataset.nSizeY-1)
         {
            a = r = g = b = 0;
@@ -1391,14 +2160,7 @@ void _mapcache_source_gdal_render_map_elevation(mapcache_context *ctx, mapcache_
     
   
 
-  // Close Dataset
-  GDALClose( hDataset );
 
-  // free SRS
-  OCTDestroyCoordinateTransformation(pCT);   
-  OCTDestroyCoordinateTransformation(pCTBack); 
-  OSRDestroySpatialReference(dstref);
-  OSRDestroySpatialReference(srcref);
 }
 //------------------------------------------------------------------------------
 /**
@@ -1408,16 +2170,20 @@ void _mapcache_source_gdal_render_map_elevation(mapcache_context *ctx, mapcache_
 void _mapcache_source_gdal_render_map(mapcache_context *ctx, mapcache_map *map)
 {
   int is_elevation = map->tileset->elevation;
+  mapcache_source_gdal *gdal = (mapcache_source_gdal*)map->tileset->source;
+  gdal_dataset_entry *entry = _gdal_acquire_dataset(ctx, gdal, map->grid_link->grid);
+  GC_CHECK_ERROR(ctx);
   
   if (is_elevation)
   {
-    _mapcache_source_gdal_render_map_elevation(ctx, map);
+    _mapcache_source_gdal_render_map_elevation(ctx, map, entry);
   }
   else
   {
-    _mapcache_source_gdal_render_map_image(ctx, map);
+    _mapcache_source_gdal_render_map_image(ctx, map, entry);
   }
   
+  _gdal_release_dataset(ctx, gdal, entry);
 }
 /*----------------------------------------------------------------------------*/
 void _mapcache_source_gdal_query(mapcache_context *ctx, mapcache_feature_info *fi)
@@ -1480,6 +2246,62 @@ void _mapcache_source_gdal_configuration_parse_xml(mapcache_context *ctx, ezxml_
      parse_extent(cur_node->txt, src->extent);
      apr_pool_cleanup_register(ctx->pool, src->extent,(void*)free, apr_pool_cleanup_null);
   }
+  
+  if ((cur_node = ezxml_child(node,"max_open_datasets")) != NULL) {
+    char *endptr;
+    src->max_open_datasets = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || src->max_open_datasets < 1) {
+      ctx->set_error(ctx,400,"failed to parse max_open_datasets \"%s\" for gdal source \"%s\". Expecting a positive integer, e.g. <max_open_datasets>8</max_open_datasets>",
+                     cur_node->txt, source->name);
+      return;
+    }
+  }
+  
+  if ((cur_node = ezxml_child(node,"reprojection_grid")) != NULL) {
+    char *endptr;
+    src->reprojection_grid = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || src->reprojection_grid < 1) {
+      ctx->set_error(ctx,400,"failed to parse reprojection_grid \"%s\" for gdal source \"%s\". Expecting a positive integer, e.g. <reprojection_grid>16</reprojection_grid>",
+                     cur_node->txt, source->name);
+      return;
+    }
+  }
+  
+  if ((cur_node = ezxml_child(node,"reprojection_tolerance")) != NULL) {
+    char *endptr;
+    src->reprojection_tolerance = strtod(cur_node->txt,&endptr);
+    if(*endptr != 0 || src->reprojection_tolerance < 0) {
+      ctx->set_error(ctx,400,"failed to parse reprojection_tolerance \"%s\" for gdal source \"%s\". Expecting a positive number of pixels, e.g. <reprojection_tolerance>0.125</reprojection_tolerance>",
+                     cur_node->txt, source->name);
+      return;
+    }
+  }
+  
+  if ((cur_node = ezxml_child(node,"resampling")) != NULL) {
+    if(!strcmp(cur_node->txt,"nearest")) {
+      src->resample_mode = MAPCACHE_RESAMPLE_NEAREST;
+    } else if(!strcmp(cur_node->txt,"bilinear")) {
+      src->resample_mode = MAPCACHE_RESAMPLE_BILINEAR;
+    } else if(!strcmp(cur_node->txt,"cubic")) {
+      src->resample_mode = MAPCACHE_RESAMPLE_CUBIC;
+    } else if(!strcmp(cur_node->txt,"average")) {
+      src->resample_mode = MAPCACHE_RESAMPLE_AVERAGE;
+    } else {
+      ctx->set_error(ctx,400, "unknown value %s for node <resampling> of gdal source \"%s\" (allowed values: nearest, bilinear, cubic, average)",
+                     cur_node->txt, source->name);
+      return;
+    }
+  }
+  
+  if ((cur_node = ezxml_child(node,"oversampling")) != NULL) {
+    char *endptr;
+    src->oversampling = strtod(cur_node->txt,&endptr);
+    if(*endptr != 0 || src->oversampling <= 0) {
+      ctx->set_error(ctx,400,"failed to parse oversampling \"%s\" for gdal source \"%s\". Expecting a positive number, e.g. <oversampling>2</oversampling>",
+                     cur_node->txt, source->name);
+      return;
+    }
+  }
 }
 /*----------------------------------------------------------------------------*/
 /**
@@ -1501,6 +2323,11 @@ mapcache_source* mapcache_source_gdal_create(mapcache_context *ctx)
   mapcache_source_init(ctx, &(source->source));
   source->srs = NULL;
   source->extent = NULL;
+  source->max_open_datasets = 8;
+  source->reprojection_grid = 16;
+  source->reprojection_tolerance = 0.125;
+  source->resample_mode = MAPCACHE_RESAMPLE_NEAREST;
+  source->oversampling = 2;
   source->source.type = MAPCACHE_SOURCE_GDAL;
   source->source.render_map = _mapcache_source_gdal_render_map;
   source->source.configuration_check = _mapcache_source_gdal_configuration_check;
@@ -77,37 +77,17 @@ void _GetTileCoords(mapcache_map *map, int* zoom, int* x, int* y, int flipy)
 }
 
 //------------------------------------------------------------------------------
-void _mapcache_source_tms_render_map_elevation(mapcache_context *ctx, mapcache_map *map)
+static void _mapcache_source_tms_elevation_done(mapcache_context *ctx, mapcache_map *map)
 {
-  mapcache_source_tms *tms;
   int elevationblock;
-  int zoom, x, y;
-  char* url;
   double dx, dy;
-  
-  tms = (mapcache_source_tms*)map->tileset->source;
+
   elevationblock = map->grid_link->grid->elevationblock;
-  
-  _GetTileCoords(map, &zoom, &x, &y, tms->flipy);
-  
-  url = apr_psprintf(ctx->pool,"%s/1.0.0/%s/%i/%i/%i.%s", tms->url,tms->layer,zoom,x,y,tms->format);
-  tms->http->url = apr_pstrdup(ctx->pool,url);
-  
-  map->encoded_data = mapcache_buffer_create(30000,ctx->pool);
-  mapcache_http_do_request(ctx, tms->http, map->encoded_data, NULL, NULL);
-  GC_CHECK_ERROR(ctx);
-  
-  if(!mapcache_imageio_is_valid_format(ctx,map->encoded_data)) {
-    char *returned_data = apr_pstrndup(ctx->pool,(char*)map->encoded_data->buf,map->encoded_data->size);
-    ctx->set_error(ctx, 502, "tms request for tileset %s returned an unsupported format:\n%s",
-                   map->tileset->name, returned_data);
-    return;
-  }
-  
+
   map->raw_image = mapcache_imageio_decode(ctx, map->encoded_data);
-  map->raw_image->is_elevation = MC_ELEVATION_YES;
   GC_CHECK_ERROR(ctx);
-  
+  map->raw_image->is_elevation = MC_ELEVATION_YES;
+
   //map->raw_image->stride = 4 * elevationblock;
   dx = fabs(map->grid_link->grid->extent.maxx-map->grid_link->grid->extent.minx);
   dy = fabs(map->grid_link->grid->extent.maxx-map->grid_link->grid->extent.minx);
@@ -115,66 +95,78 @@ void _mapcache_source_tms_render_map_elevation(mapcache_context *ctx, mapcache_m
   map->raw_image->y0 = map->extent.miny / dy * 2.0;
   map->raw_image->x1 = map->extent.maxx / dx * 2.0;
   map->raw_image->y1 = map->extent.maxy / dy * 2.0;
-  
+
   if (map->raw_image->w != elevationblock || map->raw_image->h != elevationblock)
   {
     ctx->set_error(ctx,500,"Error: size of heightmap from source is not configured propery!");
   }
-  
 }
 //------------------------------------------------------------------------------
-void _mapcache_source_tms_render_map_image(mapcache_context *ctx, mapcache_map *map)
+// validates (and decodes if needed) a tile as soon as it has been received
+static void _mapcache_source_tms_tile_done(mapcache_context *ctx, mapcache_http_transfer *transfer)
 {
-  int zoom, x, y;
-  mapcache_source_tms *tms;
-  char* url;
-  
-  tms = (mapcache_source_tms*)map->tileset->source;
-  
-  _GetTileCoords(map, &zoom, &x, &y, tms->flipy);
-  
-  url = apr_psprintf(ctx->pool,"%s/1.0.0/%s/%i/%i/%i.%s", tms->url,tms->layer,zoom,x,y,tms->format);
-  tms->http->url = apr_pstrdup(ctx->pool,url);
-  
-  map->encoded_data = mapcache_buffer_create(30000,ctx->pool);
-  mapcache_http_do_request(ctx, tms->http, map->encoded_data, NULL, NULL);
-  GC_CHECK_ERROR(ctx);
+  mapcache_map *map = (mapcache_map*)transfer->userdata;
 
   if(!mapcache_imageio_is_valid_format(ctx,map->encoded_data)) {
     char *returned_data = apr_pstrndup(ctx->pool,(char*)map->encoded_data->buf,map->encoded_data->size);
     ctx->set_error(ctx, 502, "tms request for tileset %s returned an unsupported format:\n%s",
                    map->tileset->name, returned_data);
+    return;
+  }
+
+  if (map->tileset->elevation)
+  {
+    // RGBA encoded elevation data from TMS source
+    _mapcache_source_tms_elevation_done(ctx, map);
+  }
+  else if (transfer->done && map->tileset->format)
+  {
+    // other tiles are still on their way, decode this one in the meantime
+    map->raw_image = mapcache_imageio_decode(ctx, map->encoded_data);
   }
 }
 
 /**
  * \private \memberof mapcache_source_tms
- * \sa mapcache_source::render_map()
+ * \sa mapcache_source::render_maps()
  */
-void _mapcache_source_tms_render_map(mapcache_context *ctx, mapcache_map *map)
+void _mapcache_source_tms_render_maps(mapcache_context *ctx, mapcache_map **maps, int nmaps)
 {
   // example: myserver.com/path/1.0.0/LAYER/lod/x/y.FORMAT
   //          myserver.com/render/1.0.0/osm_traffic/1/1/0.png
   //              -> <url>myserver.com/render</url>
   //                 <layer>osm_traffic</layer>
   //                 <format>png</format>
-  mapcache_source_tms *tms;
-  
-  tms = (mapcache_source_tms*)map->tileset->source;
-  
-  int is_elevation = map->tileset->elevation; // is this an elevation source ?
-  
-  if (is_elevation)
-  {
-    // RGBA encoded elevation data from TMS source
-    _mapcache_source_tms_render_map_elevation(ctx, map);
+  mapcache_source_tms *tms = (mapcache_source_tms*)maps[0]->tileset->source;
+  mapcache_http_transfer **transfers = apr_pcalloc(ctx->pool, nmaps*sizeof(mapcache_http_transfer*));
+  int i, zoom, x, y;
+
+  for(i=0; i<nmaps; i++) {
+    mapcache_map *map = maps[i];
+    _GetTileCoords(map, &zoom, &x, &y, tms->flipy);
+
+    transfers[i] = apr_pcalloc(ctx->pool, sizeof(mapcache_http_transfer));
+    transfers[i]->req = mapcache_http_clone(ctx, tms->http);
+    transfers[i]->req->url = apr_psprintf(ctx->pool,"%s/1.0.0/%s/%i/%i/%i.%s", tms->url,tms->layer,zoom,x,y,tms->format);
+    map->encoded_data = transfers[i]->data = mapcache_buffer_create(30000,ctx->pool);
+    transfers[i]->userdata = map;
+    transfers[i]->done = (nmaps > 1) ? _mapcache_source_tms_tile_done : NULL;
   }
-  else
-  {
-    // Standard image formt
-    _mapcache_source_tms_render_map_image(ctx, map);
+
+  mapcache_http_do_requests(ctx, transfers, nmaps, tms->limit);
+  GC_CHECK_ERROR(ctx);
+  if(nmaps == 1) {
+    _mapcache_source_tms_tile_done(ctx, transfers[0]);
   }
-  
+}
+
+/**
+ * \private \memberof mapcache_source_tms
+ * \sa mapcache_source::render_map()
+ */
+void _mapcache_source_tms_render_map(mapcache_context *ctx, mapcache_map *map)
+{
+  _mapcache_source_tms_render_maps(ctx, &map, 1);
 }
 
 void _mapcache_source_tms_query(mapcache_context *ctx, mapcache_feature_info *fi)
@@ -195,6 +187,7 @@ void _mapcache_source_tms_configuration_parse_xml(mapcache_context *ctx, ezxml_t
     src->url = apr_pstrdup(ctx->pool,cur_node->txt);
     src->http = (mapcache_http*)apr_pcalloc(ctx->pool,sizeof(mapcache_http));
     src->http->connection_timeout = 30;
+    src->http->keepalive = 1;
   }
   
   if ((cur_node = ezxml_child(node,"layer")) != NULL) {
@@ -208,6 +201,17 @@ void _mapcache_source_tms_configuration_parse_xml(mapcache_context *ctx, ezxml_t
   if ((cur_node = ezxml_child(node,"flipy")) != NULL) {
     src->flipy = TRUE;
   }
+
+  if ((cur_node = ezxml_child(node,"max_in_flight")) != NULL) {
+    char *endptr;
+    int max_in_flight = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || max_in_flight < 0) {
+      ctx->set_error(ctx,400,"tms source %s: failed to parse <max_in_flight> \"%s\" (positive integer expected, 0 for unlimited)",
+                     source->name, cur_node->txt);
+      return;
+    }
+    src->limit = mapcache_http_limit_create(ctx,max_in_flight);
+  }
 }
 
 /**
@@ -233,6 +237,7 @@ mapcache_source* mapcache_source_tms_create(mapcache_context *ctx)
   source->flipy = FALSE;
   source->source.type = MAPCACHE_SOURCE_TMS;
   source->source.render_map = _mapcache_source_tms_render_map;
+  source->source.render_maps = _mapcache_source_tms_render_maps;
   source->source.configuration_check = _mapcache_source_tms_configuration_check;
   source->source.configuration_parse_xml = _mapcache_source_tms_configuration_parse_xml;
   source->source.query_info = _mapcache_source_tms_query;
@@ -33,13 +33,28 @@
 #include <apr_tables.h>
 #include <apr_strings.h>
 
-/**
- * \private \memberof mapcache_source_wms
- * \sa mapcache_source::render_map()
+/*
+ * validate the response of a getmap request, decoding it if it is going to be
+ * split into tiles
  */
-void _mapcache_source_wms_render_map(mapcache_context *ctx, mapcache_map *map)
+static void _mapcache_source_wms_getmap_done(mapcache_context *ctx, mapcache_http_transfer *transfer)
+{
+  mapcache_map *map = (mapcache_map*)transfer->userdata;
+  if(!mapcache_imageio_is_valid_format(ctx,map->encoded_data)) {
+    char *returned_data = apr_pstrndup(ctx->pool,(char*)map->encoded_data->buf,map->encoded_data->size);
+    ctx->set_error(ctx, 502, "wms request for tileset %s returned an unsupported format:\n%s",
+                   map->tileset->name, returned_data);
+    return;
+  }
+  if(transfer->done && map->tileset->format) {
+    map->raw_image = mapcache_imageio_decode(ctx, map->encoded_data);
+  }
+}
+
+static mapcache_http* _mapcache_source_wms_getmap_request(mapcache_context *ctx, mapcache_map *map)
 {
   mapcache_source_wms *wms = (mapcache_source_wms*)map->tileset->source;
+  mapcache_http *http;
   apr_table_t *params = apr_table_clone(ctx->pool,wms->wms_default_params);
   apr_table_setn(params,"BBOX",apr_psprintf(ctx->pool,"%f,%f,%f,%f",
                  map->extent.minx,map->extent.miny,map->extent.maxx,map->extent.maxy));
@@ -67,15 +82,43 @@ void _mapcache_source_wms_render_map(mapcache_context *ctx, mapcache_map *map)
     apr_table_set(params,"LAYERS",map->tileset->name);
   }
 
-  map->encoded_data = mapcache_buffer_create(30000,ctx->pool);
-  mapcache_http_do_request_with_params(ctx,wms->http,params,map->encoded_data,NULL,NULL);
-  GC_CHECK_ERROR(ctx);
+  http = mapcache_http_clone(ctx,wms->http);
+  http->url = mapcache_http_build_url(ctx,wms->http->url,params);
+  return http;
+}
 
-  if(!mapcache_imageio_is_valid_format(ctx,map->encoded_data)) {
-    char *returned_data = apr_pstrndup(ctx->pool,(char*)map->encoded_data->buf,map->encoded_data->size);
-    ctx->set_error(ctx, 502, "wms request for tileset %s returned an unsupported format:\n%s",
-                   map->tileset->name, returned_data);
+/**
+ * \private \memberof mapcache_source_wms
+ * \sa mapcache_source::render_maps()
+ */
+void _mapcache_source_wms_render_maps(mapcache_context *ctx, mapcache_map **maps, int nmaps)
+{
+  mapcache_source_wms *wms = (mapcache_source_wms*)maps[0]->tileset->source;
+  mapcache_http_transfer **transfers = apr_pcalloc(ctx->pool, nmaps*sizeof(mapcache_http_transfer*));
+  int i;
+  for(i=0; i<nmaps; i++) {
+    mapcache_map *map = maps[i];
+    transfers[i] = apr_pcalloc(ctx->pool, sizeof(mapcache_http_transfer));
+    transfers[i]->req = _mapcache_source_wms_getmap_request(ctx, map);
+    map->encoded_data = transfers[i]->data = mapcache_buffer_create(30000,ctx->pool);
+    transfers[i]->userdata = map;
+    /* only decode the responses as they arrive if there are other responses to wait for */
+    transfers[i]->done = (nmaps > 1) ? _mapcache_source_wms_getmap_done : NULL;
   }
+  mapcache_http_do_requests(ctx, transfers, nmaps, wms->limit);
+  GC_CHECK_ERROR(ctx);
+  if(nmaps == 1) {
+    _mapcache_source_wms_getmap_done(ctx, transfers[0]);
+  }
+}
+
+/**
+ * \private \memberof mapcache_source_wms
+ * \sa mapcache_source::render_map()
+ */
+void _mapcache_source_wms_render_map(mapcache_context *ctx, mapcache_map *map)
+{
+  _mapcache_source_wms_render_maps(ctx, &map, 1);
 }
 
 void _mapcache_source_wms_query(mapcache_context *ctx, mapcache_feature_info *fi)
@@ -163,6 +206,17 @@ void _mapcache_source_wms_configuration_parse_xml(mapcache_context *ctx, ezxml_t
   }
   if ((cur_node = ezxml_child(node,"http")) != NULL) {
     src->http = mapcache_http_configuration_parse_xml(ctx,cur_node);
+    GC_CHECK_ERROR(ctx);
+  }
+  if ((cur_node = ezxml_child(node,"max_in_flight")) != NULL) {
+    char *endptr;
+    int max_in_flight = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || max_in_flight < 0) {
+      ctx->set_error(ctx,400,"wms source %s: failed to parse <max_in_flight> \"%s\" (positive integer expected, 0 for unlimited)",
+                     source->name, cur_node->txt);
+      return;
+    }
+    src->limit = mapcache_http_limit_create(ctx,max_in_flight);
   }
 }
 
@@ -200,6 +254,7 @@ mapcache_source* mapcache_source_wms_create(mapcache_context *ctx)
   mapcache_source_init(ctx, &(source->source));
   source->source.type = MAPCACHE_SOURCE_WMS;
   source->source.render_map = _mapcache_source_wms_render_map;
+  source->source.render_maps = _mapcache_source_wms_render_maps;
   source->source.configuration_check = _mapcache_source_wms_configuration_check;
   source->source.configuration_parse_xml = _mapcache_source_wms_configuration_parse_xml;
   source->source.query_info = _mapcache_source_wms_query;
@@ -31,7 +31,12 @@
 #include <apr_strings.h>
 #include <apr_file_info.h>
 #include <apr_file_io.h>
+#include <apr_hash.h>
 #include <math.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#endif
 
 #ifdef _WIN32
 #include <limits.h>
@@ -438,6 +443,25 @@ mapcache_metatile* mapcache_tileset_metatile_get(mapcache_context *ctx, mapcache
   return mt;
 }
 
+/*
+ * split a metatile whose map has been rendered, and save its tiles to the cache
+ */
+static void _mapcache_tileset_metatile_store(mapcache_context *ctx, mapcache_metatile *mt)
+{
+  int i;
+  mapcache_image_metatile_split(ctx, mt);
+  GC_CHECK_ERROR(ctx);
+  if(mt->map.tileset->cache->tile_multi_set) {
+    mt->map.tileset->cache->tile_multi_set(ctx, mt->map.tileset->cache, mt->tiles, mt->ntiles);
+  } else {
+    for(i=0; i<mt->ntiles; i++) {
+      mapcache_tile *tile = &(mt->tiles[i]);
+      mt->map.tileset->cache->tile_set(ctx, mt->map.tileset->cache, tile);
+      GC_CHECK_ERROR(ctx);
+    }
+  }
+}
+
 /*
  * do the actual rendering and saving of a metatile:
  *  - query the datasource for the image data
@@ -446,7 +470,6 @@ mapcache_metatile* mapcache_tileset_metatile_get(mapcache_context *ctx, mapcache
  */
 void mapcache_tileset_render_metatile(mapcache_context *ctx, mapcache_metatile *mt)
 {
-  int i;
 #ifdef DEBUG
   if(!mt->map.tileset->source) {
     ctx->set_error(ctx,500,"###BUG### tileset_render_metatile called on tileset with no source");
@@ -455,19 +478,178 @@ void mapcache_tileset_render_metatile(mapcache_context *ctx, mapcache_metatile *
 #endif
   mt->map.tileset->source->render_map(ctx, &mt->map);
   GC_CHECK_ERROR(ctx);
-  mapcache_image_metatile_split(ctx, mt);
+  _mapcache_tileset_metatile_store(ctx, mt);
+}
+
+/*
+ * same as mapcache_tileset_render_metatile for multiple metatiles, whose
+ * source requests are issued concurrently
+ */
+void mapcache_tileset_render_metatiles(mapcache_context *ctx, mapcache_metatile **mts, int nmts)
+{
+  int i;
+  mapcache_map **maps = apr_pcalloc(ctx->pool, nmts*sizeof(mapcache_map*));
+  for(i=0; i<nmts; i++) {
+    maps[i] = &mts[i]->map;
+  }
+  mapcache_source_render_maps(ctx, maps, nmts);
   GC_CHECK_ERROR(ctx);
-  if(mt->map.tileset->cache->tile_multi_set) {
-    mt->map.tileset->cache->tile_multi_set(ctx, mt->tiles, mt->ntiles);
+  for(i=0; i<nmts; i++) {
+    _mapcache_tileset_metatile_store(ctx, mts[i]);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+
+/*
+ * single-flight table: requests of this process that miss the same metatile
+ * wait for the first one (the leader) to render it, and are handed the encoded
+ * tiles directly instead of re-reading them from the cache. the leader still
+ * takes the (inter-process) metatile lock; if another process renders the
+ * metatile, every request of this process re-reads the cache.
+ */
+typedef struct {
+  int x,y;
+  void *buf;  /* malloc'ed copy of the encoded tile, NULL for no data */
+  size_t size;
+} mapcache_singleflight_tile;
+
+typedef struct {
+  char *key;
+  int refcount; /* leader and waiters */
+  int done;
+  int status;   /* MAPCACHE_SUCCESS: tiles are set, MAPCACHE_CACHE_MISS: re-read the cache,
+                   MAPCACHE_FAILURE: the leader failed */
+  int ntiles;
+  mapcache_singleflight_tile *tiles;
+} mapcache_singleflight_call;
+
+#ifdef APR_HAS_THREADS
+/* hash table key = metatile resource key, value = mapcache_singleflight_call */
+static apr_hash_t *singleflight_calls = NULL;
+static apr_thread_mutex_t *singleflight_mutex = NULL;
+static apr_thread_cond_t *singleflight_done = NULL;
+#endif
+
+static void _singleflight_call_unref(mapcache_singleflight_call *call)
+{
+  int i;
+  if(--call->refcount > 0) return;
+  for(i=0; i<call->ntiles; i++) {
+    free(call->tiles[i].buf);
+  }
+  free(call->tiles);
+  free(call->key);
+  free(call);
+}
+
+/*
+ * find the in-flight call for the given key or register a new one.
+ * sets *leader if the caller is responsible for rendering the metatile.
+ * returns NULL if single-flight is not available, in which case the caller
+ * should behave as a leader.
+ */
+static mapcache_singleflight_call* _singleflight_join(mapcache_context *ctx, const char *key, int *leader)
+{
+  mapcache_singleflight_call *call = NULL;
+  *leader = 1;
+#ifdef APR_HAS_THREADS
+  if(!singleflight_mutex) {
+    if(ctx->threadlock)
+      apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+    if(!singleflight_mutex) {
+      apr_thread_mutex_t *mutex;
+      if(apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool) == APR_SUCCESS &&
+          apr_thread_cond_create(&singleflight_done, ctx->process_pool) == APR_SUCCESS) {
+        singleflight_calls = apr_hash_make(ctx->process_pool);
+        singleflight_mutex = mutex;
+      }
+    }
+    if(ctx->threadlock)
+      apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+    if(!singleflight_mutex) return NULL;
+  }
+  apr_thread_mutex_lock(singleflight_mutex);
+  call = apr_hash_get(singleflight_calls, key, APR_HASH_KEY_STRING);
+  if(call) {
+    *leader = 0;
   } else {
-    for(i=0; i<mt->ntiles; i++) {
-      mapcache_tile *tile = &(mt->tiles[i]);
-      mt->map.tileset->cache->tile_set(ctx, tile);
-      GC_CHECK_ERROR(ctx);
+    call = calloc(1, sizeof(mapcache_singleflight_call));
+    call->key = strdup(key);
+    apr_hash_set(singleflight_calls, call->key, APR_HASH_KEY_STRING, call);
+  }
+  call->refcount++;
+  apr_thread_mutex_unlock(singleflight_mutex);
+#endif
+  return call;
+}
+
+/*
+ * wait for the leader to finish, and release the call
+ * returns the status set by the leader, and the tile data in *tile
+ */
+static int _singleflight_wait(mapcache_context *ctx, mapcache_singleflight_call *call, mapcache_tile *tile)
+{
+  int status = MAPCACHE_CACHE_MISS;
+#ifdef APR_HAS_THREADS
+  int i;
+  apr_thread_mutex_lock(singleflight_mutex);
+  while(!call->done) {
+    apr_thread_cond_wait(singleflight_done, singleflight_mutex);
+  }
+  status = call->status;
+  if(status == MAPCACHE_SUCCESS) {
+    status = MAPCACHE_CACHE_MISS;
+    for(i=0; i<call->ntiles; i++) {
+      if(call->tiles[i].x == tile->x && call->tiles[i].y == tile->y) {
+        if(call->tiles[i].buf) {
+          tile->encoded_data = mapcache_buffer_create(call->tiles[i].size, ctx->pool);
+          memcpy(tile->encoded_data->buf, call->tiles[i].buf, call->tiles[i].size);
+          tile->encoded_data->size = call->tiles[i].size;
+          status = MAPCACHE_SUCCESS;
+        }
+        break;
+      }
     }
   }
+  _singleflight_call_unref(call);
+  apr_thread_mutex_unlock(singleflight_mutex);
+#endif
+  return status;
 }
 
+/*
+ * publish the result of the leader and wake up the waiters
+ */
+static void _singleflight_complete(mapcache_context *ctx, mapcache_singleflight_call *call, int status,
+                                   mapcache_metatile *mt)
+{
+#ifdef APR_HAS_THREADS
+  int i;
+  apr_thread_mutex_lock(singleflight_mutex);
+  apr_hash_set(singleflight_calls, call->key, APR_HASH_KEY_STRING, NULL);
+  call->status = status;
+  if(status == MAPCACHE_SUCCESS && call->refcount > 1) {
+    /* only copy the tiles if somebody is waiting for them */
+    call->ntiles = mt->ntiles;
+    call->tiles = calloc(mt->ntiles, sizeof(mapcache_singleflight_tile));
+    for(i=0; i<mt->ntiles; i++) {
+      mapcache_buffer *data = mt->tiles[i].encoded_data;
+      call->tiles[i].x = mt->tiles[i].x;
+      call->tiles[i].y = mt->tiles[i].y;
+      if(data && data->size) {
+        call->tiles[i].buf = malloc(data->size);
+        memcpy(call->tiles[i].buf, data->buf, data->size);
+        call->tiles[i].size = data->size;
+      }
+    }
+  }
+  call->done = 1;
+  apr_thread_cond_broadcast(singleflight_done);
+  _singleflight_call_unref(call);
+  apr_thread_mutex_unlock(singleflight_mutex);
+#endif
+}
 
 /*
  * allocate and initialize a new tileset
@@ -593,10 +775,18 @@ mapcache_feature_info* mapcache_tileset_feature_info_create(apr_pool_t *pool, ma
  */
 void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile)
 {
-  int isLocked,ret;
+  int isLocked,isLeader,ret;
   mapcache_metatile *mt=NULL;
-  ret = tile->tileset->cache->tile_get(ctx, tile);
-  GC_CHECK_ERROR(ctx);
+  mapcache_singleflight_call *call;
+  char *key;
+  if(tile->cache_miss) {
+    /* a batched lookup already found the tile absent from the cache */
+    tile->cache_miss = 0;
+    ret = MAPCACHE_CACHE_MISS;
+  } else {
+    ret = tile->tileset->cache->tile_get(ctx, tile->tileset->cache, tile);
+    GC_CHECK_ERROR(ctx);
+  }
 
   if(ret == MAPCACHE_SUCCESS && tile->tileset->auto_expire && tile->mtime && tile->tileset->source) {
     /* the cache is in auto-expire mode, and can return the tile modification date,
@@ -641,51 +831,79 @@ void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile)
 
     /* aquire a lock on the metatile */
     mt = mapcache_tileset_metatile_get(ctx, tile);
-    isLocked = mapcache_lock_or_wait_for_resource(ctx, mapcache_tileset_metatile_resource_key(ctx,mt));
+    GC_CHECK_ERROR(ctx);
+    key = mapcache_tileset_metatile_resource_key(ctx,mt);
 
+    /* is the metatile already being rendered by a request of this process ? */
+    call = _singleflight_join(ctx, key, &isLeader);
+    if(!isLeader) {
+#ifdef DEBUG
+      ctx->log(ctx, MAPCACHE_DEBUG, "waiting on in-process render of %s", key);
+#endif
+      ret = _singleflight_wait(ctx, call, tile);
+      if(ret == MAPCACHE_FAILURE) {
+        ctx->set_error(ctx, 500, "tileset %s: unknown error (another thread failed to create the tile I was waiting for)",
+                       tile->tileset->name);
+        return;
+      }
+      isLocked = MAPCACHE_FALSE;
+    } else {
+      isLocked = mapcache_lock_or_wait_for_resource(ctx, key);
 
-    if(isLocked == MAPCACHE_TRUE) {
-      /* no other thread is doing the rendering, do it ourselves */
+      if(isLocked == MAPCACHE_TRUE) {
+        /* no other thread is doing the rendering, do it ourselves */
 #ifdef DEBUG
-      ctx->log(ctx, MAPCACHE_DEBUG, "cache miss: tileset %s - tile %d %d %d",
-               tile->tileset->name,tile->x, tile->y,tile->z);
+        ctx->log(ctx, MAPCACHE_DEBUG, "cache miss: tileset %s - tile %d %d %d",
+                 tile->tileset->name,tile->x, tile->y,tile->z);
 #endif
-      /* this will query the source to create the tiles, and save them to the cache */
-      mapcache_tileset_render_metatile(ctx, mt);
-
-      // use the rendererd tile as output instead of re-getting from cache
-      if (mt->ntiles==1 && mt->tiles && mt->tiles[0].encoded_data)
-      {
-        size_t size = mt->tiles[0].encoded_data->size;
-        
-        tile->encoded_data = mapcache_buffer_create(sizeof(mapcache_buffer),ctx->pool);
-        tile->encoded_data->buf = malloc(size);//mapcache_buffer_create(size,ctx->pool);
-        tile->encoded_data->size = size;
-        tile->encoded_data->avail = size;
-        tile->encoded_data->pool = 0;
-        tile->mtime = 0;
-        memcpy(tile->encoded_data->buf, mt->tiles[0].encoded_data->buf, size); 
-        apr_pool_cleanup_register(ctx->pool, tile->encoded_data->buf,(void*)free, apr_pool_cleanup_null);
-        
+        /* this will query the source to create the tiles, and save them to the cache */
+        mapcache_tileset_render_metatile(ctx, mt);
+        mapcache_unlock_resource(ctx, key);
+
+        if(GC_HAS_ERROR(ctx)) {
+          ret = MAPCACHE_FAILURE;
+        } else {
+          int i;
+          /* use the rendered tiles as output instead of re-getting them from the cache */
+          for(i=0; i<mt->ntiles; i++) {
+            mapcache_tile *t = &(mt->tiles[i]);
+            if(!t->encoded_data && t->raw_image && tile->tileset->format) {
+              t->encoded_data = tile->tileset->format->write(ctx, t->raw_image, tile->tileset->format);
+              if(GC_HAS_ERROR(ctx)) break;
+            }
+            if(t->x == tile->x && t->y == tile->y) {
+              tile->encoded_data = t->encoded_data;
+              tile->mtime = 0;
+            }
+          }
+          ret = GC_HAS_ERROR(ctx) ? MAPCACHE_FAILURE : MAPCACHE_SUCCESS;
+        }
+      } else {
+        /* another process rendered the metatile */
+        ret = MAPCACHE_CACHE_MISS;
+      }
+      if(call) {
+        _singleflight_complete(ctx, call, ret, mt);
       }
-      mapcache_unlock_resource(ctx, mapcache_tileset_metatile_resource_key(ctx,mt));
+      GC_CHECK_ERROR(ctx);
     }
-    
-    // don't retrieve tile from cache, use the previously generated (code above)
-    /* the previous step has successfully finished, we can now query the cache to return the tile content */
-    /*ret = tile->tileset->cache->tile_get(ctx, tile);
-    GC_CHECK_ERROR(ctx);
 
-    if(ret != MAPCACHE_SUCCESS) {
-      if(isLocked == MAPCACHE_FALSE) {
-        ctx->set_error(ctx, 500, "tileset %s: unknown error (another thread/process failed to create the tile I was waiting for)",
-                       tile->tileset->name);
-      } else {
-        //shouldn't really happen, as the error ought to have been caught beforehand
-        ctx->set_error(ctx, 500, "tileset %s: failed to re-get tile %d %d %d from cache after set", tile->tileset->name,tile->x,tile->y,tile->z);
+    if(!tile->encoded_data) {
+      /* the previous step has successfully finished, we can now query the cache to return the tile content */
+      ret = tile->tileset->cache->tile_get(ctx, tile->tileset->cache, tile);
+      GC_CHECK_ERROR(ctx);
+
+      if(ret != MAPCACHE_SUCCESS) {
+        if(isLocked == MAPCACHE_FALSE) {
+          ctx->set_error(ctx, 500, "tileset %s: unknown error (another thread/process failed to create the tile I was waiting for)",
+                         tile->tileset->name);
+        } else {
+          /* shouldn't really happen, as the error ought to have been caught beforehand */
+          ctx->set_error(ctx, 500, "tileset %s: failed to re-get tile %d %d %d from cache after set", tile->tileset->name,tile->x,tile->y,tile->z);
+        }
+        return;
       }
     }
-    */
   }
   /* update the tile expiration time */
   if(tile->tileset->auto_expire && tile->mtime) {
@@ -695,11 +913,49 @@ void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile)
   }
 }
 
+int* mapcache_tileset_tile_multi_get_cached(mapcache_context *ctx, mapcache_tile **tiles, int ntiles)
+{
+  int *found = (int*)apr_pcalloc(ctx->pool, ntiles*sizeof(int));
+  int *looked_up = (int*)apr_pcalloc(ctx->pool, ntiles*sizeof(int));
+  mapcache_tile **batch = (mapcache_tile**)apr_pcalloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+  int i,j,nbatch;
+  for(i=0; i<ntiles; i++) {
+    mapcache_cache *cache = tiles[i]->tileset->cache;
+    if(looked_up[i] || !cache->tile_multi_get) continue;
+    /* a single lookup for all the tiles stored in the same cache */
+    nbatch = 0;
+    for(j=i; j<ntiles; j++) {
+      if(!looked_up[j] && tiles[j]->tileset->cache == cache) {
+        looked_up[j] = 1;
+        batch[nbatch++] = tiles[j];
+      }
+    }
+    cache->tile_multi_get(ctx, cache, batch, nbatch);
+    if(GC_HAS_ERROR(ctx)) return NULL;
+  }
+  for(i=0; i<ntiles; i++) {
+    mapcache_tile *tile = tiles[i];
+    if(!looked_up[i] || !tile->encoded_data) continue;
+    if(tile->tileset->auto_expire && tile->mtime) {
+      apr_time_t expire_time = tile->mtime + apr_time_from_sec(tile->tileset->auto_expire);
+      apr_time_t now = apr_time_now();
+      if(tile->tileset->source && expire_time < now) {
+        /* stale, let mapcache_tileset_tile_get() delete and recreate it */
+        tile->encoded_data = NULL;
+        continue;
+      }
+      tile->expires = apr_time_sec(expire_time-now);
+    }
+    found[i] = MAPCACHE_TRUE;
+  }
+  return found;
+}
+
 void mapcache_tileset_tile_delete(mapcache_context *ctx, mapcache_tile *tile, int whole_metatile)
 {
   int i;
   /*delete the tile itself*/
-  tile->tileset->cache->tile_delete(ctx,tile);
+  tile->tileset->cache->tile_delete(ctx, tile->tileset->cache, tile);
   GC_CHECK_ERROR(ctx);
 
   if(whole_metatile) {
@@ -708,7 +964,7 @@ void mapcache_tileset_tile_delete(mapcache_context *ctx, mapcache_tile *tile, in
       mapcache_tile *subtile = &mt->tiles[i];
       /* skip deleting the actual tile */
       if(subtile->x == tile->x && subtile->y == tile->y) continue;
-      subtile->tileset->cache->tile_delete(ctx,subtile);
+      subtile->tileset->cache->tile_delete(ctx, subtile->tileset->cache, subtile);
       /* silently pass failure if the tile was not found */
       if(ctx->get_error(ctx) == 404) {
         ctx->clear_errors(ctx);
@@ -31,6 +31,7 @@
 #include "util.h"
 #include <apr_strings.h>
 #include <apr_tables.h>
+#include <apr_md5.h>
 #include <curl/curl.h>
 #include <math.h>
 
@@ -115,6 +116,20 @@ char *mapcache_util_str_replace(apr_pool_t *pool, const char *string, const char
   return newstr;
 }
 
+char* mapcache_util_md5_hex(apr_pool_t *pool, const void *data, apr_size_t len)
+{
+  unsigned char digest[APR_MD5_DIGESTSIZE];
+  char *hex = apr_palloc(pool, 2 * APR_MD5_DIGESTSIZE + 1);
+  int i;
+  apr_md5(digest, data, len);
+  for(i=0; i<APR_MD5_DIGESTSIZE; i++) {
+    hex[2*i]   = "0123456789abcdef"[digest[i] >> 4];
+    hex[2*i+1] = "0123456789abcdef"[digest[i] & 0xf];
+  }
+  hex[2 * APR_MD5_DIGESTSIZE] = '\0';
+  return hex;
+}
+
 char* mapcache_util_str_sanitize(apr_pool_t *pool, const char *str, const char* from, char to)
 {
   char *pstr = apr_pstrdup(pool,str);
@@ -74,18 +74,77 @@ ngx_http_mapcache_create_conf(ngx_conf_t *cf)
 }
 
 
+/*
+ * returns a buffer pointing at the file the response was read from, or NULL if
+ * it should be sent from memory. the descriptor is duplicated as the apr pool
+ * holding the file is destroyed before nginx is done sending it
+ */
+static ngx_buf_t* ngx_http_mapcache_file_buf(ngx_http_request_t *r, mapcache_http_response *response)
+{
+  ngx_buf_t *b;
+  ngx_pool_cleanup_t *cln;
+  ngx_pool_cleanup_file_t *clnf;
+  apr_os_file_t fd;
+  if(apr_os_file_get(&fd, response->file->file) != APR_SUCCESS) {
+    return NULL;
+  }
+  b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+  cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+  if(b == NULL || cln == NULL) {
+    return NULL;
+  }
+  b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+  if(b->file == NULL || (fd = dup(fd)) == -1) {
+    return NULL;
+  }
+  clnf = cln->data;
+  clnf->fd = fd;
+  clnf->name = (u_char*)response->file->filename;
+  clnf->log = r->pool->log;
+  cln->handler = ngx_pool_cleanup_file;
+
+  b->file->fd = fd;
+  b->file->name.data = (u_char*)response->file->filename;
+  b->file->name.len = strlen(response->file->filename);
+  b->file->log = r->connection->log;
+  b->file_pos = response->file->offset;
+  b->file_last = response->file->offset + response->file->length;
+  b->in_file = 1;
+  return b;
+}
+
+
 static void ngx_http_mapcache_write_response(mapcache_context *ctx, ngx_http_request_t *r,
     mapcache_http_response *response)
 {
+  if(response->etag) {
+    ngx_table_elt_t   *h;
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+      return;
+    }
+    ngx_str_set(&h->key, "ETag");
+    h->value.len = strlen(response->etag);
+    h->value.data = (u_char*)response->etag;
+    h->hash = 1;
+    if(r->headers_in.if_none_match) {
+      char *if_none_match = apr_pstrndup(ctx->pool, (char*)r->headers_in.if_none_match->value.data,
+                                         r->headers_in.if_none_match->value.len);
+      if(mapcache_core_etag_matches(response, if_none_match)) {
+        r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+        ngx_http_send_header(r);
+        return;
+      }
+    }
+  }
   if(response->mtime) {
     time_t  if_modified_since;
-    if(r->headers_in.if_modified_since) {
+    /* If-Modified-Since is ignored when If-None-Match is present */
+    if(r->headers_in.if_modified_since && !r->headers_in.if_none_match) {
       if_modified_since = ngx_http_parse_time(r->headers_in.if_modified_since->value.data,
                                               r->headers_in.if_modified_since->value.len);
       if (if_modified_since != NGX_ERROR) {
-        apr_time_t apr_if_m_s;
-        apr_time_ansi_put ( &apr_if_m_s, if_modified_since);
-        if(apr_if_m_s<response->mtime) {
+        if(apr_time_sec(response->mtime) <= if_modified_since) {
           r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
           ngx_http_send_header(r);
           return;
@@ -130,19 +189,24 @@ static void ngx_http_mapcache_write_response(mapcache_context *ctx, ngx_http_req
   }
 
   if(response->data) {
-    ngx_buf_t    *b;
+    ngx_buf_t    *b = NULL;
     ngx_chain_t   out;
-    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-    if (b == NULL) {
-      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "Failed to allocate response buffer.");
-      return;
+    if(response->file) {
+      b = ngx_http_mapcache_file_buf(r, response);
     }
+    if(b == NULL) {
+      b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+      if (b == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "Failed to allocate response buffer.");
+        return;
+      }
 
-    b->pos = ngx_pcalloc(r->pool,response->data->size);
-    memcpy(b->pos,response->data->buf,response->data->size);
-    b->last = b->pos + response->data->size;
-    b->memory = 1;
+      b->pos = ngx_pcalloc(r->pool,response->data->size);
+      memcpy(b->pos,response->data->buf,response->data->size);
+      b->last = b->pos + response->data->size;
+      b->memory = 1;
+    }
     b->last_buf = 1;
     b->flush = 1;
     out.buf = b;
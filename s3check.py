@@ -0,0 +1,221 @@
+#! /usr/bin/env python
+
+# checks the s3 cache against a local s3 stand-in.
+#
+# usage: s3check.py <mapcache_seed> <mapcache cgi>
+#          starts a moto s3 server (pip install "moto[server]") on a free port,
+#          creates a bucket on it and checks the s3 cache through the seeder and
+#          the cgi built with --with-s3:
+#           - set: transfer of tiles from a disk cache
+#           - multi_set: seeding with 2x2 metatiles
+#           - get: a tms tile request, whose Last-Modified must be the time the
+#             tile was stored
+#           - multi_get: a wms request assembled from several tiles
+#           - a tms request for a tile that is not in the bucket returns a 404
+#
+#        S3CHECK_ENDPOINT=host:port S3CHECK_ACCESS_KEY=... S3CHECK_SECRET_KEY=... S3CHECK_BUCKET=...
+#        s3check.py <mapcache_seed> <mapcache cgi>
+#          runs the same checks against an already running stand-in, e.g. a minio
+#          server, on which the (empty) bucket has been created beforehand.
+
+import calendar
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+try:
+    from urllib.request import urlopen, Request
+except ImportError:
+    from urllib2 import urlopen, Request
+
+CONFIG = """<?xml version="1.0" encoding="UTF-8"?>
+<mapcache>
+   <cache name="local" type="disk">
+      <base>%(tmpdir)s/tiles</base>
+   </cache>
+   <cache name="s3" type="s3" layout="template">
+      <template>set/{grid}/{z}/{x}/{y}.{ext}</template>
+      <host>%(endpoint)s</host>
+      <bucket>%(bucket)s</bucket>
+      <access_key>%(access_key)s</access_key>
+      <secret_key>%(secret_key)s</secret_key>
+   </cache>
+   <cache name="s3multi" type="s3" layout="template">
+      <template>multiset/{grid}/{z}/{x}/{y}.{ext}</template>
+      <host>%(endpoint)s</host>
+      <bucket>%(bucket)s</bucket>
+      <access_key>%(access_key)s</access_key>
+      <secret_key>%(secret_key)s</secret_key>
+      <max_parallel_requests>4</max_parallel_requests>
+   </cache>
+
+   <source name="blank" type="dummy"/>
+
+   <tileset name="local">
+      <source>blank</source>
+      <cache>local</cache>
+      <grid>WGS84</grid>
+      <format>PNG</format>
+   </tileset>
+   <!-- written through tile_set by a transfer from "local" -->
+   <tileset name="set">
+      <cache>s3</cache>
+      <grid>WGS84</grid>
+      <format>PNG</format>
+   </tileset>
+   <!-- written through tile_multi_set by seeding 2x2 metatiles -->
+   <tileset name="multiset">
+      <source>blank</source>
+      <cache>s3multi</cache>
+      <grid>WGS84</grid>
+      <format>PNG</format>
+      <metatile>2 2</metatile>
+   </tileset>
+   <!-- read only views of the two caches, so that misses are not rendered -->
+   <tileset name="get">
+      <cache>s3</cache>
+      <grid>WGS84</grid>
+      <format>PNG</format>
+   </tileset>
+   <tileset name="multiget">
+      <cache>s3multi</cache>
+      <grid>WGS84</grid>
+      <format>PNG</format>
+   </tileset>
+
+   <service type="wms" enabled="true">
+      <full_wms>assemble</full_wms>
+      <format>PNG</format>
+   </service>
+   <service type="tms" enabled="true"/>
+
+   <errors>report</errors>
+   <lock_dir>%(tmpdir)s</lock_dir>
+</mapcache>
+"""
+
+# the 2x2 tiles of zoom level 1 of the WGS84 grid
+WMS_PARAMS = "LAYERS=multiget&FORMAT=image%2Fpng&SERVICE=WMS&VERSION=1.1.1&REQUEST=GetMap&STYLES=&SRS=EPSG%3A4326&BBOX=-90,-90,90,90&WIDTH=512&HEIGHT=512"
+
+failures = 0
+
+def check(what, ok, detail=""):
+    global failures
+    if ok:
+        print("ok:     %s" % what)
+    else:
+        failures += 1
+        print("FAILED: %s %s" % (what, detail))
+
+def usage():
+    print("usage: %s <mapcache_seed> <mapcache cgi>" % sys.argv[0])
+    sys.exit(1)
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+def start_moto():
+    port = free_port()
+    server = subprocess.Popen(["moto_server", "-p", str(port)],
+                              stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    endpoint = "127.0.0.1:%d" % port
+    for i in range(50):
+        try:
+            urlopen("http://%s/" % endpoint)
+            break
+        except Exception:
+            time.sleep(0.2)
+    else:
+        server.kill()
+        print("moto_server did not start")
+        sys.exit(1)
+    return server, endpoint
+
+def seed(seeder, conffile, *args):
+    cmd = [seeder, "-c", conffile, "-g", "WGS84", "-q"] + list(args)
+    print(" ".join(cmd))
+    return subprocess.call(cmd)
+
+def cgi(binary, conffile, path_info, query_string=""):
+    """runs a cgi request, returns (status code, headers, body)"""
+    env = dict(os.environ)
+    env.update({"MAPCACHE_CONFIG_FILE": conffile, "REQUEST_METHOD": "GET",
+                "PATH_INFO": path_info, "QUERY_STRING": query_string,
+                "SERVER_NAME": "localhost", "SERVER_PORT": "80"})
+    out = subprocess.Popen([binary], env=env, stdout=subprocess.PIPE).communicate()[0]
+    head, sep, body = out.partition(b"\r\n\r\n")
+    headers = {}
+    for line in head.decode("latin-1").split("\r\n"):
+        key, sep, value = line.partition(":")
+        headers[key.strip().lower()] = value.strip()
+    status = int(headers.get("status", "200").split()[0])
+    return status, headers, body
+
+def http_date(value):
+    return calendar.timegm(time.strptime(value, "%a, %d %b %Y %H:%M:%S GMT"))
+
+if len(sys.argv) != 3:
+    usage()
+seeder, binary = sys.argv[1], sys.argv[2]
+
+server = None
+if os.environ.get("S3CHECK_ENDPOINT"):
+    endpoint = os.environ["S3CHECK_ENDPOINT"]
+    access_key = os.environ.get("S3CHECK_ACCESS_KEY", "")
+    secret_key = os.environ.get("S3CHECK_SECRET_KEY", "")
+    bucket = os.environ.get("S3CHECK_BUCKET", "mapcache")
+else:
+    server, endpoint = start_moto()
+    access_key, secret_key, bucket = "testing", "testing", "mapcache"
+    # moto accepts unsigned requests
+    req = Request("http://%s/%s" % (endpoint, bucket), data=b"")
+    req.get_method = lambda: "PUT"
+    urlopen(req)
+
+tmpdir = tempfile.mkdtemp(prefix="s3check")
+try:
+    conffile = os.path.join(tmpdir, "mapcache.xml")
+    f = open(conffile, "w")
+    f.write(CONFIG % {"tmpdir": tmpdir, "endpoint": endpoint, "bucket": bucket,
+                      "access_key": access_key, "secret_key": secret_key})
+    f.close()
+
+    # last modified dates have a one second resolution
+    before = int(time.time()) - 1
+    check("seed local tiles", seed(seeder, conffile, "-t", "local", "-z", "0,1") == 0)
+    check("set (transfer to s3)", seed(seeder, conffile, "-t", "local", "-m", "transfer", "-x", "set", "-z", "0,1") == 0)
+    check("multi_set (seed 2x2 metatiles)", seed(seeder, conffile, "-t", "multiset", "-z", "0,1") == 0)
+    after = int(time.time()) + 1
+
+    status, headers, body = cgi(binary, conffile, "/tms/1.0.0/get@WGS84/1/1/0.png")
+    check("get", status == 200 and body[1:4] == b"PNG", "(status %d)" % status)
+    mtime = headers.get("last-modified")
+    check("get Last-Modified is the time the tile was stored",
+          mtime is not None and before <= http_date(mtime) <= after, "(%s)" % mtime)
+
+    status, headers, body = cgi(binary, conffile, "/tms/1.0.0/multiget@WGS84/1/0/0.png")
+    check("get of a multi_set tile", status == 200 and body[1:4] == b"PNG", "(status %d)" % status)
+
+    status, headers, body = cgi(binary, conffile, "/", WMS_PARAMS)
+    check("multi_get (wms map over 4 tiles)", status == 200 and body[1:4] == b"PNG", "(status %d)" % status)
+
+    status, headers, body = cgi(binary, conffile, "/tms/1.0.0/get@WGS84/2/0/0.png")
+    check("404 for a tile missing from the bucket", status == 404, "(status %d)" % status)
+finally:
+    shutil.rmtree(tmpdir)
+    if server:
+        server.kill()
+        server.wait()
+
+if failures:
+    print("%d check(s) failed" % failures)
+    sys.exit(1)
+print("all checks passed")
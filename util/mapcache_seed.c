@@ -47,6 +47,7 @@
 int msqid;
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <sys/wait.h>
 #include <errno.h>
 #endif
 
@@ -78,11 +79,13 @@ int maxzoom=-1;
 mapcache_grid_link *grid_link;
 int nthreads=0;
 int nprocesses=0;
+int batchsize=1;
 int quiet = 0;
 int verbose = 0;
 int force = 0;
 int sig_int_received = 0;
 int error_detected = 0;
+int bloom_build = 0; /* transferring the whole extent to a bloom cache, see main() */
 
 apr_time_t age_limit = 0;
 int seededtilestot=0, seededtiles=0, queuedtilestot=0;
@@ -202,6 +205,7 @@ static const apr_getopt_option_t seed_options[] = {
   { "extent", 'e', TRUE, "extent to seed, format: minx,miny,maxx,maxy" },
   { "nthreads", 'n', TRUE, "number of parallel threads to use (incompatible with -p/--nprocesses)" },
   { "nprocesses", 'p', TRUE, "number of parallel processes to use (incompatible with -n/--nthreads)" },
+  { "batch", 'b', TRUE, "number of metatiles each thread requests from the source at once (default 1)" },
   { "mode", 'm', TRUE, "mode: seed (default), delete or transfer" },
   { "older", 'o', TRUE, "reseed tiles older than supplied date (format: year/month/day hour:minute, eg: 2011/01/31 20:45" },
   { "dimension", 'D', TRUE, "set the value of a dimension (format DIMENSIONNAME=VALUE). Can be used multiple times for multiple dimensions" },
@@ -351,12 +355,12 @@ cmd examine_tile(mapcache_context *ctx, mapcache_tile *tile)
 {
   int action = MAPCACHE_CMD_SKIP;
   int intersects = -1;
-  int tile_exists = force?0:tileset->cache->tile_exists(ctx,tile);
+  int tile_exists = force?0:tileset->cache->tile_exists(ctx, tileset->cache, tile);
 
   /* if the tile exists and a time limit was specified, check the tile modification date */
   if(tile_exists) {
     if(age_limit) {
-      if(tileset->cache->tile_get(ctx,tile) == MAPCACHE_SUCCESS) {
+      if(tileset->cache->tile_get(ctx, tileset->cache, tile) == MAPCACHE_SUCCESS) {
         if(tile->mtime && tile->mtime<age_limit) {
           /* the tile modification time is older than the specified limit */
 #ifdef USE_CLIPPERS
@@ -372,7 +376,7 @@ cmd examine_tile(mapcache_context *ctx, mapcache_tile *tile)
               /* if we are in mode transfer, delete it from the dst tileset */
               if (mode == MAPCACHE_CMD_TRANSFER) {
                 tile->tileset = tileset_transfer;
-                if (tileset_transfer->cache->tile_exists(ctx,tile)) {
+                if (tileset_transfer->cache->tile_exists(ctx, tileset_transfer->cache, tile)) {
                   mapcache_tileset_tile_delete(ctx,tile,MAPCACHE_TRUE);
                 }
                 tile->tileset = tileset;
@@ -398,7 +402,8 @@ cmd examine_tile(mapcache_context *ctx, mapcache_tile *tile)
         /* the tile exists in the source tileset,
            check if the tile exists in the destination cache */
         tile->tileset = tileset_transfer;
-        if (tileset_transfer->cache->tile_exists(ctx,tile)) {
+        /* when building bloom filters, the tiles are written again to add them to the filters */
+        if (!bloom_build && tileset_transfer->cache->tile_exists(ctx, tileset_transfer->cache, tile)) {
           action = MAPCACHE_CMD_SKIP;
         } else {
           action = MAPCACHE_CMD_TRANSFER;
@@ -612,29 +617,62 @@ void seed_worker()
   mapcache_tile *tile;
   mapcache_context seed_ctx = ctx;
   apr_pool_t *tpool;
+  mapcache_metatile **mts;
+  struct seed_cmd pending;
+  int has_pending = 0;
   seed_ctx.log = seed_log;
   apr_pool_create(&seed_ctx.pool,ctx.pool);
   apr_pool_create(&tpool,ctx.pool);
   tile = mapcache_tileset_tile_create(tpool, tileset, grid_link);
   tile->dimensions = dimensions;
+  mts = apr_pcalloc(tpool, batchsize*sizeof(mapcache_metatile*));
   while(1) {
     struct seed_cmd cmd;
     apr_status_t ret;
     apr_pool_clear(seed_ctx.pool);
 
-    ret = pop_queue(&cmd);
-    if(ret != APR_SUCCESS || cmd.command == MAPCACHE_CMD_STOP) break;
+    if(has_pending) {
+      cmd = pending;
+      has_pending = 0;
+    } else {
+      ret = pop_queue(&cmd);
+      if(ret != APR_SUCCESS) break;
+    }
+    if(cmd.command == MAPCACHE_CMD_STOP) break;
     tile->x = cmd.x;
     tile->y = cmd.y;
     tile->z = cmd.z;
     if(cmd.command == MAPCACHE_CMD_SEED) {
-      /* aquire a lock on the metatile ?*/
-      mapcache_metatile *mt = mapcache_tileset_metatile_get(&seed_ctx, tile);
-      int isLocked = mapcache_lock_or_wait_for_resource(&seed_ctx, mapcache_tileset_metatile_resource_key(&seed_ctx,mt));
-      if(isLocked == MAPCACHE_TRUE) {
+      int i,nmts = 0;
+      while(1) {
+        /* aquire a lock on the metatile ?*/
+        mapcache_metatile *mt = mapcache_tileset_metatile_get(&seed_ctx, tile);
+        int isLocked = mapcache_lock_or_wait_for_resource(&seed_ctx, mapcache_tileset_metatile_resource_key(&seed_ctx,mt));
+        if(isLocked == MAPCACHE_TRUE) {
+          mts[nmts++] = mt;
+        }
+        if(nmts == batchsize || GC_HAS_ERROR(&seed_ctx)) break;
+        /* gather more metatiles to request from the source at the same time,
+         * keeping aside any command that is not a seeding one */
+        if(trypop_queue(&cmd) != APR_SUCCESS) break;
+        if(cmd.command != MAPCACHE_CMD_SEED) {
+          pending = cmd;
+          has_pending = 1;
+          break;
+        }
+        tile->x = cmd.x;
+        tile->y = cmd.y;
+        tile->z = cmd.z;
+      }
+      if(nmts && !GC_HAS_ERROR(&seed_ctx)) {
         /* this will query the source to create the tiles, and save them to the cache */
-        mapcache_tileset_render_metatile(&seed_ctx, mt);
-        mapcache_unlock_resource(&seed_ctx, mapcache_tileset_metatile_resource_key(&seed_ctx,mt));
+        if(nmts == 1)
+          mapcache_tileset_render_metatile(&seed_ctx, mts[0]);
+        else
+          mapcache_tileset_render_metatiles(&seed_ctx, mts, nmts);
+      }
+      for(i=0; i<nmts; i++) {
+        mapcache_unlock_resource(&seed_ctx, mapcache_tileset_metatile_resource_key(&seed_ctx,mts[i]));
       }
     } else if (cmd.command == MAPCACHE_CMD_TRANSFER) {
       int i;
@@ -643,7 +681,7 @@ void seed_worker()
         mapcache_tile *subtile = &mt->tiles[i];
         mapcache_tileset_tile_get(&seed_ctx, subtile);
         subtile->tileset = tileset_transfer;
-        tileset_transfer->cache->tile_set(&seed_ctx, subtile);
+        tileset_transfer->cache->tile_set(&seed_ctx, tileset_transfer->cache, subtile);
       }
     } else { //CMD_DELETE
       mapcache_tileset_tile_delete(&seed_ctx,tile,MAPCACHE_TRUE);
@@ -817,6 +855,11 @@ int main(int argc, const char **argv)
         if(nthreads <=0 )
           return usage(argv[0], "failed to parse nthreads, expecting positive integer");
         break;
+      case 'b':
+        batchsize = (int)strtol(optarg, NULL, 10);
+        if(batchsize <=0 )
+          return usage(argv[0], "failed to parse batch, expecting positive integer");
+        break;
       case 'p':
 #ifdef USE_FORK
         nprocesses = (int)strtol(optarg, NULL, 10);
@@ -1119,6 +1162,19 @@ int main(int argc, const char **argv)
 
   }
 
+  /*
+   * transferring the whole extent to a bloom cache writes all the tiles through
+   * it, after which its filters hold all the tiles of the transferred levels
+   * and can be used to answer lookups. this is only the case if no tile was
+   * left out by an extent, clipping features or an age limit, and it relies on
+   * the destination cache not holding tiles the source does not have: those
+   * are never written through the filters, and would be reported missing
+   */
+  if(mode == MAPCACHE_CMD_TRANSFER && tileset_transfer->cache->type == MAPCACHE_CACHE_BLOOM &&
+      !extent && nClippers == 0 && !age_limit && apr_is_empty_array(tileset_transfer->dimensions)) {
+    bloom_build = 1;
+  }
+
   if(nthreads == 0 && nprocesses == 0) {
     nthreads = 1;
   }
@@ -1161,7 +1217,10 @@ int main(int argc, const char **argv)
       int pid = fork();
       if(pid==0) {
         seed_process();
-        exit(0);
+        /* run the cleanups of the process pool, e.g. to complete the
+           background writes of composite caches, before exiting */
+        apr_terminate();
+        exit(error_detected ? 1 : 0);
       } else {
         pids[i] = pid;
       }
@@ -1170,6 +1229,9 @@ int main(int argc, const char **argv)
     for(i=0; i<nprocesses; i++) {
       int stat_loc;
       waitpid(pids[i],&stat_loc,0);
+      if(!WIFEXITED(stat_loc) || WEXITSTATUS(stat_loc)) {
+        error_detected++;
+      }
     }
     msgctl(msqid,IPC_RMID,NULL);
 #else
@@ -1179,7 +1241,7 @@ int main(int argc, const char **argv)
     //start the thread that will populate the queue.
     apr_thread_mutex_create((apr_thread_mutex_t**)&ctx.threadlock,APR_THREAD_MUTEX_DEFAULT,ctx.pool);
     //create the queue where tile requests will be put
-    apr_queue_create(&work_queue,nthreads,ctx.pool);
+    apr_queue_create(&work_queue,nthreads*batchsize,ctx.pool);
 
     //start the rendering threads.
     apr_threadattr_create(&thread_attrs, ctx.pool);
@@ -1192,6 +1254,11 @@ int main(int argc, const char **argv)
       apr_thread_join(&rv, threads[n]);
     }
   }
+  if(bloom_build && !error_detected && !sig_int_received) {
+    for(n=minzoom; n<=maxzoom && !GC_HAS_ERROR(&ctx); n++) {
+      mapcache_cache_bloom_set_complete(&ctx, tileset_transfer->cache, tileset_transfer, grid_link, n);
+    }
+  }
   if(ctx.get_error(&ctx)) {
     printf("%s",ctx.get_error_message(&ctx));
   }